@@ -0,0 +1,229 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include "adler32.hh"
+
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+#define HAVE_X86_ADLER32
+#include <immintrin.h>
+#endif
+
+namespace {
+
+/// The largest prime smaller than 65536
+unsigned const Base = 65521;
+
+/// The largest number of bytes which can be added before 's2' has to be
+/// reduced so it doesn't overflow 32 bits
+size_t const MaxBytesBeforeReduction = 5552;
+
+Adler32::Value zlibAdler32( Adler32::Value value, void const * data,
+                            size_t size )
+{
+  // zlib takes the size as uInt, which may be narrower than size_t
+  Bytef const * next = ( Bytef const * ) data;
+  while ( size )
+  {
+    uInt chunk = size > 0x40000000 ? 0x40000000 : ( uInt ) size;
+    value = ( Adler32::Value ) adler32( value, next, chunk );
+    next += chunk;
+    size -= chunk;
+  }
+  return value;
+}
+
+#ifdef HAVE_X86_ADLER32
+
+/// Adds the tail which is too short for the vectorized loop
+inline void addScalar( uint32_t & s1, uint32_t & s2, unsigned char const * data,
+                       size_t size )
+{
+  while ( size-- )
+  {
+    s1 += *data++;
+    s2 += s1;
+  }
+  s1 %= Base;
+  s2 %= Base;
+}
+
+// Both kernels process the data in blocks. For each block, s1 grows by the
+// sum of its bytes and s2 grows by the s1 value before the block times the
+// block size plus the sum of the bytes weighted by their distance from the
+// end of the block. The bytes are summed with psadbw, the weighted sums are
+// done with pmaddubsw. The s1 values before each block are accumulated in
+// 'previous' and multiplied by the block size once per reduction
+
+__attribute__(( target( "ssse3" ) ))
+Adler32::Value ssse3Adler32( Adler32::Value value, void const * data,
+                             size_t size )
+{
+  enum { BlockSize = 32 };
+
+  uint32_t s1 = value & 0xffff;
+  uint32_t s2 = value >> 16;
+  unsigned char const * next = ( unsigned char const * ) data;
+
+  __m128i const weights1 = _mm_setr_epi8( 32, 31, 30, 29, 28, 27, 26, 25, 24,
+                                          23, 22, 21, 20, 19, 18, 17 );
+  __m128i const weights2 = _mm_setr_epi8( 16, 15, 14, 13, 12, 11, 10, 9, 8,
+                                          7, 6, 5, 4, 3, 2, 1 );
+  __m128i const zero = _mm_setzero_si128();
+  __m128i const ones = _mm_set1_epi16( 1 );
+
+  while ( size >= BlockSize )
+  {
+    size_t blocks = MaxBytesBeforeReduction / BlockSize;
+    if ( blocks > size / BlockSize )
+      blocks = size / BlockSize;
+    size -= blocks * BlockSize;
+
+    __m128i previous = _mm_cvtsi32_si128( s1 * blocks );
+    __m128i sum1 = zero;
+    __m128i sum2 = _mm_cvtsi32_si128( s2 );
+
+    do
+    {
+      __m128i bytes1 = _mm_loadu_si128( ( __m128i const * ) next );
+      __m128i bytes2 = _mm_loadu_si128( ( __m128i const * ) ( next + 16 ) );
+
+      previous = _mm_add_epi32( previous, sum1 );
+
+      sum1 = _mm_add_epi32( sum1, _mm_sad_epu8( bytes1, zero ) );
+      sum2 = _mm_add_epi32( sum2, _mm_madd_epi16(
+                              _mm_maddubs_epi16( bytes1, weights1 ), ones ) );
+      sum1 = _mm_add_epi32( sum1, _mm_sad_epu8( bytes2, zero ) );
+      sum2 = _mm_add_epi32( sum2, _mm_madd_epi16(
+                              _mm_maddubs_epi16( bytes2, weights2 ), ones ) );
+
+      next += BlockSize;
+    }
+    while ( --blocks );
+
+    sum2 = _mm_add_epi32( sum2, _mm_slli_epi32( previous, 5 ) );
+
+    sum1 = _mm_add_epi32( sum1, _mm_shuffle_epi32( sum1, 0xb1 ) );
+    sum1 = _mm_add_epi32( sum1, _mm_shuffle_epi32( sum1, 0x4e ) );
+    sum2 = _mm_add_epi32( sum2, _mm_shuffle_epi32( sum2, 0xb1 ) );
+    sum2 = _mm_add_epi32( sum2, _mm_shuffle_epi32( sum2, 0x4e ) );
+
+    s1 = ( s1 + _mm_cvtsi128_si32( sum1 ) ) % Base;
+    s2 = _mm_cvtsi128_si32( sum2 ) % Base;
+  }
+
+  addScalar( s1, s2, next, size );
+
+  return s1 | ( s2 << 16 );
+}
+
+__attribute__(( target( "avx2" ) ))
+Adler32::Value avx2Adler32( Adler32::Value value, void const * data,
+                            size_t size )
+{
+  enum { BlockSize = 64 };
+
+  uint32_t s1 = value & 0xffff;
+  uint32_t s2 = value >> 16;
+  unsigned char const * next = ( unsigned char const * ) data;
+
+  __m256i const weights1 = _mm256_setr_epi8(
+    64, 63, 62, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51, 50, 49,
+    48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33 );
+  __m256i const weights2 = _mm256_setr_epi8(
+    32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+    16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1 );
+  __m256i const zero = _mm256_setzero_si256();
+  __m256i const ones = _mm256_set1_epi16( 1 );
+
+  while ( size >= BlockSize )
+  {
+    size_t blocks = MaxBytesBeforeReduction / BlockSize;
+    if ( blocks > size / BlockSize )
+      blocks = size / BlockSize;
+    size -= blocks * BlockSize;
+
+    __m256i previous = _mm256_setr_epi32( s1 * blocks, 0, 0, 0, 0, 0, 0, 0 );
+    __m256i sum1 = zero;
+    __m256i sum2 = _mm256_setr_epi32( s2, 0, 0, 0, 0, 0, 0, 0 );
+
+    do
+    {
+      __m256i bytes1 = _mm256_loadu_si256( ( __m256i const * ) next );
+      __m256i bytes2 = _mm256_loadu_si256( ( __m256i const * ) ( next + 32 ) );
+
+      previous = _mm256_add_epi32( previous, sum1 );
+
+      sum1 = _mm256_add_epi32( sum1, _mm256_sad_epu8( bytes1, zero ) );
+      sum2 = _mm256_add_epi32( sum2, _mm256_madd_epi16(
+                                 _mm256_maddubs_epi16( bytes1, weights1 ),
+                                 ones ) );
+      sum1 = _mm256_add_epi32( sum1, _mm256_sad_epu8( bytes2, zero ) );
+      sum2 = _mm256_add_epi32( sum2, _mm256_madd_epi16(
+                                 _mm256_maddubs_epi16( bytes2, weights2 ),
+                                 ones ) );
+
+      next += BlockSize;
+    }
+    while ( --blocks );
+
+    sum2 = _mm256_add_epi32( sum2, _mm256_slli_epi32( previous, 6 ) );
+
+    // Fold the two halves, then the four lanes left
+    __m128i half1 = _mm_add_epi32( _mm256_castsi256_si128( sum1 ),
+                                   _mm256_extracti128_si256( sum1, 1 ) );
+    __m128i half2 = _mm_add_epi32( _mm256_castsi256_si128( sum2 ),
+                                   _mm256_extracti128_si256( sum2, 1 ) );
+
+    half1 = _mm_add_epi32( half1, _mm_shuffle_epi32( half1, 0xb1 ) );
+    half1 = _mm_add_epi32( half1, _mm_shuffle_epi32( half1, 0x4e ) );
+    half2 = _mm_add_epi32( half2, _mm_shuffle_epi32( half2, 0xb1 ) );
+    half2 = _mm_add_epi32( half2, _mm_shuffle_epi32( half2, 0x4e ) );
+
+    s1 = ( s1 + _mm_cvtsi128_si32( half1 ) ) % Base;
+    s2 = _mm_cvtsi128_si32( half2 ) % Base;
+  }
+
+  addScalar( s1, s2, next, size );
+
+  return s1 | ( s2 << 16 );
+}
+
+#endif
+
+Adler32::Implementation const * findImplementations()
+{
+  static Adler32::Implementation implementations[ 4 ];
+  unsigned count = 0;
+
+#ifdef HAVE_X86_ADLER32
+  __builtin_cpu_init();
+
+  if ( __builtin_cpu_supports( "avx2" ) )
+  {
+    implementations[ count ].name = "avx2";
+    implementations[ count++ ].function = avx2Adler32;
+  }
+
+  if ( __builtin_cpu_supports( "ssse3" ) )
+  {
+    implementations[ count ].name = "ssse3";
+    implementations[ count++ ].function = ssse3Adler32;
+  }
+#endif
+
+  implementations[ count ].name = "zlib";
+  implementations[ count++ ].function = zlibAdler32;
+
+  implementations[ count ].name = NULL;
+  implementations[ count ].function = NULL;
+
+  return implementations;
+}
+
+}
+
+Adler32::Implementation const * Adler32::getImplementations()
+{
+  static Implementation const * implementations = findImplementations();
+  return implementations;
+}
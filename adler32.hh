@@ -8,26 +8,47 @@
 #include <stdint.h>
 #include <stddef.h>
 
-/// A simple wrapper to calculate adler32
+/// A simple wrapper to calculate adler32. Uses a vectorized implementation if
+/// the CPU supports one, falling back to zlib's otherwise. All of them give
+/// identical results
 class Adler32
 {
 public:
   typedef uint32_t Value;
 
+  /// Updates the given adler32 value with 'size' bytes of 'data'
+  typedef Value ( * Function )( Value, void const * data, size_t size );
+
+  struct Implementation
+  {
+    char const * name;
+    Function function;
+  };
+
   Adler32(): value( ( Value ) adler32( 0, 0, 0 ) ) {}
 
+  /// Continues from the given value, as if the data it was computed over was
+  /// added already
+  explicit Adler32( Value initial ): value( initial ) {}
+
   void add( void const * data, size_t size )
   {
     // When size is 0, we assume a no-op was requested and 'data' should be
     // ignored. However, adler32() has a special semantic for NULL 'data'.
     // Therefore we check the size before calling it
     if ( size )
-      value = ( Value ) adler32( value, ( Bytef const * ) data, size );
+      value = getImplementations()->function( value, data, size );
   }
 
   Value result() const
   { return value; }
 
+  /// Returns the implementations the CPU supports, the fastest one first. The
+  /// list ends with an entry having a NULL name. The first one is used. The
+  /// CPU is only probed on the first call, so this is safe to use during
+  /// static initialization
+  static Implementation const * getImplementations();
+
 private:
   Value value;
 };
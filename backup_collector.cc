@@ -1,21 +1,56 @@
 // Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
 // Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
 
+#include <sys/stat.h>
+
 #include "backup_collector.hh"
 
 using std::string;
 
+namespace {
+uint64_t getFileSize( string const & fileName )
+{
+  struct stat st;
+  return stat( fileName.c_str(), &st ) == 0 ? st.st_size : 0;
+}
+}
+
 BundleCollector::BundleCollector( string const & bundlesPath,
     ChunkStorage::Reader * chunkStorageReader, ChunkStorage::Writer * chunkStorageWriter,
     bool gcDeep, Config & config ):
-  config( config ), bundlesPath( bundlesPath ), gcDeep( gcDeep )
+  config( config ), bundlesPath( bundlesPath ), gcDeep( gcDeep ),
+  gcState( NULL ), chunkUsage( NULL ), nextRecord( 0 ), planner( NULL ),
+  planning( false )
 {
   this->chunkStorageReader = chunkStorageReader;
   this->chunkStorageWriter = chunkStorageWriter;
 }
 
+void BundleCollector::setGcState( GcState const * state )
+{
+  gcState = state;
+}
+
+void BundleCollector::setChunkUsage( ChunkUsage const * usage )
+{
+  chunkUsage = usage;
+}
+
+void BundleCollector::startPass( GcPlanner * newPlanner, bool newPlanning )
+{
+  planner = newPlanner;
+  planning = newPlanning;
+
+  // Chunks and bundles seen in the previous pass are seen anew
+  overallChunkSet.clear();
+  overallBundleSet.clear();
+}
+
 void BundleCollector::startIndex( string const & indexFn )
 {
+  if ( chunkUsage )
+    nextRecord = chunkUsage->getFirstRecord( indexFn );
+
   indexModified = indexNecessary = false;
   indexTotalChunks = indexUsedChunks = 0;
   indexModifiedBundles = indexKeptBundles = indexRemovedBundles = 0;
@@ -23,6 +58,11 @@ void BundleCollector::startIndex( string const & indexFn )
 
 void BundleCollector::finishIndex( string const & indexFn )
 {
+  if ( planning )
+    return;
+
+  repackPendingBundles();
+
   verbosePrintf( "Chunks used: %d/%d, bundles: %d kept, %d modified, %d removed\n",
                  indexUsedChunks, indexTotalChunks, indexKeptBundles,
                  indexModifiedBundles, indexRemovedBundles );
@@ -46,22 +86,36 @@ void BundleCollector::startBundle( Bundle::Id const & bundleId )
   savedId = bundleId;
   totalChunks = 0;
   usedChunks = 0;
+  totalBytes = usedBytes = 0;
+  bundleChunksUsed.clear();
 }
 
 void BundleCollector::processChunk( ChunkId const & chunkId, uint32_t size )
 {
-  if ( gcDeep )
+  bool used, duplicate;
+  if ( chunkUsage )
   {
-    if ( overallChunkSet.find ( chunkId ) == overallChunkSet.end() )
-      overallChunkSet.insert( chunkId );
-    else
-      return;
+    unsigned flags = chunkUsage->getFlags( nextRecord++ );
+    used = flags & ChunkUsage::Used;
+    duplicate = flags & ChunkUsage::Duplicate;
+  }
+  else
+  {
+    used = gcState && gcState->isUsed( chunkId );
+    duplicate = gcDeep && !overallChunkSet.insert( chunkId );
   }
 
+  bundleChunksUsed.push_back( used );
+
+  if ( gcDeep && duplicate )
+    return;
+
   totalChunks++;
-  if ( usedChunkSet.find( chunkId ) != usedChunkSet.end() )
+  totalBytes += size;
+  if ( used )
   {
     usedChunks++;
+    usedBytes += size;
     indexNecessary = true;
   }
 }
@@ -69,6 +123,15 @@ void BundleCollector::processChunk( ChunkId const & chunkId, uint32_t size )
 void BundleCollector::finishBundle( Bundle::Id const & bundleId, BundleInfo const & info )
 {
   string i = Bundle::generateFileName( savedId, "", false );
+
+  if ( planning )
+  {
+    if ( usedChunks < totalChunks )
+      planner->addBundle( savedId, usedBytes, totalBytes,
+                          getFileSize( Dir::addPath( bundlesPath, i ) ) );
+    return;
+  }
+
   indexTotalChunks += totalChunks;
   indexUsedChunks += usedChunks;
   if ( 0 == usedChunks && 0 != totalChunks )
@@ -78,12 +141,15 @@ void BundleCollector::finishBundle( Bundle::Id const & bundleId, BundleInfo cons
     indexModified = true;
     indexRemovedBundles++;
   }
-  else if ( usedChunks < totalChunks )
+  else if ( usedChunks < totalChunks &&
+            ( !planner || planner->shouldRepack( savedId ) ) )
   {
     dPrintf( "%s: used %d/%d chunks\n", i.c_str(), usedChunks, totalChunks );
     filesToUnlink.push_back( Dir::addPath( bundlesPath, i ) );
     indexModified = true;
-    copyUsedChunks( info );
+    PendingRepack & repack = pendingRepacks[ savedId ];
+    repack.info = info;
+    repack.chunksUsed.swap( bundleChunksUsed );
     indexModifiedBundles++;
   }
   else
@@ -92,7 +158,9 @@ void BundleCollector::finishBundle( Bundle::Id const & bundleId, BundleInfo cons
     {
       filesToUnlink.push_back( Dir::addPath( bundlesPath, i ) );
       indexModified = true;
-      copyUsedChunks( info );
+      PendingRepack & repack = pendingRepacks[ savedId ];
+      repack.info = info;
+      repack.chunksUsed.swap( bundleChunksUsed );
       indexModifiedBundles++;
     }
     else
@@ -126,21 +194,51 @@ void BundleCollector::finishBundle( Bundle::Id const & bundleId, BundleInfo cons
   }
 }
 
-void BundleCollector::copyUsedChunks( BundleInfo const & info )
+void BundleCollector::repackPendingBundles()
 {
-  // Copy used chunks to the new index
-  string chunk;
-  size_t chunkSize;
-  for ( int x = info.chunk_record_size(); x--; )
+  if ( pendingRepacks.empty() )
+    return;
+
+  vector< Bundle::Id > ids;
+  ids.reserve( pendingRepacks.size() );
+  for ( PendingRepacks::const_iterator it = pendingRepacks.begin();
+        it != pendingRepacks.end(); ++it )
+    ids.push_back( it->first );
+
+  chunkStorageReader->sortBundles( ids );
+
+  for ( size_t x = 0; x < ids.size(); ++x )
+    copyUsedChunks( ids[ x ], pendingRepacks[ ids[ x ] ] );
+
+  pendingRepacks.clear();
+}
+
+void BundleCollector::copyUsedChunks( Bundle::Id const & bundleId,
+                                      PendingRepack const & repack )
+{
+  // Copy used chunks to the new index, keeping their order
+  struct Copier: public Bundle::Reader::ChunkVisitor
   {
-    BundleInfo_ChunkRecord const & record = info.chunk_record( x );
-    ChunkId id( record.id() );
-    if ( usedChunkSet.find( id ) != usedChunkSet.end() )
+    ChunkStorage::Writer & writer;
+    PendingRepack const & repack;
+
+    Copier( ChunkStorage::Writer & writer, PendingRepack const & repack ):
+      writer( writer ), repack( repack ) {}
+
+    virtual bool wantsChunk( size_t record )
     {
-      chunkStorageReader->get( id, chunk, chunkSize );
-      chunkStorageWriter->add( id, chunk.data(), chunkSize );
+      // The chunks were processed from the last record to the first one
+      return repack.chunksUsed[ repack.chunksUsed.size() - 1 - record ];
     }
-  }
+
+    virtual void visitChunk( string const & chunkId, void const * data,
+                             size_t size )
+    {
+      writer.add( ChunkId( chunkId ), chunkId, data, size );
+    }
+  } copier( *chunkStorageWriter, repack );
+
+  chunkStorageReader->forEachChunk( bundleId, copier );
 }
 
 void BundleCollector::commit()
@@ -4,12 +4,17 @@
 #ifndef BACKUP_COLLECTOR_HH_INCLUDED
 #define BACKUP_COLLECTOR_HH_INCLUDED
 
+#include <map>
 #include <string>
 #include <vector>
 
 #include "backup_restorer.hh"
 #include "backup_file.hh"
+#include "chunk_id_set.hh"
+#include "chunk_usage.hh"
 #include "config.hh"
+#include "gc_planner.hh"
+#include "gc_state.hh"
 
 #include "debug.hh"
 
@@ -26,19 +31,61 @@ private:
 
   Bundle::Id savedId;
   int totalChunks, usedChunks, indexTotalChunks, indexUsedChunks;
+  uint64_t totalBytes, usedBytes;
   int indexModifiedBundles, indexKeptBundles, indexRemovedBundles;
   bool indexModified, indexNecessary;
   vector< string > filesToUnlink;
-  BackupRestorer::ChunkSet overallChunkSet;
+  ChunkIdSet overallChunkSet;
   std::set< Bundle::Id > overallBundleSet;
 
-  void copyUsedChunks( BundleInfo const & info );
+  /// Reference counts of the chunks used by the backups, if set
+  GcState const * gcState;
+
+  /// Out-of-core usage of the chunks, if set, and the position of the next
+  /// chunk record in it
+  ChunkUsage const * chunkUsage;
+  uint64_t nextRecord;
+
+  /// Decides which partially used bundles get repacked, if set
+  GcPlanner * planner;
+  /// In the planning pass the bundles are only described to the planner
+  bool planning;
+
+  /// Whether each chunk of the current bundle is used, in the order they
+  /// were processed
+  vector< bool > bundleChunksUsed;
+
+  /// Bundles of the current index whose used chunks are to be copied. The
+  /// copying is deferred till the end of the index so the bundles can be read
+  /// in the order of their physical location
+  struct PendingRepack
+  {
+    BundleInfo info;
+    vector< bool > chunksUsed;
+  };
+  typedef std::map< Bundle::Id, PendingRepack > PendingRepacks;
+  PendingRepacks pendingRepacks;
+
+  void copyUsedChunks( Bundle::Id const &, PendingRepack const & );
+  void repackPendingBundles();
 
 public:
   BundleCollector( string const & bundlesPath, ChunkStorage::Reader *,
       ChunkStorage::Writer *, bool gcDeep, Config & config );
 
-  BackupRestorer::ChunkSet usedChunkSet;
+  /// Makes the collector take the usage of the chunks from the reference
+  /// counts of the given state. It has to outlive the collection
+  void setGcState( GcState const * );
+
+  /// Makes the collector take the usage of the chunks from the given
+  /// out-of-core join instead
+  void setChunkUsage( ChunkUsage const * );
+
+  /// Starts a new pass over the index. If 'planning' is set, the bundles are
+  /// only described to the planner and nothing is changed. Otherwise, only
+  /// the partially used bundles the planner picked are repacked, or all of
+  /// them if the planner is NULL
+  void startPass( GcPlanner *, bool planning );
 
   void startIndex( string const & indexFn );
 
@@ -3,13 +3,12 @@
 
 #include <openssl/sha.h>
 #include <string.h>
+#include <algorithm>
 
 #include "backup_creator.hh"
 #include "check.hh"
 #include "debug.hh"
-#include "message.hh"
 #include "page_size.hh"
-#include "static_assert.hh"
 
 namespace {
   unsigned const MinChunkSize = 256;
@@ -17,12 +16,16 @@ namespace {
 
 BackupCreator::BackupCreator( Config const & config,
                               ChunkIndex & chunkIndex,
-                              ChunkStorage::Writer & chunkStorageWriter ):
+                              ChunkStorage::Writer & chunkStorageWriter,
+                              ChunkIdSet * usedChunks ):
+  config( config ),
   chunkMaxSize( config.GET_STORABLE( chunk, max_size ) ),
   chunkIndex( chunkIndex ), chunkStorageWriter( chunkStorageWriter ),
   ringBufferFill( 0 ),
   chunkToSaveFill( 0 ),
-  backupDataStream( new google::protobuf::io::StringOutputStream( &backupData ) ),
+  instructionWriter( backupData ),
+  backupDataTaken( false ),
+  usedChunks( usedChunks ),
   chunkIdGenerated( false )
 {
   // In our ring buffer we have enough space to store one chunk plus an extra
@@ -107,6 +110,22 @@ void BackupCreator::handleMoreData( unsigned added )
   }
 }
 
+void BackupCreator::addData( void const * data, size_t size )
+{
+  char const * next = ( char const * ) data;
+
+  while ( size )
+  {
+    size_t toCopy = std::min( size, getInputBufferSize() );
+
+    memcpy( getInputBuffer(), next, toCopy );
+    handleMoreData( toCopy );
+
+    next += toCopy;
+    size -= toCopy;
+  }
+}
+
 void BackupCreator::saveChunkToSave()
 {
   CHECK( chunkToSaveFill > 0, "chunk to save is empty" );
@@ -114,42 +133,39 @@ void BackupCreator::saveChunkToSave()
   if ( chunkToSaveFill < 128 ) // TODO: make this value configurable
   {
     // The amount of data is too small - emit without creating a new chunk
-    BackupInstruction instr;
-    instr.set_bytes_to_emit( chunkToSave.data(), chunkToSaveFill );
-    outputInstruction( instr );
+    outputBytes( chunkToSave.data(), chunkToSaveFill );
   }
   else
   {
     // Output as a chunk
 
     ChunkId id;
-
-    id.rollingHash = RollingHash::digest( chunkToSave.data(),
-                                          chunkToSaveFill );
-    unsigned char sha1Value[ SHA_DIGEST_LENGTH ];
-    SHA1( (unsigned char const *) chunkToSave.data(), chunkToSaveFill,
-          sha1Value );
-
-    STATIC_ASSERT( sizeof( id.cryptoHash ) <= sizeof( sha1Value ) );
-    memcpy( id.cryptoHash, sha1Value, sizeof( id.cryptoHash ) );
+    id.setFromData( chunkToSave.data(), chunkToSaveFill );
 
     // Save it to the store if it's not there already
     chunkStorageWriter.add( id, chunkToSave.data(), chunkToSaveFill );
 
-    BackupInstruction instr;
-    instr.set_chunk_to_emit( id.toBlob() );
-    outputInstruction( instr );
+    outputChunk( id );
   }
 
   chunkToSaveFill = 0;
 }
 
-void BackupCreator::finish()
+void BackupCreator::addInstruction( Instruction const & instr )
 {
-  dPrintf( "At finish: %u, %u\n", chunkToSaveFill, ringBufferFill );
+  flushData();
+
+  if ( instr.hasChunk )
+    outputChunk( instr.chunkId );
+
+  if ( instr.bytesSize )
+    outputBytes( instr.bytes, instr.bytesSize );
+}
 
-  // At this point we may have some bytes in chunkToSave, and some in the ring
-  // buffer. We need to save both
+void BackupCreator::flushData()
+{
+  // We may have some bytes in chunkToSave, and some in the ring buffer. We
+  // need to save both
   if ( chunkToSaveFill + ringBufferFill > chunkMaxSize )
   {
     // We have more than a full chunk in chunkToSave and ringBuffer together, so
@@ -163,12 +179,29 @@ void BackupCreator::finish()
   // Concatenate the rest of data and save it too
 
   CHECK( chunkToSaveFill + ringBufferFill <= chunkMaxSize, "had more than two "
-         "full chunks at backup finish" );
+         "full chunks to flush" );
 
   moveFromRingBufferToChunkToSave( ringBufferFill );
 
   if ( chunkToSaveFill )
     saveChunkToSave();
+
+  rollingHash.reset();
+}
+
+void BackupCreator::finish()
+{
+  dPrintf( "At finish: %u, %u\n", chunkToSaveFill, ringBufferFill );
+
+  flushData();
+
+  instructionWriter.flush();
+  passToNextLevel();
+
+  // The levels above get the last instructions only now, so they are
+  // finished after this one
+  if ( nextLevel.get() )
+    nextLevel->finish();
 }
 
 void BackupCreator::moveFromRingBufferToChunkToSave( unsigned toMove )
@@ -253,9 +286,7 @@ void BackupCreator::addChunkIfMatched()
       saveChunkToSave();
 
     // Add the record
-    BackupInstruction instr;
-    instr.set_chunk_to_emit( getChunkId().toBlob() );
-    outputInstruction( instr );
+    outputChunk( getChunkId() );
 
     // The block was consumed from the ring buffer - remove the block from it
     tail = head;
@@ -264,17 +295,45 @@ void BackupCreator::addChunkIfMatched()
   }
 }
 
-void BackupCreator::outputInstruction( BackupInstruction const & instr )
+void BackupCreator::outputChunk( ChunkId const & id )
+{
+  if ( usedChunks )
+    usedChunks->insert( id );
+
+  instructionWriter.addChunk( id );
+  passToNextLevel();
+}
+
+void BackupCreator::outputBytes( void const * data, size_t size )
 {
-  // TODO: once backupData becomes large enough, spawn another BackupCreator and
-  // feed data to it. This way we wouldn't have to store the entire backupData
-  // in RAM
-  Message::serialize( instr, *backupDataStream );
+  instructionWriter.addBytes( data, size );
+  passToNextLevel();
+}
+
+void BackupCreator::passToNextLevel()
+{
+  if ( !nextLevel.get() && backupData.size() > chunkMaxSize )
+    nextLevel = new BackupCreator( config, chunkIndex, chunkStorageWriter,
+                                   usedChunks );
+
+  if ( nextLevel.get() && !backupData.empty() )
+  {
+    nextLevel->addData( backupData.data(), backupData.size() );
+    backupData.clear();
+  }
 }
 
 void BackupCreator::getBackupData( string & str )
 {
-  CHECK( backupDataStream.get(), "getBackupData() called twice" );
-  backupDataStream.reset();
+  if ( nextLevel.get() )
+    return nextLevel->getBackupData( str );
+
+  CHECK( !backupDataTaken, "getBackupData() called twice" );
+  backupDataTaken = true;
   str.swap( backupData );
 }
+
+unsigned BackupCreator::getLevelsAbove() const
+{
+  return nextLevel.get() ? nextLevel->getLevelsAbove() + 1 : 0;
+}
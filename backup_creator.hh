@@ -4,15 +4,17 @@
 #ifndef BACKUP_CREATOR_HH_INCLUDED
 #define BACKUP_CREATOR_HH_INCLUDED
 
-#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 #include <stddef.h>
+#include <set>
 #include <string>
 #include <vector>
 
 #include "chunk_id.hh"
+#include "chunk_id_set.hh"
 #include "chunk_index.hh"
 #include "chunk_storage.hh"
 #include "file.hh"
+#include "instruction_stream.hh"
 #include "nocopy.hh"
 #include "rolling_hash.hh"
 #include "sptr.hh"
@@ -22,9 +24,16 @@
 using std::vector;
 using std::string;
 
-/// Creates a backup by processing input data and matching/writing chunks
+/// Creates a backup by processing input data and matching/writing chunks.
+/// The instructions restoring the data make the backup manifest, which is
+/// written in the compact instruction format. Once they
+/// outgrow a chunk, they are fed as they come to another BackupCreator,
+/// which makes the next level of the manifest out of them, and so on. This
+/// way the manifest is built in the same single pass over the data, and only
+/// a chunk's worth of instructions is ever kept in RAM for each level
 class BackupCreator: ChunkIndex::ChunkInfoInterface, NoCopy
 {
+  Config const & config;
   unsigned chunkMaxSize;
   ChunkIndex & chunkIndex;
   ChunkStorage::Writer & chunkStorageWriter;
@@ -48,8 +57,14 @@ class BackupCreator: ChunkIndex::ChunkInfoInterface, NoCopy
 
   RollingHash rollingHash;
 
+  /// The instructions not passed to the next level yet. Once there is the
+  /// next level, they are passed right away
   string backupData;
-  sptr< google::protobuf::io::StringOutputStream > backupDataStream;
+  InstructionWriter instructionWriter;
+  bool backupDataTaken;
+  sptr< BackupCreator > nextLevel;
+  /// If set, gets the chunks referred to at this level and the ones above
+  ChunkIdSet * usedChunks;
 
   /// Sees if the current block in the ring buffer exists in the chunk store.
   /// If it does, the reference is emitted and the ring buffer is cleared
@@ -62,15 +77,24 @@ class BackupCreator: ChunkIndex::ChunkInfoInterface, NoCopy
   /// Ring buffer must have at least that many bytes
   void moveFromRingBufferToChunkToSave( unsigned bytes );
 
-  /// Outputs the given instruction to the backup stream
-  void outputInstruction( BackupInstruction const & );
+  /// Outputs all the data added so far, leaving the ring buffer empty
+  void flushData();
+
+  /// Output the instructions to the backup stream
+  void outputChunk( ChunkId const & );
+  void outputBytes( void const *, size_t );
+
+  /// Passes the instructions output to the next level, starting it once
+  /// they outgrow a chunk
+  void passToNextLevel();
 
   bool chunkIdGenerated;
   ChunkId generatedChunkId;
   virtual ChunkId const & getChunkId();
 
 public:
-  BackupCreator( Config const &, ChunkIndex &, ChunkStorage::Writer & );
+  BackupCreator( Config const &, ChunkIndex &, ChunkStorage::Writer &,
+                 ChunkIdSet * usedChunks = NULL );
 
   /// The data is fed the following way: the user fills getInputBuffer() with
   /// up to getInputBufferSize() bytes, then calls handleMoreData() with the
@@ -80,13 +104,26 @@ public:
 
   void handleMoreData( unsigned );
 
+  /// Copies the given data to the input buffer and handles it
+  void addData( void const *, size_t );
+
+  /// Outputs the given instruction as it is, after the data added before it.
+  /// Its chunk, if any, must be in the storage already
+  void addInstruction( Instruction const & );
+
   /// Flushes any remaining data and finishes the process. No additional data
   /// may be added after this call is made
   void finish();
 
-  /// Returns the result of the backup creation. Can only be called once the
-  /// finish() was called and the backup is complete
+  /// Returns the result of the backup creation, which is the topmost level of
+  /// the backup manifest. Can only be called once the finish() was called and
+  /// the backup is complete
   void getBackupData( string & );
+
+  /// Returns the number of levels of the manifest above the one the data is
+  /// restored with, i.e. the number of times the result of getBackupData()
+  /// has to be restored to get to the instructions restoring the data
+  unsigned getLevelsAbove() const;
 };
 
 #endif
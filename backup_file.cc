@@ -5,13 +5,17 @@
 
 #include "encrypted_file.hh"
 #include "encryption.hh"
+#include "instruction_stream.hh"
 #include "message.hh"
 
 namespace BackupFile {
 
 enum
 {
-  FileFormatVersion = 1
+  FileFormatVersion = 1,
+  /// Used for the backups in the compact instruction format, so that the
+  /// versions not supporting it refuse them instead of failing to parse them
+  CompactFileFormatVersion = 2
 };
 
 void save( string const & fileName, EncryptionKey const & encryptionKey,
@@ -22,7 +26,9 @@ void save( string const & fileName, EncryptionKey const & encryptionKey,
   os.writeRandomIv();
 
   FileHeader header;
-  header.set_version( FileFormatVersion );
+  header.set_version( backupInfo.instruction_format() ==
+                      LegacyInstructionFormat ? FileFormatVersion :
+                                                CompactFileFormatVersion );
   Message::serialize( header, os );
 
   Message::serialize( backupInfo, os );
@@ -38,7 +44,8 @@ void load( string const & fileName, EncryptionKey const & encryptionKey,
 
   FileHeader header;
   Message::parse( header, is );
-  if ( header.version() != FileFormatVersion )
+  if ( header.version() != FileFormatVersion &&
+       header.version() != CompactFileFormatVersion )
     throw exUnsupportedVersion();
 
   Message::parse( backupInfo, is );
@@ -1,29 +1,40 @@
 // Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
 // Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
 
-#include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 #include <vector>
 #include <algorithm>
 
 #include "backup_restorer.hh"
 #include "chunk_id.hh"
+#include "encrypted_file.hh"
+#include "endian.hh"
 #include "message.hh"
+#include "sha256.hh"
 #include "zbackup.pb.h"
 
 namespace BackupRestorer {
 
 using std::vector;
-using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::ZeroCopyInputStream;
 
 void restoreMap( ChunkStorage::Reader & chunkStorageReader,
               ChunkMap const * chunkMap, SeekableSink *output )
 {
+  // Visit the bundles in the order they are laid out on disk rather than
+  // in the hash order of their ids
+  vector< Bundle::Id > bundleIds;
+  bundleIds.reserve( chunkMap->size() );
+  for ( ChunkMap::const_iterator it = chunkMap->begin(); it != chunkMap->end(); it++ )
+    bundleIds.push_back( (*it).first );
+  chunkStorageReader.sortBundles( bundleIds );
+
   string chunk;
   size_t chunkSize;
-  for ( ChunkMap::const_iterator it = chunkMap->begin(); it != chunkMap->end(); it++ )
+  for ( vector< Bundle::Id >::const_iterator bi = bundleIds.begin(); bi != bundleIds.end(); bi++ )
   {
-    for ( ChunkPosition::const_iterator pi = (*it).second.begin(); pi != (*it).second.end(); pi++ )
+    ChunkPosition const & positions = chunkMap->find( *bi )->second;
+    for ( ChunkPosition::const_iterator pi = positions.begin(); pi != positions.end(); pi++ )
     {
       if ( output )
       {
@@ -36,32 +47,22 @@ void restoreMap( ChunkStorage::Reader & chunkStorageReader,
 }
 
 void restore( ChunkStorage::Reader & chunkStorageReader,
-              std::string const & backupData,
+              BackupInfo const & backupInfo,
               DataSink * output, ChunkSet * chunkSet,
               ChunkMap * chunkMap, SeekableSink * seekOut )
 {
-  google::protobuf::io::ArrayInputStream is( backupData.data(),
-                                             backupData.size() );
-  CodedInputStream cis( &is );
-  CodedInputStream::Limit limit = cis.PushLimit( backupData.size() );
-  // The following line prevents it from barfing on large backupData.
-  // TODO: this disables size checks for each separate message. Figure a better
-  // way to do this while keeping them enabled. It seems we need to create an
-  // instance of CodedInputStream for each message, but it might be expensive
-  cis.SetTotalBytesLimit( backupData.size(), -1 );
+  LevelReader instructions( chunkStorageReader, backupInfo, chunkSet );
 
   // Used when emitting chunks
   string chunk;
 
-  BackupInstruction instr;
+  Instruction instr;
   int64_t position = 0;
-  while ( cis.BytesUntilLimit() > 0 )
+  while ( instructions.readNext( instr ) )
   {
-    Message::parse( instr, cis );
-
-    if ( instr.has_chunk_to_emit() )
+    if ( instr.hasChunk )
     {
-      ChunkId id( instr.chunk_to_emit() );
+      ChunkId const & id = instr.chunkId;
       size_t chunkSize;
       if ( output )
       {
@@ -88,154 +89,341 @@ void restore( ChunkStorage::Reader & chunkStorageReader,
       }
     }
 
-    if ( ( output || chunkMap ) && instr.has_bytes_to_emit() )
+    if ( ( output || chunkMap ) && instr.bytesSize )
     {
       // Need to emit the bytes directly
-      string const & bytes = instr.bytes_to_emit();
       if ( output )
-        output->saveData( bytes.data(), bytes.size() );
+        output->saveData( instr.bytes, instr.bytesSize );
       if ( chunkMap )
       {
         if ( seekOut )
-          seekOut->saveData( position, bytes.data(), bytes.size() );
-        position += bytes.size();
+          seekOut->saveData( position, instr.bytes, instr.bytesSize );
+        position += instr.bytesSize;
       }
     }
   }
-
-  cis.PopLimit( limit );
 }
 
-void restoreIterations( ChunkStorage::Reader & chunkStorageReader,
-  BackupInfo & backupInfo, std::string & backupData, ChunkSet * chunkSet )
+/// The serialized instructions of one level of the backup manifest, restored
+/// from the level above it as they are read
+class LevelReader::LevelStream: public ZeroCopyInputStream
 {
-  // Perform the iterations needed to get to the actual user backup data
-  for ( ; ; )
+  ChunkStorage::Reader & chunkStorageReader;
+  InstructionReader upper;
+  ChunkSet * chunkSet;
+  Instruction instr;
+  string chunk;
+  /// The data emitted by the last instruction read from the upper level
+  string data;
+  /// Number of bytes of 'data' returned already
+  size_t dataUsed;
+  int64_t byteCount;
+
+public:
+  LevelStream( ChunkStorage::Reader & chunkStorageReader,
+               ZeroCopyInputStream & upper, uint32_t format,
+               ChunkSet * chunkSet ):
+    chunkStorageReader( chunkStorageReader ), upper( upper, format ),
+    chunkSet( chunkSet ), dataUsed( 0 ), byteCount( 0 )
   {
-    backupData.swap( *backupInfo.mutable_backup_data() );
+  }
 
-    if ( backupInfo.iterations() )
+  virtual bool Next( void const ** out, int * size )
+  {
+    while ( dataUsed == data.size() )
     {
-      struct StringWriter: public DataSink
+      if ( !upper.readNext( instr ) )
+        return false;
+
+      data.clear();
+      dataUsed = 0;
+
+      if ( instr.hasChunk )
       {
-        string result;
+        size_t chunkSize;
+        chunkStorageReader.get( instr.chunkId, chunk, chunkSize );
+        data.assign( chunk.data(), chunkSize );
 
-        virtual void saveData( void const * data, size_t size )
-        {
-          result.append( ( char const * ) data, size );
-        }
-      } stringWriter;
+        if ( chunkSet )
+          chunkSet->insert( instr.chunkId );
+      }
 
-      restore( chunkStorageReader, backupData, &stringWriter, chunkSet, NULL, NULL );
-      backupInfo.mutable_backup_data()->swap( stringWriter.result );
-      backupInfo.set_iterations( backupInfo.iterations() - 1 );
+      data.append( instr.bytes, instr.bytesSize );
     }
-    else
-      break;
-  }
-}
 
-// TODO: This iterator can be used in restore() function.
-/// Iterator over BackupInstructions in stream
-class BackupInstructionsIterator : NoCopy
-{
-public:
-  BackupInstructionsIterator( std::string const & backupData )
-    : is( backupData.data(), backupData.size() )
-    , cis( &is )
+    *out = data.data() + dataUsed;
+    *size = data.size() - dataUsed;
+    byteCount += *size;
+    dataUsed = data.size();
 
-  {
-    limit = cis.PushLimit( backupData.size() );
-    // The following line prevents it from barfing on large backupData.
-    // TODO: this disables size checks for each separate message. Figure a better
-    // way to do this while keeping them enabled. It seems we need to create an
-    // instance of CodedInputStream for each message, but it might be expensive
-    cis.SetTotalBytesLimit( backupData.size(), -1 );
+    return true;
   }
 
-  ~BackupInstructionsIterator()
+  virtual void BackUp( int count )
   {
-    cis.PopLimit( limit );
+    dataUsed -= count;
+    byteCount -= count;
   }
 
-  /// Read next BackupInstruction instruction in stream.
-  /// Returns true if there is any, and false if end of stream reached.
-  bool readNext( BackupInstruction & instr )
+  virtual bool Skip( int count )
   {
-    if ( cis.BytesUntilLimit() > 0 )
-    {
-      Message::parse( instr, cis );
-      return true;
-    }
-    else
+    void const * out;
+    int size;
+
+    while ( count > 0 )
     {
-      return false;
+      if ( !Next( &out, &size ) )
+        return false;
+
+      if ( size > count )
+      {
+        BackUp( size - count );
+        break;
+      }
+
+      count -= size;
     }
+
+    return true;
+  }
+
+  virtual int64_t ByteCount() const
+  {
+    return byteCount;
+  }
+};
+
+LevelReader::LevelReader( ChunkStorage::Reader & chunkStorageReader,
+                          BackupInfo const & backupInfo, ChunkSet * chunkSet ):
+  topLevel( backupInfo.backup_data().data(), backupInfo.backup_data().size() )
+{
+  ZeroCopyInputStream * upper = &topLevel;
+  uint32_t format = backupInfo.instruction_format();
+
+  for ( uint32_t x = backupInfo.iterations(); x--; )
+  {
+    levels.push_back( new LevelStream( chunkStorageReader, *upper, format,
+                                       chunkSet ) );
+    upper = levels.back();
   }
 
-private:
-  google::protobuf::io::ArrayInputStream is;
-  CodedInputStream cis;
-  CodedInputStream::Limit limit;
+  instructions = new InstructionReader( *upper, format );
+}
+
+bool LevelReader::readNext( Instruction & instr )
+{
+  return instructions->readNext( instr );
+}
+
+LevelReader::~LevelReader()
+{
+  // The readers give the data they haven't consumed back to their streams,
+  // so they go before the streams
+  instructions.reset();
+
+  for ( size_t x = levels.size(); x--; )
+    delete levels[ x ];
+}
+
+namespace {
+
+enum
+{
+  TableFileFormatVersion = 1,
+  ByteOrderMark = 0x01020304
 };
 
+template< typename T >
+void writeArray( EncryptedFile::OutputStream & os, vector< T > const & v )
+{
+  if ( !v.empty() )
+    os.write( &v[ 0 ], v.size() * sizeof( T ) );
+}
+
+template< typename T >
+void readArray( EncryptedFile::InputStream & is, vector< T > & v, uint64_t count )
+{
+  v.resize( count );
+  if ( count )
+    is.read( &v[ 0 ], count * sizeof( T ) );
+}
+
+}
+
 IndexedRestorer::IndexedRestorer( ChunkStorage::Reader & chunkStorageReader,
-                                  std::string const & backupData )
+                                  BackupInfo const & backupInfo )
    : chunkStorageReader( chunkStorageReader )
 {
-  BackupInstructionsIterator instructionIter( backupData );
+  LevelReader instructions( chunkStorageReader, backupInfo );
+  ChunkOrdinals ordinals( chunks );
 
-  BackupInstruction instr;
+  Instruction instr;
   int64_t position = 0;
-  while ( instructionIter.readNext( instr ) )
+  while ( instructions.readNext( instr ) )
   {
-    instructions.push_back( std::make_pair( position, instr ) );
+    offsets.push_back( position );
+    bytesOffsets.push_back( bytes.size() );
 
-    if ( instr.has_chunk_to_emit() )
+    if ( instr.hasChunk )
     {
-      ChunkId id( instr.chunk_to_emit() );
-      size_t chunkSize;
-      chunkStorageReader.getBundleId( id, chunkSize );
+      ChunkId const & id = instr.chunkId;
+      bool added;
+      uint32_t ordinal = ordinals.get( id, added );
+      if ( added )
+      {
+        size_t chunkSize;
+        chunkStorageReader.getBundleId( id, chunkSize );
+        chunkSizes.push_back( chunkSize );
+      }
 
-      position += chunkSize;
+      chunkOrdinals.push_back( ordinal );
+      position += chunkSizes[ ordinal ];
     }
+    else
+      chunkOrdinals.push_back( NoChunk );
 
-    if ( instr.has_bytes_to_emit() )
+    bytes.append( instr.bytes, instr.bytesSize );
+    position += instr.bytesSize;
+  }
+
+  bytesOffsets.push_back( bytes.size() );
+
+  totalSize = position;
+}
+
+IndexedRestorer::IndexedRestorer( ChunkStorage::Reader & chunkStorageReader,
+                                  std::string const & fileName,
+                                  EncryptionKey const & encryptionKey,
+                                  std::string const & backupHash,
+                                  uint64_t backupSize )
+   : chunkStorageReader( chunkStorageReader )
+{
+  EncryptedFile::InputStream is( fileName.c_str(), encryptionKey,
+                                 Encryption::ZeroIv );
+  is.consumeRandomIv();
+
+  FileHeader header;
+  Message::parse( header, is );
+  if ( header.version() != TableFileFormatVersion )
+    throw exUnsupportedTableVersion();
+
+  InstructionTableInfo info;
+  Message::parse( info, is );
+  if ( info.backup_hash() != backupHash || info.size() != backupSize ||
+       info.byte_order_mark() != ByteOrderMark )
+    throw exTableMismatch();
+
+  readArray( is, offsets, info.instruction_count() );
+  readArray( is, chunkOrdinals, info.instruction_count() );
+  readArray( is, bytesOffsets, info.instruction_count() + 1 );
+  readArray( is, chunks, info.chunk_count() );
+  readArray( is, chunkSizes, info.chunk_count() );
+
+  bytes.resize( info.bytes_size() );
+  if ( !bytes.empty() )
+    is.read( &bytes[ 0 ], bytes.size() );
+
+  is.checkAdler32();
+
+  totalSize = info.size();
+
+  checkTable();
+}
+
+void IndexedRestorer::checkTable() const
+{
+  if ( bytesOffsets.empty() || bytesOffsets.front() ||
+       bytesOffsets.back() != bytes.size() )
+    throw exCorruptTable();
+
+  // Replay the table, requiring each instruction to start where the previous
+  // one ended and to only refer to the chunks and bytes which exist
+  int64_t position = 0;
+  for ( size_t x = 0; x < offsets.size(); ++x )
+  {
+    if ( offsets[ x ] != position )
+      throw exCorruptTable();
+
+    if ( chunkOrdinals[ x ] != NoChunk )
     {
-      string const & bytes = instr.bytes_to_emit();
-      position += bytes.size();
+      if ( chunkOrdinals[ x ] >= chunks.size() )
+        throw exCorruptTable();
+      position += chunkSizes[ chunkOrdinals[ x ] ];
     }
+
+    if ( bytesOffsets[ x + 1 ] < bytesOffsets[ x ] )
+      throw exCorruptTable();
+    position += bytesOffsets[ x + 1 ] - bytesOffsets[ x ];
   }
 
-  totalSize = position;
+  if ( position != totalSize )
+    throw exCorruptTable();
 }
 
-int64_t IndexedRestorer::size() const
+void IndexedRestorer::save( std::string const & fileName,
+                            EncryptionKey const & encryptionKey,
+                            std::string const & backupHash ) const
 {
-  return totalSize;
+  EncryptedFile::OutputStream os( fileName.c_str(), encryptionKey,
+                                  Encryption::ZeroIv );
+  os.writeRandomIv();
+
+  FileHeader header;
+  header.set_version( TableFileFormatVersion );
+  Message::serialize( header, os );
+
+  InstructionTableInfo info;
+  info.set_backup_hash( backupHash );
+  info.set_size( totalSize );
+  info.set_instruction_count( offsets.size() );
+  info.set_chunk_count( chunks.size() );
+  info.set_bytes_size( bytes.size() );
+  info.set_byte_order_mark( ByteOrderMark );
+  Message::serialize( info, os );
+
+  writeArray( os, offsets );
+  writeArray( os, chunkOrdinals );
+  writeArray( os, bytesOffsets );
+  writeArray( os, chunks );
+  writeArray( os, chunkSizes );
+  os.write( bytes.data(), bytes.size() );
+
+  os.writeAdler32();
 }
 
-template<class PairType>
-class PairFirstLess
+std::string IndexedRestorer::getBackupHash( BackupInfo const & backupInfo )
 {
-public:
-  bool operator()( PairType const & left, PairType const & right )
+  Sha256 sha256;
+  uint32_t iterations = toLittleEndian( backupInfo.iterations() );
+  sha256.add( &iterations, sizeof( iterations ) );
+  // Only hashed when not the default, so the legacy backups keep their hashes
+  if ( backupInfo.instruction_format() != LegacyInstructionFormat )
   {
-    return left.first < right.first;
+    uint32_t format = toLittleEndian( backupInfo.instruction_format() );
+    sha256.add( &format, sizeof( format ) );
   }
-};
+  sha256.add( backupInfo.backup_data().data(), backupInfo.backup_data().size() );
+
+  return sha256.finish();
+}
+
+int64_t IndexedRestorer::size() const
+{
+  return totalSize;
+}
 
 void IndexedRestorer::saveData( int64_t offset, void * data, size_t size ) const
 {
   if ( offset < 0 || offset + size > totalSize )
     throw exOutOfRange();
 
+  if ( !size )
+    return;
+
   // Find first instruction which generates output range that starts after offset
-  Instructions::const_iterator it =
-      std::upper_bound( instructions.begin(), instructions.end(),
-                        std::make_pair(offset, BackupInstruction()),
-                        PairFirstLess<InstructionAtPos>() );
-  assert(it != instructions.begin());
+  vector< int64_t >::const_iterator it =
+      std::upper_bound( offsets.begin(), offsets.end(), offset );
+  assert( it != offsets.begin() );
   // Iterator will point on instruction, which range will include byte at offset
   --it;
 
@@ -264,6 +452,9 @@ void IndexedRestorer::saveData( int64_t offset, void * data, size_t size ) const
         end = offset + size - chunkOffset;
       }
 
+      if ( start >= end )
+        return size != 0;
+
       size_t partSize = end - start;
       memcpy( data, chunk + start, partSize );
 
@@ -284,17 +475,15 @@ void IndexedRestorer::saveData( int64_t offset, void * data, size_t size ) const
   Outputer out( offset, static_cast<char *>( data ), size );
   string chunk;
 
-  int64_t position = it->first;
-  for ( ; it != instructions.end(); ++it)
+  for ( size_t x = it - offsets.begin(); x < offsets.size(); ++x )
   {
-    assert( position == it->first );
-    BackupInstruction const & instr = it->second;
+    int64_t position = offsets[ x ];
 
-    if ( instr.has_chunk_to_emit() )
+    if ( chunkOrdinals[ x ] != NoChunk )
     {
-      ChunkId id( instr.chunk_to_emit() );
+      uint32_t ordinal = chunkOrdinals[ x ];
       size_t chunkSize;
-      chunkStorageReader.get( id, chunk, chunkSize );
+      chunkStorageReader.get( chunks[ ordinal ], chunk, chunkSize );
 
       if ( !out( position, chunk.data(), chunkSize ) )
       {
@@ -303,16 +492,38 @@ void IndexedRestorer::saveData( int64_t offset, void * data, size_t size ) const
       position += chunkSize;
     }
 
-    if ( instr.has_bytes_to_emit() )
+    uint64_t bytesSize = bytesOffsets[ x + 1 ] - bytesOffsets[ x ];
+    if ( bytesSize )
     {
-      string const & bytes = instr.bytes_to_emit();
-      if ( !out( position, bytes.data(), bytes.size() ) )
+      if ( !out( position, bytes.data() + bytesOffsets[ x ], bytesSize ) )
       {
         break;
       }
-      position += bytes.size();
     }
   }
 }
 
+void IndexedRestorer::prefetch( int64_t offset, size_t size ) const
+{
+  if ( offset < 0 || offset >= totalSize || !size )
+    return;
+
+  int64_t end = offset + size > totalSize ? totalSize : offset + size;
+
+  vector< int64_t >::const_iterator it =
+      std::upper_bound( offsets.begin(), offsets.end(), offset );
+  assert( it != offsets.begin() );
+  --it;
+
+  string chunk;
+
+  for ( size_t x = it - offsets.begin(); x < offsets.size() &&
+        offsets[ x ] < end; ++x )
+    if ( chunkOrdinals[ x ] != NoChunk )
+    {
+      size_t chunkSize;
+      chunkStorageReader.get( chunks[ chunkOrdinals[ x ] ], chunk, chunkSize );
+    }
+}
+
 }
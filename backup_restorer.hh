@@ -4,16 +4,24 @@
 #ifndef BACKUP_RESTORER_HH_INCLUDED
 #define BACKUP_RESTORER_HH_INCLUDED
 
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 #include <stddef.h>
 #include <exception>
 #include <string>
 #include <set>
+#include <vector>
 
 #undef __DEPRECATED
 #include <ext/hash_map>
 
+#include "chunk_id_set.hh"
 #include "chunk_storage.hh"
+#include "encryption_key.hh"
 #include "ex.hh"
+#include "instruction_stream.hh"
+#include "nocopy.hh"
+#include "sptr.hh"
+#include "zbackup.pb.h"
 
 /// Generic interface to stream data out
 class DataSink
@@ -48,27 +56,73 @@ DEF_EX( exTooManyBytesToEmit, "A backup record asks to emit too many bytes", Ex
 DEF_EX( exBytesToMap, "Can't restore bytes to ChunkMap", Ex )
 DEF_EX( exOutOfRange, "Requested data block is out of backup data range", Ex )
 
-typedef std::set< ChunkId > ChunkSet;
+typedef ChunkIdSet ChunkSet;
 typedef std::vector< std::pair < ChunkId, int64_t > > ChunkPosition;
 typedef __gnu_cxx::hash_map< Bundle::Id, ChunkPosition > ChunkMap;
 
+/// Reads the instructions which restore the user data of a backup. When the
+/// backup manifest has several levels, the ones above the user data are
+/// restored on the fly as the instructions are read. Only the chunk being
+/// read is kept in memory for each level, so no level ever has to be restored
+/// in full. The BackupInfo must outlive the reader
+class LevelReader: NoCopy
+{
+public:
+  /// Adds the chunks the levels above the user data are stored in to the
+  /// set, if one is given
+  LevelReader( ChunkStorage::Reader &, BackupInfo const &, ChunkSet * = NULL );
+
+  /// Reads the next instruction. Returns false once there are no more
+  bool readNext( Instruction & );
+
+  ~LevelReader();
+
+private:
+  class LevelStream;
+
+  google::protobuf::io::ArrayInputStream topLevel;
+  /// The levels below the top one, the last one being the user data level
+  std::vector< LevelStream * > levels;
+  sptr< InstructionReader > instructions;
+};
+
 /// Restores the given backup
-void restore( ChunkStorage::Reader &, std::string const & backupData,
+void restore( ChunkStorage::Reader &, BackupInfo const &,
               DataSink *, ChunkSet *, ChunkMap *, SeekableSink * );
 
 /// Restores ChunkMap using seekable output
 void restoreMap( ChunkStorage::Reader & chunkStorageReader,
               ChunkMap const * chunkMap, SeekableSink *output );
 
-/// Performs restore iterations on backupData
-void restoreIterations( ChunkStorage::Reader &, BackupInfo &, std::string &, ChunkSet * );
-
 /// Reader class that loads information about all backup chunks and provides
-/// fast way of retrieving data from arbitrary offset
+/// fast way of retrieving data from arbitrary offset. The information is kept
+/// in a compact columnar table, which can also be saved to a file and loaded
+/// back later instead of being rebuilt from the backup data
 class IndexedRestorer : NoCopy
 {
 public:
-  IndexedRestorer( ChunkStorage::Reader & chunkStorageReader, std::string const & backupData );
+  DEF_EX( exUnsupportedTableVersion, "Unsupported version of the instruction table file format", Ex )
+  DEF_EX( exTableMismatch, "The instruction table doesn't match the backup", Ex )
+  DEF_EX( exCorruptTable, "The instruction table is corrupt", Ex )
+
+  /// Builds the table from the backup
+  IndexedRestorer( ChunkStorage::Reader & chunkStorageReader, BackupInfo const & );
+
+  /// Loads the table previously written by save(). The hash and the size of
+  /// the backup must match the ones the table was saved with. The ordinals and
+  /// offsets loaded are checked against each other, so saveData() never goes
+  /// out of bounds
+  IndexedRestorer( ChunkStorage::Reader & chunkStorageReader,
+                   std::string const & fileName, EncryptionKey const &,
+                   std::string const & backupHash, uint64_t backupSize );
+
+  /// Saves the table, so it can be loaded instead of being rebuilt
+  void save( std::string const & fileName, EncryptionKey const &,
+             std::string const & backupHash ) const;
+
+  /// Returns the hash identifying the data of the given backup. Backups
+  /// with the same hash share the same instruction table
+  static std::string getBackupHash( BackupInfo const & );
 
   /// Returns total size of the backup
   int64_t size() const;
@@ -76,13 +130,35 @@ public:
   /// Restore "size" bytes of data from specified offset into "data" buffer
   void saveData( int64_t offset, void * data, size_t size ) const;
 
+  /// Loads the chunks covering the given range into the chunk storage
+  /// reader's caches without outputting anything. The range is clipped to
+  /// the size of the backup
+  void prefetch( int64_t offset, size_t size ) const;
+
 private:
+  enum
+  {
+    NoChunk = 0xFFFFFFFF
+  };
+
+  /// Throws exCorruptTable unless every ordinal and offset is in range
+  void checkTable() const;
+
   ChunkStorage::Reader & chunkStorageReader;
   int64_t totalSize;
 
-  typedef std::pair<int64_t, BackupInstruction> InstructionAtPos;
-  typedef std::vector<InstructionAtPos> Instructions;
-  Instructions instructions;
+  /// Position in the output at which each instruction starts
+  std::vector< int64_t > offsets;
+  /// Index in 'chunks' of the chunk each instruction emits, or NoChunk
+  std::vector< uint32_t > chunkOrdinals;
+  /// Offset in 'bytes' of the bytes each instruction emits. Has an extra
+  /// element at the end, so instruction x emits bytes up to bytesOffsets[ x + 1 ]
+  std::vector< uint64_t > bytesOffsets;
+  /// Distinct chunks the backup consists of, along with their sizes
+  std::vector< ChunkId > chunks;
+  std::vector< uint32_t > chunkSizes;
+  /// All the bytes emitted by the instructions directly, back to back
+  std::string bytes;
 };
 }
 
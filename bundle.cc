@@ -11,6 +11,7 @@
 #include "message.hh"
 #include "adler32.hh"
 #include "compression.hh"
+#include "endian.hh"
 
 namespace Bundle {
 
@@ -21,6 +22,10 @@ enum
   // This means, we don't use LZMA in this file.
   FileFormatVersionNotLZMA,
 
+  // The payload is split into separately compressed frames, listed in the
+  // file header
+  FileFormatVersionFramed,
+
   // <- add more versions here
 
   // This is the first version, we do not support.
@@ -36,9 +41,10 @@ void Creator::addChunk( string const & id, void const * data, size_t size )
 }
 
 void Creator::write( std::string const & fileName, EncryptionKey const & key,
-    Reader & reader )
+    Reader & reader, EncryptedFile::Mode mode )
 {
-  EncryptedFile::OutputStream os( fileName.c_str(), key, Encryption::ZeroIv );
+  EncryptedFile::OutputStream os( fileName.c_str(), key, Encryption::ZeroIv,
+                                  mode );
 
   os.writeRandomIv();
 
@@ -93,10 +99,43 @@ void Creator::write( std::string const & fileName, EncryptionKey const & key,
     reader.is.reset();
 }
 
+namespace {
+
+/// Compresses the data into a separate frame, appending it to 'out'
+void compressFrame( Config const & config,
+                    const_sptr< Compression::CompressionMethod > compression,
+                    char const * data, size_t size, string & out )
+{
+  sptr< Compression::EnDecoder > encoder = compression->createEncoder( config );
+
+  encoder->setInput( data, size );
+
+  size_t start = out.size();
+  size_t done = start;
+
+  for ( ; ; )
+  {
+    // Most of the time, the compressed data is smaller than the original
+    out.resize( done + size / 2 + 4096 );
+    encoder->setOutput( &out[ done ], out.size() - done );
+
+    bool finished = encoder->process( true );
+    done = out.size() - encoder->getAvailableOutput();
+
+    if ( finished )
+      break;
+  }
+
+  out.resize( done );
+}
+
+}
+
 void Creator::write( Config const & config, std::string const & fileName,
     EncryptionKey const & key )
 {
-  EncryptedFile::OutputStream os( fileName.c_str(), key, Encryption::ZeroIv );
+  EncryptedFile::OutputStream os( fileName.c_str(), key, Encryption::ZeroIv,
+      EncryptedFile::getModeByName( config.GET_STORABLE( encryption, mode ) ) );
 
   os.writeRandomIv();
 
@@ -106,13 +145,60 @@ void Creator::write( Config const & config, std::string const & fileName,
     Compression::CompressionMethod::selectedCompression;
   header.set_compression_method( compression->getName() );
 
+  size_t frameSize = config.GET_STORABLE( bundle, frame_size );
+
   // The old code only support lzma, so we will bump up the version, if we're
   // using lzma. This will make it fail cleanly.
+  if ( frameSize )
+    header.set_version( FileFormatVersionFramed );
+  else
   if ( compression->getName() == "lzma" )
     header.set_version( FileFormatVersion );
   else
     header.set_version( FileFormatVersionNotLZMA );
 
+  if ( frameSize )
+  {
+    // The frame table goes to the header, so the frames have to be compressed
+    // before anything is written. Each frame takes whole chunks until it has
+    // at least frameSize bytes
+    string compressed;
+    size_t frameStart = 0, frameEnd = 0;
+
+    for ( int x = 0, count = info.chunk_record_size(); x < count; ++x )
+    {
+      frameEnd += info.chunk_record( x ).size();
+
+      if ( frameEnd - frameStart < frameSize && x != count - 1 )
+        continue;
+
+      size_t compressedStart = compressed.size();
+      compressFrame( config, compression, payload.data() + frameStart,
+                     frameEnd - frameStart, compressed );
+
+      Adler32 adler32;
+      adler32.add( compressed.data() + compressedStart,
+                   compressed.size() - compressedStart );
+
+      BundleFileHeader_Frame * frame = header.add_frame();
+      frame->set_compressed_size( compressed.size() - compressedStart );
+      frame->set_size( frameEnd - frameStart );
+      frame->set_adler32( adler32.result() );
+
+      frameStart = frameEnd;
+    }
+
+    Message::serialize( header, os );
+
+    Message::serialize( info, os );
+    os.writeAdler32();
+
+    os.write( compressed.data(), compressed.size() );
+    os.writeAdler32();
+
+    return;
+  }
+
   Message::serialize( header, os );
 
   Message::serialize( info, os );
@@ -171,64 +257,165 @@ Reader::Reader( string const & fileName, EncryptionKey const & key, bool keepStr
   for ( int x = info.chunk_record_size(); x--; )
     payloadSize += info.chunk_record( x ).size();
 
-  payload.resize( payloadSize );
-
   if ( keepStream )
     return;
 
-  sptr<Compression::EnDecoder> decoder = Compression::CompressionMethod::findCompression(
-                                           header.compression_method() )->createDecoder();
+  if ( header.version() == FileFormatVersionFramed )
+  {
+    // Only remember where the frames are, they are loaded on demand
+    int64_t fileOffset = is->ByteCount();
+    size_t payloadOffset = 0;
 
-  decoder->setOutput( &payload[ 0 ], payload.size() );
+    for ( int x = 0, count = header.frame_size(); x < count; ++x )
+    {
+      framePayloadOffsets.push_back( payloadOffset );
+      frameFileOffsets.push_back( fileOffset );
+      payloadOffset += header.frame( x ).size();
+      fileOffset += header.frame( x ).compressed_size();
+    }
+    framePayloadOffsets.push_back( payloadOffset );
 
-  for ( ; ; )
+    if ( payloadOffset != payloadSize )
+      throw exBadFrames();
+
+    frames.resize( header.frame_size() );
+    frameLoaded.resize( header.frame_size(), false );
+
+    is.reset();
+    file = new EncryptedFile::RandomAccessFile( fileName.c_str(), key,
+                                                Encryption::ZeroIv );
+  }
+  else
   {
+    frames.resize( 1 );
+    frameLoaded.resize( 1, true );
+    framePayloadOffsets.push_back( 0 );
+    framePayloadOffsets.push_back( payloadSize );
+
+    // The decoders don't cope with corrupted input, so the whole payload is
+    // gathered and its adler32 is checked before decompressing it. A mapped
+    // file is used in place, others have the payload copied out
+    Adler32 adler32( is->getAdler32() );
+    string copy;
+    char const * compressed = NULL;
+    size_t compressedSize = 0;
+
+    void const * data;
+    int size;
+    while ( is->Next( &data, &size ) )
     {
-      void const * data;
-      int size;
-      if ( !is->Next( &data, &size ) )
+      if ( is->isMapped() )
       {
-        decoder.reset();
-        throw exBundleReadFailed();
+        if ( !compressed )
+          compressed = ( char const * ) data;
+        compressedSize += size;
       }
-      if ( !size )
-        continue;
-      decoder->setInput( data, size );
+      else
+        copy.append( ( char const * ) data, size );
     }
 
-    if ( decoder->process( false ) )
+    if ( !is->isMapped() )
     {
-      if ( decoder->getAvailableInput() )
-        is->BackUp( decoder->getAvailableInput() );
-      break;
+      compressed = copy.data();
+      compressedSize = copy.size();
     }
 
-    if ( !decoder->getAvailableOutput() && decoder->getAvailableInput() )
-    {
-      // Apparently we have more data than we were expecting
-      decoder.reset();
-      throw exTooMuchData();
-    }
-  }
+    Adler32::Value stored;
+    if ( compressedSize < sizeof( stored ) )
+      throw exBundleReadFailed();
 
-  decoder.reset();
+    compressedSize -= sizeof( stored );
+    memcpy( &stored, compressed + compressedSize, sizeof( stored ) );
+    adler32.add( compressed, compressedSize );
+    if ( adler32.result() != fromLittleEndian( stored ) )
+      throw EncryptedFile::exAdlerMismatch();
 
-  is->checkAdler32();
-  if ( is.get() )
+    frames[ 0 ].resize( payloadSize );
+    decompress( compressed, compressedSize, frames[ 0 ] );
     is.reset();
+  }
 
   // Populate the map
-  char const * next = payload.data();
+  size_t offset = 0, frame = 0;
   for ( int x = 0, count = info.chunk_record_size(); x < count; ++x )
   {
     BundleInfo_ChunkRecord const & record = info.chunk_record( x );
+
+    findFrame( offset, record.size(), frame );
+
+    ChunkLocation location;
+    location.frame = frame;
+    location.offset = offset - framePayloadOffsets[ frame ];
+    location.size = record.size();
+
     pair< Chunks::iterator, bool > res =
-      chunks.insert( Chunks::value_type( record.id(),
-                                         Chunks::mapped_type( next,
-                                                              record.size() ) ) );
+      chunks.insert( Chunks::value_type( record.id(), location ) );
     if ( !res.second )
       throw exDuplicateChunks(); // Duplicate key encountered
-    next += record.size();
+    offset += record.size();
+  }
+}
+
+void Reader::findFrame( size_t offset, size_t size, size_t & frame ) const
+{
+  for ( ; ; ++frame )
+  {
+    if ( frame + 1 >= framePayloadOffsets.size() )
+      throw exBadFrames();
+
+    if ( !size || offset < framePayloadOffsets[ frame + 1 ] )
+      break;
+  }
+
+  // Each chunk has to be held by a single frame
+  if ( offset + size > framePayloadOffsets[ frame + 1 ] )
+    throw exBadFrames();
+}
+
+void Reader::loadFrame( size_t x )
+{
+  BundleFileHeader_Frame const & frame = header.frame( x );
+
+  string compressed( frame.compressed_size(), 0 );
+  file->read( frameFileOffsets[ x ], &compressed[ 0 ], compressed.size() );
+
+  Adler32 adler32;
+  adler32.add( compressed.data(), compressed.size() );
+  if ( adler32.result() != frame.adler32() )
+    throw exFrameAdlerMismatch();
+
+  frames[ x ].resize( frame.size() );
+  decompress( compressed.data(), compressed.size(), frames[ x ] );
+
+  frameLoaded[ x ] = true;
+}
+
+void Reader::decompress( void const * compressed, size_t compressedSize,
+                         string & data ) const
+{
+  sptr<Compression::EnDecoder> decoder = Compression::CompressionMethod::findCompression(
+                                           header.compression_method() )->createDecoder();
+
+  decoder->setInput( compressed, compressedSize );
+  decoder->setOutput( &data[ 0 ], data.size() );
+
+  for ( ; ; )
+  {
+    size_t availableInput = decoder->getAvailableInput();
+
+    if ( decoder->process( false ) )
+      break;
+
+    // All the input is there already, so each call has to make progress
+    if ( decoder->getAvailableInput() == availableInput )
+    {
+      bool truncated = decoder->getAvailableOutput();
+      decoder.reset();
+      if ( truncated )
+        throw exBundleReadFailed();
+      else
+        throw exTooMuchData();
+    }
   }
 }
 
@@ -238,10 +425,22 @@ bool Reader::get( string const & chunkId, string & chunkData,
   Chunks::iterator i = chunks.find( chunkId );
   if ( i != chunks.end() )
   {
-    size_t sz = i->second.second;
+    ChunkLocation const & location = i->second;
+
+    // Frames are never unloaded, so once loaded, they can be read without
+    // the lock
+    if ( file.get() )
+    {
+      Lock _( framesMutex );
+      if ( !frameLoaded[ location.frame ] )
+        loadFrame( location.frame );
+    }
+
+    size_t sz = location.size;
     if ( chunkData.size() < sz )
       chunkData.resize( sz );
-    memcpy( &chunkData[ 0 ], i->second.first, sz );
+    memcpy( &chunkData[ 0 ], frames[ location.frame ].data() + location.offset,
+            sz );
 
     chunkDataSize = sz;
     return true;
@@ -250,6 +449,51 @@ bool Reader::get( string const & chunkId, string & chunkData,
     return false;
 }
 
+void Reader::forEachChunk( ChunkVisitor & visitor )
+{
+  size_t offset = 0, frame = 0;
+  for ( int x = 0, count = info.chunk_record_size(); x < count; ++x )
+  {
+    BundleInfo_ChunkRecord const & record = info.chunk_record( x );
+
+    findFrame( offset, record.size(), frame );
+
+    if ( visitor.wantsChunk( x ) )
+    {
+      if ( file.get() )
+      {
+        Lock _( framesMutex );
+        if ( !frameLoaded[ frame ] )
+          loadFrame( frame );
+      }
+
+      visitor.visitChunk( record.id(), frames[ frame ].data() + offset -
+                          framePayloadOffsets[ frame ], record.size() );
+    }
+
+    offset += record.size();
+  }
+}
+
+string Reader::getPayload()
+{
+  string payload;
+
+  for ( size_t x = 0; x < frames.size(); ++x )
+  {
+    if ( file.get() )
+    {
+      Lock _( framesMutex );
+      if ( !frameLoaded[ x ] )
+        loadFrame( x );
+    }
+
+    payload.append( frames[ x ] );
+  }
+
+  return payload;
+}
+
 string generateFileName( Id const & id, string const & bundlesDir,
                          bool createDirs )
 {
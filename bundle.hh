@@ -10,9 +10,11 @@
 #include <map>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "encryption_key.hh"
 #include "ex.hh"
+#include "mt.hh"
 #include "nocopy.hh"
 #include "static_assert.hh"
 #include "zbackup.pb.h"
@@ -24,6 +26,7 @@ namespace Bundle {
 using std::string;
 using std::pair;
 using std::map;
+using std::vector;
 
 enum
 {
@@ -48,27 +51,78 @@ struct Id
 
 STATIC_ASSERT( sizeof( Id ) == IdSize );
 
-/// Reads the bundle and allows accessing chunks
+/// Reads the bundle and allows accessing chunks. Framed bundles are read
+/// lazily, only decompressing the frames holding the chunks requested
 class Reader: NoCopy
 {
   BundleInfo info;
   BundleFileHeader header;
-  /// Unpacked payload
-  string payload;
-  /// Maps chunk id blob to its contents and size
-  typedef map< string, pair< char const *, size_t > > Chunks;
+  /// Unpacked payload, split into frames. Bundles which aren't framed have a
+  /// single frame. Frames not loaded yet are empty
+  vector< string > frames;
+  /// Offset of each frame in the payload, with an extra element at the end
+  vector< size_t > framePayloadOffsets;
+  /// Offset of each frame in the file, for the frames not loaded yet
+  vector< int64_t > frameFileOffsets;
+  vector< bool > frameLoaded;
+  /// Set for framed bundles only
+  sptr< EncryptedFile::RandomAccessFile > file;
+  /// Guards loading of the frames, since get() may be called from several
+  /// threads
+  Mutex framesMutex;
+  /// Maps chunk id blob to the index of its frame, its offset in the frame
+  /// and its size
+  struct ChunkLocation
+  {
+    size_t frame, offset, size;
+  };
+  typedef map< string, ChunkLocation > Chunks;
   Chunks chunks;
 
+  /// Reads, checks and decompresses the given frame. framesMutex must be held
+  void loadFrame( size_t frame );
+
+  /// Decompresses all of the compressed bytes into 'data', which has to be
+  /// exactly of the size of the result
+  void decompress( void const * compressed, size_t compressedSize,
+                   string & data ) const;
+
+  /// Advances 'frame' to the one holding the chunk of the given size at the
+  /// given payload offset. Throws exBadFrames if no frame holds all of it
+  void findFrame( size_t offset, size_t size, size_t & frame ) const;
+
 public:
   DEF_EX( Ex, "Bundle reader exception", std::exception )
   DEF_EX( exBundleReadFailed, "Bundle read failed", Ex )
   DEF_EX( exUnsupportedVersion, "Unsupported version of the index file format", Ex )
   DEF_EX( exTooMuchData, "More data than expected in a bundle", Ex )
   DEF_EX( exDuplicateChunks, "Chunks with the same id found in a bundle", Ex )
+  DEF_EX( exBadFrames, "Frames of a bundle don't match its chunks", Ex )
+  DEF_EX( exFrameAdlerMismatch, "Adler32 mismatch in a bundle frame", Ex )
 
   Reader( string const & fileName, EncryptionKey const & key,
       bool keepStream = false );
 
+  /// Receives the chunks of a bundle from forEachChunk()
+  class ChunkVisitor
+  {
+  public:
+    /// Returns true if the chunk with the given index in the BundleInfo is
+    /// wanted. Frames holding no wanted chunks aren't even decompressed
+    virtual bool wantsChunk( size_t record ) = 0;
+
+    /// Gets the id blob and the data of a wanted chunk. The data points into
+    /// the bundle and is only valid during the call
+    virtual void visitChunk( string const & chunkId, void const * data,
+                             size_t size ) = 0;
+
+    virtual ~ChunkVisitor() {}
+  };
+
+  /// Passes the wanted chunks to the visitor in the order they are stored,
+  /// without copying them
+  void forEachChunk( ChunkVisitor & );
+
   /// Reads the chunk into chunkData and returns true, or returns false if there
   /// was no such chunk in the bundle. chunkData may be enlarged but won't
   /// be shrunk. The size of the actual chunk would be stored in chunkDataSize
@@ -77,8 +131,7 @@ public:
   { return info; }
   BundleFileHeader getBundleHeader()
   { return header; }
-  string getPayload()
-  { return payload; }
+  string getPayload();
 
   sptr< EncryptedFile::InputStream > is;
 };
@@ -105,8 +158,10 @@ public:
   /// time-consuming - calling this function from a worker thread could be
   /// warranted
   void write( Config const &, string const & fileName, EncryptionKey const & );
+  /// Writes the contents of the given bundle to the given file, re-encrypting
+  /// them in the given mode
   void write( string const & fileName, EncryptionKey const &,
-      Bundle::Reader & reader );
+      Bundle::Reader & reader, EncryptedFile::Mode = EncryptedFile::Cbc );
 
   /// Returns the current BundleInfo record - this is used for index files
   BundleInfo const & getCurrentBundleInfo() const
@@ -22,6 +22,7 @@
 #include <fcntl.h>
 #include <linux/types.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -89,6 +90,124 @@ static int write_all(int fd, char* buf, size_t count)
   return 0;
 }
 
+/*
+ * Read requests are queued for a pool of worker threads when more than one
+ * thread is requested. Every reply, including the data following it, is
+ * written to the socket under write_lock, so replies to concurrent requests
+ * don't interleave.
+ */
+struct buse_job {
+  struct buse_job *next;
+  char handle[8];
+  u_int64_t from;
+  u_int32_t len;
+};
+
+struct buse_pool {
+  const struct buse_operations *aop;
+  void *userdata;
+  int sk;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct buse_job *head, *tail;
+  int stopping;
+
+  pthread_mutex_t write_lock;
+};
+
+static void send_reply(struct buse_pool *pool, struct nbd_reply *reply,
+                       char *data, size_t len)
+{
+  pthread_mutex_lock(&pool->write_lock);
+  write_all(pool->sk, (char*)reply, sizeof(struct nbd_reply));
+  if (len)
+    write_all(pool->sk, data, len);
+  pthread_mutex_unlock(&pool->write_lock);
+}
+
+static void serve_read(struct buse_pool *pool, const char *handle,
+                       u_int64_t from, u_int32_t len)
+{
+  struct nbd_reply reply;
+  void *chunk;
+
+  reply.magic = htonl(NBD_REPLY_MAGIC);
+  memcpy(reply.handle, handle, sizeof(reply.handle));
+
+  chunk = malloc(len);
+  if (pool->aop->read) {
+    reply.error = htonl(pool->aop->read(chunk, len, from, pool->userdata));
+  } else {
+    /* If user not specified read operation, return EPERM error */
+    reply.error = htonl(EPERM);
+  }
+  send_reply(pool, &reply, (char*)chunk, len);
+
+  free(chunk);
+}
+
+static void *buse_worker(void *arg)
+{
+  struct buse_pool *pool = (struct buse_pool *)arg;
+  struct buse_job *job;
+
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->head && !pool->stopping)
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    job = pool->head;
+    if (job) {
+      pool->head = job->next;
+      if (!pool->head)
+        pool->tail = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    /* The queue is drained before the workers stop */
+    if (!job)
+      return NULL;
+
+    serve_read(pool, job->handle, job->from, job->len);
+    free(job);
+  }
+}
+
+static void queue_read(struct buse_pool *pool, const char *handle,
+                       u_int64_t from, u_int32_t len)
+{
+  struct buse_job *job = malloc(sizeof(struct buse_job));
+  assert(job);
+  job->next = NULL;
+  memcpy(job->handle, handle, sizeof(job->handle));
+  job->from = from;
+  job->len = len;
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->tail)
+    pool->tail->next = job;
+  else
+    pool->head = job;
+  pool->tail = job;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* Waits for all the queued requests to be served and stops the workers */
+static void stop_workers(struct buse_pool *pool, pthread_t *workers,
+                         unsigned int count)
+{
+  unsigned int i;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 0; i < count; i++)
+    pthread_join(workers[i], NULL);
+}
+
 int buse_main(const char* dev_file, const struct buse_operations *aop, void *userdata)
 {
   int sp[2];
@@ -99,6 +218,9 @@ int buse_main(const char* dev_file, const struct buse_operations *aop, void *use
   struct nbd_request request;
   struct nbd_reply reply;
   void *chunk;
+  struct buse_pool pool;
+  pthread_t *workers = NULL;
+  unsigned int worker_count, i;
 
   err = socketpair(AF_UNIX, SOCK_STREAM, 0, sp);
   assert(!err);
@@ -154,6 +276,25 @@ int buse_main(const char* dev_file, const struct buse_operations *aop, void *use
   close(sp[1]);
   sk = sp[0];
 
+  pool.aop = aop;
+  pool.userdata = userdata;
+  pool.sk = sk;
+  pool.head = pool.tail = NULL;
+  pool.stopping = 0;
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.cond, NULL);
+  pthread_mutex_init(&pool.write_lock, NULL);
+
+  worker_count = aop->threads > 1 ? aop->threads : 0;
+  if (worker_count) {
+    workers = malloc(worker_count * sizeof(pthread_t));
+    assert(workers);
+    for (i = 0; i < worker_count; i++) {
+      err = pthread_create(&workers[i], NULL, buse_worker, &pool);
+      assert(!err);
+    }
+  }
+
   reply.magic = htonl(NBD_REPLY_MAGIC);
   reply.error = htonl(0);
 
@@ -174,58 +315,56 @@ int buse_main(const char* dev_file, const struct buse_operations *aop, void *use
        */
     case NBD_CMD_READ:
       debug_print("Request for read of size %d\n", len);
-      /* Fill with zero in case actual read is not implemented */
-      chunk = malloc(len);
-      if (aop->read) {
-        reply.error = aop->read(chunk, len, from, userdata);
-      } else {
-        /* If user not specified read operation, return EPERM error */
-        reply.error = htonl(EPERM);
-      }
-      write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
-      write_all(sk, (char*)chunk, len);
-
-      free(chunk);
+      if (worker_count)
+        queue_read(&pool, request.handle, from, len);
+      else
+        serve_read(&pool, request.handle, from, len);
       break;
     case NBD_CMD_WRITE:
       debug_print("Request for write of size %d\n", len);
       chunk = malloc(len);
       read_all(sk, chunk, len);
       if (aop->write) {
-        reply.error = aop->write(chunk, len, from, userdata);
+        reply.error = htonl(aop->write(chunk, len, from, userdata));
       } else {
         /* If user not specified write operation, return EPERM error */
         reply.error = htonl(EPERM);
       }
       free(chunk);
-      write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
+      send_reply(&pool, &reply, NULL, 0);
       break;
     case NBD_CMD_DISC:
       /* Handle a disconnect request. */
+      if (worker_count)
+        stop_workers(&pool, workers, worker_count);
       if (aop->disc) {
         aop->disc(userdata);
       }
+      free(workers);
       return 0;
 #ifdef NBD_FLAG_SEND_FLUSH
     case NBD_CMD_FLUSH:
       if (aop->flush) {
-        reply.error = aop->flush(userdata);
+        reply.error = htonl(aop->flush(userdata));
       }
-      write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
+      send_reply(&pool, &reply, NULL, 0);
       break;
 #endif
 #ifdef NBD_FLAG_SEND_TRIM
     case NBD_CMD_TRIM:
       if (aop->trim) {
-        reply.error = aop->trim(from, len, userdata);
+        reply.error = htonl(aop->trim(from, len, userdata));
       }
-      write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
+      send_reply(&pool, &reply, NULL, 0);
       break;
 #endif
     default:
       assert(0);
     }
   }
+  if (worker_count)
+    stop_workers(&pool, workers, worker_count);
+  free(workers);
   if (bytes_read == -1)
     fprintf(stderr, "%s\n", strerror(errno));
   return 0;
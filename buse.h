@@ -18,6 +18,11 @@ extern "C" {
     int (*trim)(u_int64_t from, u_int32_t len, void *userdata);
 
     u_int64_t size;
+
+    /* Number of threads serving read requests. With more than one, reads are
+     * served concurrently and their replies may be sent out of order, which
+     * the NBD protocol allows. The read callback must be thread-safe then */
+    unsigned int threads;
   };
 
   int buse_main(const char* dev_file, const struct buse_operations *bop, void *userdata);
@@ -0,0 +1,67 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "changed_extents.hh"
+
+void ChangedExtents::load( string const & fileName )
+{
+  FILE * f = fopen( fileName.c_str(), "r" );
+  if ( !f )
+    throw exCantOpen( fileName );
+
+  Extents loaded;
+  char line[ 256 ];
+
+  while ( fgets( line, sizeof( line ), f ) )
+  {
+    unsigned long long offset, size;
+    char tail[ 2 ];
+    int fields = sscanf( line, " %llu %llu %1s", &offset, &size, tail );
+
+    if ( fields == 2 && offset + size >= offset )
+    {
+      if ( size )
+        loaded.push_back( Extents::value_type( offset, offset + size ) );
+    }
+    else
+    // Anything but a blank line or a comment
+    if ( sscanf( line, " %1s", tail ) == 1 && tail[ 0 ] != '#' )
+    {
+      fclose( f );
+      line[ strcspn( line, "\r\n" ) ] = 0;
+      throw exInvalidLine( line );
+    }
+  }
+
+  fclose( f );
+
+  std::sort( loaded.begin(), loaded.end() );
+
+  // Merge the overlapping and adjacent extents
+  extents.clear();
+  for ( Extents::const_iterator i = loaded.begin(); i != loaded.end(); ++i )
+    if ( !extents.empty() && i->first <= extents.back().second )
+      extents.back().second = std::max( extents.back().second, i->second );
+    else
+      extents.push_back( *i );
+}
+
+bool ChangedExtents::overlaps( uint64_t offset, uint64_t size ) const
+{
+  if ( !size )
+    return false;
+
+  // Only the last extent starting before the region and the first one
+  // starting within it can overlap it
+  Extents::const_iterator i =
+    std::upper_bound( extents.begin(), extents.end(),
+                      Extents::value_type( offset, offset ) );
+  if ( i != extents.begin() && ( i - 1 )->second > offset )
+    return true;
+
+  return i != extents.end() && i->first < offset + size;
+}
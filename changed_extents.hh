@@ -0,0 +1,43 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef CHANGED_EXTENTS_HH_INCLUDED
+#define CHANGED_EXTENTS_HH_INCLUDED
+
+#include <stdint.h>
+#include <exception>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ex.hh"
+
+using std::string;
+
+/// The regions of a file known to have changed since its previous backup, as
+/// reported by whatever tracks them, e.g. the changed block tracking of a
+/// hypervisor or the exception store of an LVM snapshot
+class ChangedExtents
+{
+public:
+  DEF_EX( Ex, "Changed extent list exception", std::exception )
+  DEF_EX_STR( exCantOpen, "Can't open the changed extent list", Ex )
+  DEF_EX_STR( exInvalidLine, "Invalid line in the changed extent list:", Ex )
+
+  /// Loads the list from the given text file. Each of its lines holds the
+  /// offset and the size of an extent in bytes, separated by whitespace. The
+  /// extents may come in any order and may overlap. Empty lines and the ones
+  /// starting with # are ignored
+  void load( string const & fileName );
+
+  /// Returns true if any of the extents overlaps the given region
+  bool overlaps( uint64_t offset, uint64_t size ) const;
+
+private:
+  /// The extents as sorted, non-overlapping [ begin, end ) pairs
+  typedef std::vector< std::pair< uint64_t, uint64_t > > Extents;
+
+  Extents extents;
+};
+
+#endif
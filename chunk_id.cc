@@ -3,9 +3,11 @@
 
 #include "chunk_id.hh"
 
+#include <openssl/sha.h>
 #include <string.h>
 #include "endian.hh"
 #include "check.hh"
+#include "static_assert.hh"
 
 string ChunkId::toBlob() const
 {
@@ -38,6 +40,17 @@ void ChunkId::setFromBlob( void const * data )
   rollingHash = fromLittleEndian( v );
 }
 
+void ChunkId::setFromData( void const * data, size_t size )
+{
+  rollingHash = RollingHash::digest( data, size );
+
+  unsigned char sha1Value[ SHA_DIGEST_LENGTH ];
+  SHA1( ( unsigned char const * ) data, size, sha1Value );
+
+  STATIC_ASSERT( sizeof( cryptoHash ) <= sizeof( sha1Value ) );
+  memcpy( cryptoHash, sha1Value, sizeof( cryptoHash ) );
+}
+
 bool operator <( const ChunkId &lhs, const ChunkId &rhs )
 {
   int r = memcmp( &lhs.cryptoHash, &rhs.cryptoHash, sizeof( lhs.cryptoHash ) );
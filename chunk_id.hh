@@ -4,6 +4,7 @@
 #ifndef CHUNK_ID_HH_INCLUDED
 #define CHUNK_ID_HH_INCLUDED
 
+#include <stddef.h>
 #include <string>
 #include "rolling_hash.hh"
 
@@ -31,6 +32,9 @@ struct ChunkId
   /// Set the chunk id data reading from the given blob
   void setFromBlob( void const * );
 
+  /// Computes the id of a chunk holding the given data
+  void setFromData( void const * data, size_t size );
+
   ChunkId() {}
   ChunkId( string const & blob );
 };
@@ -0,0 +1,254 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <string.h>
+#include <algorithm>
+
+#include "chunk_id_set.hh"
+
+namespace {
+/// The table is grown once it gets this full, in percent
+size_t const MaxLoad = 75;
+size_t const MinSlots = 16;
+}
+
+ChunkIdSet::ChunkIdSet(): count( 0 ), hasEmptyId( false )
+{
+}
+
+ChunkId const & ChunkIdSet::emptyId()
+{
+  static ChunkId id( string( ChunkId::BlobSize, 0 ) );
+  return id;
+}
+
+bool ChunkIdSet::isEmpty( ChunkId const & id )
+{
+  return equals( id, emptyId() );
+}
+
+bool ChunkIdSet::equals( ChunkId const & x, ChunkId const & y )
+{
+  return x.rollingHash == y.rollingHash &&
+    !memcmp( x.cryptoHash, y.cryptoHash, sizeof( x.cryptoHash ) );
+}
+
+size_t ChunkIdSet::findSlot( ChunkId const & id ) const
+{
+  size_t hash;
+  memcpy( &hash, id.cryptoHash, sizeof( hash ) );
+
+  size_t mask = slots.size() - 1;
+  for ( size_t x = hash & mask; ; x = ( x + 1 ) & mask )
+    if ( isEmpty( slots[ x ] ) || equals( slots[ x ], id ) )
+      return x;
+}
+
+size_t ChunkIdSet::skipFree( size_t slot ) const
+{
+  while ( slot < slots.size() && isEmpty( slots[ slot ] ) )
+    ++slot;
+
+  if ( slot == slots.size() && !hasEmptyId )
+    ++slot;
+
+  return slot;
+}
+
+bool ChunkIdSet::insert( ChunkId const & id )
+{
+  if ( isEmpty( id ) )
+  {
+    if ( hasEmptyId )
+      return false;
+    hasEmptyId = true;
+    ++count;
+    return true;
+  }
+
+  if ( ( count + 1 ) * 100 > slots.size() * MaxLoad )
+    rehash( slots.size() < MinSlots ? MinSlots : slots.size() * 2 );
+
+  size_t slot = findSlot( id );
+  if ( !isEmpty( slots[ slot ] ) )
+    return false;
+
+  slots[ slot ] = id;
+  ++count;
+  return true;
+}
+
+bool ChunkIdSet::contains( ChunkId const & id ) const
+{
+  if ( isEmpty( id ) )
+    return hasEmptyId;
+
+  if ( slots.empty() )
+    return false;
+
+  return !isEmpty( slots[ findSlot( id ) ] );
+}
+
+void ChunkIdSet::reserve( size_t size )
+{
+  size_t slotCount = slots.size() < MinSlots ? MinSlots : slots.size();
+  while ( size * 100 > slotCount * MaxLoad )
+    slotCount *= 2;
+
+  if ( slotCount != slots.size() )
+    rehash( slotCount );
+}
+
+void ChunkIdSet::clear()
+{
+  std::vector< ChunkId >().swap( slots );
+  count = 0;
+  hasEmptyId = false;
+}
+
+void ChunkIdSet::swap( ChunkIdSet & other )
+{
+  slots.swap( other.slots );
+  std::swap( count, other.count );
+  std::swap( hasEmptyId, other.hasEmptyId );
+}
+
+void ChunkIdSet::rehash( size_t slotCount )
+{
+  std::vector< ChunkId > oldSlots( slotCount, emptyId() );
+  oldSlots.swap( slots );
+
+  for ( size_t x = 0; x < oldSlots.size(); ++x )
+    if ( !isEmpty( oldSlots[ x ] ) )
+      slots[ findSlot( oldSlots[ x ] ) ] = oldSlots[ x ];
+}
+
+ChunkIdCounts::ChunkIdCounts(): count( 0 ), usedSlots( 0 )
+{
+  emptyIdEntry.id = ChunkIdSet::emptyId();
+  emptyIdEntry.count = 0;
+}
+
+size_t ChunkIdCounts::findSlot( ChunkId const & id ) const
+{
+  size_t hash;
+  memcpy( &hash, id.cryptoHash, sizeof( hash ) );
+
+  size_t mask = slots.size() - 1;
+  for ( size_t x = hash & mask; ; x = ( x + 1 ) & mask )
+    if ( ChunkIdSet::isEmpty( slots[ x ].id ) ||
+         ChunkIdSet::equals( slots[ x ].id, id ) )
+      return x;
+}
+
+size_t ChunkIdCounts::skipUnused( size_t slot ) const
+{
+  // The free slots have zero counts as well
+  while ( slot < slots.size() && !slots[ slot ].count )
+    ++slot;
+
+  if ( slot == slots.size() && !emptyIdEntry.count )
+    ++slot;
+
+  return slot;
+}
+
+void ChunkIdCounts::add( ChunkId const & id, uint32_t toAdd )
+{
+  if ( ChunkIdSet::isEmpty( id ) )
+  {
+    if ( !emptyIdEntry.count && toAdd )
+      ++count;
+    emptyIdEntry.count += toAdd;
+    return;
+  }
+
+  if ( ( usedSlots + 1 ) * 100 > slots.size() * MaxLoad )
+  {
+    // The ids with zero counts are dropped, so this may not grow the table.
+    // It is left at most half as full as it may get, so the next rehash is
+    // far enough away
+    size_t slotCount = MinSlots;
+    while ( ( count + 1 ) * 200 > slotCount * MaxLoad )
+      slotCount *= 2;
+    rehash( slotCount );
+  }
+
+  Entry & entry = slots[ findSlot( id ) ];
+  if ( ChunkIdSet::isEmpty( entry.id ) )
+  {
+    entry.id = id;
+    ++usedSlots;
+  }
+
+  if ( !entry.count && toAdd )
+    ++count;
+  entry.count += toAdd;
+}
+
+bool ChunkIdCounts::release( ChunkId const & id )
+{
+  uint32_t * entryCount;
+  if ( ChunkIdSet::isEmpty( id ) )
+    entryCount = &emptyIdEntry.count;
+  else
+  {
+    if ( slots.empty() )
+      return false;
+    entryCount = &slots[ findSlot( id ) ].count;
+  }
+
+  if ( !*entryCount )
+    return false;
+
+  if ( !--*entryCount )
+    --count;
+
+  return true;
+}
+
+uint32_t ChunkIdCounts::get( ChunkId const & id ) const
+{
+  if ( ChunkIdSet::isEmpty( id ) )
+    return emptyIdEntry.count;
+
+  if ( slots.empty() )
+    return 0;
+
+  return slots[ findSlot( id ) ].count;
+}
+
+void ChunkIdCounts::reserve( size_t size )
+{
+  size_t slotCount = slots.size() < MinSlots ? MinSlots : slots.size();
+  while ( size * 100 > slotCount * MaxLoad )
+    slotCount *= 2;
+
+  if ( slotCount != slots.size() )
+    rehash( slotCount );
+}
+
+void ChunkIdCounts::clear()
+{
+  std::vector< Entry >().swap( slots );
+  emptyIdEntry.count = 0;
+  count = usedSlots = 0;
+}
+
+void ChunkIdCounts::rehash( size_t slotCount )
+{
+  Entry free;
+  free.id = ChunkIdSet::emptyId();
+  free.count = 0;
+
+  std::vector< Entry > oldSlots( slotCount, free );
+  oldSlots.swap( slots );
+
+  usedSlots = 0;
+  for ( size_t x = 0; x < oldSlots.size(); ++x )
+    if ( oldSlots[ x ].count )
+    {
+      slots[ findSlot( oldSlots[ x ].id ) ] = oldSlots[ x ];
+      ++usedSlots;
+    }
+}
@@ -0,0 +1,211 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef CHUNK_ID_SET_HH_INCLUDED
+#define CHUNK_ID_SET_HH_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <iterator>
+#include <vector>
+
+#include "chunk_id.hh"
+
+/// A set of chunk ids stored in a single open-addressing hash table. Unlike
+/// std::set, there are no per-element allocations: each id takes its own 24
+/// bytes and a bit of slack, and lookups touch one or two cache lines. The
+/// ids are hashed by their crypto hash part, which is uniformly distributed
+/// already
+class ChunkIdSet
+{
+public:
+  ChunkIdSet();
+
+  /// Returns true if the id wasn't in the set before
+  bool insert( ChunkId const & );
+
+  template< typename Iterator >
+  void insert( Iterator begin, Iterator end )
+  {
+    for ( ; begin != end; ++begin )
+      insert( *begin );
+  }
+
+  bool contains( ChunkId const & ) const;
+
+  size_t size() const
+  { return count; }
+
+  bool empty() const
+  { return !count; }
+
+  /// Makes room for the given number of ids, so inserting them doesn't rehash
+  void reserve( size_t );
+
+  void clear();
+
+  void swap( ChunkIdSet & );
+
+  /// Visits the ids in no particular order. Inserting invalidates it
+  class const_iterator
+  {
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef ChunkId value_type;
+    typedef ptrdiff_t difference_type;
+    typedef ChunkId const * pointer;
+    typedef ChunkId const & reference;
+
+    ChunkId const & operator * () const
+    { return slot < set->slots.size() ? set->slots[ slot ] : emptyId(); }
+
+    ChunkId const * operator -> () const
+    { return &operator * (); }
+
+    const_iterator & operator ++ ()
+    { slot = set->skipFree( slot + 1 ); return *this; }
+
+    bool operator == ( const_iterator const & other ) const
+    { return slot == other.slot; }
+
+    bool operator != ( const_iterator const & other ) const
+    { return slot != other.slot; }
+
+  private:
+    friend class ChunkIdSet;
+
+    const_iterator( ChunkIdSet const * set, size_t slot ):
+      set( set ), slot( slot ) {}
+
+    ChunkIdSet const * set;
+    /// The slot past the last one stands for the id consisting of zeros
+    size_t slot;
+  };
+
+  const_iterator begin() const
+  { return const_iterator( this, skipFree( 0 ) ); }
+
+  const_iterator end() const
+  { return const_iterator( this, slots.size() + 1 ); }
+
+private:
+  friend class ChunkIdCounts;
+
+  /// Marks the free slots. The id consisting of zeros can still be stored,
+  /// it's just kept aside
+  static ChunkId const & emptyId();
+  static bool isEmpty( ChunkId const & );
+  static bool equals( ChunkId const &, ChunkId const & );
+
+  /// Returns the slot holding the id, or the free slot it would go into
+  size_t findSlot( ChunkId const & ) const;
+
+  /// Returns the first slot from the given one on holding an id, in the
+  /// numbering const_iterator uses
+  size_t skipFree( size_t slot ) const;
+
+  void rehash( size_t slotCount );
+
+  /// The number of slots is always a power of two
+  std::vector< ChunkId > slots;
+  size_t count;
+  bool hasEmptyId;
+};
+
+/// Maps chunk ids to reference counts, in the same kind of table as
+/// ChunkIdSet. An id whose count drops to zero keeps its slot, so the ids
+/// placed past it are still found, until the table is rehashed
+class ChunkIdCounts
+{
+public:
+  struct Entry
+  {
+    ChunkId id;
+    uint32_t count;
+  };
+
+  ChunkIdCounts();
+
+  /// Adds to the count of the id
+  void add( ChunkId const &, uint32_t count = 1 );
+
+  /// Decrements the count of the id. Returns false if it was zero already
+  bool release( ChunkId const & );
+
+  /// Returns the count of the id, which is zero if it was never added
+  uint32_t get( ChunkId const & ) const;
+
+  /// Returns the number of ids with non-zero counts
+  size_t size() const
+  { return count; }
+
+  /// Makes room for the given number of ids, so adding them doesn't rehash
+  void reserve( size_t );
+
+  void clear();
+
+  /// Visits the ids with non-zero counts in no particular order. Adding
+  /// invalidates it
+  class const_iterator
+  {
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef Entry value_type;
+    typedef ptrdiff_t difference_type;
+    typedef Entry const * pointer;
+    typedef Entry const & reference;
+
+    Entry const & operator * () const
+    { return slot < counts->slots.size() ? counts->slots[ slot ] :
+        counts->emptyIdEntry; }
+
+    Entry const * operator -> () const
+    { return &operator * (); }
+
+    const_iterator & operator ++ ()
+    { slot = counts->skipUnused( slot + 1 ); return *this; }
+
+    bool operator == ( const_iterator const & other ) const
+    { return slot == other.slot; }
+
+    bool operator != ( const_iterator const & other ) const
+    { return slot != other.slot; }
+
+  private:
+    friend class ChunkIdCounts;
+
+    const_iterator( ChunkIdCounts const * counts, size_t slot ):
+      counts( counts ), slot( slot ) {}
+
+    ChunkIdCounts const * counts;
+    /// The slot past the last one stands for the id consisting of zeros
+    size_t slot;
+  };
+
+  const_iterator begin() const
+  { return const_iterator( this, skipUnused( 0 ) ); }
+
+  const_iterator end() const
+  { return const_iterator( this, slots.size() + 1 ); }
+
+private:
+  /// Returns the slot holding the id, or the free slot it would go into
+  size_t findSlot( ChunkId const & ) const;
+
+  /// Returns the first slot from the given one on holding a non-zero count,
+  /// in the numbering const_iterator uses
+  size_t skipUnused( size_t slot ) const;
+
+  /// Moves the ids with non-zero counts to a table of the given size
+  void rehash( size_t slotCount );
+
+  /// The number of slots is always a power of two. The free ones hold the
+  /// id consisting of zeros, whose count is kept in emptyIdEntry instead
+  std::vector< Entry > slots;
+  Entry emptyIdEntry;
+  /// The number of ids with non-zero counts, and the number of slots which
+  /// aren't free, including the ones with zero counts
+  size_t count, usedSlots;
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
 #include <new>
 #include <utility>
 
@@ -29,14 +30,58 @@ void ChunkIndex::loadIndex( IndexProcessor & ip )
 
   Dir::Entry entry;
 
+  // The processor may write new index files as it goes, so the list is taken
+  // beforehand. It is sorted, so visiting the same files twice goes in the
+  // same order
+  std::vector< string > fileNames;
+  while( lst.getNext( entry ) )
+    fileNames.push_back( entry.getFileName() );
+  std::sort( fileNames.begin(), fileNames.end() );
+
   verbosePrintf( "Loading index...\n" );
 
+  loadIndexFiles( fileNames, ip );
+
+  verbosePrintf( "Index loaded.\n" );
+}
+
+void ChunkIndex::reload()
+{
+  hashTable.clear();
+  storage.clear();
+  lastBundleId = NULL;
+  loadedIndexFiles.clear();
+
+  loadIndex( *this );
+}
+
+size_t ChunkIndex::loadNewIndexFiles()
+{
+  Dir::Listing lst( indexPath );
+
+  Dir::Entry entry;
+
+  std::vector< string > fileNames;
   while( lst.getNext( entry ) )
+    if ( loadedIndexFiles.find( Dir::addPath( indexPath, entry.getFileName() ) ) ==
+         loadedIndexFiles.end() )
+      fileNames.push_back( entry.getFileName() );
+  std::sort( fileNames.begin(), fileNames.end() );
+
+  loadIndexFiles( fileNames, *this );
+
+  return fileNames.size();
+}
+
+void ChunkIndex::loadIndexFiles( std::vector< string > const & fileNames,
+                                 IndexProcessor & ip )
+{
+  for ( size_t n = 0; n < fileNames.size(); ++n )
   {
-    verbosePrintf( "Loading index file %s...\n", entry.getFileName().c_str() );
+    verbosePrintf( "Loading index file %s...\n", fileNames[ n ].c_str() );
     try
     {
-      string indexFn = Dir::addPath( indexPath, entry.getFileName() );
+      string indexFn = Dir::addPath( indexPath, fileNames[ n ] );
       IndexFile::Reader reader( key, indexFn );
 
       ip.startIndex( indexFn );
@@ -74,8 +119,6 @@ void ChunkIndex::loadIndex( IndexProcessor & ip )
       continue;
     }
   }
-
-  verbosePrintf( "Index loaded.\n" );
 }
 
 size_t ChunkIndex::size()
@@ -83,8 +126,9 @@ size_t ChunkIndex::size()
   return hashTable.size();
 }
 
-void ChunkIndex::startIndex( string const & )
+void ChunkIndex::startIndex( string const & indexFn )
 {
+  loadedIndexFiles.insert( indexFn );
 }
 
 void ChunkIndex::startBundle( Bundle::Id const & bundleId )
@@ -12,6 +12,7 @@
 #include <exception>
 #include <ext/hash_map>
 #include <functional>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -52,6 +53,8 @@ public:
   virtual void processChunk( ChunkId const &, uint32_t ) = 0;
   virtual void finishBundle( Bundle::Id const &, BundleInfo const & ) = 0;
   virtual void finishIndex( string const & ) = 0;
+
+  virtual ~IndexProcessor() {}
 };
 
 /// Maintains an in-memory hash table allowing to check whether we have a
@@ -84,6 +87,9 @@ class ChunkIndex: NoCopy, IndexProcessor
   /// Stores the last used bundle id, which can be re-used
   Bundle::Id const * lastBundleId;
 
+  /// The index files this index has loaded so far
+  std::set< string > loadedIndexFiles;
+
 public:
   DEF_EX( Ex, "Chunk index exception", std::exception )
   DEF_EX( exIncorrectChunkIdSize, "Incorrect chunk id size encountered", Ex )
@@ -118,9 +124,19 @@ public:
 
   void loadIndex( IndexProcessor & );
 
+  /// Forgets everything and loads the index files anew, for when the storage
+  /// may have lost some of the chunks it had
+  void reload();
+
+  /// Loads the index files which have appeared since the index was loaded,
+  /// e.g. written by other processes. Returns the number of them
+  size_t loadNewIndexFiles();
+
   size_t size();
 
 private:
+  void loadIndexFiles( vector< string > const & fileNames, IndexProcessor & );
+
   /// Inserts new chunk id into the in-memory hash table. Returns the created
   /// Chain if it was inserted, NULL if it existed before
   Chain * registerNewChunkId( ChunkId const & id, uint32_t, Bundle::Id const * );
@@ -0,0 +1,233 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <string.h>
+#include <algorithm>
+
+#include "chunk_manifest.hh"
+
+#include "chunk_id.hh"
+#include "encrypted_file.hh"
+#include "encryption.hh"
+#include "message.hh"
+#include "zbackup.pb.h"
+
+namespace ChunkManifest {
+
+using std::vector;
+
+namespace {
+
+enum
+{
+  FileFormatVersion = 1
+};
+
+void writeHeader( EncryptedFile::OutputStream & os, uint64_t chunkCount )
+{
+  os.writeRandomIv();
+
+  FileHeader header;
+  header.set_version( FileFormatVersion );
+  Message::serialize( header, os );
+
+  ChunkManifestInfo info;
+  info.set_chunk_count( chunkCount );
+  Message::serialize( info, os );
+}
+
+}
+
+void save( string const & fileName, EncryptionKey const & encryptionKey,
+           BackupRestorer::ChunkSet const & chunkSet )
+{
+  EncryptedFile::OutputStream os( fileName.c_str(), encryptionKey,
+                                  Encryption::ZeroIv );
+  writeHeader( os, chunkSet.size() );
+
+  char blob[ ChunkId::BlobSize ];
+  for ( BackupRestorer::ChunkSet::const_iterator i = chunkSet.begin();
+        i != chunkSet.end(); ++i )
+  {
+    i->toBlob( blob );
+    os.write( blob, sizeof( blob ) );
+  }
+
+  os.writeAdler32();
+}
+
+void load( string const & fileName, EncryptionKey const & encryptionKey,
+           BackupRestorer::ChunkSet & chunkSet )
+{
+  EncryptedFile::InputStream is( fileName.c_str(), encryptionKey,
+                                 Encryption::ZeroIv );
+  is.consumeRandomIv();
+
+  FileHeader header;
+  Message::parse( header, is );
+  if ( header.version() != FileFormatVersion )
+    throw exUnsupportedVersion();
+
+  ChunkManifestInfo info;
+  Message::parse( info, is );
+
+  chunkSet.reserve( chunkSet.size() + info.chunk_count() );
+
+  char blob[ ChunkId::BlobSize ];
+  ChunkId id;
+  for ( uint64_t left = info.chunk_count(); left--; )
+  {
+    is.read( blob, sizeof( blob ) );
+    id.setFromBlob( blob );
+    chunkSet.insert( id );
+  }
+
+  is.checkAdler32();
+}
+
+Collector::Collector( TmpMgr & tmpMgr, EncryptionKey const & encryptionKey ):
+  tmpMgr( tmpMgr ), encryptionKey( encryptionKey )
+{
+}
+
+BackupRestorer::ChunkSet & Collector::getChunkSet()
+{
+  return chunkSet;
+}
+
+void Collector::spillIfNeeded()
+{
+  if ( chunkSet.size() < MaxChunksInMemory )
+    return;
+
+  writeRun();
+
+  if ( runs.size() == MaxRuns )
+    mergeRuns();
+}
+
+void Collector::writeRun()
+{
+  // The runs are merged, so they have to be sorted
+  vector< ChunkId > ids( chunkSet.begin(), chunkSet.end() );
+  std::sort( ids.begin(), ids.end() );
+  chunkSet.clear();
+
+  Run run;
+  run.file = tmpMgr.makeTemporaryFile();
+  run.count = ids.size();
+
+  EncryptedFile::OutputStream os( run.file->getFileName().c_str(),
+                                  encryptionKey, Encryption::ZeroIv );
+  os.writeRandomIv();
+
+  char blob[ ChunkId::BlobSize ];
+  for ( size_t x = 0; x < ids.size(); ++x )
+  {
+    ids[ x ].toBlob( blob );
+    os.write( blob, sizeof( blob ) );
+  }
+
+  os.writeAdler32();
+
+  runs.push_back( run );
+}
+
+void Collector::mergeRuns()
+{
+  size_t count = runs.size();
+  vector< sptr< EncryptedFile::InputStream > > inputs( count );
+  // The next id of each run, and the number of ids left in it after that one
+  vector< ChunkId > heads( count );
+  vector< uint64_t > left( count );
+  char blob[ ChunkId::BlobSize ];
+
+  for ( size_t x = 0; x < count; ++x )
+  {
+    inputs[ x ] = new EncryptedFile::InputStream(
+      runs[ x ].file->getFileName().c_str(), encryptionKey, Encryption::ZeroIv );
+    inputs[ x ]->consumeRandomIv();
+
+    left[ x ] = runs[ x ].count;
+    inputs[ x ]->read( blob, sizeof( blob ) );
+    heads[ x ].setFromBlob( blob );
+  }
+
+  Run merged;
+  merged.file = tmpMgr.makeTemporaryFile();
+  merged.count = 0;
+
+  EncryptedFile::OutputStream os( merged.file->getFileName().c_str(),
+                                  encryptionKey, Encryption::ZeroIv );
+  os.writeRandomIv();
+
+  for ( ; ; )
+  {
+    // There are only a few runs, so the smallest id is simply looked for
+    size_t next = count;
+    for ( size_t x = 0; x < count; ++x )
+      if ( left[ x ] && ( next == count || heads[ x ] < heads[ next ] ) )
+        next = x;
+
+    if ( next == count )
+      break;
+
+    ChunkId id = heads[ next ];
+    id.toBlob( blob );
+    os.write( blob, sizeof( blob ) );
+    ++merged.count;
+
+    // The same id may be in several runs
+    for ( size_t x = 0; x < count; ++x )
+      if ( left[ x ] && !memcmp( &heads[ x ], &id, sizeof( id ) ) &&
+           --left[ x ] )
+      {
+        inputs[ x ]->read( blob, sizeof( blob ) );
+        heads[ x ].setFromBlob( blob );
+      }
+  }
+
+  os.writeAdler32();
+
+  for ( size_t x = 0; x < count; ++x )
+    inputs[ x ]->checkAdler32();
+
+  inputs.clear();
+  runs.clear();
+  runs.push_back( merged );
+}
+
+void Collector::save( string const & fileName )
+{
+  if ( runs.empty() )
+  {
+    ChunkManifest::save( fileName, encryptionKey, chunkSet );
+    return;
+  }
+
+  if ( !chunkSet.empty() )
+    writeRun();
+
+  if ( runs.size() > 1 )
+    mergeRuns();
+
+  EncryptedFile::InputStream is( runs[ 0 ].file->getFileName().c_str(),
+                                 encryptionKey, Encryption::ZeroIv );
+  is.consumeRandomIv();
+
+  EncryptedFile::OutputStream os( fileName.c_str(), encryptionKey,
+                                  Encryption::ZeroIv );
+  writeHeader( os, runs[ 0 ].count );
+
+  char blob[ ChunkId::BlobSize ];
+  for ( uint64_t left = runs[ 0 ].count; left--; )
+  {
+    is.read( blob, sizeof( blob ) );
+    os.write( blob, sizeof( blob ) );
+  }
+
+  is.checkAdler32();
+  os.writeAdler32();
+}
+
+}
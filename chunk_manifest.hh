@@ -0,0 +1,89 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef CHUNK_MANIFEST_HH_INCLUDED
+#define CHUNK_MANIFEST_HH_INCLUDED
+
+#include <stdint.h>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include "backup_restorer.hh"
+#include "encryption_key.hh"
+#include "ex.hh"
+#include "nocopy.hh"
+#include "sptr.hh"
+#include "tmp_mgr.hh"
+
+/// Lists of the chunks the backups refer to. They are written when the backups
+/// are made, so the garbage collector can tell which chunks a backup uses
+/// without restoring it
+namespace ChunkManifest {
+
+using std::string;
+
+DEF_EX( Ex, "Chunk manifest exception", std::exception )
+DEF_EX( exUnsupportedVersion, "Unsupported version of the chunk manifest format", Ex )
+
+/// Saves the given chunk set into the given file. The ids are written in no
+/// particular order
+void save( string const & fileName, EncryptionKey const &,
+           BackupRestorer::ChunkSet const & );
+
+/// Loads the chunk set from the given file, adding to the given one
+void load( string const & fileName, EncryptionKey const &,
+           BackupRestorer::ChunkSet & );
+
+/// Collects the chunks of a backup being made, for its manifest. Only up to
+/// MaxChunksInMemory of them are kept in memory: once there are more, they
+/// are written out to a temporary file as a sorted run, and the runs are
+/// merged when the manifest is saved. This way the memory used doesn't
+/// depend on the size of the backup
+class Collector: NoCopy
+{
+public:
+  enum
+  {
+    /// At most 48 MB worth of table slots, and 24 MB more while a run is
+    /// sorted
+    MaxChunksInMemory = 1 << 20,
+    /// The runs get merged into one once there are this many of them, which
+    /// bounds the number of files, and so buffers, open during a merge
+    MaxRuns = 16
+  };
+
+  Collector( TmpMgr &, EncryptionKey const & );
+
+  /// The chunks collected since they were last written out. The chunks are
+  /// to be added to it directly
+  BackupRestorer::ChunkSet & getChunkSet();
+
+  /// Writes the chunks out if there are too many of them in memory. Has to
+  /// be called regularly as they are added
+  void spillIfNeeded();
+
+  /// Saves the manifest of all the chunks collected into the given file
+  void save( string const & fileName );
+
+private:
+  /// A temporary file with a sorted list of distinct chunk ids
+  struct Run
+  {
+    sptr< TemporaryFile > file;
+    uint64_t count;
+  };
+
+  /// Writes the chunks held in memory out as a new run
+  void writeRun();
+  /// Replaces all the runs with a single one
+  void mergeRuns();
+
+  TmpMgr & tmpMgr;
+  EncryptionKey const & encryptionKey;
+  BackupRestorer::ChunkSet chunkSet;
+  std::vector< Run > runs;
+};
+}
+
+#endif
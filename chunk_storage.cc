@@ -5,6 +5,7 @@
 #include "chunk_storage.hh"
 #include "debug.hh"
 #include "dir.hh"
+#include "io_order.hh"
 #include "utils.hh"
 #include "random.hh"
 
@@ -29,6 +30,12 @@ Writer::~Writer()
 }
 
 bool Writer::add( ChunkId const & id, void const * data, size_t size )
+{
+  return add( id, id.toBlob(), data, size );
+}
+
+bool Writer::add( ChunkId const & id, string const & idBlob, void const * data,
+                  size_t size )
 {
   if ( index.addChunk( id, size, getCurrentBundleId() ) )
   {
@@ -37,7 +44,7 @@ bool Writer::add( ChunkId const & id, void const * data, size_t size )
          config.GET_STORABLE( bundle, max_payload_size ) )
       finishCurrentBundle();
 
-    getCurrentBundle().addChunk( id.toBlob(), data, size );
+    getCurrentBundle().addChunk( idBlob, data, size );
 
     return true;
   }
@@ -52,7 +59,8 @@ void Writer::addBundle( BundleInfo const & bundleInfo, Bundle::Id const & bundle
     // Create a new index file
     indexTempFile = tmpMgr.makeTemporaryFile();
     indexFile = new IndexFile::Writer( encryptionKey,
-                                       indexTempFile->getFileName() );
+        indexTempFile->getFileName(),
+        EncryptedFile::getModeByName( config.GET_STORABLE( encryption, mode ) ) );
   }
 
   indexFile->add( bundleInfo, bundleId );
@@ -194,12 +202,75 @@ void * Writer::Compressor::Compressor::threadFunction() throw()
   return NULL;
 }
 
+ChunkCache::ChunkCache( size_t maxBytes ): maxBytes( maxBytes ),
+  totalBytes( 0 ), hits( 0 ), misses( 0 )
+{
+}
+
+bool ChunkCache::get( ChunkId const & id, string & data, size_t & size )
+{
+  Lock _( mutex );
+
+  Map::iterator i = map.find( id );
+  if ( i == map.end() )
+  {
+    ++misses;
+    return false;
+  }
+
+  ++hits;
+
+  // Move it to the front
+  entries.splice( entries.begin(), entries, i->second );
+
+  string const & cached = i->second->data;
+  if ( data.size() < cached.size() )
+    data.resize( cached.size() );
+  memcpy( &data[ 0 ], cached.data(), cached.size() );
+  size = cached.size();
+
+  return true;
+}
+
+void ChunkCache::put( ChunkId const & id, void const * data, size_t size )
+{
+  // Don't let a single chunk flush the whole cache
+  if ( size > maxBytes / 2 )
+    return;
+
+  Lock _( mutex );
+
+  if ( map.find( id ) != map.end() )
+    return;
+
+  while ( totalBytes + size > maxBytes && !entries.empty() )
+  {
+    totalBytes -= entries.back().data.size();
+    map.erase( entries.back().id );
+    entries.pop_back();
+  }
+
+  entries.push_front( Entry() );
+  entries.front().id = id;
+  entries.front().data.assign( ( char const * ) data, size );
+  map[ id ] = entries.begin();
+  totalBytes += size;
+}
+
+void ChunkCache::getStats( uint64_t & hitsOut, uint64_t & missesOut )
+{
+  Lock _( mutex );
+  hitsOut = hits;
+  missesOut = misses;
+}
+
 Reader::Reader( Config const & configIn,
                 EncryptionKey const & encryptionKey,
                 ChunkIndex & index, string const & bundlesDir,
                 size_t maxCacheSizeBytes ):
   config( configIn ), encryptionKey( encryptionKey ),
   index( index ), bundlesDir( bundlesDir ),
+  maxCacheSizeBytes( maxCacheSizeBytes ),
   // We need to have at least one cached reader, otherwise we would have to
   // unpack a bundle each time a chunk is read, even for consecutive chunks
   // in the same bundle
@@ -227,12 +298,36 @@ Bundle::Id const * Reader::getBundleId( ChunkId const & chunkId, size_t & size )
   }
 }
 
+void Reader::enableChunkCache( size_t bytes )
+{
+  size_t bundleSize = config.GET_STORABLE( bundle, max_payload_size );
+  size_t bundleBytes = bytes < maxCacheSizeBytes ?
+                       maxCacheSizeBytes - bytes : 0;
+
+  {
+    Lock _( cacheMutex );
+    cachedReaders.setMaxObjects( bundleBytes < bundleSize ?
+                                 1 : bundleBytes / bundleSize );
+  }
+
+  chunkCache = new ChunkCache( bytes );
+
+  verbosePrintf( "Using %zu MB of the cache for separate chunks\n",
+                 bytes / 1048576 );
+}
+
 void Reader::get( ChunkId const & chunkId, string & data, size_t & size )
 {
+  if ( chunkCache.get() && chunkCache->get( chunkId, data, size ) )
+    return;
+
   if ( Bundle::Id const * bundleId = index.findChunk( chunkId ) )
   {
-    Bundle::Reader & reader = getReaderFor( *bundleId );
-    reader.get( chunkId.toBlob(), data, size );
+    ReaderRef reader( *this, *bundleId );
+    reader->get( chunkId.toBlob(), data, size );
+
+    if ( chunkCache.get() )
+      chunkCache->put( chunkId, data.data(), size );
   }
   else
   {
@@ -242,6 +337,73 @@ void Reader::get( ChunkId const & chunkId, string & data, size_t & size )
   }
 }
 
+void Reader::forEachChunk( Bundle::Id const & bundleId,
+                           Bundle::Reader::ChunkVisitor & visitor )
+{
+  ReaderRef reader( *this, bundleId );
+  reader->forEachChunk( visitor );
+}
+
+Reader::ReaderRef::ReaderRef( Reader & owner, Bundle::Id const & id ):
+  owner( owner )
+{
+  string key( ( char const * ) &id, sizeof( id ) );
+
+  Lock _( owner.cacheMutex );
+
+  for ( ; ; )
+  {
+    sptr< Bundle::Reader > & cached =
+      owner.cachedReaders.entry< Bundle::Reader >( key );
+
+    if ( cached.get() )
+    {
+      reader = cached;
+      return;
+    }
+
+    if ( owner.loadingBundles.find( id ) == owner.loadingBundles.end() )
+      break;
+
+    // Some other thread is loading this bundle already, wait for it instead of
+    // decoding the same bundle twice
+    owner.bundleLoaded.wait( owner.cacheMutex );
+  }
+
+  owner.loadingBundles.insert( id );
+
+  // Load the bundle with the lock released, so the other bundles can be read
+  // and loaded meanwhile
+  owner.cacheMutex.unlock();
+  try
+  {
+    reader = new Bundle::Reader( Bundle::generateFileName( id, owner.bundlesDir,
+                                                           false ),
+                                 owner.encryptionKey );
+  }
+  catch( ... )
+  {
+    owner.cacheMutex.lock();
+    owner.loadingBundles.erase( id );
+    owner.bundleLoaded.broadcast();
+    throw;
+  }
+  owner.cacheMutex.lock();
+
+  // The entry could have been evicted while we were loading, so look it up
+  // again
+  owner.cachedReaders.entry< Bundle::Reader >( key ) = reader;
+  owner.loadingBundles.erase( id );
+  owner.bundleLoaded.broadcast();
+}
+
+Reader::ReaderRef::~ReaderRef()
+{
+  // Reference counting is not thread-safe, so is done under the lock
+  Lock _( owner.cacheMutex );
+  reader.reset();
+}
+
 Bundle::Reader & Reader::getReaderFor( Bundle::Id const & id )
 {
   sptr< Bundle::Reader > & reader = cachedReaders.entry< Bundle::Reader >(
@@ -258,4 +420,22 @@ Bundle::Reader & Reader::getReaderFor( Bundle::Id const & id )
   return *reader;
 }
 
+void Reader::sortBundles( vector< Bundle::Id > & ids ) const
+{
+  if ( config.runtime.ioOrder == IoOrder::None )
+    return;
+
+  vector< string > fileNames( ids.size() );
+  for ( size_t x = 0; x < ids.size(); ++x )
+    fileNames[ x ] = Bundle::generateFileName( ids[ x ], bundlesDir, false );
+
+  vector< size_t > order = IoOrder::getOrder( fileNames,
+                                              config.runtime.ioOrder );
+  vector< Bundle::Id > sorted( ids.size() );
+  for ( size_t x = 0; x < order.size(); ++x )
+    sorted[ x ] = ids[ order[ x ] ];
+
+  ids.swap( sorted );
+}
+
 }
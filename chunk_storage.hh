@@ -5,7 +5,11 @@
 #define CHUNK_STORAGE_HH_INCLUDED
 
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include <exception>
+#include <list>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
@@ -49,6 +53,10 @@ public:
   /// in the index, does nothing and returns false
   bool add( ChunkId const &, void const * data, size_t size );
 
+  /// Same as the above, for when the id blob is at hand already
+  bool add( ChunkId const &, string const & idBlob, void const * data,
+            size_t size );
+
   /// Adds an existing bundle to the index
   void addBundle( BundleInfo const &, Bundle::Id const & bundleId );
 
@@ -114,6 +122,53 @@ private:
   vector< PendingBundleRename > pendingBundleRenames;
 };
 
+/// A thread-safe LRU cache of separate decoded chunks, bounded by the total
+/// size of the chunks it holds
+class ChunkCache: NoCopy
+{
+public:
+  ChunkCache( size_t maxBytes );
+
+  /// If the chunk is cached, copies it to 'data', which may be enlarged but
+  /// won't be shrunk, stores its size in 'size' and returns true
+  bool get( ChunkId const &, string & data, size_t & size );
+
+  /// Adds the chunk to the cache, evicting the least recently used ones
+  void put( ChunkId const &, void const * data, size_t size );
+
+  /// Returns the number of successful and unsuccessful get() calls
+  void getStats( uint64_t & hits, uint64_t & misses );
+
+private:
+  struct Entry
+  {
+    ChunkId id;
+    string data;
+  };
+  typedef std::list< Entry > Entries;
+
+  struct IdHash
+  {
+    size_t operator()( ChunkId const & id ) const
+    { return id.rollingHash; }
+  };
+
+  struct IdEqual
+  {
+    bool operator()( ChunkId const & x, ChunkId const & y ) const
+    { return memcmp( &x, &y, sizeof( x ) ) == 0; }
+  };
+
+  typedef __gnu_cxx::hash_map< ChunkId, Entries::iterator, IdHash, IdEqual > Map;
+
+  Mutex mutex;
+  size_t maxBytes, totalBytes;
+  /// Most recently used entries go first
+  Entries entries;
+  Map map;
+  uint64_t hits, misses;
+};
+
 /// Allows retrieving existing chunks by extracting them from the bundles with
 /// the help of an Index object
 class Reader: NoCopy
@@ -128,18 +183,66 @@ public:
 
   /// Loads the given chunk from the store into the given buffer. May throw file
   /// and decompression exceptions. 'data' may be enlarged but won't be shrunk.
-  /// The size of the actual chunk would be stored in 'size'
+  /// The size of the actual chunk would be stored in 'size'. Can be called
+  /// from several threads at once, as long as the index isn't being modified.
+  /// If several threads need the same bundle, only one of them loads it while
+  /// the others wait for it
   void get( ChunkId const &, string & data, size_t & size );
 
-  /// Retrieves the reader for the given bundle id. May employ caching
+  /// Passes the chunks of the given bundle to the visitor, in the order they
+  /// are stored. Unlike get(), needs no index lookups and copies nothing
+  void forEachChunk( Bundle::Id const &, Bundle::Reader::ChunkVisitor & );
+
+  /// Retrieves the reader for the given bundle id. May employ caching. Unlike
+  /// get(), this is not thread-safe, as the returned reader can be evicted from
+  /// the cache by a concurrent call
   Bundle::Reader & getReaderFor( Bundle::Id const & );
 
+  /// Adds a cache of separate decoded chunks in front of the cache of whole
+  /// bundles, taking 'bytes' out of the memory the bundles may use. Helps with
+  /// random reads which only need a few chunks out of each bundle
+  void enableChunkCache( size_t bytes );
+
+  /// Returns the chunk cache, or NULL if it is not enabled
+  ChunkCache * getChunkCache()
+  { return chunkCache.get(); }
+
+  /// Reorders the given bundle ids so that reading them one after another
+  /// follows their physical layout on disk, according to the io.order
+  /// runtime option
+  void sortBundles( vector< Bundle::Id > & ) const;
+
 private:
+  /// Keeps a cached bundle reader alive while it's being used, even if the
+  /// cache evicts it meanwhile
+  class ReaderRef: NoCopy
+  {
+    Reader & owner;
+    sptr< Bundle::Reader > reader;
+  public:
+    ReaderRef( Reader &, Bundle::Id const & );
+    Bundle::Reader * operator -> () const
+    { return reader.get(); }
+    ~ReaderRef();
+  };
+
+  friend class ReaderRef;
+
   Config const & config;
   EncryptionKey const & encryptionKey;
   ChunkIndex & index;
   string bundlesDir;
+  size_t maxCacheSizeBytes;
   ObjectCache cachedReaders;
+  sptr< ChunkCache > chunkCache;
+
+  /// Protects cachedReaders, loadingBundles and the reference counts of the
+  /// cached readers
+  Mutex cacheMutex;
+  /// Signalled each time a bundle finishes loading
+  Condition bundleLoaded;
+  /// Bundles currently being loaded by some thread
+  std::set< Bundle::Id > loadingBundles;
 };
 
 }
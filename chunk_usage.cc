@@ -0,0 +1,96 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <string.h>
+
+#include "chunk_usage.hh"
+#include "debug.hh"
+
+ChunkUsage::ChunkUsage( TmpMgr & tmpMgr, EncryptionKey const & key,
+                        size_t sortBufferSize ):
+  used( tmpMgr, key, sortBufferSize ), indexed( tmpMgr, key, sortBufferSize ),
+  records( 0 )
+{
+}
+
+void ChunkUsage::addUsed( ChunkIdSet const & ids )
+{
+  UsedRecord record;
+  Lock _( usedMutex );
+  for ( ChunkIdSet::const_iterator i = ids.begin(); i != ids.end(); ++i )
+  {
+    i->toBlob( record.id );
+    used.add( record );
+  }
+}
+
+void ChunkUsage::startIndex( string const & indexFn )
+{
+  firstRecords[ indexFn ] = records;
+}
+
+void ChunkUsage::startBundle( Bundle::Id const & )
+{
+}
+
+void ChunkUsage::processChunk( ChunkId const & id, uint32_t )
+{
+  IndexRecord record;
+  id.toBlob( record.id );
+  record.position = records++;
+  indexed.add( record );
+}
+
+void ChunkUsage::finishBundle( Bundle::Id const &, BundleInfo const & )
+{
+}
+
+void ChunkUsage::finishIndex( string const & )
+{
+}
+
+void ChunkUsage::join()
+{
+  verbosePrintf( "Joining %llu used chunk ids with %llu index records...\n",
+                 ( unsigned long long ) used.size(),
+                 ( unsigned long long ) records );
+
+  used.finish();
+  indexed.finish();
+
+  flags.assign( ( records + 3 ) / 4, 0 );
+
+  UsedRecord usedRecord;
+  bool haveUsed = used.next( usedRecord );
+
+  IndexRecord record, previous;
+  bool havePrevious = false;
+
+  while ( indexed.next( record ) )
+  {
+    unsigned recordFlags = 0;
+
+    if ( havePrevious && !memcmp( record.id, previous.id, sizeof( record.id ) ) )
+      recordFlags |= Duplicate;
+
+    while ( haveUsed && memcmp( usedRecord.id, record.id, sizeof( record.id ) ) < 0 )
+      haveUsed = used.next( usedRecord );
+
+    if ( haveUsed && !memcmp( usedRecord.id, record.id, sizeof( record.id ) ) )
+      recordFlags |= Used;
+
+    flags[ record.position / 4 ] |= recordFlags << ( record.position % 4 * 2 );
+
+    previous = record;
+    havePrevious = true;
+  }
+}
+
+uint64_t ChunkUsage::getFirstRecord( string const & indexFn ) const
+{
+  std::map< string, uint64_t >::const_iterator i = firstRecords.find( indexFn );
+  if ( i == firstRecords.end() )
+    throw exUnknownIndex( indexFn );
+
+  return i->second;
+}
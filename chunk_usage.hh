@@ -0,0 +1,111 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef CHUNK_USAGE_HH_INCLUDED
+#define CHUNK_USAGE_HH_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <exception>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "chunk_id.hh"
+#include "chunk_id_set.hh"
+#include "chunk_index.hh"
+#include "encryption_key.hh"
+#include "ex.hh"
+#include "external_sort.hh"
+#include "mt.hh"
+#include "nocopy.hh"
+#include "tmp_mgr.hh"
+
+using std::string;
+
+/// Tells which chunk records of the index are used by the backups, without
+/// keeping all the chunk ids in memory. It is fed the ids of the chunks the
+/// backups use and then the index, through loadIndex(). Both are sorted
+/// externally and merge-joined. Only a couple of bits per chunk record are
+/// kept, addressed by the position of the record in the order loadIndex()
+/// visits them
+class ChunkUsage: public IndexProcessor, NoCopy
+{
+public:
+  DEF_EX( Ex, "Chunk usage exception", std::exception )
+  DEF_EX_STR( exUnknownIndex, "Index file wasn't seen when sorting the chunk ids:", Ex )
+
+  enum Flags
+  {
+    /// The chunk is used by a backup
+    Used = 1,
+    /// The same chunk was recorded earlier in the index
+    Duplicate = 2
+  };
+
+  /// Each of the two sorts gets a buffer of the given size
+  ChunkUsage( TmpMgr &, EncryptionKey const &, size_t sortBufferSize );
+
+  /// Adds the ids of the chunks used by a backup. Adding the same ones several
+  /// times is fine. Several threads may add at once
+  void addUsed( ChunkIdSet const & );
+
+  /// Computes the flags. Must be called once the index was loaded
+  void join();
+
+  /// Returns the position of the first chunk record of the given index file
+  uint64_t getFirstRecord( string const & indexFn ) const;
+
+  /// Returns the flags of the chunk record at the given position. Records
+  /// which weren't there when the index was sorted are reported as used, so
+  /// they are kept
+  unsigned getFlags( uint64_t record ) const
+  {
+    return record < records ?
+      ( flags[ record / 4 ] >> ( record % 4 * 2 ) ) & 3 : Used;
+  }
+
+  /// IndexProcessor
+  virtual void startIndex( string const & );
+  virtual void startBundle( Bundle::Id const & );
+  virtual void processChunk( ChunkId const &, uint32_t );
+  virtual void finishBundle( Bundle::Id const &, BundleInfo const & );
+  virtual void finishIndex( string const & );
+
+private:
+  /// Ids sort as their blobs do, which needs no conversions
+  struct UsedRecord
+  {
+    char id[ ChunkId::BlobSize ];
+
+    bool operator < ( UsedRecord const & other ) const
+    { return memcmp( id, other.id, sizeof( id ) ) < 0; }
+  };
+
+  /// Records of the same chunk sort in the order they were seen
+  struct IndexRecord
+  {
+    char id[ ChunkId::BlobSize ];
+    uint64_t position;
+
+    bool operator < ( IndexRecord const & other ) const
+    {
+      int r = memcmp( id, other.id, sizeof( id ) );
+      return r ? r < 0 : position < other.position;
+    }
+  };
+
+  ExternalSorter< UsedRecord > used;
+  Mutex usedMutex;
+  ExternalSorter< IndexRecord > indexed;
+
+  /// Position of the first chunk record of each index file
+  std::map< string, uint64_t > firstRecords;
+  uint64_t records;
+
+  /// Two bits per record
+  std::vector< uint8_t > flags;
+};
+
+#endif
@@ -62,6 +62,18 @@ void Config::prefillKeywords()
       "Default is %s",
       GET_STORABLE( bundle, compression_method )
     },
+    {
+      "bundle.frame_size",
+      Config::oBundle_frame_size,
+      Config::Storable,
+      "If not zero, new bundles are split into frames of at least this\n"
+      "many payload bytes, each compressed separately. Reading a chunk\n"
+      "then only requires decompressing its frame, which speeds up NBD\n"
+      "and other random reads at some cost in compression ratio.\n"
+      "Bundles written this way can't be read by older versions\n"
+      "Default is %s",
+      Utils::numberToString( GET_STORABLE( bundle, frame_size ) )
+    },
     {
       "lzma.compression_level",
       Config::oLZMA_compression_level,
@@ -71,6 +83,18 @@ void Config::prefillKeywords()
       "Default is %s",
       Utils::numberToString( GET_STORABLE( lzma, compression_level ) )
     },
+    {
+      "encryption.mode",
+      Config::oEncryption_mode,
+      Config::Storable,
+      "Cipher mode for new encrypted bundle and index files\n"
+      "Valid values: cbc, gcm. GCM files are made of separately\n"
+      "authenticated segments, so any part of them can be read and\n"
+      "checked without decrypting the whole file. They can't be read\n"
+      "by older versions\n"
+      "Default is %s",
+      GET_STORABLE( encryption, mode )
+    },
 
     // Shortcuts for storable options
     {
@@ -88,6 +112,7 @@ void Config::prefillKeywords()
       Config::oRuntime_threads,
       Config::Runtime,
       "Maximum number of compressor threads to use in backup process\n"
+      "and of threads serving requests in NBD mode\n"
       "Default is %s on your system",
       Utils::numberToString( runtime.threads )
     },
@@ -155,6 +180,149 @@ void Config::prefillKeywords()
       Utils::numberToString( runtime.backupMinimalSize / 1024 / 1024 )
     },
 
+    {
+      "io.order",
+      Config::oRuntime_ioOrder,
+      Config::Runtime,
+      "Order in which bundles are visited during restore,\n"
+      "garbage collection and import/export.\n"
+      "Valid values:\n"
+      "none - don't reorder bundles\n"
+      "inode - sort bundles by their inode numbers\n"
+      "extent - sort bundles by their physical location on disk\n"
+      "(falls back to inode if the filesystem lacks FIEMAP)\n"
+      "Default is %s",
+      IoOrder::getModeName( runtime.ioOrder )
+    },
+
+    {
+      "io.buffer_size",
+      Config::oRuntime_ioBufferSize,
+      Config::Runtime,
+      "Size of the buffers used to read and write repository files.\n"
+      "Larger buffers mean fewer system calls per bundle or index\n"
+      "file. Rounded up to the page size.\n"
+      VALID_SUFFIXES
+      "Default is %sMiB",
+      Utils::numberToString( runtime.ioBufferSize / 1024 / 1024 )
+    },
+
+    {
+      "nbd.chunk_cache",
+      Config::oRuntime_nbdChunkCache,
+      Config::Runtime,
+      "Part of cache-size to use in NBD mode for caching separate\n"
+      "chunks rather than whole bundles, which helps random reads.\n"
+      "0 means three quarters of cache-size.\n"
+      VALID_SUFFIXES
+      "Default is %sMiB",
+      Utils::numberToString( runtime.nbdChunkCache / 1024 / 1024 )
+    },
+
+    {
+      "nbd.read_ahead",
+      Config::oRuntime_nbdReadAhead,
+      Config::Runtime,
+      "Amount of data to read ahead of sequential reads in NBD mode.\n"
+      "0 disables read-ahead.\n"
+      VALID_SUFFIXES
+      "Default is %sMiB",
+      Utils::numberToString( runtime.nbdReadAhead / 1024 / 1024 )
+    },
+
+    {
+      "verify.rate",
+      Config::oRuntime_verifyRate,
+      Config::Runtime,
+      "Maximum rate, in bytes per second, at which the verify command\n"
+      "reads the repository, so it doesn't starve other users of the\n"
+      "disks. 0 means no limit.\n"
+      VALID_SUFFIXES
+      "Default is %sMiB",
+      Utils::numberToString( runtime.verifyRate / 1024 / 1024 )
+    },
+
+    {
+      "gc.sort_buffer",
+      Config::oRuntime_gcSortBuffer,
+      Config::Runtime,
+      "Makes garbage collection work out of core, for repositories\n"
+      "whose chunk ids don't fit in memory. The ids are sorted in\n"
+      "runs of this size, spilled to tmp/ and merged with the index.\n"
+      "0 means all the ids are kept in memory.\n"
+      VALID_SUFFIXES
+      "Default is %sMiB",
+      Utils::numberToString( runtime.gcSortBuffer / 1024 / 1024 )
+    },
+
+    {
+      "gc.threshold",
+      Config::oRuntime_gcThreshold,
+      Config::Runtime,
+      "Garbage collection only repacks the bundles in which the\n"
+      "used chunks make up less than this percentage of the data.\n"
+      "The unused chunks of the other bundles are left in place,\n"
+      "saving the I/O of rewriting mostly used bundles.\n"
+      "Default is %s",
+      Utils::numberToString( runtime.gcThreshold )
+    },
+
+    {
+      "gc.budget",
+      Config::oRuntime_gcBudget,
+      Config::Runtime,
+      "Maximum amount of I/O garbage collection may spend on\n"
+      "repacking bundles. The least used bundles are repacked\n"
+      "first. 0 means no limit.\n"
+      VALID_SUFFIXES
+      "Default is %sMiB",
+      Utils::numberToString( runtime.gcBudget / 1024 / 1024 )
+    },
+
+    {
+      "gc.dry_run",
+      Config::oRuntime_gcDryRun,
+      Config::Runtime,
+      "Makes garbage collection only report how many bytes it\n"
+      "would reclaim and how much I/O that would take, without\n"
+      "changing anything. Same as the --dry-run flag.\n"
+      "Not default, you should specify it explicitly."
+    },
+
+    {
+      "backup.file_cache",
+      Config::oRuntime_backupFileCache,
+      Config::Runtime,
+      "Makes directory backups remember the state of each file\n"
+      "backed up. A file whose size, inode, modification and change\n"
+      "times haven't changed since is not read again, its previous\n"
+      "backup is written instead.\n"
+      "Not default, you should specify it explicitly."
+    },
+
+    {
+      "backup.parent",
+      Config::oRuntime_backupParent,
+      Config::Runtime,
+      "Backup file of a previous version of the file being backed\n"
+      "up, e.g. a disk image. The parts of the file which are the\n"
+      "same as in that backup take its chunks as they are, rather\n"
+      "than being chunked again. Same as the --parent flag.\n"
+      "Not default, you should specify it explicitly."
+    },
+
+    {
+      "backup.changed_extents",
+      Config::oRuntime_backupChangedExtents,
+      Config::Runtime,
+      "Text file listing the extents of the file changed since\n"
+      "the backup.parent one was made, one \"offset size\" pair\n"
+      "in bytes per line. Those extents are then backed up anew\n"
+      "without being compared with the parent backup. The rest is\n"
+      "still compared, and a warning lists the changes found there.\n"
+      "Not default, you should specify it explicitly."
+    },
+
     { "", Config::oBadOption, Config::None }
   };
 
@@ -299,6 +467,24 @@ bool Config::parseOrValidate( const string & option, const OptionType type,
       /* NOTREACHED */
       break;
 
+    case oBundle_frame_size:
+      SKIP_ON_VALIDATION;
+      REQUIRE_VALUE;
+
+      if ( sscanf( optionValue, "%u %n", &uint32Value, &n ) == 1
+          && !optionValue[ n ] )
+      {
+        SET_STORABLE( bundle, frame_size, uint32Value );
+        dPrintf( "storable[bundle][frame_size] = %u\n",
+            GET_STORABLE( bundle, frame_size ) );
+
+        return true;
+      }
+
+      return false;
+      /* NOTREACHED */
+      break;
+
     case oLZMA_compression_level:
       REQUIRE_VALUE;
 
@@ -386,6 +572,24 @@ bool Config::parseOrValidate( const string & option, const OptionType type,
       /* NOTREACHED */
       break;
 
+    case oEncryption_mode:
+      REQUIRE_VALUE;
+
+      if ( PARSE_OR_VALIDATE(
+            strcmp( optionValue, "cbc" ) != 0 && strcmp( optionValue, "gcm" ) != 0,
+            GET_STORABLE( encryption, mode ) != "cbc" &&
+            GET_STORABLE( encryption, mode ) != "gcm" ) )
+        return false;
+
+      SKIP_ON_VALIDATION;
+      SET_STORABLE( encryption, mode, string( optionValue ) );
+      dPrintf( "storable[encryption][mode] = %s\n",
+          GET_STORABLE( encryption, mode ).c_str() );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
     case oRuntime_threads:
       REQUIRE_VALUE;
 
@@ -510,6 +714,187 @@ bool Config::parseOrValidate( const string & option, const OptionType type,
       /* NOTREACHED */
       break;
 
+    case oRuntime_ioOrder:
+      REQUIRE_VALUE;
+
+      if ( !IoOrder::parseMode( optionValue, runtime.ioOrder ) )
+      {
+        fprintf( stderr, "Invalid io.order value specified: %s\n"
+                 "Must be one of the following: none, inode, extent.\n",
+                 optionValue );
+        return false;
+      }
+
+      dPrintf( "runtime[ioOrder] = %s\n",
+               IoOrder::getModeName( runtime.ioOrder ) );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_ioBufferSize:
+      REQUIRE_VALUE;
+
+      sizeValue = runtime.ioBufferSize;
+      if ( sscanf( optionValue, "%zu %15s %n",
+                   &sizeValue, suffix, &n ) == 2 && !optionValue[ n ] )
+      {
+        runtime.ioBufferSize = sizeValue * Utils::getScale( suffix );
+        if ( 0 == runtime.ioBufferSize )
+          return false;
+
+        dPrintf( "runtime[ioBufferSize] = %zu\n", runtime.ioBufferSize );
+
+        return true;
+      }
+      return false;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_nbdChunkCache:
+      REQUIRE_VALUE;
+
+      sizeValue = runtime.nbdChunkCache;
+      if ( sscanf( optionValue, "%zu %15s %n",
+                   &sizeValue, suffix, &n ) == 2 && !optionValue[ n ] )
+      {
+        runtime.nbdChunkCache = sizeValue * Utils::getScale( suffix );
+
+        dPrintf( "runtime[nbdChunkCache] = %zu\n", runtime.nbdChunkCache );
+
+        return true;
+      }
+      return false;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_nbdReadAhead:
+      REQUIRE_VALUE;
+
+      sizeValue = runtime.nbdReadAhead;
+      if ( sscanf( optionValue, "%zu %15s %n",
+                   &sizeValue, suffix, &n ) == 2 && !optionValue[ n ] )
+      {
+        runtime.nbdReadAhead = sizeValue * Utils::getScale( suffix );
+
+        dPrintf( "runtime[nbdReadAhead] = %zu\n", runtime.nbdReadAhead );
+
+        return true;
+      }
+      return false;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_verifyRate:
+      REQUIRE_VALUE;
+
+      sizeValue = runtime.verifyRate;
+      if ( sscanf( optionValue, "%zu %15s %n",
+                   &sizeValue, suffix, &n ) == 2 && !optionValue[ n ] )
+      {
+        runtime.verifyRate = sizeValue * Utils::getScale( suffix );
+
+        dPrintf( "runtime[verifyRate] = %zu\n", runtime.verifyRate );
+
+        return true;
+      }
+      return false;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_gcSortBuffer:
+      REQUIRE_VALUE;
+
+      sizeValue = runtime.gcSortBuffer;
+      if ( sscanf( optionValue, "%zu %15s %n",
+                   &sizeValue, suffix, &n ) == 2 && !optionValue[ n ] )
+      {
+        runtime.gcSortBuffer = sizeValue * Utils::getScale( suffix );
+
+        dPrintf( "runtime[gcSortBuffer] = %zu\n", runtime.gcSortBuffer );
+
+        return true;
+      }
+      return false;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_gcThreshold:
+      REQUIRE_VALUE;
+
+      sizeValue = runtime.gcThreshold;
+      if ( sscanf( optionValue, "%zu %n", &sizeValue, &n ) == 1 &&
+           !optionValue[ n ] && sizeValue <= 100 )
+      {
+        runtime.gcThreshold = sizeValue;
+
+        dPrintf( "runtime[gcThreshold] = %u\n", runtime.gcThreshold );
+
+        return true;
+      }
+      return false;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_gcBudget:
+      REQUIRE_VALUE;
+
+      sizeValue = runtime.gcBudget;
+      if ( sscanf( optionValue, "%zu %15s %n",
+                   &sizeValue, suffix, &n ) == 2 && !optionValue[ n ] )
+      {
+        runtime.gcBudget = sizeValue * Utils::getScale( suffix );
+
+        dPrintf( "runtime[gcBudget] = %zu\n", runtime.gcBudget );
+
+        return true;
+      }
+      return false;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_gcDryRun:
+      runtime.gcDryRun = true;
+
+      dPrintf( "runtime[gcDryRun] = true\n" );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_backupFileCache:
+      runtime.backupFileCache = true;
+
+      dPrintf( "runtime[backupFileCache] = true\n" );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_backupParent:
+      REQUIRE_VALUE;
+
+      // The path is everything after the '=', spaces included
+      runtime.backupParent = option.substr( option.find( '=' ) + 1 );
+
+      dPrintf( "runtime[backupParent] = %s\n", runtime.backupParent.c_str() );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
+    case oRuntime_backupChangedExtents:
+      REQUIRE_VALUE;
+
+      runtime.backupChangedExtents = option.substr( option.find( '=' ) + 1 );
+
+      dPrintf( "runtime[backupChangedExtents] = %s\n",
+               runtime.backupChangedExtents.c_str() );
+
+      return true;
+      /* NOTREACHED */
+      break;
+
     case oBadOption:
     default:
       return false;
@@ -626,8 +1011,12 @@ void Config::reset_storable()
         bundle, max_payload_size ) );
   SET_STORABLE( bundle, compression_method, defaultConfig.GET_STORABLE(
         bundle, compression_method ) );
+  SET_STORABLE( bundle, frame_size, defaultConfig.GET_STORABLE(
+        bundle, frame_size ) );
   SET_STORABLE( lzma, compression_level, defaultConfig.GET_STORABLE(
         lzma, compression_level ) );
+  SET_STORABLE( encryption, mode, defaultConfig.GET_STORABLE(
+        encryption, mode ) );
 }
 
 void Config::show()
@@ -10,6 +10,7 @@
 #include "zbackup.pb.h"
 #include "mt.hh"
 #include "backup_exchanger.hh"
+#include "io_order.hh"
 
 // TODO: make *_storable to be variadic
 #define SET_STORABLE( storage, property, value ) \
@@ -33,6 +34,18 @@ public:
     bool gcConcat;
     bool pathsRespectTmp;
     size_t backupMinimalSize;
+    IoOrder::Mode ioOrder;
+    size_t ioBufferSize;
+    size_t nbdChunkCache;
+    size_t nbdReadAhead;
+    size_t verifyRate;
+    size_t gcSortBuffer;
+    unsigned gcThreshold;
+    size_t gcBudget;
+    bool gcDryRun;
+    bool backupFileCache;
+    string backupParent;
+    string backupChangedExtents;
 
     // Default runtime config
     RuntimeConfig():
@@ -41,7 +54,17 @@ public:
       gcRepack ( false ),
       gcConcat ( false ),
       pathsRespectTmp( false ),
-      backupMinimalSize( 10 * 1024 * 1024) // 10 MB
+      backupMinimalSize( 10 * 1024 * 1024), // 10 MB
+      ioOrder( IoOrder::Extent ),
+      ioBufferSize( 1024 * 1024 ), // 1 MB
+      nbdChunkCache( 0 ), // 3/4 of cacheSize
+      nbdReadAhead( 4 * 1024 * 1024 ), // 4 MB
+      verifyRate( 0 ), // Unlimited
+      gcSortBuffer( 0 ), // Everything is kept in memory
+      gcThreshold( 100 ), // Repack any bundle with unused chunks
+      gcBudget( 0 ), // Unlimited
+      gcDryRun( false ),
+      backupFileCache( false )
     {
     }
   };
@@ -61,7 +84,9 @@ public:
     oChunk_max_size,
     oBundle_max_payload_size,
     oBundle_compression_method,
+    oBundle_frame_size,
     oLZMA_compression_level,
+    oEncryption_mode,
 
     oRuntime_threads,
     oRuntime_cacheSize,
@@ -70,6 +95,18 @@ public:
     oRuntime_gcConcat,
     oRuntime_pathsRespectTmp,
     oRuntime_backupMinimalSize,
+    oRuntime_ioOrder,
+    oRuntime_ioBufferSize,
+    oRuntime_nbdChunkCache,
+    oRuntime_nbdReadAhead,
+    oRuntime_verifyRate,
+    oRuntime_gcSortBuffer,
+    oRuntime_gcThreshold,
+    oRuntime_gcBudget,
+    oRuntime_gcDryRun,
+    oRuntime_backupFileCache,
+    oRuntime_backupParent,
+    oRuntime_backupChangedExtents,
 
     oDeprecated, oUnsupported
   } OpCodes;
@@ -1,6 +1,7 @@
 // Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
 // Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
 
+#include <limits.h>
 #include <string.h>
 #include <algorithm>
 
@@ -14,25 +15,125 @@
 namespace EncryptedFile {
 
 using Encryption::BlockSize;
+using Encryption::GcmTagSize;
+
+namespace {
+size_t bufferSize = 1024 * 1024;
+}
+
+Mode getModeByName( std::string const & name )
+{
+  return name == "gcm" ? Gcm : Cbc;
+}
+
+void setBufferSize( size_t size )
+{
+  size_t pageSize = getPageSize();
+  bufferSize = std::max( ( size + pageSize - 1 ) / pageSize * pageSize,
+                         pageSize );
+}
+
+size_t getBufferSize()
+{
+  return bufferSize;
+}
+
+GcmSegments::GcmSegments( EncryptionKey const & key, void const * salt,
+                          uint64_t count, size_t lastSize ):
+  cipher( key.getKey(), salt, Encryption::Cipher::Decrypt ), count( count ),
+  lastSize( lastSize )
+{
+}
+
+GcmSegments * GcmSegments::open( UnbufferedFile & file,
+                                 EncryptionKey const & key )
+{
+  char header[ HeaderSize ];
+  if ( file.readAt( header, sizeof( header ), 0 ) != sizeof( header ) ||
+       memcmp( header, Encryption::GcmMagic, Encryption::GcmMagicSize ) != 0 )
+    return NULL;
+
+  // There's always at least one segment, and only the last one can be shorter
+  // than Stride
+  UnbufferedFile::Offset segmentsSize = file.size() - HeaderSize;
+  if ( segmentsSize < GcmTagSize )
+    throw exIncorrectFileSize();
+
+  uint64_t count = ( segmentsSize + Stride - 1 ) / Stride;
+  size_t lastSize = segmentsSize - ( count - 1 ) * Stride;
+  if ( lastSize < GcmTagSize )
+    throw exIncorrectFileSize();
+
+  return new GcmSegments( key, header + Encryption::GcmMagicSize, count,
+                          lastSize - GcmTagSize );
+}
+
+size_t GcmSegments::read( UnbufferedFile & file, uint64_t index, char * buf )
+{
+  CHECK( index < count, "reading past the last segment" );
+
+  bool last = ( index == count - 1 );
+  size_t size = last ? lastSize : ( size_t ) SegmentSize;
+
+  if ( file.readAt( buf, size + GcmTagSize, HeaderSize + index * Stride ) !=
+       size + GcmTagSize )
+    throw exIncorrectFileSize();
+
+  if ( !cipher.decrypt( index, last, buf, size, buf + size ) )
+    throw exAuthenticationFailed();
+
+  return size;
+}
 
 InputStream::InputStream( char const * fileName, EncryptionKey const & key,
                           void const * iv_ ):
   file( fileName, UnbufferedFile::ReadOnly ), filePos( 0 ), key( key ),
-  // Our buffer must be larger than BlockSize, as otherwise we won't be able
-  // to handle PKCS#7 padding properly
-  buffer( std::max( getPageSize(), ( unsigned ) BlockSize * 2 ) ),
+  nextSegment( 0 ), adlerSkipped( false ), mapped( NULL ), mappedSize( 0 ),
   fill( 0 ), remainder( 0 ), backedUp( false )
 {
   dPrintf( "Loading %s, hasKey: %s\n", fileName, key.hasKey() ? "true" : "false" );
-  if ( key.hasKey() )
+
+  // We are going to read the whole file, most likely in one go
+  file.adviseSequential();
+
+  UnbufferedFile::Offset size = file.size();
+
+  if ( key.hasKey() && ( gcm = GcmSegments::open( file, key ) ).get() )
+    buffer.resize( GcmSegments::Stride );
+  else
   {
-    memcpy( iv, iv_, sizeof( iv ) );
-    // Since we use padding, file size should be evenly dividable by the cipher
-    // block size, and we should have at least one block
-    UnbufferedFile::Offset size = file.size();
-    if ( !size || size % BlockSize )
-      throw exIncorrectFileSize();
+    if ( key.hasKey() )
+    {
+      cipher = new Encryption::Cipher( key.getDecryptor() );
+      memcpy( iv, iv_, sizeof( iv ) );
+      // Since we use padding, file size should be evenly dividable by the
+      // cipher block size, and we should have at least one block
+      if ( !size || size % BlockSize )
+        throw exIncorrectFileSize();
+    }
+    else
+    if ( ( UnbufferedFile::Offset )( size_t ) size == size &&
+         ( mapped = ( char * ) file.map( size ) ) )
+    {
+      // No need for a buffer then
+      mappedSize = size;
+      start = mapped;
+      return;
+    }
+
+    // A buffer larger than the file lets us read all of it at once and see the
+    // end of it in the same read, so we don't allocate more than that. Our
+    // buffer must be larger than BlockSize, as otherwise we won't be able to
+    // handle PKCS#7 padding properly, and be a multiple of it
+    UnbufferedFile::Offset fileBufferSize =
+      ( size / BlockSize + 1 ) * BlockSize;
+    size_t bufferSize = getBufferSize();
+    if ( fileBufferSize < ( UnbufferedFile::Offset ) bufferSize )
+      bufferSize = fileBufferSize;
+    buffer.resize( std::max( bufferSize, ( size_t ) BlockSize * 2 ) );
   }
+
+  start = buffer.data();
 }
 
 bool InputStream::Next( void const ** data, int * size )
@@ -41,6 +142,38 @@ bool InputStream::Next( void const ** data, int * size )
   if ( backedUp )
     backedUp = false;
   else
+  if ( mapped )
+  {
+    adler32.add( start, fill );
+
+    // Give out as much as the interface permits, filePos being where the
+    // unconsumed data starts
+    start = mapped + filePos;
+    fill = std::min( mappedSize - ( size_t ) filePos, ( size_t ) INT_MAX );
+  }
+  else
+  if ( gcm.get() )
+  {
+    try
+    {
+      adler32.add( start, fill );
+
+      if ( nextSegment == gcm->getCount() )
+      {
+        fill = 0;
+        return false;
+      }
+
+      start = buffer.data();
+      fill = gcm->read( file, nextSegment++, start );
+    }
+    catch( UnbufferedFile::exReadError & )
+    {
+      fill = 0;
+      return false;
+    }
+  }
+  else
   {
     try
     {
@@ -102,6 +235,46 @@ bool InputStream::Skip( int count )
 {
   CHECK( count >= 0, "count is negative" );
 
+  // GCM segments can be decrypted on their own, so we go straight to the
+  // target one, unless it is the one we have already
+  if ( gcm.get() && !( backedUp && ( size_t ) count < fill ) )
+  {
+    uint64_t target = filePos + count;
+    adlerSkipped = true;
+    backedUp = false;
+
+    if ( target >= gcm->getDataSize() )
+    {
+      nextSegment = gcm->getCount();
+      start = buffer.data();
+      fill = 0;
+      bool reached = ( target == gcm->getDataSize() );
+      filePos = gcm->getDataSize();
+      return reached;
+    }
+
+    uint64_t segment = target / GcmSegments::SegmentSize;
+    size_t offset = target % GcmSegments::SegmentSize;
+
+    try
+    {
+      fill = gcm->read( file, segment, buffer.data() );
+    }
+    catch( UnbufferedFile::exReadError & )
+    {
+      fill = 0;
+      return false;
+    }
+
+    nextSegment = segment + 1;
+    start = buffer.data() + offset;
+    fill -= offset;
+    filePos = target;
+    // Make the next Next() return the rest of the segment
+    backedUp = fill;
+    return true;
+  }
+
   // We always need to read and decrypt data, as otherwise both the state of
   // CBC and adler32 would be incorrect
   void const * data;
@@ -164,10 +337,16 @@ void InputStream::checkAdler32()
   Adler32::Value ours = getAdler32();
   Adler32::Value r;
   read( &r, sizeof( r ) );
-  if ( ours != fromLittleEndian( r ) )
+  if ( !adlerSkipped && ours != fromLittleEndian( r ) )
     throw exAdlerMismatch();
 }
 
+InputStream::~InputStream()
+{
+  if ( mapped )
+    UnbufferedFile::unmap( mapped, mappedSize );
+}
+
 void InputStream::consumeRandomIv()
 {
   if ( key.hasKey() )
@@ -231,19 +410,116 @@ void InputStream::doDecrypt()
   memcpy( newIv, Encryption::getNextDecryptionIv( start, fill ),
           sizeof( newIv ) );
   // Decrypt the data
-  Encryption::decrypt( iv, key.getKey(), start, start, fill );
+  Encryption::decrypt( iv, *cipher, start, start, fill );
   // Copy the new iv
   memcpy( iv, newIv, sizeof( iv ) );
 }
 
+RandomAccessFile::RandomAccessFile( char const * fileName,
+                                    EncryptionKey const & key,
+                                    void const * iv_ ):
+  file( fileName, UnbufferedFile::ReadOnly ), key( key )
+{
+  dPrintf( "Opening %s for random access, hasKey: %s\n", fileName,
+           key.hasKey() ? "true" : "false" );
+  if ( key.hasKey() )
+  {
+    memcpy( iv, iv_, sizeof( iv ) );
+    gcm = GcmSegments::open( file, key );
+  }
+}
+
+void RandomAccessFile::read( int64_t offset, void * buf, size_t size )
+{
+  if ( !size )
+    return;
+
+  if ( gcm.get() )
+  {
+    std::vector< char > segment( GcmSegments::Stride );
+    char * out = ( char * ) buf;
+
+    Lock _( gcmMutex );
+
+    while ( size )
+    {
+      uint64_t index = offset / GcmSegments::SegmentSize;
+      size_t skip = offset % GcmSegments::SegmentSize;
+
+      if ( index >= gcm->getCount() )
+        throw exReadFailed();
+
+      size_t segmentSize = gcm->read( file, index, segment.data() );
+      if ( segmentSize <= skip )
+        throw exReadFailed();
+
+      size_t toCopy = std::min( size, segmentSize - skip );
+      memcpy( out, segment.data() + skip, toCopy );
+      out += toCopy;
+      offset += toCopy;
+      size -= toCopy;
+    }
+
+    return;
+  }
+
+  if ( !key.hasKey() )
+  {
+    if ( file.readAt( buf, size, offset ) != size )
+      throw exReadFailed();
+    return;
+  }
+
+  // In CBC, each block is decrypted with the previous ciphertext block as the
+  // IV, so we read the block preceding the range as well, unless it starts at
+  // the beginning of the file
+  int64_t first = offset / BlockSize * BlockSize;
+  int64_t end = ( offset + size + BlockSize - 1 ) / BlockSize * BlockSize;
+  size_t prefix = first ? BlockSize : 0;
+
+  std::vector< char > data( prefix + ( end - first ) );
+  if ( file.readAt( data.data(), data.size(), first - prefix ) != data.size() )
+    throw exReadFailed();
+
+  // Each call gets its own copy of the context, so several threads can read
+  // at once
+  Encryption::Cipher cipher( key.getDecryptor() );
+  Encryption::decrypt( prefix ? data.data() : iv, cipher,
+                       data.data() + prefix, data.data() + prefix,
+                       end - first );
+
+  memcpy( buf, data.data() + prefix + ( offset - first ), size );
+}
+
 OutputStream::OutputStream( char const * fileName, EncryptionKey const & key,
-                            void const * iv_ ):
+                            void const * iv_, Mode mode ):
   file( fileName, UnbufferedFile::WriteOnly ), filePos( 0 ), key( key ),
-  buffer( getPageSize() ), start( buffer.data() ), avail( 0 ), backedUp( false )
+  nextSegment( 0 ),
+  buffer( key.hasKey() && mode == Gcm ? ( size_t ) GcmSegments::SegmentSize :
+          getBufferSize() ),
+  start( buffer.data() ), avail( 0 ), backedUp( false )
 {
   dPrintf( "Saving %s, hasKey: %s\n", fileName, key.hasKey() ? "true" : "false" );
+  if ( key.hasKey() && mode == Gcm )
+  {
+    char header[ GcmSegments::HeaderSize ];
+    memcpy( header, Encryption::GcmMagic, Encryption::GcmMagicSize );
+    Random::generateTrue( header + Encryption::GcmMagicSize,
+                          Encryption::GcmSaltSize );
+    file.write( header, sizeof( header ) );
+
+    gcm = new Encryption::GcmCipher( key.getKey(),
+                                     header + Encryption::GcmMagicSize,
+                                     Encryption::Cipher::Encrypt );
+
+    // The buffer holds exactly one segment
+  }
+  else
   if ( key.hasKey() )
+  {
+    cipher = new Encryption::Cipher( key.getEncryptor() );
     memcpy( iv, iv_, sizeof( iv ) );
+  }
 }
 
 bool OutputStream::Next( void ** data, int * size )
@@ -349,15 +625,24 @@ void OutputStream::writeRandomIv()
   }
 }
 
-void OutputStream::encryptAndWrite( size_t bytes )
+void OutputStream::encryptAndWrite( size_t bytes, bool last )
 {
+  if ( gcm.get() )
+  {
+    char tag[ GcmTagSize ];
+    gcm->encrypt( nextSegment++, last, buffer.data(), bytes, tag );
+    file.write( buffer.data(), bytes );
+    file.write( tag, sizeof( tag ) );
+    return;
+  }
+
   if ( key.hasKey() )
   {
     CHECK( bytes > 0 && !( bytes % BlockSize ), "incorrect number of bytes to "
            "encrypt and write - must be non-zero and in multiples of %u",
            ( unsigned ) BlockSize );
 
-    void const * nextIv = Encryption::encrypt( iv, key.getKey(), buffer.data(),
+    void const * nextIv = Encryption::encrypt( iv, *cipher, buffer.data(),
                                                buffer.data(), bytes );
     memcpy( iv, nextIv, sizeof( iv ) );
   }
@@ -370,6 +655,14 @@ OutputStream::~OutputStream()
   // This makes all data consumed, if not already
   BackUp( 0 );
 
+  // In the GCM mode, whatever is left forms the last segment, even if it is
+  // empty or full
+  if ( gcm.get() )
+  {
+    encryptAndWrite( start - buffer.data(), true );
+    return;
+  }
+
   // If we have the full buffer, write it first
   if ( start == buffer.data() + buffer.size() )
   {
@@ -9,35 +9,103 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <exception>
+#include <string>
 #include <vector>
 
 #include "adler32.hh"
 #include "encryption.hh"
 #include "encryption_key.hh"
 #include "ex.hh"
+#include "mt.hh"
+#include "nocopy.hh"
+#include "sptr.hh"
 #include "unbuffered_file.hh"
 
 /// Google's ZeroCopyStream implementations which read and write files encrypted
 /// with our encryption mechanism. They also calculate adler32 of all file
 /// content and write/check it at the end.
-/// Encryption-wise we implement AES-128 in CBC mode with PKCS#7 padding. We
-/// don't use EVP for this currently - everyone is welcome to change this, and
-/// to add support for arbitrary ciphers, key lengths and modes of operations as
-/// well. When no encryption key is set, no encryption or padding is done, but
-/// everything else works the same way otherwise
+/// Encryption-wise we implement AES-128 in CBC mode with PKCS#7 padding, done
+/// through EVP. Files can also be written in the GCM mode, in which they are
+/// split into separately authenticated segments, so any part of them can be
+/// read without decrypting everything before it. Readers recognize the mode on
+/// their own. Everyone is welcome to add support for arbitrary ciphers and key
+/// lengths. When no encryption key is set, no encryption or padding is done,
+/// but everything else works the same way otherwise
 namespace EncryptedFile {
 
 DEF_EX( Ex, "Encrypted file exception", std::exception )
 DEF_EX( exFileCorrupted, "encrypted file data is currupted", Ex )
 DEF_EX( exIncorrectFileSize, "size of the encrypted file is incorrect", exFileCorrupted )
-DEF_EX( exReadFailed, "read failed", Ex ) // Only thrown by InputStream::read()
+DEF_EX( exAuthenticationFailed, "encrypted file data failed authentication", exFileCorrupted )
+DEF_EX( exReadFailed, "read failed", Ex ) // Only thrown by read() methods
 DEF_EX( exAdlerMismatch, "adler32 mismatch", Ex )
 
+/// Modes new files can be encrypted in
+enum Mode
+{
+  /// AES-128-CBC, readable by all versions
+  Cbc,
+  /// AES-128-GCM in segments
+  Gcm
+};
+
+/// Returns the mode with the given name, as used by the encryption.mode
+/// option. Unknown names give Cbc
+Mode getModeByName( std::string const & );
+
+/// Sets the size of the buffers of the streams created afterwards, as given by
+/// the io.buffer_size option. It is rounded up to the page size. Input streams
+/// don't allocate more than the file needs
+void setBufferSize( size_t );
+size_t getBufferSize();
+
+/// Segments of a file encrypted in the GCM mode. The file consists of the
+/// magic, the salt, and the segments, each holding SegmentSize bytes of data
+/// followed by the tag, except the last one, which may hold less. The data
+/// of the file always ends with the last segment, even if it's empty
+class GcmSegments: NoCopy
+{
+public:
+  enum
+  {
+    SegmentSize = 65536,
+    HeaderSize = Encryption::GcmMagicSize + Encryption::GcmSaltSize,
+    /// Number of bytes each segment but the last one takes in the file
+    Stride = SegmentSize + Encryption::GcmTagSize
+  };
+
+  /// Returns the segments of the file if it is encrypted in the GCM mode, or
+  /// NULL otherwise
+  static GcmSegments * open( UnbufferedFile &, EncryptionKey const & );
+
+  /// Returns the number of segments
+  uint64_t getCount() const
+  { return count; }
+
+  /// Returns the total size of the data in all segments
+  uint64_t getDataSize() const
+  { return ( count - 1 ) * SegmentSize + lastSize; }
+
+  /// Reads, authenticates and decrypts the given segment to 'buf', which
+  /// should have room for Stride bytes. Returns the size of its data. Not
+  /// thread-safe
+  size_t read( UnbufferedFile &, uint64_t index, char * buf );
+
+private:
+  GcmSegments( EncryptionKey const &, void const * salt, uint64_t count,
+               size_t lastSize );
+
+  Encryption::GcmCipher cipher;
+  uint64_t count;
+  size_t lastSize;
+};
+
 class InputStream: public google::protobuf::io::ZeroCopyInputStream
 {
 public:
   /// Opens the input file. If EncryptionKey contains no key, the input won't be
-  /// decrypted and iv would be ignored
+  /// decrypted and iv would be ignored. Such files are mapped into memory if
+  /// possible, and Next() returns the data straight from the mapping
   InputStream( char const * fileName, EncryptionKey const &, void const * iv );
   virtual bool Next( void const ** data, int * size );
   virtual void BackUp( int count );
@@ -46,9 +114,16 @@ public:
 
 
   /// Returns adler32 of all data read so far. Calling this makes backing up
-  /// for the previous Next() call impossible - the data has to be consumed
+  /// for the previous Next() call impossible - the data has to be consumed.
+  /// The value is meaningless once Skip() has skipped a part of a GCM file
   Adler32::Value getAdler32();
 
+  /// Returns true if the file is mapped into memory. The data Next() returns
+  /// then stays valid until the stream is destroyed, each piece following the
+  /// previous one in memory
+  bool isMapped() const
+  { return mapped; }
+
   /// Performs a traditional read, for convenience purposes
   void read( void * buf, size_t size );
 
@@ -62,15 +137,28 @@ public:
   void consumeRandomIv();
 
   /// Closes the file
-  ~InputStream() {}
+  ~InputStream();
 
 private:
   UnbufferedFile file;
   UnbufferedFile::Offset filePos;
   EncryptionKey const & key;
+  /// Our own copy of the key's decryption context, if there is a key
+  sptr< Encryption::Cipher > cipher;
+  /// Set instead of 'cipher' for files in the GCM mode
+  sptr< GcmSegments > gcm;
+  uint64_t nextSegment;
+  /// Set once Skip() has skipped a part of a GCM file without reading it. The
+  /// adler32 can't be checked then, but the segments are authenticated anyway
+  bool adlerSkipped;
+  /// The whole file mapped into memory, if it is not encrypted and could be
+  /// mapped. It is never written to, 'start' just points into it
+  char * mapped;
+  size_t mappedSize;
   char iv[ Encryption::IvSize ];
   std::vector< char > buffer;
-  char * start; /// Points to the start of the data currently held in buffer
+  char * start; /// Points to the start of the data currently held in buffer,
+                /// or in the mapping
   size_t fill; /// Number of bytes held in buffer
   size_t remainder; /// Number of bytes held in buffer just after the main
                     /// 'fill'-bytes portion. We have to keep those to implement
@@ -85,12 +173,40 @@ private:
   void doDecrypt();
 };
 
+/// Reads arbitrary ranges of the decrypted contents of a file, without reading
+/// everything before them. Offsets are the ones InputStream::ByteCount() would
+/// report, including the random IV. Only the segments of files in the GCM mode
+/// are verified, so the callers should have checksums of their own for the
+/// ranges they read
+class RandomAccessFile: NoCopy
+{
+public:
+  /// Opens the input file. If EncryptionKey contains no key, the input won't be
+  /// decrypted and iv would be ignored
+  RandomAccessFile( char const * fileName, EncryptionKey const &,
+                    void const * iv );
+
+  /// Reads 'size' bytes at the given offset. Throws exReadFailed if the file
+  /// ends before that. Can be used from several threads at once
+  void read( int64_t offset, void * buf, size_t size );
+
+private:
+  UnbufferedFile file;
+  EncryptionKey const & key;
+  char iv[ Encryption::IvSize ];
+  sptr< GcmSegments > gcm;
+  /// Guards 'gcm', which can't be used by several threads at once
+  Mutex gcmMutex;
+};
+
 class OutputStream: public google::protobuf::io::ZeroCopyOutputStream
 {
 public:
   /// Creates the output file. If EncryptionKey contains no key, the output
-  /// won't be encrypted and iv would be ignored
-  OutputStream( char const * fileName, EncryptionKey const &, void const * iv );
+  /// won't be encrypted and iv would be ignored. In the GCM mode, the iv is
+  /// ignored as well
+  OutputStream( char const * fileName, EncryptionKey const &, void const * iv,
+                Mode = Cbc );
   virtual bool Next( void ** data, int * size );
   virtual void BackUp( int count );
   virtual int64_t ByteCount() const;
@@ -118,6 +234,11 @@ private:
   UnbufferedFile file;
   UnbufferedFile::Offset filePos;
   EncryptionKey const & key;
+  /// Our own copy of the key's encryption context, if there is a key
+  sptr< Encryption::Cipher > cipher;
+  /// Set instead of 'cipher' in the GCM mode
+  sptr< Encryption::GcmCipher > gcm;
+  uint64_t nextSegment;
   char iv[ Encryption::IvSize ];
   std::vector< char > buffer;
   char * start; /// Points to the start of the area currently available for
@@ -128,8 +249,9 @@ private:
   Adler32 adler32;
 
   /// Encrypts and writes 'bytes' bytes from the beginning of the buffer.
-  /// 'bytes' must be non-zero and in multiples of BlockSize
-  void encryptAndWrite( size_t bytes );
+  /// 'bytes' must be non-zero and in multiples of BlockSize, unless in the GCM
+  /// mode, in which 'last' marks the last segment
+  void encryptAndWrite( size_t bytes, bool last = false );
 };
 
 }
@@ -1,11 +1,12 @@
 // Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
 // Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
 
-#include <openssl/aes.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <string.h>
 
 #include "check.hh"
 #include "encryption.hh"
-#include "static_assert.hh"
 
 namespace Encryption {
 
@@ -14,43 +15,83 @@ char const ZeroIv[ IvSize ] = { 0, 0, 0, 0,
                                 0, 0, 0, 0,
                                 0, 0, 0, 0 };
 
-void const * encrypt( void const * iv, void const * keyData,
-                      void const * inData, void * outData, size_t size )
+Cipher::Cipher( void const * key, Direction direction ):
+  ctx( EVP_CIPHER_CTX_new() ), direction( direction )
 {
-  unsigned char block[ BlockSize ];
-
-  CHECK( !( size % BlockSize ), "size of data to encrypt is not a multiple of "
-         "block size" );
+  CHECK( ctx, "can't allocate a cipher context" );
+  CHECK( EVP_CipherInit_ex( ctx, EVP_aes_128_cbc(), NULL,
+                            ( unsigned char const * ) key, NULL,
+                            direction == Encrypt ) == 1,
+         "can't set up the cipher" );
+  // We do the padding ourselves
+  EVP_CIPHER_CTX_set_padding( ctx, 0 );
+}
 
-  AES_KEY key;
-  AES_set_encrypt_key( ( unsigned char const * ) keyData, KeySize * 8, &key );
+Cipher::Cipher( Cipher const & other ):
+  ctx( EVP_CIPHER_CTX_new() ), direction( other.direction )
+{
+  CHECK( ctx, "can't allocate a cipher context" );
+  CHECK( EVP_CIPHER_CTX_copy( ctx, other.ctx ) == 1,
+         "can't copy the cipher context" );
+}
 
-  void const * prev = iv;
+Cipher::~Cipher()
+{
+  // This also clears the key schedule from memory
+  EVP_CIPHER_CTX_free( ctx );
+}
 
-  // We do the operation in block size multiples. We do XOR in size_t
-  // multiples. The operation is endian-neutral
+void Cipher::process( void const * iv, void const * in, void * out,
+                      size_t size )
+{
+  CHECK( !( size % BlockSize ), "size of data to process is not a multiple of "
+         "block size" );
 
-  // Make sure that BlockSize is a multiple of the size of size_t
-  STATIC_ASSERT( !( BlockSize % sizeof( size_t ) ) );
+  // Only the iv is changed, the key schedule stays
+  CHECK( EVP_CipherInit_ex( ctx, NULL, NULL, NULL,
+                            ( unsigned char const * ) iv, -1 ) == 1,
+         "can't set the iv" );
 
-  size_t const * inS = ( size_t const * ) inData;
-  unsigned char * out = ( unsigned char * ) outData;
+  unsigned char const * inP = ( unsigned char const * ) in;
+  unsigned char * outP = ( unsigned char * ) out;
 
-  for ( size_t count = size / BlockSize; count--; )
+  // EVP takes int sizes
+  while ( size )
   {
-    size_t const * prevS = ( size_t const * ) prev;
-    size_t * blockS = ( size_t * ) block;
+    int chunk = size > 0x40000000 ? 0x40000000 : size;
+    int done;
+    CHECK( EVP_CipherUpdate( ctx, outP, &done, inP, chunk ) == 1 &&
+           done == chunk, "cipher operation failed" );
+    inP += chunk;
+    outP += chunk;
+    size -= chunk;
+  }
+}
 
-    for ( size_t x = BlockSize / sizeof( size_t ); x--; )
-      *blockS++ = *inS++ ^ *prevS++;
+void const * encrypt( void const * iv, Cipher & cipher, void const * in,
+                      void * out, size_t size )
+{
+  CHECK( cipher.direction == Cipher::Encrypt, "decryption context used to "
+         "encrypt" );
+  cipher.process( iv, in, out, size );
 
-    AES_encrypt( block, out, &key );
+  // The IV to continue with is the last encrypted block
+  return size ? ( char const * ) out + size - BlockSize : iv;
+}
 
-    prev = out;
-    out += BlockSize;
-  }
+void decrypt( void const * iv, Cipher & cipher, void const * in, void * out,
+              size_t size )
+{
+  CHECK( cipher.direction == Cipher::Decrypt, "encryption context used to "
+         "decrypt" );
+  cipher.process( iv, in, out, size );
+}
 
-  return prev;
+void const * encrypt( void const * iv, void const * keyData,
+                      void const * inData, void * outData, size_t size )
+{
+  Cipher cipher( keyData, Cipher::Encrypt );
+  return encrypt( iv, cipher, inData, outData, size );
 }
 
 void const * getNextDecryptionIv( void const * in, size_t size )
@@ -63,35 +104,90 @@ void const * getNextDecryptionIv( void const * in, size_t size )
 void decrypt( void const * iv, void const * keyData, void const * inData,
               void * outData, size_t size )
 {
-  CHECK( !( size % BlockSize ), "size of data to decrypt is not a multiple of "
-         "block size" );
+  Cipher cipher( keyData, Cipher::Decrypt );
+  decrypt( iv, cipher, inData, outData, size );
+}
 
-  AES_KEY key;
-  AES_set_decrypt_key( ( unsigned char const * ) keyData, KeySize * 8, &key );
+char const GcmMagic[ GcmMagicSize ] = { 'Z', 'B', 'a', 'c', 'k', 'u', 'p', '-',
+                                        'A', 'E', 'S', 'G', 'C', 'M', '0', '1' };
 
-  // We decrypt from the end to the beginning
+GcmCipher::GcmCipher( void const * key, void const * salt,
+                      Cipher::Direction direction ):
+  ctx( EVP_CIPHER_CTX_new() ), direction( direction )
+{
+  CHECK( ctx, "can't allocate a cipher context" );
 
-  unsigned char const * in = ( unsigned char const * ) inData + size;
-  unsigned char * out = ( unsigned char * ) outData + size;
+  unsigned char fileKey[ EVP_MAX_MD_SIZE ];
+  unsigned fileKeySize;
+  CHECK( HMAC( EVP_sha256(), key, KeySize, ( unsigned char const * ) salt,
+               GcmSaltSize, fileKey, &fileKeySize ) &&
+         fileKeySize >= KeySize, "file key derivation failed" );
 
-  size_t count = size / BlockSize;
+  CHECK( EVP_CipherInit_ex( ctx, EVP_aes_128_gcm(), NULL, fileKey, NULL,
+                            direction == Cipher::Encrypt ) == 1,
+         "can't set up the cipher" );
 
-  size_t const * prevS = ( size_t const * )( in - BlockSize );
+  memset( fileKey, 0, sizeof( fileKey ) );
+}
 
-  size_t * outS = ( size_t * ) out;
+GcmCipher::~GcmCipher()
+{
+  EVP_CIPHER_CTX_free( ctx );
+}
 
-  while( count-- )
-  {
-    if ( prevS == inData )
-      prevS = ( size_t const * )( ( unsigned char const * ) iv + BlockSize );
+void GcmCipher::process( uint64_t index, bool last, void * data, size_t size )
+{
+  // The default 96-bit nonce, with the big-endian segment index in its first
+  // 64 bits
+  unsigned char nonce[ 12 ];
+  memset( nonce, 0, sizeof( nonce ) );
+  for ( int x = 8; x--; index >>= 8 )
+    nonce[ x ] = index & 0xFF;
+
+  CHECK( EVP_CipherInit_ex( ctx, NULL, NULL, NULL, nonce, -1 ) == 1,
+         "can't set the nonce" );
+
+  unsigned char lastFlag = last;
+  int done;
+  CHECK( EVP_CipherUpdate( ctx, NULL, &done, &lastFlag, 1 ) == 1,
+         "cipher operation failed" );
+
+  CHECK( size <= 0x40000000, "segment is too large" );
+  if ( size )
+    CHECK( EVP_CipherUpdate( ctx, ( unsigned char * ) data, &done,
+                             ( unsigned char const * ) data, size ) == 1 &&
+           done == ( int ) size, "cipher operation failed" );
+}
 
-    in -= BlockSize;
+void GcmCipher::encrypt( uint64_t index, bool last, void * data, size_t size,
+                         void * tag )
+{
+  CHECK( direction == Cipher::Encrypt, "decryption context used to encrypt" );
 
-    AES_decrypt( in, ( unsigned char * ) outS - BlockSize, &key );
+  process( index, last, data, size );
 
-    for ( size_t x = BlockSize / sizeof( size_t ); x--; )
-      *--outS ^= *--prevS;
-  }
+  unsigned char final[ BlockSize ];
+  int done;
+  CHECK( EVP_CipherFinal_ex( ctx, final, &done ) == 1 &&
+         EVP_CIPHER_CTX_ctrl( ctx, EVP_CTRL_GCM_GET_TAG, GcmTagSize,
+                              tag ) == 1,
+         "cipher operation failed" );
+}
+
+bool GcmCipher::decrypt( uint64_t index, bool last, void * data, size_t size,
+                         void const * tag )
+{
+  CHECK( direction == Cipher::Decrypt, "encryption context used to decrypt" );
+
+  process( index, last, data, size );
+
+  unsigned char final[ BlockSize ];
+  int done;
+  CHECK( EVP_CIPHER_CTX_ctrl( ctx, EVP_CTRL_GCM_SET_TAG, GcmTagSize,
+                              ( void * ) tag ) == 1,
+         "can't set the tag" );
+
+  return EVP_CipherFinal_ex( ctx, final, &done ) == 1;
 }
 
 void pad( void * data, size_t size )
@@ -5,11 +5,15 @@
 #define ENCRYPTION_HH_INCLUDED
 
 #include <stddef.h>
+#include <stdint.h>
 #include <exception>
 
 #include "ex.hh"
 
-/// What we implement right now is AES-128 in CBC mode with PKCS#7 padding
+struct evp_cipher_ctx_st;
+
+/// What we implement right now is AES-128 in CBC mode with PKCS#7 padding, and
+/// AES-128 in GCM mode for files split into separately authenticated segments
 namespace Encryption {
 
 enum
@@ -21,6 +25,52 @@ enum
 
 DEF_EX( exBadPadding, "Bad padding encountered", std::exception )
 
+/// A CBC encryption or decryption context for a particular key, with the key
+/// schedule set up already. Setting the key up is costly compared to
+/// processing a page of data, so it is done once per key and the contexts
+/// for the streams are copied from there. A single context can't be used by
+/// several threads at once, but different copies can
+class Cipher
+{
+public:
+  enum Direction
+  {
+    Encrypt,
+    Decrypt
+  };
+
+  /// 'key' points to KeySize bytes of the key data
+  Cipher( void const * key, Direction );
+  Cipher( Cipher const & );
+  ~Cipher();
+
+  Direction getDirection() const
+  { return direction; }
+
+private:
+  Cipher & operator = ( Cipher const & );
+
+  friend void const * encrypt( void const *, Cipher &, void const *, void *,
+                               size_t );
+  friend void decrypt( void const *, Cipher &, void const *, void *, size_t );
+
+  /// Processes 'size' bytes starting a new CBC chain with the given iv
+  void process( void const * iv, void const * in, void * out, size_t size );
+
+  evp_cipher_ctx_st * ctx;
+  Direction direction;
+};
+
+/// Same as the encrypt() below, but uses the key schedule set up in 'cipher'
+/// already. This is the one to use for bulk data
+void const * encrypt( void const * iv, Cipher & cipher, void const * in,
+                      void * out, size_t size );
+
+/// Same as the decrypt() below, but uses the key schedule set up in 'cipher'
+/// already. This is the one to use for bulk data
+void decrypt( void const * iv, Cipher & cipher, void const * in, void * out,
+              size_t size );
+
 /// Encrypts 'size' bytes of the data pointed to by 'in', outputting 'size'
 /// bytes to 'out'. 'key' points to KeySize bytes of the key data. 'iv' points
 /// to IvSize bytes used as an initialization vector. 'in' and 'out' can be the
@@ -41,6 +91,52 @@ void const * getNextDecryptionIv( void const * in, size_t size );
 void decrypt( void const * iv, void const * key, void const * in, void * out,
               size_t size );
 
+enum
+{
+  GcmMagicSize = 16, /// Size of the magic GCM files start with
+  GcmSaltSize = 16, /// Size of the salt following the magic
+  GcmTagSize = 16 /// Size of the authentication tag of each segment
+};
+
+/// The bytes files encrypted in the GCM mode start with. A CBC file starts
+/// with a random block, so the chance of it starting the same way is 2^-128
+extern char const GcmMagic[ GcmMagicSize ];
+
+/// AES-128 in GCM mode, for files split into segments encrypted and
+/// authenticated separately. Each file gets its own key, derived from the
+/// repository key and a random salt stored in the file. The nonce of a
+/// segment is its index, and the last segment is marked as such in its
+/// additional data, so segments can't be reordered or dropped, nor the file
+/// truncated, without failing the authentication
+class GcmCipher
+{
+public:
+  /// 'key' points to KeySize bytes of the key data, 'salt' to GcmSaltSize
+  /// bytes of the salt of the file
+  GcmCipher( void const * key, void const * salt, Cipher::Direction );
+  ~GcmCipher();
+
+  /// Encrypts the segment in place, storing GcmTagSize bytes of its tag
+  /// to 'tag'
+  void encrypt( uint64_t index, bool last, void * data, size_t size,
+                void * tag );
+
+  /// Decrypts the segment in place. Returns false if the segment fails the
+  /// authentication, in which case the data should be discarded
+  bool decrypt( uint64_t index, bool last, void * data, size_t size,
+                void const * tag );
+
+private:
+  GcmCipher( GcmCipher const & );
+  GcmCipher & operator = ( GcmCipher const & );
+
+  /// Sets up the context for the given segment and processes the data
+  void process( uint64_t index, bool last, void * data, size_t size );
+
+  evp_cipher_ctx_st * ctx;
+  Cipher::Direction direction;
+};
+
 /// Pads the last block to be encrypted, pointed to by 'data', 'size' bytes,
 /// which should be less than BlockSize, to occupy BlockSize bytes
 void pad( void * data, size_t size );
@@ -56,6 +56,9 @@ EncryptionKey::EncryptionKey( string const & password,
     if ( calculateKeyHmac( key, sizeof( key ), info->key_check_input() ) !=
          info->key_check_hmac() )
       throw exInvalidPassword();
+
+    encryptor = new Encryption::Cipher( key, Encryption::Cipher::Encrypt );
+    decryptor = new Encryption::Cipher( key, Encryption::Cipher::Decrypt );
   }
 }
 
@@ -7,7 +7,9 @@
 #include <exception>
 #include <string>
 
+#include "encryption.hh"
 #include "ex.hh"
+#include "sptr.hh"
 #include "zbackup.pb.h"
 
 using std::string;
@@ -17,6 +19,8 @@ class EncryptionKey
   bool isSet;
   unsigned const static KeySize = 16; // TODO: make this configurable
   char key[ KeySize ];
+  /// Contexts with the key schedules set up, to be copied by the users
+  sptr< Encryption::Cipher > encryptor, decryptor;
 
 public:
   DEF_EX( exInvalidPassword, "Invalid password specified", std::exception )
@@ -36,6 +40,14 @@ public:
   void const * getKey() const
   { return key; }
 
+  /// Returns the encryption and decryption contexts for the key. Check if
+  /// there is one with hasKey() first. Copy them to use them, so they can
+  /// be shared by several threads
+  Encryption::Cipher const & getEncryptor() const
+  { return *encryptor; }
+  Encryption::Cipher const & getDecryptor() const
+  { return *decryptor; }
+
   /// Returns key size, in bytes
   unsigned getKeySize() const
   { return sizeof( key ); }
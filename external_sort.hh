@@ -0,0 +1,239 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef EXTERNAL_SORT_HH_INCLUDED
+#define EXTERNAL_SORT_HH_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include "encrypted_file.hh"
+#include "encryption.hh"
+#include "encryption_key.hh"
+#include "nocopy.hh"
+#include "sptr.hh"
+#include "tmp_mgr.hh"
+
+/// Sorts records which may not fit in memory. The records are collected into a
+/// buffer of the given size, which is sorted and spilled to a temporary file
+/// each time it gets full. Reading the records back merges the spilled runs.
+/// The records must be plain structures ordered by operator <. The runs are
+/// encrypted with the given key, since the records may reveal what the
+/// storage holds. If nothing had to be spilled, everything stays in memory
+template< class T >
+class ExternalSorter: NoCopy
+{
+public:
+  ExternalSorter( TmpMgr & tmpMgr, EncryptionKey const & key, size_t bufferSize ):
+    tmpMgr( tmpMgr ), key( key ),
+    bufferLimit( bufferSize > sizeof( T ) ? bufferSize / sizeof( T ) : 1 ),
+    total( 0 ), position( 0 )
+  {
+  }
+
+  void add( T const & record )
+  {
+    if ( buffer.empty() )
+      buffer.reserve( bufferLimit );
+
+    buffer.push_back( record );
+    ++total;
+
+    if ( buffer.size() >= bufferLimit )
+      spill();
+  }
+
+  /// Returns the number of records added
+  uint64_t size() const
+  { return total; }
+
+  /// Must be called once all the records are added and before reading them
+  void finish()
+  {
+    if ( runs.empty() )
+    {
+      std::sort( buffer.begin(), buffer.end() );
+      return;
+    }
+
+    if ( !buffer.empty() )
+      spill();
+    std::vector< T >().swap( buffer );
+
+    // Each run being merged needs an input buffer, so merge them in groups
+    // until few enough are left
+    while ( runs.size() > MaxRunsMerged )
+    {
+      Merger merger( key, runs.begin(), runs.begin() + MaxRunsMerged );
+      Run run = writeRun( merger, merger.size() );
+      runs.erase( runs.begin(), runs.begin() + MaxRunsMerged );
+      runs.push_back( run );
+    }
+
+    merger = new Merger( key, runs.begin(), runs.end() );
+  }
+
+  /// Fetches the next record in the sorted order. Returns false once there
+  /// are no more. Duplicate records are all returned
+  bool next( T & record )
+  {
+    if ( merger.get() )
+      return merger->next( record );
+
+    if ( position == buffer.size() )
+      return false;
+
+    record = buffer[ position++ ];
+    return true;
+  }
+
+private:
+  enum
+  {
+    MaxRunsMerged = 64
+  };
+
+  struct Run
+  {
+    sptr< TemporaryFile > file;
+    uint64_t size;
+  };
+
+  typedef typename std::vector< Run >::const_iterator RunIterator;
+
+  /// Merges the given sorted runs
+  class Merger: NoCopy
+  {
+  public:
+    Merger( EncryptionKey const & key, RunIterator begin, RunIterator end ):
+      total( 0 )
+    {
+      for ( ; begin != end; ++begin )
+      {
+        Source source;
+        source.stream = new EncryptedFile::InputStream(
+          begin->file->getFileName().c_str(), key, Encryption::ZeroIv );
+        source.stream->consumeRandomIv();
+        source.left = begin->size;
+        total += begin->size;
+        sources.push_back( source );
+
+        fetch( sources.size() - 1 );
+      }
+    }
+
+    uint64_t size() const
+    { return total; }
+
+    bool next( T & record )
+    {
+      if ( heads.empty() )
+        return false;
+
+      record = heads.top().first;
+      size_t source = heads.top().second;
+      heads.pop();
+      fetch( source );
+
+      return true;
+    }
+
+  private:
+    struct Source
+    {
+      sptr< EncryptedFile::InputStream > stream;
+      uint64_t left;
+    };
+
+    /// Puts the next record of the source into the heap, if it has one
+    void fetch( size_t source )
+    {
+      if ( !sources[ source ].left )
+      {
+        sources[ source ].stream.reset();
+        return;
+      }
+
+      std::pair< T, size_t > head;
+      sources[ source ].stream->read( &head.first, sizeof( head.first ) );
+      --sources[ source ].left;
+      head.second = source;
+      heads.push( head );
+    }
+
+    struct Greater
+    {
+      bool operator()( std::pair< T, size_t > const & x,
+                       std::pair< T, size_t > const & y ) const
+      { return y.first < x.first; }
+    };
+
+    std::vector< Source > sources;
+    std::priority_queue< std::pair< T, size_t >,
+                         std::vector< std::pair< T, size_t > >, Greater > heads;
+    uint64_t total;
+  };
+
+  /// Reads the records from the in-memory buffer
+  struct BufferReader
+  {
+    std::vector< T > const & buffer;
+    size_t position;
+
+    BufferReader( std::vector< T > const & buffer ):
+      buffer( buffer ), position( 0 ) {}
+
+    bool next( T & record )
+    {
+      if ( position == buffer.size() )
+        return false;
+      record = buffer[ position++ ];
+      return true;
+    }
+  };
+
+  void spill()
+  {
+    std::sort( buffer.begin(), buffer.end() );
+
+    BufferReader reader( buffer );
+    runs.push_back( writeRun( reader, buffer.size() ) );
+    buffer.clear();
+  }
+
+  template< class Reader >
+  Run writeRun( Reader & reader, uint64_t size )
+  {
+    Run run;
+    run.file = tmpMgr.makeTemporaryFile();
+    run.size = size;
+
+    EncryptedFile::OutputStream os( run.file->getFileName().c_str(), key,
+                                    Encryption::ZeroIv );
+    os.writeRandomIv();
+
+    T record;
+    while ( reader.next( record ) )
+      os.write( &record, sizeof( record ) );
+
+    return run;
+  }
+
+  TmpMgr & tmpMgr;
+  EncryptionKey const & key;
+  size_t bufferLimit;
+  uint64_t total;
+
+  std::vector< T > buffer;
+  size_t position;
+
+  std::vector< Run > runs;
+  sptr< Merger > merger;
+};
+
+#endif
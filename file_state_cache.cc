@@ -0,0 +1,125 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <sys/stat.h>
+
+#include "file_state_cache.hh"
+
+#include "encrypted_file.hh"
+#include "encryption.hh"
+#include "message.hh"
+
+namespace {
+
+enum
+{
+  FileFormatVersion = 1
+};
+
+int64_t toNanoseconds( struct timespec const & time )
+{
+  return int64_t( time.tv_sec ) * 1000000000 + time.tv_nsec;
+}
+
+}
+
+void FileStateCache::getState( string const & fileName, FileState & state )
+{
+  struct stat st;
+  if ( stat( fileName.c_str(), &st ) != 0 )
+    throw exCantStat( fileName );
+
+  state.set_device( st.st_dev );
+  state.set_inode( st.st_ino );
+  state.set_size( st.st_size );
+#if defined( __APPLE__ )
+  state.set_mtime( toNanoseconds( st.st_mtimespec ) );
+  state.set_ctime( toNanoseconds( st.st_ctimespec ) );
+#else
+  state.set_mtime( toNanoseconds( st.st_mtim ) );
+  state.set_ctime( toNanoseconds( st.st_ctim ) );
+#endif
+}
+
+void FileStateCache::load( string const & fileName,
+                           EncryptionKey const & encryptionKey )
+{
+  clear();
+
+  EncryptedFile::InputStream is( fileName.c_str(), encryptionKey,
+                                 Encryption::ZeroIv );
+  is.consumeRandomIv();
+
+  FileHeader header;
+  Message::parse( header, is );
+  if ( header.version() != FileFormatVersion )
+    throw exUnsupportedVersion();
+
+  FileStateCacheInfo info;
+  Message::parse( info, is );
+
+  FileState state;
+  for ( uint64_t left = info.entry_count(); left--; )
+  {
+    Message::parse( state, is );
+    states[ state.path() ].Swap( &state );
+  }
+
+  is.checkAdler32();
+}
+
+void FileStateCache::save( string const & fileName,
+                           EncryptionKey const & encryptionKey ) const
+{
+  EncryptedFile::OutputStream os( fileName.c_str(), encryptionKey,
+                                  Encryption::ZeroIv );
+  os.writeRandomIv();
+
+  FileHeader header;
+  header.set_version( FileFormatVersion );
+  Message::serialize( header, os );
+
+  FileStateCacheInfo info;
+  info.set_entry_count( states.size() );
+  Message::serialize( info, os );
+
+  for ( States::const_iterator i = states.begin(); i != states.end(); ++i )
+    Message::serialize( i->second, os );
+
+  os.writeAdler32();
+}
+
+BackupInfo const * FileStateCache::find( string const & path,
+                                         FileState const & state ) const
+{
+  States::const_iterator i = states.find( path );
+  if ( i == states.end() )
+    return NULL;
+
+  FileState const & cached = i->second;
+  if ( cached.device() != state.device() || cached.inode() != state.inode() ||
+       cached.size() != state.size() || cached.mtime() != state.mtime() ||
+       cached.ctime() != state.ctime() || !cached.has_backup_info() )
+    return NULL;
+
+  return &cached.backup_info();
+}
+
+void FileStateCache::record( string const & path, FileState const & state,
+                             BackupInfo const & backupInfo )
+{
+  FileState & recorded = states[ path ];
+
+  recorded.set_path( path );
+  recorded.set_device( state.device() );
+  recorded.set_inode( state.inode() );
+  recorded.set_size( state.size() );
+  recorded.set_mtime( state.mtime() );
+  recorded.set_ctime( state.ctime() );
+  recorded.mutable_backup_info()->CopyFrom( backupInfo );
+}
+
+void FileStateCache::clear()
+{
+  states.clear();
+}
@@ -0,0 +1,55 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef FILE_STATE_CACHE_HH_INCLUDED
+#define FILE_STATE_CACHE_HH_INCLUDED
+
+#include <exception>
+#include <map>
+#include <string>
+
+#include "encryption_key.hh"
+#include "ex.hh"
+#include "zbackup.pb.h"
+
+using std::string;
+
+/// The states of the files of an input directory as of their last backups,
+/// along with the backups made. A file whose size, inode, modification and
+/// change times are all still the same is taken to be unchanged, so its
+/// previous backup can be written again without reading the file
+class FileStateCache
+{
+public:
+  DEF_EX( Ex, "File state cache exception", std::exception )
+  DEF_EX( exUnsupportedVersion, "Unsupported version of the file state cache format", Ex )
+  DEF_EX_STR( exCantStat, "Can't get the state of file", Ex )
+
+  /// Gets the current state of the given file, leaving the path as it is
+  static void getState( string const & fileName, FileState & );
+
+  /// Loads the states from the given file, replacing the current ones
+  void load( string const & fileName, EncryptionKey const & );
+
+  /// Saves the states recorded into the given file
+  void save( string const & fileName, EncryptionKey const & ) const;
+
+  /// Returns the backup previously made of the file at the given path if the
+  /// file is still in the given state, or NULL otherwise
+  BackupInfo const * find( string const & path, FileState const & ) const;
+
+  /// Records the state of the file at the given path and the backup made of
+  /// it, replacing the previous record. The backup info must not be one
+  /// returned by find() on the same cache
+  void record( string const & path, FileState const &, BackupInfo const & );
+
+  /// Forgets all the states
+  void clear();
+
+private:
+  typedef std::map< string, FileState > States;
+
+  States states;
+};
+
+#endif
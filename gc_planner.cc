@@ -0,0 +1,91 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <algorithm>
+
+#include "gc_planner.hh"
+
+GcPlanner::GcPlanner( unsigned threshold, uint64_t budget ):
+  threshold( threshold ), budget( budget ),
+  removedBundles( 0 ), removedBytes( 0 ),
+  repackedBundles( 0 ), repackedBytes( 0 ), repackCost( 0 ),
+  keptBundles( 0 ), keptBytes( 0 )
+{
+}
+
+uint64_t GcPlanner::Candidate::getUsedSize() const
+{
+  return totalBytes ? ( double ) fileSize * usedBytes / totalBytes : 0;
+}
+
+bool GcPlanner::Candidate::operator < ( Candidate const & other ) const
+{
+  // Compares usedBytes / totalBytes without dividing
+  return ( double ) usedBytes * other.totalBytes <
+         ( double ) other.usedBytes * totalBytes;
+}
+
+void GcPlanner::addBundle( Bundle::Id const & id, uint64_t usedBytes,
+                           uint64_t totalBytes, uint64_t fileSize )
+{
+  if ( !usedBytes )
+  {
+    ++removedBundles;
+    removedBytes += fileSize;
+    return;
+  }
+
+  Candidate candidate;
+  candidate.id = id;
+  candidate.usedBytes = usedBytes;
+  candidate.totalBytes = totalBytes;
+  candidate.fileSize = fileSize;
+  candidates.push_back( candidate );
+}
+
+void GcPlanner::plan()
+{
+  std::sort( candidates.begin(), candidates.end() );
+
+  for ( size_t x = 0; x < candidates.size(); ++x )
+  {
+    Candidate const & c = candidates[ x ];
+    uint64_t reclaimed = c.fileSize - c.getUsedSize();
+    uint64_t cost = c.fileSize + c.getUsedSize();
+
+    if ( c.usedBytes * 100 < c.totalBytes * threshold &&
+         ( !budget || repackCost + cost <= budget ) )
+    {
+      toRepack.insert( c.id );
+      ++repackedBundles;
+      repackedBytes += reclaimed;
+      repackCost += cost;
+    }
+    else
+    {
+      ++keptBundles;
+      keptBytes += reclaimed;
+    }
+  }
+
+  std::vector< Candidate >().swap( candidates );
+}
+
+bool GcPlanner::shouldRepack( Bundle::Id const & id ) const
+{
+  return toRepack.find( id ) != toRepack.end();
+}
+
+void GcPlanner::print( FILE * f ) const
+{
+  fprintf( f, "Bundles to remove: %llu, reclaiming %llu bytes without "
+           "rewriting anything\n", ( unsigned long long ) removedBundles,
+           ( unsigned long long ) removedBytes );
+  fprintf( f, "Bundles to repack: %llu, reclaiming about %llu bytes for about "
+           "%llu bytes of I/O\n", ( unsigned long long ) repackedBundles,
+           ( unsigned long long ) repackedBytes,
+           ( unsigned long long ) repackCost );
+  fprintf( f, "Bundles left as they are: %llu, holding about %llu bytes of "
+           "unused chunks\n", ( unsigned long long ) keptBundles,
+           ( unsigned long long ) keptBytes );
+}
@@ -0,0 +1,62 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef GC_PLANNER_HH_INCLUDED
+#define GC_PLANNER_HH_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+#include <set>
+#include <vector>
+
+#include "bundle.hh"
+
+/// Decides which of the bundles holding unused chunks are worth repacking.
+/// Bundles with no used chunks left are simply removed. The others are only
+/// repacked if their used chunks make up less than the threshold percentage
+/// of their data, the least used ones first, until the I/O budget is spent.
+/// Repacking a bundle costs reading its file and writing its used part, which
+/// is assumed to compress as well as the whole bundle did
+class GcPlanner
+{
+public:
+  /// Zero budget means no limit
+  GcPlanner( unsigned threshold, uint64_t budget );
+
+  /// Adds a bundle holding unused chunks. The bytes are the uncompressed
+  /// sizes of the chunks
+  void addBundle( Bundle::Id const &, uint64_t usedBytes, uint64_t totalBytes,
+                  uint64_t fileSize );
+
+  /// Picks the bundles to repack. Must be called once all were added
+  void plan();
+
+  bool shouldRepack( Bundle::Id const & ) const;
+
+  /// Prints how much would be reclaimed and at which cost
+  void print( FILE * ) const;
+
+private:
+  struct Candidate
+  {
+    Bundle::Id id;
+    uint64_t usedBytes, totalBytes, fileSize;
+
+    /// Compressed size of the used chunks
+    uint64_t getUsedSize() const;
+
+    bool operator < ( Candidate const & ) const;
+  };
+
+  unsigned threshold;
+  uint64_t budget;
+
+  std::vector< Candidate > candidates;
+  std::set< Bundle::Id > toRepack;
+
+  uint64_t removedBundles, removedBytes;
+  uint64_t repackedBundles, repackedBytes, repackCost;
+  uint64_t keptBundles, keptBytes;
+};
+
+#endif
@@ -0,0 +1,156 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <string.h>
+#include <vector>
+
+#include "gc_state.hh"
+
+#include "encrypted_file.hh"
+#include "encryption.hh"
+#include "endian.hh"
+#include "message.hh"
+#include "zbackup.pb.h"
+
+enum
+{
+  FileFormatVersion = 1,
+  RecordSize = ChunkId::BlobSize + sizeof( uint32_t )
+};
+
+void GcState::load( string const & fileName,
+                    EncryptionKey const & encryptionKey )
+{
+  clear();
+
+  EncryptedFile::InputStream is( fileName.c_str(), encryptionKey,
+                                 Encryption::ZeroIv );
+  is.consumeRandomIv();
+
+  FileHeader header;
+  Message::parse( header, is );
+  if ( header.version() != FileFormatVersion )
+    throw exUnsupportedVersion();
+
+  GcStateInfo info;
+  Message::parse( info, is );
+
+  for ( int x = 0; x < info.backup_hash_size(); ++x )
+    backups.insert( info.backup_hash( x ) );
+
+  // The shards are about even, as the ids are hashes
+  for ( size_t x = 0; x < Shards; ++x )
+    refCounts[ x ].reserve( info.chunk_count() / Shards * 9 / 8 );
+
+  char record[ RecordSize ];
+  ChunkId id;
+  for ( uint64_t left = info.chunk_count(); left--; )
+  {
+    is.read( record, sizeof( record ) );
+    id.setFromBlob( record );
+
+    uint32_t count;
+    memcpy( &count, record + ChunkId::BlobSize, sizeof( count ) );
+    refCounts[ getShard( id ) ].add( id, fromLittleEndian( count ) );
+  }
+
+  is.checkAdler32();
+}
+
+void GcState::save( string const & fileName,
+                    EncryptionKey const & encryptionKey ) const
+{
+  EncryptedFile::OutputStream os( fileName.c_str(), encryptionKey,
+                                  Encryption::ZeroIv );
+  os.writeRandomIv();
+
+  FileHeader header;
+  header.set_version( FileFormatVersion );
+  Message::serialize( header, os );
+
+  GcStateInfo info;
+  for ( Backups::const_iterator i = backups.begin(); i != backups.end(); ++i )
+    info.add_backup_hash( *i );
+  uint64_t chunkCount = 0;
+  for ( size_t x = 0; x < Shards; ++x )
+    chunkCount += refCounts[ x ].size();
+  info.set_chunk_count( chunkCount );
+  Message::serialize( info, os );
+
+  // The records are written in no particular order
+  char record[ RecordSize ];
+  for ( size_t x = 0; x < Shards; ++x )
+    for ( ChunkIdCounts::const_iterator i = refCounts[ x ].begin();
+          i != refCounts[ x ].end(); ++i )
+    {
+      i->id.toBlob( record );
+
+      uint32_t count = toLittleEndian( i->count );
+      memcpy( record + ChunkId::BlobSize, &count, sizeof( count ) );
+      os.write( record, sizeof( record ) );
+    }
+
+  os.writeAdler32();
+}
+
+void GcState::clear()
+{
+  backups.clear();
+  for ( size_t x = 0; x < Shards; ++x )
+    refCounts[ x ].clear();
+}
+
+bool GcState::hasBackup( string const & backupHash ) const
+{
+  Lock _( backupsMutex );
+  return backups.find( backupHash ) != backups.end();
+}
+
+void GcState::addBackup( string const & backupHash,
+                         BackupRestorer::ChunkSet const & chunkSet )
+{
+  {
+    Lock _( backupsMutex );
+    if ( !backups.insert( backupHash ).second )
+      return;
+  }
+
+  // Group the ids by their shards, so each shard is only locked once
+  std::vector< size_t > offsets( Shards + 1, 0 );
+  for ( BackupRestorer::ChunkSet::const_iterator i = chunkSet.begin();
+        i != chunkSet.end(); ++i )
+    ++offsets[ getShard( *i ) + 1 ];
+  for ( size_t x = 1; x <= Shards; ++x )
+    offsets[ x ] += offsets[ x - 1 ];
+
+  std::vector< ChunkId > ids( chunkSet.size() );
+  std::vector< size_t > next( offsets.begin(), offsets.end() - 1 );
+  for ( BackupRestorer::ChunkSet::const_iterator i = chunkSet.begin();
+        i != chunkSet.end(); ++i )
+    ids[ next[ getShard( *i ) ]++ ] = *i;
+
+  // Start at a shard depending on the backup, so the threads adding backups
+  // at once mostly lock different ones
+  size_t first = backupHash.empty() ? 0 :
+    ( unsigned char ) backupHash[ 0 ] % Shards;
+
+  for ( size_t x = 0; x < Shards; ++x )
+  {
+    size_t shard = ( first + x ) % Shards;
+    Lock _( shardMutexes[ shard ] );
+    for ( size_t y = offsets[ shard ]; y < offsets[ shard + 1 ]; ++y )
+      refCounts[ shard ].add( ids[ y ] );
+  }
+}
+
+void GcState::removeBackup( string const & backupHash,
+                            BackupRestorer::ChunkSet const & chunkSet )
+{
+  if ( !backups.erase( backupHash ) )
+    return;
+
+  for ( BackupRestorer::ChunkSet::const_iterator i = chunkSet.begin();
+        i != chunkSet.end(); ++i )
+    if ( !refCounts[ getShard( *i ) ].release( *i ) )
+      throw exInconsistent();
+}
@@ -0,0 +1,82 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef GC_STATE_HH_INCLUDED
+#define GC_STATE_HH_INCLUDED
+
+#include <stdint.h>
+#include <exception>
+#include <set>
+#include <string>
+
+#include "backup_restorer.hh"
+#include "chunk_id.hh"
+#include "chunk_id_set.hh"
+#include "encryption_key.hh"
+#include "ex.hh"
+#include "mt.hh"
+#include "nocopy.hh"
+
+using std::string;
+
+/// Reference counts of the chunks used by the backups, kept between the
+/// garbage collections. Each backup is identified by its hash, and each chunk
+/// is counted once per backup using it. A collection then only has to account
+/// for the backups added and removed since the previous one. Backups may be
+/// added from several threads at once, and nothing else may happen meanwhile
+class GcState: NoCopy
+{
+public:
+  DEF_EX( Ex, "Garbage collector state exception", std::exception )
+  DEF_EX( exUnsupportedVersion, "Unsupported version of the garbage collector state format", Ex )
+  DEF_EX( exInconsistent, "The garbage collector state doesn't match the backups removed", Ex )
+
+  typedef std::set< string > Backups;
+
+  /// Loads the state from the given file, replacing the current one
+  void load( string const & fileName, EncryptionKey const & );
+
+  /// Saves the state into the given file
+  void save( string const & fileName, EncryptionKey const & ) const;
+
+  /// Forgets all the backups and the chunks
+  void clear();
+
+  bool hasBackup( string const & backupHash ) const;
+
+  Backups const & getBackups() const
+  { return backups; }
+
+  /// Accounts for a new backup using the given chunks. Thread-safe
+  void addBackup( string const & backupHash, BackupRestorer::ChunkSet const & );
+
+  /// Releases the chunks of a backup which is gone. Throws exInconsistent if
+  /// the chunks weren't accounted for, in which case the state should be
+  /// rebuilt
+  void removeBackup( string const & backupHash,
+                     BackupRestorer::ChunkSet const & );
+
+  /// Returns true if any of the backups uses the chunk
+  bool isUsed( ChunkId const & id ) const
+  { return refCounts[ getShard( id ) ].get( id ); }
+
+private:
+  enum
+  {
+    Shards = 64
+  };
+
+  static size_t getShard( ChunkId const & id )
+  { return ( unsigned char ) id.cryptoHash[ sizeof( id.cryptoHash ) - 1 ] %
+      Shards; }
+
+  Backups backups;
+  mutable Mutex backupsMutex; /// Guards 'backups' while adding
+
+  /// The counts are split by the ids into shards, each with a lock of its
+  /// own, so the threads adding backups at once rarely wait for each other
+  ChunkIdCounts refCounts[ Shards ];
+  Mutex shardMutexes[ Shards ];
+};
+
+#endif
@@ -15,8 +15,9 @@ enum
   FileFormatVersion = 1
 };
 
-Writer::Writer( EncryptionKey const & key, string const & fileName ):
-  stream( fileName.c_str(), key, Encryption::ZeroIv )
+Writer::Writer( EncryptionKey const & key, string const & fileName,
+                EncryptedFile::Mode mode ):
+  stream( fileName.c_str(), key, Encryption::ZeroIv, mode )
 {
   stream.writeRandomIv();
   FileHeader header;
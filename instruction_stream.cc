@@ -0,0 +1,438 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <string.h>
+
+#include "instruction_stream.hh"
+
+using google::protobuf::io::ZeroCopyInputStream;
+
+namespace {
+
+/// The kinds of the compact records
+enum
+{
+  NewChunks = 0,
+  ChunkRun = 1,
+  Bytes = 2
+};
+
+/// The protobuf wire format of BackupInstruction, as the legacy format has it
+enum
+{
+  WireVarint = 0,
+  WireFixed64 = 1,
+  WireLengthDelimited = 2,
+  WireFixed32 = 5,
+
+  ChunkToEmitTag = ( 1 << 3 ) | WireLengthDelimited,
+  BytesToEmitTag = ( 2 << 3 ) | WireLengthDelimited
+};
+
+}
+
+ChunkOrdinals::ChunkOrdinals( vector< ChunkId > & chunks ): chunks( chunks ),
+  slots( 1024, uint32_t( Empty ) ), mask( 1023 )
+{
+}
+
+size_t ChunkOrdinals::findSlot( ChunkId const & id ) const
+{
+  size_t slot = id.rollingHash & mask;
+  while ( slots[ slot ] != Empty &&
+          memcmp( &chunks[ slots[ slot ] ], &id, sizeof( id ) ) != 0 )
+    slot = ( slot + 1 ) & mask;
+  return slot;
+}
+
+uint32_t ChunkOrdinals::get( ChunkId const & id, bool & added )
+{
+  size_t slot = findSlot( id );
+  added = ( slots[ slot ] == Empty );
+  if ( !added )
+    return slots[ slot ];
+
+  if ( chunks.size() >= Empty - 1 )
+    throw exTooManyChunks();
+
+  chunks.push_back( id );
+  slots[ slot ] = chunks.size() - 1;
+
+  // Keep the load factor under 1/2
+  if ( chunks.size() * 2 > slots.size() )
+  {
+    slots.assign( slots.size() * 2, uint32_t( Empty ) );
+    mask = slots.size() - 1;
+    for ( size_t x = 0; x < chunks.size(); ++x )
+      slots[ findSlot( chunks[ x ] ) ] = x;
+  }
+
+  return chunks.size() - 1;
+}
+
+bool ChunkOrdinals::find( ChunkId const & id, uint32_t & ordinal ) const
+{
+  size_t slot = findSlot( id );
+  if ( slots[ slot ] == Empty )
+    return false;
+
+  ordinal = slots[ slot ];
+  return true;
+}
+
+void ChunkOrdinals::clear()
+{
+  chunks.clear();
+  slots.assign( 1024, uint32_t( Empty ) );
+  mask = 1023;
+}
+
+InstructionWriter::InstructionWriter( string & out ): out( out ),
+  ordinals( chunks ), nextOrdinal( 0 ), newChunkCount( 0 ), runLength( 0 )
+{
+}
+
+void InstructionWriter::writeVarint( uint64_t value )
+{
+  while ( value >= 0x80 )
+  {
+    out.push_back( char( value | 0x80 ) );
+    value >>= 7;
+  }
+  out.push_back( char( value ) );
+}
+
+void InstructionWriter::addChunk( ChunkId const & id )
+{
+  uint32_t ordinal;
+
+  if ( ordinals.find( id, ordinal ) )
+  {
+    if ( runLength && ordinal == runStart + runLength )
+    {
+      ++runLength;
+      return;
+    }
+
+    flush();
+    runStart = ordinal;
+    runLength = 1;
+    return;
+  }
+
+  if ( runLength || newChunkCount == MaxNewChunks )
+    flush();
+
+  // The reader empties its table at this very point as well
+  if ( chunks.size() == MaxTableSize )
+    ordinals.clear();
+
+  bool added;
+  ordinals.get( id, added );
+
+  char blob[ ChunkId::BlobSize ];
+  id.toBlob( blob );
+  newChunks.append( blob, sizeof( blob ) );
+  ++newChunkCount;
+}
+
+void InstructionWriter::addBytes( void const * data, size_t size )
+{
+  flush();
+
+  writeVarint( ( uint64_t( size ) << 2 ) | Bytes );
+  out.append( ( char const * ) data, size );
+}
+
+void InstructionWriter::flush()
+{
+  if ( newChunkCount )
+  {
+    writeVarint( ( uint64_t( newChunkCount ) << 2 ) | NewChunks );
+    out.append( newChunks );
+
+    newChunks.clear();
+    newChunkCount = 0;
+    nextOrdinal = chunks.size();
+  }
+  else
+  if ( runLength )
+  {
+    int64_t delta = int64_t( runStart ) - int64_t( nextOrdinal );
+
+    writeVarint( ( uint64_t( runLength ) << 2 ) | ChunkRun );
+    writeVarint( ( uint64_t( delta ) << 1 ) ^ uint64_t( delta >> 63 ) );
+
+    nextOrdinal = runStart + runLength;
+    runLength = 0;
+  }
+}
+
+InstructionReader::InstructionReader( ZeroCopyInputStream & is,
+                                      uint32_t format ):
+  is( is ), format( format ), data( 0 ), dataSize( 0 ), consumed( 0 ),
+  nextOrdinal( 0 ), left( 0 ), kind( 0 )
+{
+  if ( format != LegacyInstructionFormat && format != CompactInstructionFormat )
+    throw exUnsupportedFormat();
+}
+
+bool InstructionReader::readLegacy( Instruction & instr )
+{
+  // Each instruction is a size-prefixed BackupInstruction message
+  uint64_t size;
+  if ( !readVarint( size ) )
+    return false;
+
+  uint64_t end = consumed + size;
+
+  instr.hasChunk = false;
+  instr.bytes = 0;
+  instr.bytesSize = 0;
+
+  while ( consumed < end )
+  {
+    uint64_t tag;
+    if ( !readVarint( tag ) )
+      throw exCorrupted();
+
+    if ( tag == ChunkToEmitTag )
+    {
+      uint64_t fieldSize;
+      if ( !readVarint( fieldSize ) || fieldSize != ChunkId::BlobSize )
+        throw exCorrupted();
+
+      readChunkId( instr.chunkId );
+      instr.hasChunk = true;
+    }
+    else
+    if ( tag == BytesToEmitTag )
+    {
+      uint64_t fieldSize;
+      if ( !readVarint( fieldSize ) || fieldSize > end - consumed )
+        throw exCorrupted();
+
+      readBytes( instr, fieldSize );
+    }
+    else
+    {
+      // Skip the fields this version doesn't know
+      uint64_t value;
+      switch ( tag & 7 )
+      {
+        case WireVarint:
+          if ( !readVarint( value ) )
+            throw exCorrupted();
+        break;
+
+        case WireFixed64:
+          skip( 8 );
+        break;
+
+        case WireLengthDelimited:
+          if ( !readVarint( value ) || value > end - consumed )
+            throw exCorrupted();
+          skip( value );
+        break;
+
+        case WireFixed32:
+          skip( 4 );
+        break;
+
+        default:
+          throw exCorrupted();
+      }
+    }
+  }
+
+  if ( consumed != end )
+    throw exCorrupted();
+
+  return true;
+}
+
+bool InstructionReader::fill()
+{
+  while ( !dataSize )
+  {
+    void const * next;
+    if ( !is.Next( &next, &dataSize ) )
+    {
+      dataSize = 0;
+      return false;
+    }
+    data = ( char const * ) next;
+  }
+
+  return true;
+}
+
+bool InstructionReader::readVarint( uint64_t & value )
+{
+  if ( !fill() )
+    return false;
+
+  value = 0;
+  for ( unsigned shift = 0; ; shift += 7 )
+  {
+    if ( shift > 63 || !fill() )
+      throw exCorrupted();
+
+    unsigned char byte = *data++;
+    --dataSize;
+    ++consumed;
+
+    value |= uint64_t( byte & 0x7F ) << shift;
+    if ( !( byte & 0x80 ) )
+      return true;
+  }
+}
+
+void InstructionReader::read( void * out, size_t size )
+{
+  char * next = ( char * ) out;
+
+  while ( size )
+  {
+    if ( !fill() )
+      throw exCorrupted();
+
+    size_t toCopy = size < size_t( dataSize ) ? size : dataSize;
+    memcpy( next, data, toCopy );
+
+    data += toCopy;
+    dataSize -= toCopy;
+    consumed += toCopy;
+    next += toCopy;
+    size -= toCopy;
+  }
+}
+
+void InstructionReader::skip( uint64_t size )
+{
+  while ( size )
+  {
+    if ( !fill() )
+      throw exCorrupted();
+
+    size_t toSkip = size < uint64_t( dataSize ) ? size : dataSize;
+
+    data += toSkip;
+    dataSize -= toSkip;
+    consumed += toSkip;
+    size -= toSkip;
+  }
+}
+
+void InstructionReader::readChunkId( ChunkId & id )
+{
+  // The id is decoded right from the stream's buffer when it's all there
+  if ( dataSize >= ChunkId::BlobSize )
+  {
+    id.setFromBlob( data );
+    data += ChunkId::BlobSize;
+    dataSize -= ChunkId::BlobSize;
+    consumed += ChunkId::BlobSize;
+  }
+  else
+  {
+    char blob[ ChunkId::BlobSize ];
+    read( blob, sizeof( blob ) );
+    id.setFromBlob( blob );
+  }
+}
+
+void InstructionReader::readBytes( Instruction & instr, uint64_t size )
+{
+  if ( size && !fill() )
+    throw exCorrupted();
+
+  if ( size <= uint64_t( dataSize ) )
+  {
+    instr.bytes = data;
+    data += size;
+    dataSize -= size;
+    consumed += size;
+  }
+  else
+  {
+    if ( size > size_t( -1 ) )
+      throw exCorrupted();
+
+    scratch.resize( size );
+    read( &scratch[ 0 ], size );
+    instr.bytes = scratch.data();
+  }
+
+  instr.bytesSize = size;
+}
+
+bool InstructionReader::readNext( Instruction & instr )
+{
+  if ( format == LegacyInstructionFormat )
+    return readLegacy( instr );
+
+  while ( !left )
+  {
+    uint64_t tag;
+    if ( !readVarint( tag ) )
+      return false;
+
+    kind = tag & 3;
+    left = tag >> 2;
+
+    if ( kind == Bytes )
+    {
+      instr.hasChunk = false;
+      readBytes( instr, left );
+
+      left = 0;
+      return true;
+    }
+    else
+    if ( kind == ChunkRun )
+    {
+      uint64_t encoded;
+      if ( !readVarint( encoded ) )
+        throw exCorrupted();
+
+      int64_t delta = int64_t( encoded >> 1 ) ^ -int64_t( encoded & 1 );
+      int64_t start = int64_t( nextOrdinal ) + delta;
+
+      if ( start < 0 || uint64_t( start ) + left > chunks.size() )
+        throw exCorrupted();
+
+      nextOrdinal = start;
+    }
+    else
+    if ( kind != NewChunks )
+      throw exCorrupted();
+  }
+
+  --left;
+  instr.hasChunk = true;
+  instr.bytes = 0;
+  instr.bytesSize = 0;
+
+  if ( kind == ChunkRun )
+  {
+    instr.chunkId = chunks[ nextOrdinal++ ];
+    return true;
+  }
+
+  readChunkId( instr.chunkId );
+
+  if ( chunks.size() == InstructionWriter::MaxTableSize )
+    chunks.clear();
+
+  chunks.push_back( instr.chunkId );
+  nextOrdinal = chunks.size();
+
+  return true;
+}
+
+InstructionReader::~InstructionReader()
+{
+  if ( dataSize )
+    is.BackUp( dataSize );
+}
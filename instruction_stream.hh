@@ -0,0 +1,177 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef INSTRUCTION_STREAM_HH_INCLUDED
+#define INSTRUCTION_STREAM_HH_INCLUDED
+
+#include <google/protobuf/io/zero_copy_stream.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include "chunk_id.hh"
+#include "ex.hh"
+#include "nocopy.hh"
+
+using std::string;
+using std::vector;
+
+/// The encodings of the instruction streams the backups consist of. The
+/// format of a backup is recorded in its BackupInfo and applies to all the
+/// levels of its manifest
+enum InstructionFormat
+{
+  /// A stream of size-prefixed BackupInstruction messages
+  LegacyInstructionFormat = 1,
+  /// The compact encoding written by InstructionWriter
+  CompactInstructionFormat = 2
+};
+
+/// A single instruction of the backup data. It emits the chunk, if there is
+/// one, followed by the bytes. The bytes are only valid until the next
+/// instruction is read, since they usually point right into the buffer of
+/// the stream the instruction was read from
+struct Instruction
+{
+  bool hasChunk;
+  ChunkId chunkId;
+  char const * bytes;
+  size_t bytesSize;
+};
+
+/// Maps chunk ids to their ordinals in a table of chunks. An open addressing
+/// table of ordinals into 'chunks' takes far less memory than a node-based
+/// map for tables with hundreds of millions of chunks
+class ChunkOrdinals
+{
+public:
+  DEF_EX( exTooManyChunks, "Too many different chunks", std::exception )
+
+  ChunkOrdinals( vector< ChunkId > & chunks );
+
+  /// Returns the ordinal of the given chunk, appending it to 'chunks' if it
+  /// is not there yet
+  uint32_t get( ChunkId const & id, bool & added );
+
+  /// Looks the chunk up without adding it. Returns false if it's not there
+  bool find( ChunkId const & id, uint32_t & ordinal ) const;
+
+  /// Empties the table, along with 'chunks'
+  void clear();
+
+private:
+  enum
+  {
+    Empty = 0xFFFFFFFF
+  };
+
+  size_t findSlot( ChunkId const & id ) const;
+
+  vector< ChunkId > & chunks;
+  vector< uint32_t > slots;
+  size_t mask;
+};
+
+/// Encodes the instructions in the compact format. It is a sequence of
+/// records, each starting with a varint holding ( value << 2 ) | kind:
+///
+/// - kind 0: 'value' new chunks follow, as ChunkId::BlobSize bytes each. They
+///   are emitted, and appended to the chunk table in that order;
+/// - kind 1: a zigzag varint follows, holding the ordinal of a chunk in the
+///   table minus the ordinal following the one of the last chunk emitted.
+///   The 'value' chunks of the table starting at that ordinal are emitted;
+/// - kind 2: 'value' bytes follow, which are emitted as they are.
+///
+/// Chunks repeated within the stream are thus only stored once, and runs of
+/// them take a couple of bytes. The chunk table is emptied each time a chunk
+/// is to be appended to it while it has MaxTableSize entries already, which
+/// bounds the memory both sides need
+class InstructionWriter: NoCopy
+{
+public:
+  enum
+  {
+    MaxTableSize = 1 << 20,
+    /// New chunks are held back to be put in one record up to this count
+    MaxNewChunks = 64
+  };
+
+  /// The records get appended to 'out'
+  explicit InstructionWriter( string & out );
+
+  void addChunk( ChunkId const & );
+  void addBytes( void const * data, size_t size );
+
+  /// Outputs the record being held back to be merged with the following ones,
+  /// if any. Must be done once all the instructions are added
+  void flush();
+
+private:
+  void writeVarint( uint64_t );
+
+  string & out;
+  vector< ChunkId > chunks;
+  ChunkOrdinals ordinals;
+  /// The ordinal following the one of the last chunk emitted, as of the
+  /// records output so far
+  uint32_t nextOrdinal;
+
+  /// New chunks held back
+  string newChunks;
+  unsigned newChunkCount;
+  /// The run of table chunks held back
+  uint32_t runStart, runLength;
+};
+
+/// Decodes the instructions of either format from a stream. Both are decoded
+/// by hand, straight from the buffers of the stream, so no memory is
+/// allocated for each instruction
+class InstructionReader: NoCopy
+{
+public:
+  DEF_EX( Ex, "Instruction reader exception", std::exception )
+  DEF_EX( exUnsupportedFormat, "Unsupported format of the backup instructions", Ex )
+  DEF_EX( exCorrupted, "The backup instructions are corrupted", Ex )
+
+  InstructionReader( google::protobuf::io::ZeroCopyInputStream &,
+                     uint32_t format );
+
+  /// Reads the next instruction. Returns false once there are no more
+  bool readNext( Instruction & );
+
+  /// Gives the data not consumed yet back to the stream
+  ~InstructionReader();
+
+private:
+  bool readLegacy( Instruction & );
+
+  /// Makes sure there is some data available. Returns false at the end
+  bool fill();
+  /// Returns false if the stream ends before the varint starts
+  bool readVarint( uint64_t & );
+  void read( void *, size_t );
+  void skip( uint64_t );
+  void readChunkId( ChunkId & );
+  /// Points the instruction's bytes at the given number of bytes of the
+  /// stream, copying them aside only if they span several buffers
+  void readBytes( Instruction &, uint64_t size );
+
+  google::protobuf::io::ZeroCopyInputStream & is;
+  uint32_t format;
+  char const * data;
+  int dataSize;
+  /// Number of bytes consumed from the stream
+  uint64_t consumed;
+  /// Holds the bytes which were split between the buffers
+  string scratch;
+
+  vector< ChunkId > chunks;
+  uint32_t nextOrdinal;
+  /// Number of instructions left in the current record, and its kind
+  uint64_t left;
+  unsigned kind;
+};
+
+#endif
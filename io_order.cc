@@ -0,0 +1,210 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include "io_order.hh"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <utility>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+#include "debug.hh"
+#include "dir.hh"
+
+namespace IoOrder {
+
+namespace {
+
+uint64_t const UnknownLocation = ~uint64_t( 0 );
+
+uint64_t getInodeKey( string const & fileName )
+{
+  struct stat st;
+  if ( stat( fileName.c_str(), &st ) != 0 )
+    return UnknownLocation;
+
+  return st.st_ino;
+}
+
+/// Returns true and stores the physical offset of the first extent of the
+/// file in 'key' on success. Sets 'unsupported' if the filesystem doesn't
+/// implement FIEMAP at all, so the caller doesn't need to retry for other files
+bool getExtentKey( string const & fileName, uint64_t & key, bool & unsupported )
+{
+  unsupported = false;
+#ifdef FS_IOC_FIEMAP
+  int fd = open( fileName.c_str(), O_RDONLY );
+  if ( fd < 0 )
+    return false;
+
+  // Room for a single extent is enough, we only need the first one
+  union
+  {
+    struct fiemap map;
+    char space[ sizeof( struct fiemap ) + sizeof( struct fiemap_extent ) ];
+  } request;
+
+  memset( &request, 0, sizeof( request ) );
+  request.map.fm_start = 0;
+  request.map.fm_length = FIEMAP_MAX_OFFSET;
+  request.map.fm_extent_count = 1;
+
+  bool ok = false;
+  if ( ioctl( fd, FS_IOC_FIEMAP, &request.map ) == 0 )
+  {
+    if ( request.map.fm_mapped_extents )
+    {
+      key = request.map.fm_extents[ 0 ].fe_physical;
+      ok = true;
+    }
+  }
+  else
+  if ( errno == EOPNOTSUPP || errno == ENOTTY )
+    unsupported = true;
+
+  close( fd );
+  return ok;
+#else
+  unsupported = true;
+  return false;
+#endif
+}
+
+}
+
+bool parseMode( char const * name, Mode & mode )
+{
+  if ( strcmp( name, "none" ) == 0 )
+    mode = None;
+  else
+  if ( strcmp( name, "inode" ) == 0 )
+    mode = Inode;
+  else
+  if ( strcmp( name, "extent" ) == 0 )
+    mode = Extent;
+  else
+    return false;
+
+  return true;
+}
+
+char const * getModeName( Mode mode )
+{
+  switch ( mode )
+  {
+    case None:
+      return "none";
+    case Inode:
+      return "inode";
+    case Extent:
+      return "extent";
+  }
+
+  return "unknown";
+}
+
+uint64_t getLocationKey( string const & fileName, Mode mode )
+{
+  if ( mode == Extent )
+  {
+    uint64_t key;
+    bool unsupported;
+    if ( getExtentKey( fileName, key, unsupported ) )
+      return key;
+
+    // Inode numbers can't be compared with physical offsets
+    if ( !unsupported )
+      return UnknownLocation;
+  }
+
+  if ( mode != None )
+    return getInodeKey( fileName );
+
+  return UnknownLocation;
+}
+
+vector< size_t > getOrder( vector< string > const & fileNames, Mode mode )
+{
+  vector< size_t > order( fileNames.size() );
+  for ( size_t x = 0; x < order.size(); ++x )
+    order[ x ] = x;
+
+  if ( mode == None || fileNames.size() < 2 )
+    return order;
+
+  vector< std::pair< uint64_t, size_t > > keys( fileNames.size() );
+
+  // Physical offsets and inode numbers are not comparable, so if the
+  // filesystem doesn't support FIEMAP, use inodes for all the files
+  bool useExtents = ( mode == Extent );
+  for ( size_t x = 0; x < fileNames.size(); ++x )
+  {
+    uint64_t key = UnknownLocation;
+    bool unsupported = false;
+
+    if ( !useExtents )
+      key = getInodeKey( fileNames[ x ] );
+    else
+    if ( !getExtentKey( fileNames[ x ], key, unsupported ) )
+    {
+      if ( unsupported )
+      {
+        dPrintf( "FIEMAP is not supported, ordering by inodes instead\n" );
+        useExtents = false;
+        // Redo the files we've already examined
+        for ( size_t y = 0; y < x; ++y )
+          keys[ y ].first = getInodeKey( fileNames[ y ] );
+        key = getInodeKey( fileNames[ x ] );
+      }
+      else
+        // The file can't be mapped, e.g. it's empty or its data is inline.
+        // Its inode number can't be compared with the offsets of the others
+        key = UnknownLocation;
+    }
+
+    keys[ x ] = std::make_pair( key, x );
+  }
+
+  std::sort( keys.begin(), keys.end() );
+
+  for ( size_t x = 0; x < keys.size(); ++x )
+    order[ x ] = keys[ x ].second;
+
+  return order;
+}
+
+void sort( vector< string > & fileNames, Mode mode, string const & directory )
+{
+  if ( mode == None )
+    return;
+
+  vector< size_t > order;
+  if ( directory.empty() )
+    order = getOrder( fileNames, mode );
+  else
+  {
+    vector< string > paths( fileNames.size() );
+    for ( size_t x = 0; x < fileNames.size(); ++x )
+      paths[ x ] = Dir::addPath( directory, fileNames[ x ] );
+    order = getOrder( paths, mode );
+  }
+
+  vector< string > sorted( fileNames.size() );
+
+  for ( size_t x = 0; x < order.size(); ++x )
+    sorted[ x ].swap( fileNames[ order[ x ] ] );
+
+  fileNames.swap( sorted );
+}
+
+}
@@ -0,0 +1,55 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef IO_ORDER_HH_INCLUDED
+#define IO_ORDER_HH_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/// Helps to visit many files in the order they are laid out on the disk.
+/// On a cold cache, reading bundles in the hash order of their ids results
+/// in a seek per bundle on rotational media, while visiting them sorted by
+/// their physical location turns most of those seeks into short forward ones
+namespace IoOrder {
+
+using std::string;
+using std::vector;
+
+enum Mode
+{
+  /// Keep the order the files were supplied in
+  None,
+  /// Sort by the inode number. Most filesystems allocate data for inodes
+  /// created close in time close to each other, so this is a good and cheap
+  /// approximation
+  Inode,
+  /// Sort by the physical offset of the first extent of each file, as reported
+  /// by FIEMAP. Falls back to Inode ordering if the filesystem lacks FIEMAP.
+  /// Files which can't be mapped otherwise, e.g. empty ones, go last
+  Extent
+};
+
+/// Parses the mode name as accepted by the io.order runtime option. Returns
+/// false if the name is not known
+bool parseMode( char const * name, Mode & );
+
+/// Returns the name of the given mode
+char const * getModeName( Mode );
+
+/// Returns a key which orders the given file according to its physical
+/// location. Files which can't be examined get a key sorting them last
+uint64_t getLocationKey( string const & fileName, Mode );
+
+/// Returns the indices of the given files in the order they should be visited
+vector< size_t > getOrder( vector< string > const & fileNames, Mode );
+
+/// Reorders the given files in place. If a directory is given, the names are
+/// relative to it
+void sort( vector< string > & fileNames, Mode,
+           string const & directory = string() );
+}
+
+#endif
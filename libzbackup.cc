@@ -0,0 +1,277 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <string.h>
+#include <algorithm>
+
+#include "libzbackup.hh"
+
+#include "backup_restorer.hh"
+#include "debug.hh"
+#include "encrypted_file.hh"
+#include "sha256.hh"
+#include "sptr.hh"
+#include "zutils.hh"
+
+using std::string;
+using std::vector;
+
+// Every entry point converts the internal exceptions, so that the programs
+// only ever see Error
+#define CONVERT_EXCEPTIONS( ... ) \
+  try \
+  { \
+    __VA_ARGS__ \
+  } \
+  catch( Error & ) \
+  { \
+    throw; \
+  } \
+  catch( std::exception & e ) \
+  { \
+    throw Error( e.what() ); \
+  }
+
+namespace LibZBackup {
+
+Error::Error( string const & message ): message( message )
+{
+}
+
+char const * Error::what() const throw()
+{
+  return message.c_str();
+}
+
+Error::~Error() throw()
+{
+}
+
+void setVerbose( bool verbose )
+{
+  verboseMode = verbose;
+}
+
+class Repository::Impl
+{
+public:
+  Config config;
+  sptr< ZRepository > repository;
+
+  Impl( string const & storageDir, string const & password,
+        vector< string > const & runtimeOptions )
+  {
+    for ( size_t x = 0; x < runtimeOptions.size(); ++x )
+      if ( !config.parseOrValidate( runtimeOptions[ x ], Config::Runtime ) )
+        throw Error( "Invalid option specified: " + runtimeOptions[ x ] );
+
+    EncryptedFile::setBufferSize( config.runtime.ioBufferSize );
+
+    repository = new ZRepository( storageDir, password, config );
+  }
+
+  string getBackupFileName( string const & backupName )
+  {
+    return Dir::addPath( repository->getBackupsPath(), backupName );
+  }
+};
+
+Repository::Repository( string const & storageDir, string const & password,
+                        vector< string > const & runtimeOptions ): impl( 0 )
+{
+  CONVERT_EXCEPTIONS(
+    impl = new Impl( storageDir, password, runtimeOptions );
+  )
+}
+
+Repository::~Repository()
+{
+  delete impl;
+}
+
+/// Holds the repository acquired for as long as it exists
+class BackupWriter::Impl
+{
+public:
+  ZRepository & repository;
+  sptr< ZBackup::Session > session;
+  bool committed;
+
+  Impl( ZRepository & repository, string const & fileName ):
+    repository( repository ), committed( false )
+  {
+    repository.acquire();
+
+    try
+    {
+      session = new ZBackup::Session( repository, fileName );
+    }
+    catch( ... )
+    {
+      repository.release();
+      throw;
+    }
+  }
+
+  ~Impl()
+  {
+    if ( !committed && session.get() )
+    {
+      session.reset();
+      repository.invalidateIndex();
+    }
+
+    repository.release();
+  }
+};
+
+BackupWriter::BackupWriter( Repository & repository, string const & backupName ):
+  impl( 0 )
+{
+  CONVERT_EXCEPTIONS(
+    impl = new Impl( *repository.impl->repository,
+                     repository.impl->getBackupFileName( backupName ) );
+  )
+}
+
+void BackupWriter::write( void const * data, size_t size )
+{
+  if ( impl->committed )
+    throw Error( "The backup is committed already" );
+
+  CONVERT_EXCEPTIONS(
+    impl->session->add( data, size );
+  )
+}
+
+void BackupWriter::commit()
+{
+  if ( impl->committed )
+    throw Error( "The backup is committed already" );
+
+  CONVERT_EXCEPTIONS(
+    impl->session->finish();
+    impl->committed = true;
+  )
+}
+
+BackupWriter::~BackupWriter()
+{
+  delete impl;
+}
+
+/// Holds the repository acquired for as long as it exists
+class BackupReader::Impl
+{
+public:
+  ZRepository & repository;
+  BackupInfo backupInfo;
+  sptr< BackupRestorer::IndexedRestorer > restorer;
+  uint64_t position;
+  /// The data read from the start without gaps is hashed, to check it once
+  /// the end is reached
+  Sha256 sha256;
+  uint64_t hashedBytes;
+  bool hashing;
+
+  Impl( ZRepository & repository, string const & fileName ):
+    repository( repository ), position( 0 ), hashedBytes( 0 ), hashing( true )
+  {
+    repository.acquire();
+
+    try
+    {
+      restorer = repository.getIndexedRestorer( fileName, backupInfo );
+      // The backup data isn't needed any more
+      backupInfo.clear_backup_data();
+    }
+    catch( ... )
+    {
+      repository.release();
+      throw;
+    }
+  }
+
+  size_t readAt( uint64_t offset, void * data, size_t size )
+  {
+    if ( offset >= backupInfo.size() )
+      return 0;
+
+    size = std::min< uint64_t >( size, backupInfo.size() - offset );
+    restorer->saveData( offset, data, size );
+
+    if ( hashing )
+    {
+      if ( offset == hashedBytes )
+      {
+        sha256.add( data, size );
+        hashedBytes += size;
+
+        if ( hashedBytes == backupInfo.size() )
+        {
+          hashing = false;
+          if ( sha256.finish() != backupInfo.sha256() )
+            throw ZBackupBase::exChecksumError();
+        }
+      }
+      else
+      if ( offset < hashedBytes && offset + size > hashedBytes )
+        hashing = false; // Overlapping reads would need to be split
+    }
+
+    return size;
+  }
+
+  ~Impl()
+  {
+    restorer.reset();
+    repository.release();
+  }
+};
+
+BackupReader::BackupReader( Repository & repository, string const & backupName ):
+  impl( 0 )
+{
+  CONVERT_EXCEPTIONS(
+    impl = new Impl( *repository.impl->repository,
+                     repository.impl->getBackupFileName( backupName ) );
+  )
+}
+
+uint64_t BackupReader::size() const
+{
+  return impl->backupInfo.size();
+}
+
+size_t BackupReader::read( void * data, size_t size )
+{
+  CONVERT_EXCEPTIONS(
+    size_t result = impl->readAt( impl->position, data, size );
+    impl->position += result;
+    return result;
+  )
+}
+
+size_t BackupReader::readAt( uint64_t offset, void * data, size_t size )
+{
+  CONVERT_EXCEPTIONS(
+    return impl->readAt( offset, data, size );
+  )
+}
+
+void BackupReader::seek( uint64_t offset )
+{
+  impl->position = offset;
+}
+
+uint64_t BackupReader::tell() const
+{
+  return impl->position;
+}
+
+BackupReader::~BackupReader()
+{
+  delete impl;
+}
+
+}
@@ -0,0 +1,133 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef LIBZBACKUP_HH_INCLUDED
+#define LIBZBACKUP_HH_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <exception>
+#include <string>
+#include <vector>
+
+/// The API of libzbackup, for programs embedding zbackup instead of running
+/// it. This header is all they need: the internals are kept out of it, so
+/// they can change without breaking the programs. The library is a static
+/// one, so the programs have to link with the libraries zbackup uses, too.
+///
+/// A repository is opened once, and then any number of backups can be
+/// written into it and read back. The repository is only locked while a
+/// backup is being written or read, so other processes, including the
+/// garbage collection, can work on it in between. Nothing here is
+/// thread-safe: a repository and its writers and readers must only be used
+/// by one thread at a time
+namespace LibZBackup {
+
+/// Every error is reported with this exception
+class Error: public std::exception
+{
+public:
+  explicit Error( std::string const & message );
+  virtual char const * what() const throw();
+  virtual ~Error() throw();
+
+private:
+  std::string message;
+};
+
+/// Enables or disables the progress messages printed to stderr. They are
+/// enabled by default, as they are for the command line
+void setVerbose( bool );
+
+class Repository
+{
+public:
+  /// Opens the repository in the given directory, loading its index. An
+  /// empty password is for a non-encrypted one. The runtime options are the
+  /// ones the command line takes with -O, e.g. "threads=4"
+  Repository( std::string const & storageDir, std::string const & password,
+              std::vector< std::string > const & runtimeOptions =
+                std::vector< std::string >() );
+
+  /// Closes the repository. Its writers and readers must be destroyed first
+  ~Repository();
+
+  class Impl;
+
+private:
+  Impl * impl;
+
+  friend class BackupWriter;
+  friend class BackupReader;
+
+  Repository( Repository const & );
+  Repository & operator = ( Repository const & );
+};
+
+/// Writes a new backup from the data pushed into it
+class BackupWriter
+{
+public:
+  /// Starts a backup to be saved under the given name, which is relative to
+  /// the backups/ directory of the repository
+  BackupWriter( Repository &, std::string const & backupName );
+
+  /// Adds more data to the backup
+  void write( void const * data, size_t size );
+
+  /// Finishes the backup and saves it. Unless this is called, the backup is
+  /// abandoned once the writer is destroyed
+  void commit();
+
+  ~BackupWriter();
+
+  class Impl;
+
+private:
+  Impl * impl;
+
+  BackupWriter( BackupWriter const & );
+  BackupWriter & operator = ( BackupWriter const & );
+};
+
+/// Reads an existing backup, either as a stream or at random offsets
+class BackupReader
+{
+public:
+  /// Opens the backup with the given name, which is relative to the backups/
+  /// directory of the repository
+  BackupReader( Repository &, std::string const & backupName );
+
+  /// Returns the size of the data in the backup
+  uint64_t size() const;
+
+  /// Reads up to 'size' bytes at the current position, moving it past them.
+  /// Returns the number of bytes read, which is only less than requested at
+  /// the end of the data. When the whole backup gets read this way from its
+  /// start, its checksum is verified at the end
+  size_t read( void * data, size_t size );
+
+  /// Reads up to 'size' bytes at the given offset, leaving the current
+  /// position as is. Returns the number of bytes read
+  size_t readAt( uint64_t offset, void * data, size_t size );
+
+  /// Moves the current position
+  void seek( uint64_t offset );
+
+  /// Returns the current position
+  uint64_t tell() const;
+
+  ~BackupReader();
+
+  class Impl;
+
+private:
+  Impl * impl;
+
+  BackupReader( BackupReader const & );
+  BackupReader & operator = ( BackupReader const & );
+};
+
+}
+
+#endif
@@ -0,0 +1,264 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include "nbd_server.hh"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "buse.h"
+#include "debug.hh"
+
+namespace {
+
+uint64_t getMicroseconds()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return uint64_t( ts.tv_sec ) * 1000000 + ts.tv_nsec / 1000;
+}
+
+}
+
+NbdServer::Histogram::Histogram(): count( 0 ), totalMicroseconds( 0 ),
+  bytes( 0 )
+{
+  memset( buckets, 0, sizeof( buckets ) );
+}
+
+void NbdServer::Histogram::add( uint64_t microseconds, size_t size )
+{
+  unsigned bucket = 0;
+  while ( bucket < HistogramBuckets - 1 && ( microseconds >> bucket ) > 1 )
+    ++bucket;
+
+  ++buckets[ bucket ];
+  ++count;
+  totalMicroseconds += microseconds;
+  bytes += size;
+}
+
+void NbdServer::Histogram::print( char const * title ) const
+{
+  if ( !count )
+    return;
+
+  verbosePrintf( "%s: %llu requests, %llu KiB, %llu us on average\n", title,
+                 (unsigned long long) count, (unsigned long long) bytes / 1024,
+                 (unsigned long long) totalMicroseconds / count );
+
+  for ( unsigned x = 0; x < HistogramBuckets; ++x )
+    if ( buckets[ x ] )
+    {
+      if ( x < HistogramBuckets - 1 )
+        verbosePrintf( "  < %10llu us: %llu\n", 2ull << x,
+                       (unsigned long long) buckets[ x ] );
+      else
+        verbosePrintf( "  >= %9llu us: %llu\n", 1ull << x,
+                       (unsigned long long) buckets[ x ] );
+    }
+}
+
+NbdServer::NbdServer( BackupRestorer::IndexedRestorer & restorer,
+                      ChunkStorage::Reader & chunkStorageReader,
+                      Config const & config ):
+  restorer( restorer ), chunkStorageReader( chunkStorageReader ),
+  readAheadSize( config.runtime.nbdReadAhead ),
+  threads( config.runtime.threads ), requestCounter( 0 ),
+  stopping( false ), readAheadThread( *this ), readAheadRunning( false )
+{
+  memset( streams, 0, sizeof( streams ) );
+
+  // The chunk tier takes its part out of the cache size, the rest is left to
+  // the whole bundles. Sequential reads are served by the bundle tier, random
+  // ones mostly by the chunk tier
+  size_t chunkCacheSize = config.runtime.nbdChunkCache;
+  if ( !chunkCacheSize )
+    chunkCacheSize = config.runtime.cacheSize / 4 * 3;
+  if ( chunkCacheSize > config.runtime.cacheSize )
+    chunkCacheSize = config.runtime.cacheSize;
+
+  chunkStorageReader.enableChunkCache( chunkCacheSize );
+
+  if ( readAheadSize )
+  {
+    readAheadThread.start();
+    readAheadRunning = true;
+    verbosePrintf( "Reading up to %zu KiB ahead of sequential reads\n",
+                   readAheadSize / 1024 );
+  }
+}
+
+void NbdServer::serve( std::string const & nbdDevice )
+{
+  static struct buse_operations aop;
+  memset( &aop, 0, sizeof( aop ) );
+  aop.read = read;
+  aop.size = restorer.size();
+  aop.threads = threads;
+
+  buse_main( nbdDevice.c_str(), &aop, this );
+
+  printStats();
+}
+
+int NbdServer::read( void * buf, u_int32_t len, u_int64_t offset,
+                     void * userdata )
+{
+  dPrintf( "NBD read offset=%lu, size=%u\n", offset, len );
+
+  NbdServer & server = *( NbdServer * ) userdata;
+
+  uint64_t started = getMicroseconds();
+  bool sequential = server.noteRead( offset, len );
+  int result = 0;
+
+  // This is called from the worker threads of buse, so the exceptions must
+  // not escape
+  try
+  {
+    server.restorer.saveData( offset, buf, len );
+  }
+  catch( std::exception & e )
+  {
+    fprintf( stderr, "NBD read of %u bytes at %llu failed: %s\n", len,
+             ( unsigned long long ) offset, e.what() );
+    result = EIO;
+  }
+
+  uint64_t elapsed = getMicroseconds() - started;
+
+  Lock _( server.statsMutex );
+  ( result ? server.failedReads : sequential ? server.sequentialReads :
+             server.randomReads ).add( elapsed, len );
+
+  return result;
+}
+
+bool NbdServer::noteRead( uint64_t offset, size_t size )
+{
+  Lock _( streamsMutex );
+
+  ++requestCounter;
+
+  Stream * stream = NULL;
+  for ( unsigned x = 0; x < MaxStreams; ++x )
+    if ( streams[ x ].runs && streams[ x ].next == offset )
+    {
+      stream = streams + x;
+      break;
+    }
+
+  if ( !stream )
+  {
+    // Start a new stream in place of the least recently used one
+    stream = streams;
+    for ( unsigned x = 1; x < MaxStreams; ++x )
+      if ( streams[ x ].lastUsed < stream->lastUsed )
+        stream = streams + x;
+
+    stream->runs = 0;
+    stream->readAheadEnd = 0;
+  }
+
+  ++stream->runs;
+  stream->next = offset + size;
+  stream->lastUsed = requestCounter;
+
+  if ( stream->runs < SequentialRuns )
+    return false;
+
+  // Keep at least half of the read-ahead window in front of the stream, so
+  // the read-ahead is issued in large pieces rather than per request
+  if ( readAheadRunning &&
+       stream->readAheadEnd < stream->next + readAheadSize / 2 )
+  {
+    uint64_t start = stream->readAheadEnd > stream->next ?
+                     stream->readAheadEnd : stream->next;
+    uint64_t end = stream->next + readAheadSize;
+
+    Lock _( queueMutex );
+    // Newer requests are more important, so drop the oldest ones if the
+    // read-ahead thread can't keep up
+    if ( queue.size() >= MaxQueuedReadAheads )
+      queue.pop_front();
+    queue.push_back( std::make_pair( start, size_t( end - start ) ) );
+    queueCondition.signal();
+
+    stream->readAheadEnd = end;
+  }
+
+  return true;
+}
+
+void * NbdServer::ReadAheadThread::threadFunction() throw()
+{
+  server.readAhead();
+  return NULL;
+}
+
+void NbdServer::readAhead()
+{
+  for ( ; ; )
+  {
+    std::pair< uint64_t, size_t > range;
+
+    {
+      Lock _( queueMutex );
+      while ( queue.empty() && !stopping )
+        queueCondition.wait( queueMutex );
+
+      if ( stopping )
+        return;
+
+      range = queue.front();
+      queue.pop_front();
+    }
+
+    try
+    {
+      restorer.prefetch( range.first, range.second );
+    }
+    catch( std::exception & e )
+    {
+      // The actual read will report it, if it comes
+      dPrintf( "NBD read-ahead at %llu failed: %s\n",
+               ( unsigned long long ) range.first, e.what() );
+    }
+  }
+}
+
+void NbdServer::printStats()
+{
+  Lock _( statsMutex );
+
+  sequentialReads.print( "Sequential NBD reads" );
+  randomReads.print( "Random NBD reads" );
+  failedReads.print( "Failed NBD reads" );
+
+  if ( ChunkStorage::ChunkCache * chunkCache =
+         chunkStorageReader.getChunkCache() )
+  {
+    uint64_t hits, misses;
+    chunkCache->getStats( hits, misses );
+    verbosePrintf( "Chunk cache: %llu hits, %llu misses\n",
+                   ( unsigned long long ) hits,
+                   ( unsigned long long ) misses );
+  }
+}
+
+NbdServer::~NbdServer()
+{
+  if ( readAheadRunning )
+  {
+    {
+      Lock _( queueMutex );
+      stopping = true;
+      queueCondition.signal();
+    }
+
+    readAheadThread.join();
+  }
+}
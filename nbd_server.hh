@@ -0,0 +1,111 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef NBD_SERVER_HH_INCLUDED
+#define NBD_SERVER_HH_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <deque>
+#include <string>
+#include <utility>
+
+#include "backup_restorer.hh"
+#include "chunk_storage.hh"
+#include "config.hh"
+#include "mt.hh"
+#include "nocopy.hh"
+
+/// Serves a backup as a read-only NBD block device. Recognizes sequential
+/// streams of reads, such as the ones of a file being copied out of a mounted
+/// filesystem, and reads the chunks ahead of them in a separate thread. Keeps
+/// latency histograms of the requests, which are printed in verbose mode when
+/// the device is disconnected
+class NbdServer: NoCopy
+{
+public:
+  NbdServer( BackupRestorer::IndexedRestorer &, ChunkStorage::Reader &,
+             Config const & );
+
+  /// Serves the given device until it is disconnected
+  void serve( std::string const & nbdDevice );
+
+  ~NbdServer();
+
+private:
+  /// Buckets are powers of two of microseconds, the last one collects
+  /// everything slower than about 16 seconds
+  enum
+  {
+    HistogramBuckets = 25,
+    MaxStreams = 8,
+    /// Number of consecutive requests after which a stream is considered
+    /// sequential
+    SequentialRuns = 3,
+    MaxQueuedReadAheads = 16
+  };
+
+  struct Histogram
+  {
+    uint64_t buckets[ HistogramBuckets ];
+    uint64_t count, totalMicroseconds, bytes;
+
+    Histogram();
+    void add( uint64_t microseconds, size_t size );
+    void print( char const * title ) const;
+  };
+
+  /// A stream of reads, each one starting where the previous one ended
+  struct Stream
+  {
+    uint64_t next;
+    unsigned runs;
+    /// The read-ahead has been requested up to this offset
+    uint64_t readAheadEnd;
+    uint64_t lastUsed;
+  };
+
+  class ReadAheadThread: public Thread
+  {
+    NbdServer & server;
+  public:
+    ReadAheadThread( NbdServer & server ): server( server ) {}
+  protected:
+    virtual void * threadFunction() throw();
+  };
+
+  friend class ReadAheadThread;
+
+  static int read( void * buf, u_int32_t len, u_int64_t offset,
+                   void * userdata );
+
+  /// Returns true if the read continues a sequential stream. Queues a
+  /// read-ahead for the stream if it is needed
+  bool noteRead( uint64_t offset, size_t size );
+
+  void readAhead();
+
+  void printStats();
+
+  BackupRestorer::IndexedRestorer & restorer;
+  ChunkStorage::Reader & chunkStorageReader;
+  size_t readAheadSize;
+  size_t threads;
+
+  Mutex streamsMutex;
+  Stream streams[ MaxStreams ];
+  uint64_t requestCounter;
+
+  Mutex queueMutex;
+  Condition queueCondition;
+  std::deque< std::pair< uint64_t, size_t > > queue;
+  bool stopping;
+  ReadAheadThread readAheadThread;
+  bool readAheadRunning;
+
+  Mutex statsMutex;
+  Histogram sequentialReads, randomReads, failedReads;
+};
+
+#endif
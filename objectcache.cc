@@ -45,3 +45,19 @@ void ObjectCache::clear()
     delete ref;
   }
 }
+
+void ObjectCache::setMaxObjects( unsigned maxObjects_ )
+{
+  maxObjects = maxObjects_;
+
+  while ( totalObjects > maxObjects )
+  {
+    Objects::iterator i = --objects.end();
+    Reference * ref = i->reference;
+    objectMap.erase( i );
+    objects.pop_back();
+    --totalObjects;
+
+    delete ref;
+  }
+}
@@ -37,6 +37,10 @@ public:
   /// Deletes all the objects from cache
   void clear();
 
+  /// Changes the maximum number of objects the cache holds, evicting the
+  /// least recently used ones if there are too many of them now
+  void setMaxObjects( unsigned );
+
   ~ObjectCache()
   { clear(); }
 
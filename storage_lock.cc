@@ -0,0 +1,130 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "storage_lock.hh"
+
+#include "check.hh"
+#include "debug.hh"
+#include "dir.hh"
+
+StorageLock::StorageLock( string const & storageDir, Mode mode ):
+  storageDir( storageDir ), fileName( Dir::addPath( storageDir, "lock" ) ),
+  fd( -1 ), mode( mode )
+{
+  acquire( mode );
+}
+
+void StorageLock::acquire( Mode newMode )
+{
+  release();
+  mode = newMode;
+
+  if ( !Dir::exists( storageDir ) )
+    return;
+
+  // The storage dir itself serves as the gate. The exclusive lockers hold it
+  // while waiting for the lock, and the shared ones pass through it on their
+  // way, so they queue up behind a waiting exclusive locker instead of
+  // overtaking it
+  bool waited = false;
+  int gateFd = open( storageDir.c_str(), O_RDONLY );
+  if ( gateFd >= 0 )
+    lock( gateFd, mode == Exclusive ? LOCK_EX : LOCK_SH, waited );
+
+  fd = open( fileName.c_str(), O_RDWR | O_CREAT, 0666 );
+  if ( fd < 0 && mode == Shared )
+    fd = open( fileName.c_str(), O_RDONLY );
+
+  bool locked = fd >= 0 &&
+    lock( fd, mode == Exclusive ? LOCK_EX : LOCK_SH, waited );
+
+  if ( gateFd >= 0 )
+    close( gateFd );
+
+  if ( locked )
+  {
+    dPrintf( "Locked %s, generation %llu\n", fileName.c_str(),
+             ( unsigned long long ) getGeneration() );
+    return;
+  }
+
+  release();
+
+  if ( mode == Exclusive )
+    throw exCantLock( storageDir );
+
+  verbosePrintf( "Can't lock the storage, proceeding without the lock\n" );
+}
+
+void StorageLock::release()
+{
+  if ( fd >= 0 )
+  {
+    close( fd );
+    fd = -1;
+  }
+}
+
+bool StorageLock::lock( int fd, int operation, bool & waited )
+{
+  if ( flock( fd, operation | LOCK_NB ) == 0 )
+    return true;
+
+  if ( errno != EWOULDBLOCK )
+    return false;
+
+  if ( !waited )
+    verbosePrintf( "Waiting for another process to release the storage...\n" );
+  waited = true;
+
+  for ( ; ; )
+  {
+    if ( flock( fd, operation ) == 0 )
+      return true;
+    if ( errno != EINTR )
+      return false;
+  }
+}
+
+uint64_t StorageLock::getGeneration() const
+{
+  if ( fd < 0 )
+    return 0;
+
+  char buf[ 32 ];
+  ssize_t size = pread( fd, buf, sizeof( buf ) - 1, 0 );
+  if ( size <= 0 )
+    return 0;
+  buf[ size ] = 0;
+
+  return strtoull( buf, NULL, 10 );
+}
+
+void StorageLock::bumpGeneration()
+{
+  CHECK( mode == Exclusive, "the storage must be locked exclusively to bump "
+         "its generation" );
+
+  if ( fd < 0 )
+    throw exCantUpdate( fileName );
+
+  // The width is fixed, so the contents are always overwritten completely
+  char buf[ 32 ];
+  int size = snprintf( buf, sizeof( buf ), "%020llu\n",
+                       ( unsigned long long ) getGeneration() + 1 );
+
+  if ( pwrite( fd, buf, size, 0 ) != size )
+    throw exCantUpdate( fileName );
+}
+
+StorageLock::~StorageLock()
+{
+  release();
+}
@@ -0,0 +1,78 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef STORAGE_LOCK_HH_INCLUDED
+#define STORAGE_LOCK_HH_INCLUDED
+
+#include <stdint.h>
+#include <exception>
+#include <string>
+
+#include "ex.hh"
+#include "nocopy.hh"
+
+using std::string;
+
+/// Locks the storage for the lifetime of the object. Any number of processes
+/// can hold a shared lock at once. This is enough for backing up and
+/// restoring: new bundles and index files get random names and are renamed
+/// into place only once complete, so writers never touch each other's files.
+/// If two writers store the same new chunk at the same time, each of them
+/// keeps its own copy. Both copies are valid, since a chunk's id is the hash
+/// of its data. The index uses whichever it loads first, and a deep garbage
+/// collection drops the other one. Anything that removes or rewrites existing
+/// files, i.e. the garbage collection and the changes of the storage info,
+/// must hold an exclusive lock instead.
+///
+/// A process waiting for the exclusive lock holds up the new shared lockers,
+/// so a steady stream of backups can't starve the garbage collection.
+///
+/// The lock file also keeps the generation of the storage. It is bumped each
+/// time existing files get removed or rewritten, so anything that caches the
+/// storage contents between locks can tell if it's still current
+class StorageLock: NoCopy
+{
+public:
+  DEF_EX( Ex, "Storage lock exception", std::exception )
+  DEF_EX_STR( exCantLock, "Can't lock the storage at", Ex )
+  DEF_EX_STR( exCantUpdate, "Can't update the storage generation in", Ex )
+
+  enum Mode
+  {
+    Shared,
+    Exclusive
+  };
+
+  /// Waits until the lock is acquired. If a shared lock is requested and the
+  /// lock file can't be created, e.g. since the storage is read-only, works
+  /// without locking. A missing storage dir is left for the caller to report
+  StorageLock( string const & storageDir, Mode );
+
+  /// Releases the lock, if held, and acquires it again in the given mode, the
+  /// same way the constructor does
+  void acquire( Mode );
+
+  /// Releases the lock. Long-running processes should hold it only while they
+  /// work, to let the exclusive lockers in
+  void release();
+
+  /// Returns the current generation of the storage. It is 0 for a storage
+  /// which has never been modified yet, and when the lock isn't held
+  uint64_t getGeneration() const;
+
+  /// Increments the generation. Requires the exclusive lock
+  void bumpGeneration();
+
+  ~StorageLock();
+
+private:
+  /// Locks the file, printing a note the first time it has to wait, which is
+  /// then recorded in 'waited'. Returns false if the locking isn't supported
+  static bool lock( int fd, int operation, bool & waited );
+
+  string storageDir, fileName;
+  int fd;
+  Mode mode;
+};
+
+#endif
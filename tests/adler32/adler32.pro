@@ -0,0 +1,19 @@
+######################################################################
+# Checks the vectorized adler32 implementations against zlib's one and
+# measures their speed
+######################################################################
+
+TEMPLATE = app
+TARGET = 
+DEPENDPATH += .
+INCLUDEPATH += .
+LIBS += -lz
+
+CONFIG = release
+
+# Input
+SOURCES += test_adler32.cc \
+    ../../adler32.cc
+
+HEADERS += \
+    ../../adler32.hh
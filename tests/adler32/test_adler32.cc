@@ -0,0 +1,82 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+// Checks that every adler32 implementation the CPU supports gives the same
+// results as zlib's one for random lengths, alignments and starting values,
+// including the worst case of all bytes being 0xff. Then prints the speed of
+// each of them
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <vector>
+#include <zlib.h>
+
+#include "../../adler32.hh"
+#include "../../check.hh"
+
+using std::vector;
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static Adler32::Value reference( Adler32::Value value, char const * data,
+                                 size_t size )
+{
+  return ( Adler32::Value ) adler32( value, ( Bytef const * ) data, size );
+}
+
+static void check( Adler32::Implementation const & implementation,
+                   vector< char > const & data )
+{
+  for ( unsigned iteration = 0; iteration < 20000; ++iteration )
+  {
+    size_t offset = rand() % 64;
+    size_t size = rand() % ( iteration % 10 ? 200 : data.size() - offset );
+    // Starting values are any s1 and s2 below the modulus
+    Adler32::Value value = iteration % 2 ? 1 :
+      ( rand() % 65521 ) | ( ( rand() % 65521 ) << 16 );
+
+    Adler32::Value expected = reference( value, &data[ offset ], size );
+    Adler32::Value result = implementation.function( value, &data[ offset ],
+                                                     size );
+    CHECK( result == expected, "%s adler32 of %zu bytes at offset %zu from "
+           "%08x is %08x instead of %08x", implementation.name, size, offset,
+           value, result, expected );
+  }
+}
+
+int main()
+{
+  vector< char > data( 1024 * 1024 );
+  for ( size_t x = 0; x < data.size(); ++x )
+    data[ x ] = rand();
+
+  vector< char > allOnes( data.size(), ( char ) 0xff );
+
+  for ( Adler32::Implementation const * i = Adler32::getImplementations();
+        i->name; ++i )
+  {
+    check( *i, data );
+    check( *i, allOnes );
+
+    double started = now();
+    unsigned rounds = 2000;
+    Adler32::Value value = 1;
+    for ( unsigned x = 0; x < rounds; ++x )
+      value = i->function( value, data.data(), data.size() );
+    double elapsed = now() - started;
+
+    printf( "%-6s %8.2f GB/s (%08x)\n", i->name,
+            rounds * data.size() / elapsed / 1e9, value );
+  }
+
+  printf( "Using %s\n", Adler32::getImplementations()->name );
+
+  return EXIT_SUCCESS;
+}
@@ -22,12 +22,17 @@ SOURCES += test_bundle.cc \
     ../../encryption_key.cc \
     ../../encryption.cc \
     ../../encrypted_file.cc \
+    ../../adler32.cc \
+    ../../mt.cc \
     ../../file.cc \
     ../../dir.cc \
     ../../bundle.cc \
     ../../message.cc \
-    ../../hex.cc \
     ../../compression.cc \
+    ../../config.cc \
+    ../../io_order.cc \
+    ../../utils.cc \
+    ../../debug.cc \
     ../../zbackup.pb.cc
 
 HEADERS += \
@@ -38,13 +43,16 @@ HEADERS += \
     ../../random.hh \
     ../../encryption_key.hh \
     ../../encrypted_file.hh \
+    ../../mt.hh \
     ../../encryption.hh \
     ../../ex.hh \
     ../../file.hh \
     ../../dir.hh \
     ../../bundle.hh \
     ../../message.hh \
-    ../../hex.hh \
     ../../compression.hh \
-    ../../message.hh \
+    ../../config.hh \
+    ../../io_order.hh \
+    ../../utils.hh \
+    ../../debug.hh \
     ../../zbackup.pb.h
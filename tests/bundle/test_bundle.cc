@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <algorithm>
 #include <vector>
 #include "../../encrypted_file.hh"
 #include "../../encryption_key.hh"
@@ -13,8 +14,12 @@
 #include "../../bundle.hh"
 #include "../../compression.hh"
 #include "../../message.hh"
+#include "../../config.hh"
+#include "../../encryption.hh"
 
 using namespace Compression;
+using std::string;
+using std::vector;
 
 
 char tmpbuf[100];
@@ -79,8 +84,24 @@ void testCompatibility()
   printf("compatibility test successful.\n");
 }
 
+/// Flips a byte the given number of bytes before the end of the file
+void corruptFile( string const & fileName, long fromEnd )
+{
+  FILE * f = fopen( fileName.c_str(), "r+b" );
+  CHECK( f, "can't open %s", fileName.c_str() );
+
+  CHECK( fseek( f, -fromEnd, SEEK_END ) == 0, "can't seek in %s", fileName.c_str() );
+  int c = fgetc( f );
+  CHECK( c != EOF, "can't read %s", fileName.c_str() );
+
+  CHECK( fseek( f, -fromEnd, SEEK_END ) == 0, "can't seek in %s", fileName.c_str() );
+  fputc( c ^ 0x5A, f );
+  fclose( f );
+}
+
 void readAndWrite( EncryptionKey const & key,
-  const_sptr<CompressionMethod> compression1, const_sptr<CompressionMethod> compression2 )
+  const_sptr<CompressionMethod> compression1, const_sptr<CompressionMethod> compression2,
+  size_t frameSize )
 {
   // temporary file for the bundle
   TmpMgr tmpMgr( "/dev/shm" );
@@ -92,7 +113,12 @@ void readAndWrite( EncryptionKey const & key,
   char**  chunks      = new char*[chunkCount];
   string* chunkIds    = new string[chunkCount];
 
-  CompressionMethod::defaultCompression = compression1;
+  Config config;
+  config.SET_STORABLE( bundle, frame_size, frameSize );
+  if ( rand() & 1 )
+    config.SET_STORABLE( encryption, mode, "gcm" );
+
+  CompressionMethod::selectedCompression = compression1;
 
   // write bundle
   {
@@ -100,26 +126,38 @@ void readAndWrite( EncryptionKey const & key,
 
     for (int i=0;i<chunkCount;i++) {
       chunks[i] = new char[chunkSize];
-      Random::genaratePseudo( chunks[i], chunkSize );
+      Random::generatePseudo( chunks[i], chunkSize );
 
       //TODO make it look like a real Id (or even let it match the data)
-      //TODO make sure we don't have any duplicate Ids
-      sprintf(tmpbuf, "0x%08x", rand());
+      sprintf(tmpbuf, "0x%08x%04x", rand(), i);
       chunkIds[i] = string(tmpbuf);
 
       bundle.addChunk( chunkIds[i], chunks[i], chunkSize );
     }
 
-    bundle.write( tempFile->getFileName().c_str(), key );
+    bundle.write( config, tempFile->getFileName().c_str(), key );
   }
 
-  CompressionMethod::defaultCompression = compression2;
+  CompressionMethod::selectedCompression = compression2;
 
   // read it and compare
   {
     Bundle::Reader bundle( tempFile->getFileName().c_str(), key );
 
-    for (int i=0;i<chunkCount;i++) {
+    // Each frame takes whole chunks until it has at least frameSize bytes
+    int expectedFrames = 0;
+    if ( frameSize )
+    {
+      int chunksPerFrame = std::max< int >( 1, ( frameSize + chunkSize - 1 ) / chunkSize );
+      expectedFrames = ( chunkCount + chunksPerFrame - 1 ) / chunksPerFrame;
+    }
+    CHECK( bundle.getBundleHeader().frame_size() == expectedFrames,
+           "bundle has %d frames instead of %d", bundle.getBundleHeader().frame_size(),
+           expectedFrames );
+
+    // Going backwards makes the frames get loaded out of order, the later ones
+    // first
+    for (int i=chunkCount;i--;) {
       string data;
       size_t size;
       bool ret = bundle.get( chunkIds[i], data, size );
@@ -127,6 +165,10 @@ void readAndWrite( EncryptionKey const & key,
       CHECK( size == chunkSize, "wrong chunk size for chunk %d (%s)", i, chunkIds[i].c_str() );
       CHECK( memcmp(data.c_str(), chunks[i], chunkSize) == 0, "wrong chunk data for chunk %d (%s)", i, chunkIds[i].c_str() );
     }
+
+    string data;
+    size_t size;
+    CHECK( !bundle.get( "no such chunk", data, size ), "bundle.get found a chunk which isn't there" );
   }
 
   // clean up
@@ -140,21 +182,182 @@ void readAndWrite( EncryptionKey const & key,
   fflush(stdout);
 }
 
+void testCorruption( const_sptr<CompressionMethod> compression )
+{
+  TmpMgr tmpMgr( "/dev/shm" );
+  sptr< TemporaryFile > tempFile = tmpMgr.makeTemporaryFile();
+  std::string fileName = tempFile->getFileName();
+
+  EncryptionKey noKey( std::string(), NULL );
+
+  CompressionMethod::selectedCompression = compression;
+
+  // Four frames of a single chunk each
+  enum { ChunkCount = 4, ChunkSize = 10000 };
+  char chunks[ ChunkCount ][ ChunkSize ];
+  for ( int x = 0; x < ChunkCount; ++x )
+    Random::generatePseudo( chunks[ x ], ChunkSize );
+
+  for ( int framed = 0; framed < 2; ++framed )
+  {
+    Config config;
+    config.SET_STORABLE( bundle, frame_size, framed ? ChunkSize : 0 );
+
+    {
+      Bundle::Creator bundle;
+      for ( int x = 0; x < ChunkCount; ++x )
+        bundle.addChunk( string( 1, 'a' + x ), chunks[ x ], ChunkSize );
+      bundle.write( config, fileName, noKey );
+    }
+
+    // The last bytes are the adler32 of the whole payload, the ones before
+    // them belong to the last frame
+    corruptFile( fileName, sizeof( Adler32::Value ) + 1 );
+
+    string data;
+    size_t size;
+
+    if ( framed )
+    {
+      Bundle::Reader bundle( fileName, noKey );
+
+      // The intact frames are still readable
+      CHECK( bundle.get( "a", data, size ) && size == ChunkSize &&
+             memcmp( data.data(), chunks[ 0 ], ChunkSize ) == 0,
+             "can't read an intact frame of a corrupted bundle" );
+
+      bool thrown = false;
+      try
+      {
+        bundle.get( string( 1, 'a' + ChunkCount - 1 ), data, size );
+      }
+      catch( Bundle::Reader::exFrameAdlerMismatch & )
+      {
+        thrown = true;
+      }
+      CHECK( thrown, "a corrupted frame was read without an error" );
+
+      // And it stays unreadable
+      thrown = false;
+      try
+      {
+        bundle.get( string( 1, 'a' + ChunkCount - 1 ), data, size );
+      }
+      catch( Bundle::Reader::exFrameAdlerMismatch & )
+      {
+        thrown = true;
+      }
+      CHECK( thrown, "a corrupted frame was read without an error on retry" );
+    }
+    else
+    {
+      bool thrown = false;
+      try
+      {
+        Bundle::Reader bundle( fileName, noKey );
+      }
+      catch( EncryptedFile::exAdlerMismatch & )
+      {
+        thrown = true;
+      }
+      CHECK( thrown, "a corrupted unframed bundle was read without an error" );
+    }
+  }
+
+  printf( "corruption test with %s successful.\n", compression->getName().c_str() );
+}
+
+/// Writes a framed bundle header listing the given frame and chunk sizes,
+/// without any payload, and checks that the reader rejects it
+void checkBadFrames( string const & fileName, vector< size_t > const & frameSizes,
+                     vector< size_t > const & chunkSizes )
+{
+  EncryptionKey noKey( std::string(), NULL );
+
+  {
+    EncryptedFile::OutputStream os( fileName.c_str(), noKey, Encryption::ZeroIv );
+    os.writeRandomIv();
+
+    BundleFileHeader header;
+    // FileFormatVersionFramed in bundle.cc
+    header.set_version( 3 );
+    header.set_compression_method( "lzma" );
+    for ( size_t x = 0; x < frameSizes.size(); ++x )
+    {
+      BundleFileHeader_Frame * frame = header.add_frame();
+      frame->set_size( frameSizes[ x ] );
+      frame->set_compressed_size( 1 );
+      frame->set_adler32( 0 );
+    }
+    Message::serialize( header, os );
+
+    BundleInfo info;
+    for ( size_t x = 0; x < chunkSizes.size(); ++x )
+    {
+      BundleInfo_ChunkRecord * record = info.add_chunk_record();
+      record->set_id( string( 1, 'a' + x ) );
+      record->set_size( chunkSizes[ x ] );
+    }
+    Message::serialize( info, os );
+    os.writeAdler32();
+  }
+
+  bool thrown = false;
+  try
+  {
+    Bundle::Reader bundle( fileName, noKey );
+  }
+  catch( Bundle::Reader::exBadFrames & )
+  {
+    thrown = true;
+  }
+  CHECK( thrown, "frames not matching the chunks were accepted" );
+}
+
+void testBadFrames()
+{
+  TmpMgr tmpMgr( "/dev/shm" );
+  sptr< TemporaryFile > tempFile = tmpMgr.makeTemporaryFile();
+  std::string fileName = tempFile->getFileName();
+
+  vector< size_t > frameSizes, chunkSizes;
+
+  // The frames hold more than the chunks
+  frameSizes.push_back( 10 );
+  frameSizes.push_back( 10 );
+  chunkSizes.push_back( 10 );
+  checkBadFrames( fileName, frameSizes, chunkSizes );
+
+  // A chunk spans two frames
+  chunkSizes.clear();
+  chunkSizes.push_back( 5 );
+  chunkSizes.push_back( 10 );
+  chunkSizes.push_back( 5 );
+  checkBadFrames( fileName, frameSizes, chunkSizes );
+
+  printf( "bad frames test successful.\n" );
+}
+
 int main()
 {
   EncryptionKeyInfo keyInfo;
-  EncryptionKey::generate( "blah", keyInfo );
-  EncryptionKey key( "blah", &keyInfo );
   EncryptionKey noKey( std::string(), NULL );
+  EncryptionKey::generate( "blah", keyInfo, noKey );
+  EncryptionKey key( "blah", &keyInfo );
 
   testCompatibility();
+  testBadFrames();
 
   std::vector< const_sptr<CompressionMethod> > compressions;
   for ( CompressionMethod::iterator it = CompressionMethod::begin(); it!=CompressionMethod::end(); ++it ) {
     printf( "supported compression: %s\n", (*it)->getName().c_str() );
     compressions.push_back( *it );
+    testCorruption( *it );
   }
 
+  // No frames, one chunk per frame, a few chunks per frame, a single frame
+  size_t const frameSizes[] = { 0, 1, 200000, 4000000 };
+
   for ( size_t iteration = 100; iteration--; ) {
     // default compression while writing the file
     const_sptr<CompressionMethod> compression1 = compressions[ rand() % compressions.size() ];
@@ -162,7 +365,8 @@ int main()
     // The reader should ignore it and always use the compression that was used for the file.
     const_sptr<CompressionMethod> compression2 = compressions[ rand() % compressions.size() ];
 
-    readAndWrite( ( rand() & 1 ) ? key : noKey, compression1, compression2 );
+    readAndWrite( ( rand() & 1 ) ? key : noKey, compression1, compression2,
+                  frameSizes[ rand() % ( sizeof( frameSizes ) / sizeof( *frameSizes ) ) ] );
   }
 
   printf("\n");
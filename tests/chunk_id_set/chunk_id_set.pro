@@ -0,0 +1,22 @@
+######################################################################
+# Checks the open-addressing chunk id set against std::set
+######################################################################
+
+TEMPLATE = app
+TARGET = 
+DEPENDPATH += .
+INCLUDEPATH += .
+LIBS += -lcrypto
+
+CONFIG = release
+
+# Input
+SOURCES += test_chunk_id_set.cc \
+    ../../chunk_id.cc \
+    ../../chunk_id_set.cc \
+    ../../rolling_hash.cc
+
+HEADERS += \
+    ../../chunk_id.hh \
+    ../../chunk_id_set.hh \
+    ../../rolling_hash.hh
@@ -0,0 +1,130 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+// Inserts random chunk ids into a ChunkIdSet and an std::set and checks they
+// agree on every insertion, lookup and iteration. Does the same for the
+// counts of a ChunkIdCounts and an std::map, adding and releasing ids at
+// random. The ids are drawn from a small range, so there are plenty of
+// repeated ones, and the all-zero id is among them
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <set>
+
+#include "../../check.hh"
+#include "../../chunk_id.hh"
+#include "../../chunk_id_set.hh"
+
+static ChunkId randomId( unsigned range )
+{
+  char blob[ ChunkId::BlobSize ];
+  memset( blob, 0, sizeof( blob ) );
+
+  unsigned value = rand() % range;
+  // Ids only differing past the part used for hashing collide in the table
+  if ( value % 2 )
+    memcpy( blob + ChunkId::BlobSize - sizeof( value ), &value, sizeof( value ) );
+  else
+    memcpy( blob, &value, sizeof( value ) );
+
+  ChunkId id;
+  id.setFromBlob( blob );
+  return id;
+}
+
+int main()
+{
+  for ( unsigned iteration = 0; iteration < 20; ++iteration )
+  {
+    ChunkIdSet set;
+    std::set< ChunkId > reference;
+
+    unsigned range = 1 + rand() % 20000;
+    if ( iteration % 2 )
+      set.reserve( rand() % range );
+
+    for ( unsigned x = 0; x < 50000; ++x )
+    {
+      ChunkId id = randomId( range );
+      bool inserted = reference.insert( id ).second;
+      CHECK( set.insert( id ) == inserted, "insert() disagrees with std::set" );
+      CHECK( set.size() == reference.size(), "size %zu instead of %zu",
+             set.size(), reference.size() );
+
+      id = randomId( range * 2 );
+      CHECK( set.contains( id ) == ( reference.find( id ) != reference.end() ),
+             "contains() disagrees with std::set" );
+    }
+
+    size_t visited = 0;
+    for ( ChunkIdSet::const_iterator i = set.begin(); i != set.end(); ++i )
+    {
+      CHECK( reference.find( *i ) != reference.end(), "iterated over a "
+             "stray id" );
+      ++visited;
+    }
+    CHECK( visited == reference.size(), "iterated over %zu ids instead of "
+           "%zu", visited, reference.size() );
+
+    set.clear();
+    CHECK( !set.size() && !set.contains( randomId( 1 ) ), "clear() failed" );
+  }
+
+  for ( unsigned iteration = 0; iteration < 10; ++iteration )
+  {
+    ChunkIdCounts counts;
+    std::map< ChunkId, uint32_t > reference;
+
+    unsigned range = 1 + rand() % 20000;
+    for ( unsigned x = 0; x < 50000; ++x )
+    {
+      ChunkId id = randomId( range );
+      uint32_t & count = reference[ id ];
+
+      // Releasing a bit more often than adding keeps most counts small, so
+      // plenty of them drop to zero
+      if ( rand() % 5 < 3 )
+      {
+        CHECK( counts.release( id ) == ( count != 0 ), "release() disagrees "
+               "with std::map" );
+        if ( count )
+          --count;
+      }
+      else
+      {
+        uint32_t toAdd = 1 + rand() % 3;
+        counts.add( id, toAdd );
+        count += toAdd;
+      }
+
+      id = randomId( range * 2 );
+      CHECK( counts.get( id ) == ( reference.count( id ) ? reference[ id ] :
+                                   0 ), "get() disagrees with std::map" );
+    }
+
+    size_t used = 0;
+    for ( std::map< ChunkId, uint32_t >::const_iterator i = reference.begin();
+          i != reference.end(); ++i )
+      if ( i->second )
+        ++used;
+    CHECK( counts.size() == used, "size %zu instead of %zu", counts.size(),
+           used );
+
+    size_t visited = 0;
+    for ( ChunkIdCounts::const_iterator i = counts.begin(); i != counts.end();
+          ++i )
+    {
+      CHECK( i->count && reference[ i->id ] == i->count, "iterated over a "
+             "wrong count" );
+      ++visited;
+    }
+    CHECK( visited == used, "iterated over %zu ids instead of %zu", visited,
+           used );
+  }
+
+  printf( "Ok\n" );
+
+  return EXIT_SUCCESS;
+}
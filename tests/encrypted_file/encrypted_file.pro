@@ -19,6 +19,8 @@ SOURCES += test_encrypted_file.cc \
     ../../encryption_key.cc \
     ../../encryption.cc \
     ../../encrypted_file.cc \
+    ../../adler32.cc \
+    ../../mt.cc \
     ../../file.cc \
     ../../dir.cc \
     ../../zbackup.pb.cc
@@ -31,6 +33,7 @@ HEADERS += \
     ../../random.hh \
     ../../encryption_key.hh \
     ../../encrypted_file.hh \
+    ../../mt.hh \
     ../../encryption.hh \
     ../../ex.hh \
     ../../file.hh \
@@ -0,0 +1,26 @@
+######################################################################
+# Round-trips random instruction sequences through both encodings
+######################################################################
+
+TEMPLATE = app
+TARGET = 
+DEPENDPATH += .
+INCLUDEPATH += .
+LIBS += -lcrypto -lprotobuf
+
+CONFIG = release
+
+# Input
+SOURCES += test_instruction_stream.cc \
+    ../../chunk_id.cc \
+    ../../instruction_stream.cc \
+    ../../message.cc \
+    ../../rolling_hash.cc \
+    ../../zbackup.pb.cc
+
+HEADERS += \
+    ../../chunk_id.hh \
+    ../../instruction_stream.hh \
+    ../../message.hh \
+    ../../rolling_hash.hh \
+    ../../zbackup.pb.h
@@ -0,0 +1,153 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+// Encodes random instruction sequences with InstructionWriter, and with
+// protobuf as BackupInstruction messages, and checks InstructionReader gives
+// them back from both. The sequences mix new chunks, repeated ones, runs of
+// repeated ones and bytes, and the last one overflows the chunk table. The
+// encoded data is read in small pieces, so the records and the chunk ids get
+// split between them
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "../../check.hh"
+#include "../../chunk_id.hh"
+#include "../../instruction_stream.hh"
+#include "../../message.hh"
+#include "../../zbackup.pb.h"
+
+struct Expected
+{
+  bool hasChunk;
+  ChunkId chunkId;
+  string bytes;
+};
+
+static ChunkId makeId( unsigned value )
+{
+  char blob[ ChunkId::BlobSize ];
+  memset( blob, 0, sizeof( blob ) );
+  memcpy( blob, &value, sizeof( value ) );
+  // The rolling hash part is what the chunk table hashes
+  memcpy( blob + sizeof( ChunkId::CryptoHashPart ), &value, sizeof( value ) );
+
+  ChunkId id;
+  id.setFromBlob( blob );
+  return id;
+}
+
+static void decode( string const & encoded, uint32_t format,
+                    std::vector< Expected > const & expected )
+{
+  google::protobuf::io::ArrayInputStream is( encoded.data(), encoded.size(),
+                                             1 + rand() % 50 );
+  InstructionReader reader( is, format );
+  Instruction instr;
+
+  for ( size_t x = 0; x < expected.size(); ++x )
+  {
+    CHECK( reader.readNext( instr ), "instruction %zu missing", x );
+    CHECK( instr.hasChunk == expected[ x ].hasChunk &&
+           string( instr.bytes, instr.bytesSize ) == expected[ x ].bytes &&
+           ( !instr.hasChunk || !memcmp( &instr.chunkId,
+                                         &expected[ x ].chunkId,
+                                         sizeof( instr.chunkId ) ) ),
+           "instruction %zu differs", x );
+  }
+
+  CHECK( !reader.readNext( instr ), "extra instructions at the end" );
+}
+
+static void check( unsigned count, unsigned distinct )
+{
+  std::vector< Expected > expected;
+
+  for ( unsigned x = 0; x < count; ++x )
+  {
+    Expected instr;
+
+    switch ( rand() % 8 )
+    {
+      case 0:
+        instr.hasChunk = false;
+        instr.bytes.resize( rand() % 200 );
+        for ( size_t y = 0; y < instr.bytes.size(); ++y )
+          instr.bytes[ y ] = rand();
+        expected.push_back( instr );
+      break;
+
+      case 1:
+      case 2:
+        // A run of the chunks following the one before
+        if ( !expected.empty() && expected.back().hasChunk )
+        {
+          unsigned value;
+          memcpy( &value, expected.back().chunkId.cryptoHash, sizeof( value ) );
+          for ( unsigned y = rand() % 10; y--; )
+          {
+            instr.hasChunk = true;
+            instr.chunkId = makeId( ++value % distinct );
+            expected.push_back( instr );
+          }
+        }
+      break;
+
+      default:
+        instr.hasChunk = true;
+        instr.chunkId = makeId( rand() % distinct );
+        expected.push_back( instr );
+    }
+  }
+
+  string compact, legacy;
+
+  {
+    InstructionWriter writer( compact );
+    google::protobuf::io::StringOutputStream legacyStream( &legacy );
+    google::protobuf::io::CodedOutputStream legacyCoded( &legacyStream );
+
+    for ( size_t x = 0; x < expected.size(); ++x )
+    {
+      BackupInstruction instr;
+
+      if ( expected[ x ].hasChunk )
+      {
+        writer.addChunk( expected[ x ].chunkId );
+        instr.set_chunk_to_emit( expected[ x ].chunkId.toBlob() );
+      }
+      else
+      {
+        writer.addBytes( expected[ x ].bytes.data(), expected[ x ].bytes.size() );
+        instr.set_bytes_to_emit( expected[ x ].bytes );
+      }
+
+      Message::serialize( instr, legacyCoded );
+    }
+
+    writer.flush();
+  }
+
+  decode( compact, CompactInstructionFormat, expected );
+  decode( legacy, LegacyInstructionFormat, expected );
+
+  printf( "%zu instructions, %zu bytes encoded, %zu in the legacy format\n",
+          expected.size(), compact.size(), legacy.size() );
+}
+
+int main()
+{
+  for ( unsigned iteration = 0; iteration < 20; ++iteration )
+    check( 1 + rand() % 20000, 1 + rand() % 5000 );
+
+  // More distinct chunks than the table holds
+  check( 3000000, InstructionWriter::MaxTableSize * 2 );
+
+  printf( "Instruction stream test passed\n" );
+
+  return 0;
+}
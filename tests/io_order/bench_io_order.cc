@@ -0,0 +1,139 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+// Writes a number of bundle-sized files with random hex names, the way
+// bundles are written by consecutive backups, then reads all of them back on
+// a cold cache in the name order and in each of the io.order modes. Prints the
+// time taken and the total distance the disk head would have to travel. Run it
+// on the filesystem you keep your repository on -- on tmpfs it shows nothing.
+
+#include <algorithm>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "../../io_order.hh"
+
+using std::string;
+using std::vector;
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void dropCache( string const & fileName )
+{
+  int fd = open( fileName.c_str(), O_RDONLY );
+  if ( fd < 0 )
+    return;
+  fdatasync( fd );
+  posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED );
+  close( fd );
+}
+
+static void readAll( string const & fileName, vector< char > & buffer )
+{
+  int fd = open( fileName.c_str(), O_RDONLY );
+  if ( fd < 0 )
+  {
+    perror( fileName.c_str() );
+    exit( EXIT_FAILURE );
+  }
+  while ( read( fd, &buffer[ 0 ], buffer.size() ) > 0 ) ;
+  close( fd );
+}
+
+static void run( char const * title, vector< string > const & fileNames,
+                 vector< size_t > const & order, size_t fileSize )
+{
+  for ( size_t x = 0; x < fileNames.size(); ++x )
+    dropCache( fileNames[ x ] );
+
+  // Sum of the distances between the end of one file and the start of the
+  // next one, according to their first extents
+  uint64_t distance = 0;
+  uint64_t previousEnd = 0;
+  for ( size_t x = 0; x < order.size(); ++x )
+  {
+    uint64_t start = IoOrder::getLocationKey( fileNames[ order[ x ] ],
+                                              IoOrder::Extent );
+    if ( x )
+      distance += start > previousEnd ? start - previousEnd : previousEnd - start;
+    previousEnd = start + fileSize;
+  }
+
+  vector< char > buffer( 1024 * 1024 );
+  double started = now();
+  for ( size_t x = 0; x < order.size(); ++x )
+    readAll( fileNames[ order[ x ] ], buffer );
+  double elapsed = now() - started;
+
+  printf( "%-8s %8.2f s %10.1f MiB/s %14.1f MiB of head travel\n", title,
+          elapsed, fileNames.size() * fileSize / 1048576.0 / elapsed,
+          distance / 1048576.0 );
+}
+
+int main( int argc, char * argv[] )
+{
+  if ( argc < 2 )
+  {
+    fprintf( stderr, "Usage: %s <directory> [file count] [file size in KiB]\n",
+             argv[ 0 ] );
+    return EXIT_FAILURE;
+  }
+
+  string dir( argv[ 1 ] );
+  size_t count = argc > 2 ? atoi( argv[ 2 ] ) : 256;
+  size_t fileSize = ( argc > 3 ? atoi( argv[ 3 ] ) : 2048 ) * 1024;
+
+  vector< char > data( fileSize );
+  for ( size_t x = 0; x < data.size(); ++x )
+    data[ x ] = rand();
+
+  // Files are written one after another, as consecutive backups do, but are
+  // named randomly, as bundles are
+  vector< string > fileNames;
+  for ( size_t x = 0; x < count; ++x )
+  {
+    char name[ 32 ];
+    snprintf( name, sizeof( name ), "/%08x%08x", rand(), rand() );
+    fileNames.push_back( dir + name );
+
+    // Flush each file right away so delayed allocation places them in the
+    // order of creation
+    FILE * f = fopen( fileNames.back().c_str(), "wb" );
+    if ( !f || fwrite( &data[ 0 ], data.size(), 1, f ) != 1 || fflush( f ) != 0 ||
+         fdatasync( fileno( f ) ) != 0 || fclose( f ) != 0 )
+    {
+      perror( fileNames.back().c_str() );
+      return EXIT_FAILURE;
+    }
+  }
+
+  // The name order is what a directory listing or a hash map of bundle ids
+  // gives
+  std::sort( fileNames.begin(), fileNames.end() );
+
+  printf( "%zu files of %zu KiB each\n", count, fileSize / 1024 );
+
+  run( "name", fileNames, IoOrder::getOrder( fileNames, IoOrder::None ),
+       fileSize );
+  run( "inode", fileNames, IoOrder::getOrder( fileNames, IoOrder::Inode ),
+       fileSize );
+  run( "extent", fileNames, IoOrder::getOrder( fileNames, IoOrder::Extent ),
+       fileSize );
+
+  for ( size_t x = 0; x < fileNames.size(); ++x )
+    unlink( fileNames[ x ].c_str() );
+
+  return EXIT_SUCCESS;
+}
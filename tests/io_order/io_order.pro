@@ -0,0 +1,21 @@
+######################################################################
+# Cold cache benchmark for the io.order bundle visiting modes
+######################################################################
+
+TEMPLATE = app
+TARGET = 
+DEPENDPATH += .
+INCLUDEPATH += .
+
+CONFIG = release
+
+# Input
+SOURCES += bench_io_order.cc \
+    ../../io_order.cc \
+    ../../debug.cc \
+    ../../dir.cc
+
+HEADERS += \
+    ../../io_order.hh \
+    ../../debug.hh \
+    ../../dir.hh
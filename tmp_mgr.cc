@@ -3,6 +3,7 @@
 
 #include "tmp_mgr.hh"
 
+#include <errno.h>
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -45,10 +46,19 @@ sptr< TemporaryFile > TmpMgr::makeTemporaryFile()
   string name( Dir::addPath( path, "XXXXXX") );
 
   int fd = mkstemp( &name[ 0 ] );
-  if ( fchmod ( fd, S_IRUSR | S_IWUSR | S_IRGRP ) != 0 )
+  if ( fd == -1 && errno == ENOENT )
+  {
+    // Another process sharing the directory may have just removed it on exit
+    if ( !Dir::exists( path ) )
+      Dir::create( path );
+    name = Dir::addPath( path, "XXXXXX" );
+    fd = mkstemp( &name[ 0 ] );
+  }
+
+  if ( fd == -1 )
     throw exCantCreate( path );
 
-  if ( fd == -1 || close( fd ) != 0 )
+  if ( fchmod ( fd, S_IRUSR | S_IWUSR | S_IRGRP ) != 0 || close( fd ) != 0 )
     throw exCantCreate( path );
 
   return new TemporaryFile( name );
@@ -7,6 +7,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "check.hh"
@@ -15,6 +16,7 @@
 
 #if defined( __APPLE__ ) || defined( __OpenBSD__ ) || defined(__FreeBSD__) || defined(__CYGWIN__)
 #define lseek64 lseek
+#define pread64 pread
 #endif
 
 
@@ -60,6 +62,35 @@ size_t UnbufferedFile::read( void * buf, size_t size )
   return size - left;
 }
 
+size_t UnbufferedFile::readAt( void * buf, size_t size, Offset offset )
+  throw( exReadError )
+{
+  char * next = ( char * ) buf;
+  size_t left = size;
+
+  while( left )
+  {
+    ssize_t rd = ::pread64( fd, next, left, offset );
+    if ( rd < 0 )
+    {
+      if ( errno != EINTR )
+        throw exReadError();
+    }
+    else
+    if ( rd > 0 )
+    {
+      CHECK( ( size_t ) rd <= left, "read too many bytes from a file" );
+      next += rd;
+      left -= rd;
+      offset += rd;
+    }
+    else
+      break;
+  }
+
+  return size - left;
+}
+
 void UnbufferedFile::write( void const * buf, size_t size )
   throw( exWriteError )
 {
@@ -106,6 +137,33 @@ void UnbufferedFile::seek( Offset offset ) throw( exSeekError )
     throw exSeekError();
 }
 
+void UnbufferedFile::adviseSequential() throw()
+{
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+  posix_fadvise( fd, 0, 0, POSIX_FADV_WILLNEED );
+#endif
+}
+
+void const * UnbufferedFile::map( size_t size ) throw()
+{
+  if ( !size )
+    return NULL;
+
+  void * result = mmap( NULL, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  if ( result == MAP_FAILED )
+    return NULL;
+
+  madvise( result, size, MADV_SEQUENTIAL );
+
+  return result;
+}
+
+void UnbufferedFile::unmap( void const * data, size_t size ) throw()
+{
+  munmap( const_cast< void * >( data ), size );
+}
+
 UnbufferedFile::~UnbufferedFile() throw()
 {
   close( fd );
@@ -12,12 +12,9 @@
 #include "ex.hh"
 #include "nocopy.hh"
 
-/// A file which does not employ its own buffering.
-/// TODO: add support for memory-mapped I/O, with the interface which would look
-/// like that of a zero-copy stream. However, since we can do encryption in-
-/// place, both interfaces should be available - when there's no memory-mapped
-/// I/O available, the user should still provide its own buffer (and then do
-/// in-place encryption in it).
+/// A file which does not employ its own buffering. Files can also be mapped
+/// into memory for reading, which EncryptedFile::InputStream uses to provide
+/// a zero-copy interface when there's no decryption to be done in its buffer
 class UnbufferedFile: NoCopy
 {
 public:
@@ -45,6 +42,11 @@ public:
   /// file was reached
   size_t read( void * buf, size_t size ) throw( exReadError );
 
+  /// Reads up to 'size' bytes at the given offset into the buffer, not
+  /// changing the current file offset. Returns the number of bytes read, same
+  /// as read() does. Can be used from several threads at once
+  size_t readAt( void * buf, size_t size, Offset ) throw( exReadError );
+
   /// Writes 'size' bytes
   void write( void const * buf, size_t size ) throw( exWriteError );
 
@@ -57,6 +59,18 @@ public:
   /// Seeks to the given offset, relative to the beginning
   void seek( Offset ) throw( exSeekError );
 
+  /// Tells the kernel the file is going to be read sequentially from start to
+  /// end, so it reads ahead aggressively. It is only a hint, so nothing is
+  /// reported if the system doesn't support it
+  void adviseSequential() throw();
+
+  /// Maps the first 'size' bytes of the file into memory for reading. Returns
+  /// NULL if that is not possible, e.g. when 'size' is zero. The mapping stays
+  /// valid after the file is closed, until it is released with unmap()
+  void const * map( size_t size ) throw();
+
+  static void unmap( void const *, size_t size ) throw();
+
   ~UnbufferedFile() throw();
 
 private:
@@ -0,0 +1,254 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "unix_socket.hh"
+
+#include "endian.hh"
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+namespace UnixSocket {
+
+namespace {
+/// Fills in the address of the socket at the given path. Returns false if
+/// the path is too long
+bool makeAddress( string const & path, sockaddr_un & address )
+{
+  if ( path.size() >= sizeof( address.sun_path ) )
+    return false;
+
+  memset( &address, 0, sizeof( address ) );
+  address.sun_family = AF_UNIX;
+  memcpy( address.sun_path, path.c_str(), path.size() + 1 );
+
+  return true;
+}
+
+int connectTo( sockaddr_un const & address )
+{
+  int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( fd < 0 )
+    return -1;
+
+  if ( connect( fd, ( sockaddr const * ) &address, sizeof( address ) ) != 0 )
+  {
+    int savedErrno = errno;
+    close( fd );
+    errno = savedErrno;
+    return -1;
+  }
+
+  return fd;
+}
+}
+
+Connection::Connection( int fd ): sock( fd )
+{
+}
+
+Connection::Connection( string const & path )
+{
+  sockaddr_un address;
+  if ( !makeAddress( path, address ) ||
+       ( sock = connectTo( address ) ) < 0 )
+    throw exCantConnect( path );
+}
+
+void Connection::send( MessageLite const & message, int fd )
+{
+  string data( sizeof( uint32_t ), 0 );
+  if ( !message.AppendToString( &data ) )
+    throw exCantSend();
+
+  uint32_t size = toLittleEndian( ( uint32_t ) ( data.size() - sizeof( size ) ) );
+  memcpy( &data[ 0 ], &size, sizeof( size ) );
+
+  char control[ CMSG_SPACE( sizeof( int ) ) ];
+  size_t sent = 0;
+
+  while ( sent < data.size() )
+  {
+    iovec iov;
+    iov.iov_base = &data[ sent ];
+    iov.iov_len = data.size() - sent;
+
+    msghdr header;
+    memset( &header, 0, sizeof( header ) );
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+
+    // The descriptor goes along with the first byte
+    if ( fd >= 0 && !sent )
+    {
+      memset( control, 0, sizeof( control ) );
+      header.msg_control = control;
+      header.msg_controllen = sizeof( control );
+
+      cmsghdr * cmsg = CMSG_FIRSTHDR( &header );
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN( sizeof( int ) );
+      memcpy( CMSG_DATA( cmsg ), &fd, sizeof( int ) );
+    }
+
+    ssize_t rv = sendmsg( sock, &header, MSG_NOSIGNAL );
+    if ( rv < 0 )
+    {
+      if ( errno == EINTR )
+        continue;
+      throw exCantSend();
+    }
+
+    sent += rv;
+  }
+}
+
+void Connection::receiveBytes( void * data, size_t size, int & fd )
+{
+  char * next = ( char * ) data;
+
+  while ( size )
+  {
+    iovec iov;
+    iov.iov_base = next;
+    iov.iov_len = size;
+
+    char control[ CMSG_SPACE( sizeof( int ) ) ];
+
+    msghdr header;
+    memset( &header, 0, sizeof( header ) );
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof( control );
+
+    ssize_t rv = recvmsg( sock, &header, 0 );
+    if ( rv < 0 )
+    {
+      if ( errno == EINTR )
+        continue;
+      throw exCantReceive();
+    }
+
+    if ( !rv )
+      throw exCantReceive(); // The other side has gone away
+
+    for ( cmsghdr * cmsg = CMSG_FIRSTHDR( &header ); cmsg;
+          cmsg = CMSG_NXTHDR( &header, cmsg ) )
+      if ( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+           cmsg->cmsg_len == CMSG_LEN( sizeof( int ) ) )
+      {
+        int received;
+        memcpy( &received, CMSG_DATA( cmsg ), sizeof( int ) );
+        if ( fd >= 0 )
+          close( fd );
+        fd = received;
+      }
+
+    next += rv;
+    size -= rv;
+  }
+}
+
+void Connection::receive( MessageLite & message, int * fdOut )
+{
+  int fd = -1;
+
+  try
+  {
+    uint32_t size;
+    receiveBytes( &size, sizeof( size ), fd );
+    size = fromLittleEndian( size );
+
+    if ( size > MaxMessageSize )
+      throw exMessageTooLarge();
+
+    string data( size, 0 );
+    if ( size )
+      receiveBytes( &data[ 0 ], size, fd );
+
+    if ( !message.ParseFromString( data ) )
+      throw exCantReceive();
+  }
+  catch( ... )
+  {
+    if ( fd >= 0 )
+      close( fd );
+    throw;
+  }
+
+  if ( fdOut )
+    *fdOut = fd;
+  else
+  if ( fd >= 0 )
+    close( fd );
+}
+
+Connection::~Connection()
+{
+  close( sock );
+}
+
+Listener::Listener( string const & path ): path( path )
+{
+  sockaddr_un address;
+  if ( !makeAddress( path, address ) )
+    throw exCantListen( path );
+
+  // A socket nobody listens on any more is a leftover and can be replaced
+  int existing = connectTo( address );
+  if ( existing >= 0 )
+  {
+    close( existing );
+    throw exCantListen( path + " (in use by another process)" );
+  }
+  if ( errno == ECONNREFUSED )
+    unlink( path.c_str() );
+
+  sock = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( sock < 0 )
+    throw exCantListen( path );
+
+  // Whoever can connect can read and write the backups, so only the owner
+  // may. The mask is used since changing the mode after bind() would leave
+  // a window
+  mode_t savedMask = umask( 0077 );
+  int rv = bind( sock, ( sockaddr const * ) &address, sizeof( address ) );
+  umask( savedMask );
+
+  if ( rv != 0 || listen( sock, SOMAXCONN ) != 0 )
+  {
+    close( sock );
+    throw exCantListen( path );
+  }
+}
+
+int Listener::accept()
+{
+  for ( ; ; )
+  {
+    int fd = ::accept( sock, NULL, NULL );
+    if ( fd >= 0 )
+      return fd;
+    if ( errno != EINTR && errno != ECONNABORTED )
+      throw exCantAccept();
+  }
+}
+
+Listener::~Listener()
+{
+  close( sock );
+  unlink( path.c_str() );
+}
+
+}
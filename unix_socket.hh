@@ -0,0 +1,84 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef UNIX_SOCKET_HH_INCLUDED
+#define UNIX_SOCKET_HH_INCLUDED
+
+#include <google/protobuf/message_lite.h>
+#include <exception>
+#include <string>
+
+#include "ex.hh"
+#include "nocopy.hh"
+
+using std::string;
+
+/// Unix domain stream sockets carrying protobuf messages. Each message may
+/// pass a file descriptor along with it
+namespace UnixSocket {
+
+DEF_EX( Ex, "Unix socket exception", std::exception )
+DEF_EX_STR( exCantListen, "Can't listen on socket", Ex )
+DEF_EX_STR( exCantConnect, "Can't connect to socket", Ex )
+DEF_EX( exCantAccept, "Can't accept a connection", Ex )
+DEF_EX( exCantSend, "Can't send a message", Ex )
+DEF_EX( exCantReceive, "Can't receive a message", Ex )
+DEF_EX( exMessageTooLarge, "The message received is too large", Ex )
+
+using google::protobuf::MessageLite;
+
+class Connection: NoCopy
+{
+public:
+  /// Takes over the given connected socket
+  explicit Connection( int fd );
+
+  /// Connects to the socket at the given path
+  explicit Connection( string const & path );
+
+  /// Sends the message, passing the given file descriptor along with it
+  /// unless it's -1
+  void send( MessageLite const &, int fd = -1 );
+
+  /// Receives a message. The file descriptor passed along with it, if any, is
+  /// stored in 'fd', which then has to be closed by the caller. -1 is stored
+  /// if there was none
+  void receive( MessageLite &, int * fd = NULL );
+
+  ~Connection();
+
+private:
+  enum
+  {
+    MaxMessageSize = 1024 * 1024
+  };
+
+  /// Receives exactly 'size' bytes. Picks up the descriptor passed along
+  /// with them, if any
+  void receiveBytes( void * data, size_t size, int & fd );
+
+  int sock;
+};
+
+/// A socket accepting connections
+class Listener: NoCopy
+{
+public:
+  /// Creates the socket, accessible by the owner only. A socket left over by
+  /// a process which is gone gets replaced, but not one still in use
+  explicit Listener( string const & path );
+
+  /// Waits for the next connection and returns its socket
+  int accept();
+
+  /// Closes and removes the socket
+  ~Listener();
+
+private:
+  string path;
+  int sock;
+};
+
+}
+
+#endif
@@ -0,0 +1,571 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#include "verifier.hh"
+
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <algorithm>
+
+#include "adler32.hh"
+#include "backup_file.hh"
+#include "backup_restorer.hh"
+#include "bundle.hh"
+#include "chunk_id.hh"
+#include "debug.hh"
+#include "dir.hh"
+#include "endian.hh"
+#include "index_file.hh"
+#include "message.hh"
+#include "sha256.hh"
+#include "utils.hh"
+
+namespace {
+
+uint64_t getMicroseconds()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return uint64_t( ts.tv_sec ) * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t getFileSize( string const & fileName )
+{
+  struct stat st;
+  if ( stat( fileName.c_str(), &st ) != 0 )
+    return 0;
+  return st.st_size;
+}
+
+/// Bundles are stored as xx/xxxx..., where xx is the first byte of the id
+string getBundleName( Bundle::Id const & id )
+{
+  string hex( Utils::toHex( ( unsigned char const * ) &id, sizeof( id ) ) );
+  return hex.substr( 0, 2 ) + Dir::separator() + hex;
+}
+
+/// The reverse of getBundleName(). Returns false if the name isn't one of a
+/// bundle
+bool getBundleId( string const & name, Bundle::Id & id )
+{
+  size_t const start = 3;
+  if ( name.size() != start + Bundle::IdSize * 2 ||
+       name[ 2 ] != Dir::separator() || name.compare( 0, 2, name, start, 2 ) )
+    return false;
+
+  for ( size_t x = 0; x < Bundle::IdSize; ++x )
+  {
+    unsigned char byte = 0;
+    for ( size_t y = 0; y < 2; ++y )
+    {
+      char c = name[ start + x * 2 + y ];
+      byte <<= 4;
+      if ( c >= '0' && c <= '9' )
+        byte |= c - '0';
+      else
+      if ( c >= 'a' && c <= 'f' )
+        byte |= c - 'a' + 10;
+      else
+        return false;
+    }
+    id.blob[ x ] = byte;
+  }
+
+  return true;
+}
+
+/// Hashes the ids and the sizes of the chunk records, so the ones of a bundle
+/// can be compared with the ones of its index record without keeping the
+/// latter around
+uint64_t hashChunkRecords( BundleInfo const & info )
+{
+  Sha256 sha256;
+  for ( int x = 0; x < info.chunk_record_size(); ++x )
+  {
+    BundleInfo_ChunkRecord const & record = info.chunk_record( x );
+    uint32_t size = toLittleEndian( ( uint32_t ) record.size() );
+    sha256.add( record.id().data(), record.id().size() );
+    sha256.add( &size, sizeof( size ) );
+  }
+
+  char digest[ Sha256::Size ];
+  sha256.finish( digest );
+
+  uint64_t result;
+  memcpy( &result, digest, sizeof( result ) );
+  return result;
+}
+
+/// Rehashes each chunk of a bundle and compares it to its id
+class ChunkChecker: public Bundle::Reader::ChunkVisitor
+{
+  ChunkId id;
+
+public:
+  virtual bool wantsChunk( size_t )
+  { return true; }
+
+  virtual void visitChunk( string const & chunkId, void const * data,
+                           size_t size )
+  {
+    id.setFromData( data, size );
+    if ( id.toBlob() != chunkId )
+      throw Verifier::exChunkMismatch();
+  }
+};
+
+string toJsonString( string const & in )
+{
+  string out( 1, '"' );
+  for ( string::const_iterator i = in.begin(); i != in.end(); ++i )
+  {
+    unsigned char c = *i;
+    if ( c == '"' || c == '\\' )
+    {
+      out += '\\';
+      out += c;
+    }
+    else
+    if ( c < 0x20 )
+    {
+      char escaped[ 8 ];
+      snprintf( escaped, sizeof( escaped ), "\\u%04x", c );
+      out += escaped;
+    }
+    else
+      out += c;
+  }
+  out += '"';
+  return out;
+}
+
+}
+
+Verifier::RateLimiter::RateLimiter( size_t bytesPerSecond ):
+  bytesPerSecond( bytesPerSecond ), nextFreeMicroseconds( 0 )
+{
+}
+
+void Verifier::RateLimiter::consume( uint64_t bytes )
+{
+  if ( !bytesPerSecond )
+    return;
+
+  uint64_t wait;
+  {
+    Lock _( mutex );
+    uint64_t now = getMicroseconds();
+    if ( nextFreeMicroseconds < now )
+      nextFreeMicroseconds = now;
+    wait = nextFreeMicroseconds - now;
+    nextFreeMicroseconds += bytes * 1000000 / bytesPerSecond;
+  }
+
+  if ( wait )
+  {
+    struct timespec ts;
+    ts.tv_sec = wait / 1000000;
+    ts.tv_nsec = ( wait % 1000000 ) * 1000;
+    nanosleep( &ts, NULL );
+  }
+}
+
+Verifier::Verifier( EncryptionKey const & key, Config const & config,
+                    bool deep, FILE * reportFile ):
+  key( key ), config( config ), deep( deep ), reportFile( reportFile ),
+  rateLimiter( config.runtime.verifyRate ), started( getMicroseconds() ),
+  indexesOk( true ), nextBundle( 0 ), filesChecked( 0 ), bytesChecked( 0 ),
+  chunksChecked( 0 ), errors( 0 ), warnings( 0 )
+{
+}
+
+void Verifier::verifyIndexes( string const & indexPath )
+{
+  verbosePrintf( "Checking index files...\n" );
+
+  std::vector< string > names;
+  Dir::Listing listing( indexPath );
+  Dir::Entry entry;
+  while ( listing.getNext( entry ) )
+    if ( !entry.isDir() )
+      names.push_back( entry.getFileName() );
+
+  std::sort( names.begin(), names.end() );
+
+  for ( size_t x = 0; x < names.size(); ++x )
+  {
+    string fileName( Dir::addPath( indexPath, names[ x ] ) );
+    uint64_t bytes = getFileSize( fileName );
+    size_t records = 0;
+
+    rateLimiter.consume( bytes );
+
+    try
+    {
+      IndexFile::Reader reader( key, fileName );
+      BundleInfo info;
+      Bundle::Id id;
+
+      while ( reader.readNextRecord( info, id ) )
+      {
+        IndexedBundle indexed;
+        indexed.id = id;
+        indexed.records = info.chunk_record_size();
+        indexed.recordsHash = deep ? hashChunkRecords( info ) : 0;
+        indexedBundles.push_back( indexed );
+        ++records;
+      }
+
+      report( "index", names[ x ], "ok", string(), bytes, records );
+    }
+    catch( std::exception & e )
+    {
+      indexesOk = false;
+      report( "index", names[ x ], "error", e.what(), bytes, records );
+    }
+  }
+
+  // A bundle listed more than once is only remembered once
+  std::sort( indexedBundles.begin(), indexedBundles.end() );
+  size_t unique = 0;
+  for ( size_t x = 0; x < indexedBundles.size(); ++x )
+    if ( !unique || indexedBundles[ unique - 1 ].id != indexedBundles[ x ].id )
+      indexedBundles[ unique++ ] = indexedBundles[ x ];
+  indexedBundles.resize( unique );
+}
+
+Verifier::IndexedBundle const * Verifier::findIndexedBundle(
+  string const & name ) const
+{
+  IndexedBundle key;
+  if ( !getBundleId( name, key.id ) )
+    return NULL;
+
+  std::vector< IndexedBundle >::const_iterator i =
+    std::lower_bound( indexedBundles.begin(), indexedBundles.end(), key );
+  if ( i == indexedBundles.end() || i->id != key.id )
+    return NULL;
+
+  return &*i;
+}
+
+void Verifier::verifyBundles( string const & bundlesPath_ )
+{
+  verbosePrintf( "Checking bundles...\n" );
+
+  bundlesPath = bundlesPath_;
+  bundleNames.clear();
+  nextBundle = 0;
+
+  Dir::Listing listing( bundlesPath );
+  Dir::Entry entry;
+  while ( listing.getNext( entry ) )
+  {
+    if ( !entry.isDir() )
+      continue;
+
+    Dir::Listing subListing( Dir::addPath( bundlesPath,
+                                           entry.getFileName() ) );
+    Dir::Entry subEntry;
+    while ( subListing.getNext( subEntry ) )
+      if ( !subEntry.isDir() )
+        bundleNames.push_back( entry.getFileName() + Dir::separator() +
+                               subEntry.getFileName() );
+  }
+
+  std::sort( bundleNames.begin(), bundleNames.end() );
+
+  size_t threads = std::min( config.runtime.threads, bundleNames.size() );
+  std::vector< sptr< Worker > > workers;
+  for ( size_t x = 0; x < threads; ++x )
+  {
+    workers.push_back( new Worker( *this ) );
+    workers.back()->start();
+  }
+
+  for ( size_t x = 0; x < workers.size(); ++x )
+    workers[ x ]->join();
+
+  // Now compare the bundles present with the ones the indexes list
+  std::vector< Bundle::Id > present;
+  present.reserve( bundleNames.size() );
+  for ( size_t x = 0; x < bundleNames.size(); ++x )
+  {
+    Bundle::Id id;
+    if ( getBundleId( bundleNames[ x ], id ) )
+      present.push_back( id );
+  }
+  std::sort( present.begin(), present.end() );
+
+  for ( size_t x = 0; x < indexedBundles.size(); ++x )
+    if ( !std::binary_search( present.begin(), present.end(),
+                              indexedBundles[ x ].id ) )
+      report( "bundle", getBundleName( indexedBundles[ x ].id ), "missing",
+              "listed in an index file, but doesn't exist", 0, 0 );
+
+  // Unless some index file couldn't be read, the bundles not listed anywhere
+  // are just garbage left by interrupted backups
+  if ( indexesOk )
+    for ( size_t x = 0; x < bundleNames.size(); ++x )
+      if ( !findIndexedBundle( bundleNames[ x ] ) )
+        report( "bundle", bundleNames[ x ], "unindexed", "not listed in any "
+                "index file", 0, 0 );
+}
+
+void * Verifier::Worker::threadFunction() throw()
+{
+  verifier.bundleWorker();
+  return NULL;
+}
+
+void Verifier::bundleWorker()
+{
+  for ( ; ; )
+  {
+    string name;
+    {
+      Lock _( mutex );
+      if ( nextBundle == bundleNames.size() )
+        return;
+      name = bundleNames[ nextBundle++ ];
+    }
+
+    string fileName( Dir::addPath( bundlesPath, name ) );
+    uint64_t bytes = getFileSize( fileName );
+
+    rateLimiter.consume( bytes );
+
+    try
+    {
+      size_t chunks = verifyBundle( fileName, name );
+      report( "bundle", name, "ok", string(), bytes, chunks );
+    }
+    catch( std::exception & e )
+    {
+      report( "bundle", name, "error", e.what(), bytes, 0 );
+    }
+  }
+}
+
+size_t Verifier::verifyBundle( string const & fileName, string const & name )
+{
+  if ( !deep )
+  {
+    // Decrypt everything and check both adler32 values. This doesn't need the
+    // payload to be decompressed
+    EncryptedFile::InputStream is( fileName.c_str(), key,
+                                   Encryption::ZeroIv );
+    is.consumeRandomIv();
+
+    BundleFileHeader header;
+    Message::parse( header, is );
+
+    BundleInfo info;
+    Message::parse( info, is );
+    is.checkAdler32();
+
+    checkTrailingAdler32( is );
+
+    return info.chunk_record_size();
+  }
+
+  // The reader checks the adler32 of the payload, or of each of the frames,
+  // while decompressing it, so the file is only read once
+  Bundle::Reader reader( fileName, key );
+  ChunkChecker checker;
+  reader.forEachChunk( checker );
+
+  BundleInfo info = reader.getBundleInfo();
+
+  IndexedBundle const * indexed = findIndexedBundle( name );
+  if ( indexed && ( indexed->records != ( uint32_t ) info.chunk_record_size() ||
+                    indexed->recordsHash != hashChunkRecords( info ) ) )
+    throw exIndexMismatch();
+
+  return info.chunk_record_size();
+}
+
+void Verifier::checkTrailingAdler32( EncryptedFile::InputStream & is )
+{
+  Adler32 adler32( is.getAdler32() );
+
+  // The last bytes seen so far, which might turn out to be the adler32
+  char tail[ sizeof( Adler32::Value ) ];
+  size_t tailSize = 0;
+
+  void const * data;
+  int size;
+  while ( is.Next( &data, &size ) )
+  {
+    char const * next = ( char const * ) data;
+
+    if ( ( size_t ) size >= sizeof( tail ) )
+    {
+      adler32.add( tail, tailSize );
+      adler32.add( next, size - sizeof( tail ) );
+      memcpy( tail, next + size - sizeof( tail ), sizeof( tail ) );
+      tailSize = sizeof( tail );
+    }
+    else
+    {
+      size_t excess = tailSize + size;
+      if ( excess > sizeof( tail ) )
+      {
+        excess -= sizeof( tail );
+        adler32.add( tail, excess );
+        memmove( tail, tail + excess, tailSize - excess );
+        tailSize -= excess;
+      }
+      memcpy( tail + tailSize, next, size );
+      tailSize += size;
+    }
+  }
+
+  if ( tailSize != sizeof( tail ) )
+    throw exTruncated();
+
+  Adler32::Value stored;
+  memcpy( &stored, tail, sizeof( stored ) );
+  if ( adler32.result() != fromLittleEndian( stored ) )
+    throw EncryptedFile::exAdlerMismatch();
+}
+
+void Verifier::verifyBackups( string const & backupsPath,
+                              string const & bundlesPath,
+                              string const & indexPath, TmpMgr & tmpMgr )
+{
+  verbosePrintf( "Checking backups...\n" );
+
+  std::vector< string > names = Utils::findOrRebuild( backupsPath );
+  std::sort( names.begin(), names.end() );
+
+  // The chunks the backups refer to can only be looked up if the index could
+  // be loaded completely
+  sptr< ChunkIndex > chunkIndex;
+  sptr< ChunkStorage::Reader > chunkStorageReader;
+  if ( deep )
+  {
+    if ( indexesOk )
+    {
+      chunkIndex = new ChunkIndex( key, tmpMgr, indexPath, false );
+      chunkStorageReader = new ChunkStorage::Reader( config, key, *chunkIndex,
+          bundlesPath, config.runtime.cacheSize );
+    }
+    else
+      report( "backups", string(), "skipped", "chunks are not looked up, since "
+              "some index files are corrupted", 0, 0 );
+  }
+
+  for ( size_t x = 0; x < names.size(); ++x )
+  {
+    string fileName( Dir::addPath( backupsPath, names[ x ] ) );
+    uint64_t bytes = getFileSize( fileName );
+    size_t chunks = 0;
+
+    rateLimiter.consume( bytes );
+
+    try
+    {
+      BackupInfo backupInfo;
+      BackupFile::load( fileName, key, backupInfo );
+
+      if ( chunkStorageReader.get() )
+      {
+        BackupRestorer::ChunkSet chunkSet;
+        BackupRestorer::restore( *chunkStorageReader, backupInfo, NULL,
+                                 &chunkSet, NULL, NULL );
+
+        size_t missing = 0;
+        for ( BackupRestorer::ChunkSet::const_iterator i = chunkSet.begin();
+              i != chunkSet.end(); ++i )
+          if ( !chunkIndex->findChunk( *i ) )
+            ++missing;
+
+        chunks = chunkSet.size();
+
+        if ( missing )
+        {
+          report( "backup", names[ x ], "error", Utils::numberToString(
+                    missing ) + " chunks are missing from the index", bytes,
+                  chunks );
+          continue;
+        }
+      }
+
+      report( "backup", names[ x ], "ok", string(), bytes, chunks );
+    }
+    catch( std::exception & e )
+    {
+      report( "backup", names[ x ], "error", e.what(), bytes, chunks );
+    }
+  }
+}
+
+void Verifier::report( char const * type, string const & name,
+                       char const * status, string const & error,
+                       uint64_t bytes, size_t chunks )
+{
+  Lock _( mutex );
+
+  bool ok = strcmp( status, "ok" ) == 0;
+  bool checked = ok || strcmp( status, "error" ) == 0;
+
+  if ( checked )
+  {
+    ++filesChecked;
+    bytesChecked += bytes;
+    chunksChecked += chunks;
+  }
+
+  if ( strcmp( status, "error" ) == 0 || strcmp( status, "missing" ) == 0 )
+    ++errors;
+  else
+  if ( !ok )
+    ++warnings;
+
+  if ( !ok )
+    verbosePrintf( "%s %s: %s\n", type, name.c_str(), error.c_str() );
+
+  string line( "{\"type\":" );
+  line += toJsonString( type );
+  if ( !name.empty() )
+    line += ",\"name\":" + toJsonString( name );
+  line += ",\"status\":" + toJsonString( status );
+  if ( checked )
+  {
+    line += ",\"bytes\":" + Utils::numberToString( bytes );
+    line += ",\"chunks\":" + Utils::numberToString( chunks );
+  }
+  if ( !ok )
+    line += ",\"error\":" + toJsonString( error );
+  line += "}\n";
+
+  fputs( line.c_str(), reportFile );
+  fflush( reportFile );
+}
+
+bool Verifier::finish()
+{
+  Lock _( mutex );
+
+  double seconds = ( getMicroseconds() - started ) / 1000000.0;
+
+  fprintf( reportFile, "{\"type\":\"summary\",\"mode\":\"%s\",\"files\":%llu,"
+           "\"bytes\":%llu,\"chunks\":%llu,\"errors\":%llu,\"warnings\":%llu,"
+           "\"seconds\":%.3f}\n", deep ? "deep" : "fast",
+           ( unsigned long long ) filesChecked,
+           ( unsigned long long ) bytesChecked,
+           ( unsigned long long ) chunksChecked,
+           ( unsigned long long ) errors, ( unsigned long long ) warnings,
+           seconds );
+  fflush( reportFile );
+
+  verbosePrintf( "Checked %llu files, %llu MiB in %.1f seconds: %llu errors, "
+                 "%llu warnings\n", ( unsigned long long ) filesChecked,
+                 ( unsigned long long ) bytesChecked / 1048576, seconds,
+                 ( unsigned long long ) errors,
+                 ( unsigned long long ) warnings );
+
+  return !errors;
+}
@@ -0,0 +1,136 @@
+// Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
+// Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
+
+#ifndef VERIFIER_HH_INCLUDED
+#define VERIFIER_HH_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include "bundle.hh"
+#include "chunk_index.hh"
+#include "chunk_storage.hh"
+#include "config.hh"
+#include "encrypted_file.hh"
+#include "encryption_key.hh"
+#include "ex.hh"
+#include "mt.hh"
+#include "nocopy.hh"
+#include "sptr.hh"
+#include "zbackup.pb.h"
+
+using std::string;
+
+/// Checks the integrity of a repository without restoring anything. In the
+/// fast mode every index, bundle and backup file is decrypted and its adler32
+/// checked. In the deep mode the bundles are also decompressed, each of their
+/// chunks is rehashed and compared to its id, the bundles are compared to
+/// their index records, and the chunks the backups refer to are looked up in
+/// the index. Each bundle is only read once in either mode: the deep mode
+/// relies on the adler32 of each frame instead of the one of the whole file.
+/// Bundles are checked by a pool of threads, at a limited rate if
+/// verify.rate is set. Each file checked and each problem found gets a line of
+/// JSON in the report
+class Verifier: NoCopy
+{
+public:
+  DEF_EX( Ex, "Verifier exception", std::exception )
+  DEF_EX( exTruncated, "file is truncated", Ex )
+  DEF_EX( exChunkMismatch, "chunk data doesn't match its id", Ex )
+  DEF_EX( exIndexMismatch, "bundle contents don't match its index record", Ex )
+
+  Verifier( EncryptionKey const &, Config const &, bool deep, FILE * report );
+
+  /// Reads all the index files, remembering the bundles they list
+  void verifyIndexes( string const & indexPath );
+
+  /// Checks all the bundle files, and reports the ones listed in the indexes
+  /// but missing and the ones not listed at all
+  void verifyBundles( string const & bundlesPath );
+
+  /// Loads all the backup files. In the deep mode, their chunks are looked up
+  /// in the index, which is only loaded if all the index files were fine
+  void verifyBackups( string const & backupsPath, string const & bundlesPath,
+                      string const & indexPath, TmpMgr & );
+
+  /// Writes the summary to the report. Returns true if no errors were found
+  bool finish();
+
+private:
+  /// Spreads the reads over time so they don't exceed the given rate
+  class RateLimiter: NoCopy
+  {
+    Mutex mutex;
+    size_t bytesPerSecond;
+    uint64_t nextFreeMicroseconds;
+  public:
+    /// Zero means no limit
+    RateLimiter( size_t bytesPerSecond );
+    /// Waits until 'bytes' more bytes can be read
+    void consume( uint64_t bytes );
+  };
+
+  class Worker: public Thread
+  {
+    Verifier & verifier;
+  public:
+    Worker( Verifier & verifier ): verifier( verifier ) {}
+  protected:
+    virtual void * threadFunction() throw();
+  };
+
+  friend class Worker;
+
+  /// Checks bundles from 'bundleNames' until none are left
+  void bundleWorker();
+
+  /// Throws on any problem found. Returns the number of chunks checked
+  size_t verifyBundle( string const & fileName, string const & name );
+
+  /// Reads the rest of the stream, checking the adler32 it ends with
+  static void checkTrailingAdler32( EncryptedFile::InputStream & );
+
+  /// Reports the result of checking a file. Empty 'status' means ok
+  void report( char const * type, string const & name, char const * status,
+               string const & error, uint64_t bytes, size_t chunks );
+
+  EncryptionKey const & key;
+  Config const & config;
+  bool deep;
+  FILE * reportFile;
+  RateLimiter rateLimiter;
+  uint64_t started;
+
+  /// What the indexes say about a bundle
+  struct IndexedBundle
+  {
+    Bundle::Id id;
+    uint32_t records;
+    /// Hash of the ids and sizes of the chunk records. Only computed in the
+    /// deep mode
+    uint64_t recordsHash;
+
+    bool operator < ( IndexedBundle const & other ) const
+    { return id < other.id; }
+  };
+
+  /// Returns the bundle with the given name relative to the bundles directory,
+  /// or NULL if the indexes don't list it
+  IndexedBundle const * findIndexedBundle( string const & name ) const;
+
+  /// Bundles listed in the indexes, sorted by their ids
+  std::vector< IndexedBundle > indexedBundles;
+  bool indexesOk;
+
+  string bundlesPath;
+  std::vector< string > bundleNames;
+
+  Mutex mutex; /// Guards everything below
+  size_t nextBundle;
+  uint64_t filesChecked, bytesChecked, chunksChecked, errors, warnings;
+};
+
+#endif
@@ -1,6 +1,7 @@
 // Copyright (c) 2012-2014 Konstantin Isakov <ikm@zbackup.org> and ZBackup contributors, see CONTRIBUTORS
 // Part of ZBackup. Licensed under GNU GPLv2 or later + OpenSSL, see LICENSE
 
+#include "encrypted_file.hh"
 #include "zutils.hh"
 #include "debug.hh"
 #include "version.hh"
@@ -11,6 +12,7 @@ DEF_EX( exSpecifyTwoKeys, "Specify password flag (--non-encrypted or --password-
 DEF_EX( exNonEncryptedWithKey, "--non-encrypted and --password-file are incompatible", std::exception )
 DEF_EX( exSpecifyEncryptionOptions, "Specify either --password-file or --non-encrypted", std::exception )
 DEF_EX( exSourceInaccessible, "Backup source file/directory is inaccessible", std::exception )
+DEF_EX( exConnectUnsupported, "Only backup and restore of single files can be done with --connect", std::exception )
 
 int main( int argc, char *argv[] )
 {
@@ -21,6 +23,7 @@ int main( int argc, char *argv[] )
     bool printHelp = false;
     vector< char const * > args;
     vector< string > passwords;
+    string connectPath;
     Config config;
 
     for( int x = 1; x < argc; ++x )
@@ -100,6 +103,22 @@ int main( int argc, char *argv[] )
         goto parse_option;
       }
       else
+      if ( strcmp( argv[ x ], "--dry-run" ) == 0 )
+        config.parseOrValidate( "gc.dry_run", Config::Runtime );
+      else
+      if ( strcmp( argv[ x ], "--parent" ) == 0 && x + 1 < argc )
+      {
+        config.parseOrValidate( string( "backup.parent=" ) + argv[ x + 1 ],
+                                Config::Runtime );
+        ++x;
+      }
+      else
+      if ( strcmp( argv[ x ], "--connect" ) == 0 && x + 1 < argc )
+      {
+        connectPath = argv[ x + 1 ];
+        ++x;
+      }
+      else
       if ( strcmp( argv[ x ], "--help" ) == 0 || strcmp( argv[ x ], "-h" ) == 0 )
       {
         printHelp = true;
@@ -142,6 +161,9 @@ invalid_option:
         args.push_back( argv[ x ] );
     }
 
+    // Set before any repository file gets opened, index files included
+    EncryptedFile::setBufferSize( config.runtime.ioBufferSize );
+
     if ( args.size() < 1 || printHelp )
     {
       fprintf( stderr,
@@ -157,6 +179,11 @@ invalid_option:
 "          password flag should be specified twice if\n"
 "          import/export/passwd command specified\n"
 "         --silent (default is verbose)\n"
+"         --dry-run makes gc only report what it would do\n"
+"         --parent <backup file name> makes a backup from file\n"
+"          reuse the chunks of the data unchanged since that backup\n"
+"         --connect <socket path> passes backup and restore to\n"
+"          a serve process, which needs no password flags then\n"
 "         --help|-h show this message\n"
 "         -O <option[=value]> (overrides runtime configuration,\n"
 "          can be specified multiple times,\n"
@@ -173,6 +200,8 @@ invalid_option:
 "    restore <backup file name> - restores a backup to stdout\n"
 "    restore <backup file name> <output file name> - restores\n"
 "            a backup to file using two-pass \"cacheless\" process\n"
+"    serve <storage path> <socket path> - keeps the storage open\n"
+"            and serves the backups and restores passed with --connect\n"
 "    nbd <backup file name> /dev/nbd0\n"
 "            start NBD server that will serve backup data as block device\n"
 "    export <source storage path> <destination storage path> -\n"
@@ -185,6 +214,9 @@ invalid_option:
 "            is fast)\n"
 "    gc [fast|deep] <storage path> - performs garbage\n"
 "            collection (default is fast)\n"
+"    verify [fast|deep] <storage path> - checks the integrity of\n"
+"            all repository files without restoring anything (default\n"
+"            is fast), writing a JSON report to stdout\n"
 "    passwd <storage path> - changes repo info file passphrase\n"
 "    config [show|edit|set|reset] <storage path> - performs\n"
 "            configuration manipulations (default is show)\n"
@@ -192,6 +224,16 @@ invalid_option:
       return EXIT_FAILURE;
     }
 
+    if ( !connectPath.empty() )
+    {
+      // The serve process does the work, and it has the password
+      if ( ( strcmp( args[ 0 ], "backup" ) != 0 &&
+             strcmp( args[ 0 ], "restore" ) != 0 ) ||
+           ( strcmp( args[ 0 ], "backup" ) == 0 && args.size() == 3 &&
+             Dir::exists( args[ 1 ] ) ) )
+        throw exConnectUnsupported();
+    }
+    else
     if ( passwords.size() > 1 &&
         ( ( passwords[ 0 ].empty() && !passwords[ 1 ].empty() ) ||
           ( !passwords[ 0 ].empty() && passwords[ 1 ].empty() ) ) &&
@@ -250,6 +292,31 @@ invalid_option:
           backupsDest = args[ 2 ];
       }
 
+      bool withParent = !config.runtime.backupParent.empty();
+      if ( withParent && ( args.size() == 2 || dirBackupMode ||
+                           !connectPath.empty() ) )
+      {
+        fprintf( stderr, "A parent backup can only be used when backing up "
+                         "a file directly\n" );
+        return EXIT_FAILURE;
+      }
+
+      if ( !withParent && !config.runtime.backupChangedExtents.empty() )
+      {
+        fprintf( stderr, "backup.changed_extents needs a parent backup\n" );
+        return EXIT_FAILURE;
+      }
+
+      if ( !connectPath.empty() )
+      {
+        ZClient zc( connectPath );
+        if ( args.size() == 2 )
+          zc.backupFromStdin( backupsDest );
+        else
+          zc.backupFromFile( args[ 1 ], backupsDest );
+        return EXIT_SUCCESS;
+      }
+
       ZBackup zb( ZBackup::deriveStorageDirFromBackupsFile( backupsDest ),
                   passwords[ 0 ], config );
       if ( args.size() == 2 )
@@ -258,6 +325,10 @@ invalid_option:
       {
         if ( dirBackupMode )
           zb.backupFromDirectory( args[ 1 ], backupsDest );
+        else
+        if ( withParent )
+          zb.backupFromFileWithParent( args[ 1 ], backupsDest,
+                                       config.runtime.backupParent );
         else
           zb.backupFromFile( args[ 1 ], backupsDest );
       }
@@ -272,6 +343,16 @@ invalid_option:
                  *argv , args[ 0 ] );
         return EXIT_FAILURE;
       }
+      if ( !connectPath.empty() )
+      {
+        ZClient zc( connectPath );
+        if ( args.size() == 3 )
+          zc.restoreToFile( args[ 1 ], args[ 2 ] );
+        else
+          zc.restoreToStdin( args[ 1 ] );
+        return EXIT_SUCCESS;
+      }
+
       ZRestore zr( ZRestore::deriveStorageDirFromBackupsFile( args[ 1 ] ),
                    passwords[ 0 ], config );
       if ( args.size() == 3 )
@@ -280,6 +361,19 @@ invalid_option:
         zr.restoreToStdin( args[ 1 ] );
     }
     else
+    if ( strcmp( args[ 0 ], "serve" ) == 0 )
+    {
+      if ( args.size() != 3 )
+      {
+        fprintf( stderr, "Usage: %s %s <storage path> <socket path>\n",
+                 *argv, args[ 0 ] );
+        return EXIT_FAILURE;
+      }
+      ZServe zs( ZBackupBase::deriveStorageDirFromBackupsFile( args[ 1 ], true ),
+                 passwords[ 0 ], config );
+      zs.serve( args[ 2 ] );
+    }
+    else
     if ( strcmp( args[ 0 ], "nbd" ) == 0 )
     {
       // Start NBD server
@@ -367,6 +461,39 @@ invalid_option:
       }
     }
     else
+    if ( strcmp( args[ 0 ], "verify" ) == 0 )
+    {
+      if ( args.size() < 2 || args.size() > 3 )
+      {
+        fprintf( stderr, "Usage: %s %s [fast|deep] <storage path>\n",
+                 *argv, args[ 0 ] );
+        return EXIT_FAILURE;
+      }
+
+      int fieldStorage = 1, fieldAction = 2;
+
+      if ( args.size() == 3 )
+      {
+        fieldStorage = 2, fieldAction = 1;
+      }
+
+      bool deep = false;
+      if ( args.size() > 2 && strcmp( args[ fieldAction ], "deep" ) == 0 )
+        deep = true;
+      else
+      if ( args.size() > 2 && strcmp( args[ fieldAction ], "fast" ) != 0 )
+      {
+        fprintf( stderr, "Usage: %s %s [fast|deep] <storage path>\n",
+                 *argv, args[ 0 ] );
+        return EXIT_FAILURE;
+      }
+
+      ZVerify zv( ZBackupBase::deriveStorageDirFromBackupsFile( args[ fieldStorage ], true ),
+          passwords[ 0 ], config );
+      if ( !zv.verify( deep ) )
+        return EXIT_FAILURE;
+    }
+    else
     if ( strcmp( args[ 0 ], "passwd" ) == 0 )
     {
       // Perform the password change
@@ -378,7 +505,7 @@ invalid_option:
       }
 
       ZBackupBase zbb( ZBackupBase::deriveStorageDirFromBackupsFile( args[ 1 ], true ),
-          passwords[ 0 ], true );
+          passwords[ 0 ], true, StorageLock::Exclusive );
 
       if ( passwords[ 0 ].empty() != passwords[ 1 ].empty() )
       {
@@ -440,7 +567,7 @@ invalid_option:
       if ( args.size() > 2 && strcmp( args[ fieldAction ], "edit" ) == 0 )
       {
         ZBackupBase zbb( ZBackupBase::deriveStorageDirFromBackupsFile( args[ fieldStorage ], true ),
-            passwords[ 0 ], true );
+            passwords[ 0 ], true, StorageLock::Exclusive );
         if ( zbb.editConfigInteractively() )
           zbb.saveExtendedStorageInfo();
       }
@@ -448,7 +575,7 @@ invalid_option:
       if ( args.size() > 2 && strcmp( args[ fieldAction ], "set" ) == 0 )
       {
         ZBackupBase zbb( ZBackupBase::deriveStorageDirFromBackupsFile( args[ fieldStorage ], true ),
-            passwords[ 0 ], config, true );
+            passwords[ 0 ], config, true, StorageLock::Exclusive );
         zbb.config.show();
         zbb.saveExtendedStorageInfo();
       }
@@ -456,7 +583,7 @@ invalid_option:
       if ( args.size() > 2 && strcmp( args[ fieldAction ], "reset" ) == 0 )
       {
         ZBackupBase zbb( ZBackupBase::deriveStorageDirFromBackupsFile( args[ fieldStorage ], true ),
-            passwords[ 0 ], true );
+            passwords[ 0 ], true, StorageLock::Exclusive );
         zbb.config.reset_storable();
         zbb.config.show();
         zbb.saveExtendedStorageInfo();
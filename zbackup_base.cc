@@ -9,8 +9,10 @@
 #include "zbackup_base.hh"
 
 #include "storage_info_file.hh"
+#include "chunk_manifest.hh"
 #include "compression.hh"
 #include "debug.hh"
+#include "utils.hh"
 
 // TODO: make configurable by cmake
 #if defined(PATH_VI)
@@ -70,8 +72,34 @@ string Paths::getBackupsPath()
   return string( Dir::addPath( storageDir, "backups" ) );
 }
 
+string Paths::getCachePath()
+{
+  return string( Dir::addPath( storageDir, "cache" ) );
+}
+
+string Paths::getInstructionTablesPath()
+{
+  return string( Dir::addPath( getCachePath(), "tables" ) );
+}
+
+string Paths::getChunkManifestsPath()
+{
+  return string( Dir::addPath( getCachePath(), "manifests" ) );
+}
+
+string Paths::getGcStatePath()
+{
+  return string( Dir::addPath( getCachePath(), "gc_state" ) );
+}
+
+string Paths::getFileStatesPath()
+{
+  return string( Dir::addPath( getCachePath(), "files" ) );
+}
+
 ZBackupBase::ZBackupBase( string const & storageDir, string const & password ):
-  Paths( storageDir ), storageInfo( loadStorageInfo() ),
+  Paths( storageDir ), storageLock( storageDir, StorageLock::Shared ),
+  storageInfo( loadStorageInfo() ),
   encryptionkey( password, storageInfo.has_encryption_key() ?
                    &storageInfo.encryption_key() : 0 ),
   extendedStorageInfo( loadExtendedStorageInfo( encryptionkey ) ),
@@ -85,8 +113,9 @@ ZBackupBase::ZBackupBase( string const & storageDir, string const & password ):
 }
 
 ZBackupBase::ZBackupBase( string const & storageDir, string const & password,
-                          Config & configIn ):
-  Paths( storageDir, configIn ), storageInfo( loadStorageInfo() ),
+                          Config & configIn, StorageLock::Mode lockMode ):
+  Paths( storageDir, configIn ), storageLock( storageDir, lockMode ),
+  storageInfo( loadStorageInfo() ),
   encryptionkey( password, storageInfo.has_encryption_key() ?
                    &storageInfo.encryption_key() : 0 ),
   extendedStorageInfo( loadExtendedStorageInfo( encryptionkey ) ),
@@ -100,8 +129,10 @@ ZBackupBase::ZBackupBase( string const & storageDir, string const & password,
 }
 
 ZBackupBase::ZBackupBase( string const & storageDir, string const & password,
-                          bool prohibitChunkIndexLoading ):
-  Paths( storageDir ), storageInfo( loadStorageInfo() ),
+                          bool prohibitChunkIndexLoading,
+                          StorageLock::Mode lockMode ):
+  Paths( storageDir ), storageLock( storageDir, lockMode ),
+  storageInfo( loadStorageInfo() ),
   encryptionkey( password, storageInfo.has_encryption_key() ?
                    &storageInfo.encryption_key() : 0 ),
   extendedStorageInfo( loadExtendedStorageInfo( encryptionkey ) ),
@@ -115,8 +146,10 @@ ZBackupBase::ZBackupBase( string const & storageDir, string const & password,
 }
 
 ZBackupBase::ZBackupBase( string const & storageDir, string const & password,
-                          Config & configIn, bool prohibitChunkIndexLoading ):
-  Paths( storageDir, configIn ), storageInfo( loadStorageInfo() ),
+                          Config & configIn, bool prohibitChunkIndexLoading,
+                          StorageLock::Mode lockMode ):
+  Paths( storageDir, configIn ), storageLock( storageDir, lockMode ),
+  storageInfo( loadStorageInfo() ),
   encryptionkey( password, storageInfo.has_encryption_key() ?
                    &storageInfo.encryption_key() : 0 ),
   extendedStorageInfo( loadExtendedStorageInfo( encryptionkey ) ),
@@ -264,6 +297,7 @@ void ZBackupBase::setPassword( string const & password )
                          *storageInfo.mutable_encryption_key(), encryptionkey );
 
   StorageInfoFile::save( getStorageInfoPath(), storageInfo );
+  storageLock.bumpGeneration();
 
   EncryptionKey encryptionkey( password, storageInfo.has_encryption_key() ?
                    &storageInfo.encryption_key() : 0 );
@@ -273,6 +307,125 @@ void ZBackupBase::saveExtendedStorageInfo()
 {
   ExtendedStorageInfoFile::save( getExtendedStorageInfoPath(), encryptionkey,
       extendedStorageInfo );
+  storageLock.bumpGeneration();
+}
+
+void ZBackupBase::saveChunkManifest( string const & backupHash,
+                                     BackupRestorer::ChunkSet const & chunkSet )
+{
+  try
+  {
+    if ( !Dir::exists( getCachePath() ) )
+      Dir::create( getCachePath() );
+    if ( !Dir::exists( getChunkManifestsPath() ) )
+      Dir::create( getChunkManifestsPath() );
+
+    sptr< TemporaryFile > tmpFile = tmpMgr.makeTemporaryFile();
+    ChunkManifest::save( tmpFile->getFileName(), encryptionkey, chunkSet );
+    tmpFile->moveOverTo( Dir::addPath( getChunkManifestsPath(),
+                                       Utils::toHex( backupHash ) ), true );
+  }
+  catch( std::exception & e )
+  {
+    verbosePrintf( "Can't save the chunk manifest: %s\n", e.what() );
+  }
+}
+
+void ZBackupBase::saveChunkManifest( string const & backupHash,
+                                     ChunkManifest::Collector & collector )
+{
+  try
+  {
+    if ( !Dir::exists( getCachePath() ) )
+      Dir::create( getCachePath() );
+    if ( !Dir::exists( getChunkManifestsPath() ) )
+      Dir::create( getChunkManifestsPath() );
+
+    sptr< TemporaryFile > tmpFile = tmpMgr.makeTemporaryFile();
+    collector.save( tmpFile->getFileName() );
+    tmpFile->moveOverTo( Dir::addPath( getChunkManifestsPath(),
+                                       Utils::toHex( backupHash ) ), true );
+  }
+  catch( std::exception & e )
+  {
+    verbosePrintf( "Can't save the chunk manifest: %s\n", e.what() );
+  }
+}
+
+bool ZBackupBase::loadChunkManifest( string const & backupHash,
+                                     BackupRestorer::ChunkSet & chunkSet )
+{
+  string fileName = Dir::addPath( getChunkManifestsPath(),
+                                  Utils::toHex( backupHash ) );
+  if ( !File::exists( fileName ) )
+    return false;
+
+  try
+  {
+    BackupRestorer::ChunkSet loaded;
+    ChunkManifest::load( fileName, encryptionkey, loaded );
+    if ( chunkSet.empty() )
+      chunkSet.swap( loaded );
+    else
+      chunkSet.insert( loaded.begin(), loaded.end() );
+    return true;
+  }
+  catch( std::exception & e )
+  {
+    verbosePrintf( "Ignoring the chunk manifest %s: %s\n", fileName.c_str(),
+                   e.what() );
+    return false;
+  }
+}
+
+sptr< BackupRestorer::IndexedRestorer > ZBackupBase::getIndexedRestorer(
+  ChunkStorage::Reader & chunkStorageReader, BackupInfo const & backupInfo )
+{
+  // Building the instruction table requires restoring and indexing the whole
+  // backup, so it is cached in the storage and reused the next time
+  string backupHash = BackupRestorer::IndexedRestorer::getBackupHash( backupInfo );
+  string tableFileName = Dir::addPath( getInstructionTablesPath(),
+      Utils::toHex( backupHash ) );
+
+  if ( File::exists( tableFileName ) )
+  {
+    try
+    {
+      sptr< BackupRestorer::IndexedRestorer > restorer =
+        new BackupRestorer::IndexedRestorer( chunkStorageReader,
+          tableFileName, encryptionkey, backupHash, backupInfo.size() );
+      verbosePrintf( "Loaded the instruction table from %s\n",
+                     tableFileName.c_str() );
+      return restorer;
+    }
+    catch( std::exception & e )
+    {
+      verbosePrintf( "Ignoring the instruction table %s: %s\n",
+                     tableFileName.c_str(), e.what() );
+    }
+  }
+
+  sptr< BackupRestorer::IndexedRestorer > restorer =
+    new BackupRestorer::IndexedRestorer( chunkStorageReader, backupInfo );
+
+  // The storage may be read-only, which is not a reason not to use it
+  try
+  {
+    if ( !Dir::exists( getCachePath() ) )
+      Dir::create( getCachePath() );
+    if ( !Dir::exists( getInstructionTablesPath() ) )
+      Dir::create( getInstructionTablesPath() );
+
+    sptr< TemporaryFile > tmpFile = tmpMgr.makeTemporaryFile();
+    restorer->save( tmpFile->getFileName(), encryptionkey, backupHash );
+    tmpFile->moveOverTo( tableFileName, true );
+  }
+  catch( std::exception & e )
+  {
+    verbosePrintf( "Can't save the instruction table: %s\n", e.what() );
+  }
+
+  return restorer;
 }
 
 bool ZBackupBase::spawnEditor( string & data, bool( * validator )
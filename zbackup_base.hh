@@ -8,8 +8,12 @@
 #include <string>
 
 #include "ex.hh"
+#include "backup_restorer.hh"
 #include "chunk_index.hh"
+#include "chunk_manifest.hh"
 #include "config.hh"
+#include "sptr.hh"
+#include "storage_lock.hh"
 
 struct Paths
 {
@@ -27,6 +31,11 @@ struct Paths
   std::string getExtendedStorageInfoPath();
   std::string getIndexPath();
   std::string getBackupsPath();
+  std::string getCachePath();
+  std::string getInstructionTablesPath();
+  std::string getChunkManifestsPath();
+  std::string getGcStatePath();
+  std::string getFileStatesPath();
 };
 
 class ZBackupBase: public Paths
@@ -43,13 +52,14 @@ public:
   DEF_EX( exChecksumError, "Checksum error", Ex )
   DEF_EX_STR( exCantDeriveStorageDir, "The path must be within the backups/ dir:", Ex )
 
-  /// Opens the storage
+  /// Opens the storage, locking it in the given mode first
   ZBackupBase( std::string const & storageDir, std::string const & password );
-  ZBackupBase( std::string const & storageDir, std::string const & password, Config & configIn );
+  ZBackupBase( std::string const & storageDir, std::string const & password, Config & configIn,
+      StorageLock::Mode = StorageLock::Shared );
   ZBackupBase( std::string const & storageDir, std::string const & password,
-      bool prohibitChunkIndexLoading );
+      bool prohibitChunkIndexLoading, StorageLock::Mode = StorageLock::Shared );
   ZBackupBase( std::string const & storageDir, std::string const & password, Config & configIn,
-      bool prohibitChunkIndexLoading );
+      bool prohibitChunkIndexLoading, StorageLock::Mode = StorageLock::Shared );
 
   /// Creates new storage
   static void initStorage( std::string const & storageDir, std::string const & password,
@@ -61,8 +71,29 @@ public:
 
   void propagateUpdate();
 
+  /// Saves the storage configuration. Requires the exclusive lock
   void saveExtendedStorageInfo();
 
+  /// Saves the list of the chunks used by the backup with the given hash into
+  /// the cache, for the garbage collector to use. Failing to do so is only
+  /// reported, since the collector can always rebuild the list
+  void saveChunkManifest( std::string const & backupHash,
+                          BackupRestorer::ChunkSet const & );
+  void saveChunkManifest( std::string const & backupHash,
+                          ChunkManifest::Collector & );
+
+  /// Loads the list saved by saveChunkManifest() into the set. Returns false
+  /// if there is no usable one
+  bool loadChunkManifest( std::string const & backupHash,
+                          BackupRestorer::ChunkSet & );
+
+  /// Returns a restorer with random access to the backup. Its instruction
+  /// table is loaded from the cache if it's there, or built and saved there
+  /// otherwise
+  sptr< BackupRestorer::IndexedRestorer > getIndexedRestorer(
+    ChunkStorage::Reader &, BackupInfo const & );
+
+  /// Changes the password. Requires the exclusive lock
   void setPassword( std::string const & password );
 
   // returns true if data is changed
@@ -73,6 +104,8 @@ public:
   // returns true if configuration is changed
   bool editConfigInteractively();
 
+  /// Comes first, so everything else is loaded under the lock
+  StorageLock storageLock;
   StorageInfo storageInfo;
   EncryptionKey encryptionkey;
   ExtendedStorageInfo extendedStorageInfo;
@@ -80,7 +113,7 @@ public:
   ChunkIndex chunkIndex;
   Config config;
 
-private:
+protected:
   StorageInfo loadStorageInfo();
   ExtendedStorageInfo loadExtendedStorageInfo( EncryptionKey const & );
 };
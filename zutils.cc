@@ -3,10 +3,21 @@
 
 #include "zutils.hh"
 #include "backup_creator.hh"
+#include "backup_file.hh"
+#include "changed_extents.hh"
 #include "sha256.hh"
 #include "backup_collector.hh"
+#include "gc_planner.hh"
 #include "utils.hh"
-#include "buse.h"
+#include "io_order.hh"
+#include "mt.hh"
+#include "nbd_server.hh"
+#include "unix_socket.hh"
+#include "verifier.hh"
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/sha.h>
+#include <signal.h>
 #include <unistd.h>
 
 using std::vector;
@@ -29,20 +40,102 @@ void ZBackup::backupFromStdin( string const & outputFileName )
 }
 
 /// Backs up the data from a file
-void ZBackup::backupFromFile( string const & inputFileName, string const & outputFileName,
-                              bool checkFileSize )
+bool ZBackup::backupFromFile( string const & inputFileName, string const & outputFileName,
+                              bool checkFileSize, BackupInfo * backupInfo )
 {
   File inputFile( inputFileName, File::ReadOnly );
   if ( checkFileSize && inputFile.size() < config.runtime.backupMinimalSize )
+  {
     fprintf( stderr, "WARNING: skipping file %s because its size (use -O backup.minimalSize to adjust)\n",
         inputFileName.c_str() );
-  else
-    backupFromFileHandle( inputFileName, inputFile.file(), outputFileName );
+    return false;
+  }
+
+  backupFromFileHandle( inputFileName, inputFile.file(), outputFileName,
+                        backupInfo );
+  return true;
+}
+
+bool ZBackup::backupFromFileWithStates( string const & inputFileName,
+                                        string const & relativePath,
+                                        string const & outputFileName,
+                                        FileStateCache const & previousStates,
+                                        FileStateCache & states )
+{
+  // The state is taken before the file is read, so any change made while
+  // it's being read shows up the next time
+  FileState state;
+  FileStateCache::getState( inputFileName, state );
+
+  BackupInfo const * previous = previousStates.find( relativePath, state );
+  if ( previous && state.size() >= config.runtime.backupMinimalSize &&
+       hasAllChunks( *previous ) )
+  {
+    dPrintf( "%s is unchanged\n", inputFileName.c_str() );
+
+    sptr< TemporaryFile > tmpFile = tmpMgr.makeTemporaryFile();
+    BackupFile::save( tmpFile->getFileName(), encryptionkey, *previous );
+    tmpFile->moveOverTo( outputFileName );
+
+    states.record( relativePath, state, *previous );
+    return true;
+  }
+
+  BackupInfo backupInfo;
+  if ( backupFromFile( inputFileName, outputFileName, true, &backupInfo ) )
+    states.record( relativePath, state, backupInfo );
+
+  return false;
+}
+
+bool ZBackup::hasAllChunks( BackupInfo const & backupInfo )
+{
+  BackupRestorer::ChunkSet chunkSet;
+  if ( !loadChunkManifest( BackupRestorer::IndexedRestorer::getBackupHash( backupInfo ),
+                           chunkSet ) )
+    return false;
+
+  for ( BackupRestorer::ChunkSet::const_iterator it = chunkSet.begin();
+        it != chunkSet.end(); ++it )
+    if ( !chunkIndex.findChunk( *it ) )
+      return false;
+
+  return true;
 }
 
 /// Backs up the data from a directory
 void ZBackup::backupFromDirectory( string const & inputDirectoryName, string const & outputDirectoryName )
 {
+  // The states of the files as of the previous backup of the directory, and
+  // the ones of this backup. There is a cache per input directory, named
+  // after its absolute path
+  FileStateCache previousStates, states;
+  string statesFileName;
+  size_t unchangedFiles = 0;
+
+  if ( config.runtime.backupFileCache )
+  {
+    string absolutePath = Dir::getRealPath( inputDirectoryName );
+
+    Sha256 sha256;
+    sha256.add( absolutePath.data(), absolutePath.size() );
+    statesFileName = Dir::addPath( getFileStatesPath(),
+                                   Utils::toHex( sha256.finish() ) );
+
+    if ( File::exists( statesFileName ) )
+    {
+      try
+      {
+        previousStates.load( statesFileName, encryptionkey );
+      }
+      catch( std::exception & e )
+      {
+        verbosePrintf( "Ignoring the file state cache: %s\n", e.what() );
+        previousStates.clear();
+      }
+    }
+  }
+
   std::list< string > dirs;
   dirs.push_front( inputDirectoryName );
   
@@ -79,30 +172,52 @@ void ZBackup::backupFromDirectory( string const & inputDirectoryName, string con
       }
       else if ( File::special( srcPath ) )
         fprintf( stderr, "WARNING: ignoring special file: %s\n", srcPath.c_str() );
+      else if ( config.runtime.backupFileCache )
+      {
+        if ( backupFromFileWithStates( srcPath, relativePath, outputPath,
+                                       previousStates, states ) )
+          ++unchangedFiles;
+      }
       else 
         backupFromFile( srcPath, outputPath, true );
     }
   }
-}
 
-/// Backs up the data from a FILE handle
-void ZBackup::backupFromFileHandle( string const & inputName, FILE* inputFileHandle, string const & outputFileName )
-{
-  if ( File::exists( outputFileName ) )
-    throw exWontOverwrite( outputFileName );
+  if ( config.runtime.backupFileCache )
+  {
+    verbosePrintf( "%zu files were unchanged since the previous backup\n",
+                   unchangedFiles );
 
-  Sha256 sha256;
-  BackupCreator backupCreator( config, chunkIndex, chunkStorageWriter );
+    try
+    {
+      if ( !Dir::exists( getCachePath() ) )
+        Dir::create( getCachePath() );
+      if ( !Dir::exists( getFileStatesPath() ) )
+        Dir::create( getFileStatesPath() );
+
+      sptr< TemporaryFile > tmpFile = tmpMgr.makeTemporaryFile();
+      states.save( tmpFile->getFileName(), encryptionkey );
+      tmpFile->moveOverTo( statesFileName, true );
+    }
+    catch( std::exception & e )
+    {
+      verbosePrintf( "Can't save the file state cache: %s\n", e.what() );
+    }
+  }
+}
 
-  time_t startTime = time( 0 );
-  uint64_t totalDataSize = 0;
+namespace {
 
+/// Adds all the data left in the FILE handle to the session
+void addFromFileHandle( ZBackup::Session & session, string const & inputName,
+                        FILE * inputFileHandle )
+{
   for ( ; ; )
   {
-    size_t toRead = backupCreator.getInputBufferSize();
+    size_t toRead = session.getInputBufferSize();
 //    dPrintf( "Reading up to %u bytes on input\n", toRead );
 
-    void * inputBuffer = backupCreator.getInputBuffer();
+    void * inputBuffer = session.getInputBuffer();
     size_t rd = fread( inputBuffer, 1, toRead, inputFileHandle );
 
     if ( !rd )
@@ -113,15 +228,185 @@ void ZBackup::backupFromFileHandle( string const & inputName, FILE* inputFileHan
         break;
       }
       else
-        throw exInputError( inputName );
+        throw ZBackup::exInputError( inputName );
     }
 
-    sha256.add( inputBuffer, rd );
+    session.handleMoreData( rd );
+  }
+}
+
+}
+
+/// Backs up the data from a FILE handle
+void ZBackup::backupFromFileHandle( string const & inputName, FILE* inputFileHandle,
+                                    string const & outputFileName,
+                                    BackupInfo * backupInfo )
+{
+  Session session( *this, outputFileName );
+
+  addFromFileHandle( session, inputName, inputFileHandle );
+
+  session.finish( backupInfo );
+}
+
+void ZBackup::backupFromFileWithParent( string const & inputFileName,
+                                        string const & outputFileName,
+                                        string const & parentFileName )
+{
+  BackupInfo parentInfo;
+  BackupFile::load( parentFileName, encryptionkey, parentInfo );
+
+  ChangedExtents changedExtents;
+  bool haveChangedExtents = !config.runtime.backupChangedExtents.empty();
+  if ( haveChangedExtents )
+    changedExtents.load( config.runtime.backupChangedExtents );
+
+  // Only needed for the levels of the parent's manifest
+  ChunkStorage::Reader chunkStorageReader( config, encryptionkey, chunkIndex,
+                                           getBundlesPath(),
+                                           config.runtime.cacheSize );
+  BackupRestorer::LevelReader parent( chunkStorageReader, parentInfo );
+
+  File inputFile( inputFileName, File::ReadOnly );
+  Session session( *this, outputFileName );
+
+  string data;
+  uint64_t position = 0, unchangedSize = 0, unlistedChanges = 0;
+  Instruction instr;
+
+  // The file is read along with the instructions of the parent, a piece
+  // restored by each of them at a time, until either of them ends
+  while ( parent.readNext( instr ) )
+  {
+    uint32_t chunkSize = 0;
+    if ( instr.hasChunk && !chunkIndex.findChunk( instr.chunkId, &chunkSize ) )
+      throw exParentChunkMissing( parentFileName );
+
+    size_t size = chunkSize + instr.bytesSize;
+    data.resize( size );
+    size_t rd = size ? inputFile.readRecords( &data[ 0 ], 1, size ) : 0;
+
+    // The pieces the extent list has as changed aren't compared. The others
+    // are, since a wrong list must not make the backup refer to data other
+    // than the file's
+    bool unchanged = rd == size;
+    if ( unchanged && haveChangedExtents &&
+         changedExtents.overlaps( position, size ) )
+      unchanged = false;
+    else
+    if ( unchanged )
+    {
+      // The cryptographic hash is what tells the chunks apart anyway, so the
+      // rolling hash, which is the slower one to compute, is left out
+      if ( instr.hasChunk )
+      {
+        unsigned char sha1Value[ SHA_DIGEST_LENGTH ];
+        SHA1( ( unsigned char const * ) data.data(), chunkSize, sha1Value );
+        unchanged = !memcmp( sha1Value, instr.chunkId.cryptoHash,
+                             sizeof( instr.chunkId.cryptoHash ) );
+      }
+
+      if ( unchanged && instr.bytesSize )
+        unchanged = !memcmp( data.data() + chunkSize, instr.bytes,
+                             instr.bytesSize );
+
+      if ( !unchanged && haveChangedExtents )
+        ++unlistedChanges;
+    }
+
+    if ( unchanged )
+    {
+      session.addUnchanged( instr, data.data(), size );
+      unchangedSize += size;
+    }
+    else
+      session.add( data.data(), rd );
+
+    position += rd;
+
+    if ( rd < size )
+      break;
+  }
+
+  // The file may have grown since
+  addFromFileHandle( session, inputFileName, inputFile.file() );
+
+  session.finish();
+
+  // The backup is fine, as those pieces were backed up anew, but the list
+  // can't be relied upon
+  if ( unlistedChanges )
+    fprintf( stderr, "WARNING: %llu pieces of %s changed outside the extents "
+             "listed in %s\n", ( unsigned long long ) unlistedChanges,
+             inputFileName.c_str(),
+             config.runtime.backupChangedExtents.c_str() );
+
+  verbosePrintf( "%llu of the bytes were unchanged since the parent backup\n",
+                 ( unsigned long long ) unchangedSize );
+}
+
+ZBackup::Session::Session( ZBackup & zbackup, string const & outputFileName ):
+  zbackup( zbackup ), outputFileName( outputFileName ),
+  usedChunks( zbackup.tmpMgr, zbackup.encryptionkey ),
+  backupCreator( zbackup.config, zbackup.chunkIndex, zbackup.chunkStorageWriter,
+                 &usedChunks.getChunkSet() ),
+  startTime( time( 0 ) ), totalDataSize( 0 ), finished( false )
+{
+  if ( File::exists( outputFileName ) )
+    throw exWontOverwrite( outputFileName );
+}
+
+void * ZBackup::Session::getInputBuffer()
+{
+  return backupCreator.getInputBuffer();
+}
+
+size_t ZBackup::Session::getInputBufferSize()
+{
+  return backupCreator.getInputBufferSize();
+}
+
+void ZBackup::Session::handleMoreData( size_t size )
+{
+  sha256.add( backupCreator.getInputBuffer(), size );
+
+  backupCreator.handleMoreData( size );
+  usedChunks.spillIfNeeded();
+
+  totalDataSize += size;
+}
+
+void ZBackup::Session::addUnchanged( Instruction const & instr,
+                                     void const * data, size_t size )
+{
+  sha256.add( data, size );
+
+  backupCreator.addInstruction( instr );
+  usedChunks.spillIfNeeded();
 
-    backupCreator.handleMoreData( rd );
+  totalDataSize += size;
+}
+
+void ZBackup::Session::add( void const * data, size_t size )
+{
+  char const * next = ( char const * ) data;
+
+  while ( size )
+  {
+    size_t toCopy = std::min( size, backupCreator.getInputBufferSize() );
+
+    memcpy( backupCreator.getInputBuffer(), next, toCopy );
+    handleMoreData( toCopy );
 
-    totalDataSize += rd;
+    next += toCopy;
+    size -= toCopy;
   }
+}
+
+void ZBackup::Session::finish( BackupInfo * backupInfo )
+{
+  ChunkIndex & chunkIndex = zbackup.chunkIndex;
+  ChunkStorage::Writer & chunkStorageWriter = zbackup.chunkStorageWriter;
 
   // Finish up with the creator
   backupCreator.finish();
@@ -133,24 +418,17 @@ void ZBackup::backupFromFileHandle( string const & inputName, FILE* inputFileHan
 
   info.set_sha256( sha256.finish() );
   info.set_size( totalDataSize );
+  info.set_iterations( backupCreator.getLevelsAbove() );
+  info.set_instruction_format( CompactInstructionFormat );
 
-  // Shrink the serialized data iteratively until it wouldn't shrink anymore
+  // The top level of the manifest is at most about a chunk in size. Shrink it
+  // further while it shrinks, to keep the backup file small
   for ( ; ; )
   {
-    BackupCreator backupCreator( config, chunkIndex, chunkStorageWriter );
-    char const * ptr = serialized.data();
-    size_t left = serialized.size();
-    while( left )
-    {
-      size_t bufferSize = backupCreator.getInputBufferSize();
-      size_t toCopy = bufferSize > left ? left : bufferSize;
-
-      memcpy( backupCreator.getInputBuffer(), ptr, toCopy );
-      backupCreator.handleMoreData( toCopy );
-      ptr += toCopy;
-      left -= toCopy;
-    }
-
+    BackupRestorer::ChunkSet newChunks;
+    BackupCreator backupCreator( zbackup.config, chunkIndex, chunkStorageWriter,
+                                 &newChunks );
+    backupCreator.addData( serialized.data(), serialized.size() );
     backupCreator.finish();
 
     string newGen;
@@ -158,8 +436,10 @@ void ZBackup::backupFromFileHandle( string const & inputName, FILE* inputFileHan
 
     if ( newGen.size() < serialized.size() )
     {
+      usedChunks.getChunkSet().insert( newChunks.begin(), newChunks.end() );
       serialized.swap( newGen );
-      info.set_iterations( info.iterations() + 1 );
+      info.set_iterations( info.iterations() + 1 +
+                           backupCreator.getLevelsAbove() );
     }
     else
       break;
@@ -173,12 +453,34 @@ void ZBackup::backupFromFileHandle( string const & inputName, FILE* inputFileHan
 
   // Commit the bundles to the disk before creating the final output file
   chunkStorageWriter.commit();
+  finished = true;
 
   // Now save the resulting BackupInfo
 
-  sptr< TemporaryFile > tmpFile = tmpMgr.makeTemporaryFile();
-  BackupFile::save( tmpFile->getFileName(), encryptionkey, info );
+  sptr< TemporaryFile > tmpFile = zbackup.tmpMgr.makeTemporaryFile();
+  BackupFile::save( tmpFile->getFileName(), zbackup.encryptionkey, info );
   tmpFile->moveOverTo( outputFileName );
+
+  zbackup.saveChunkManifest( BackupRestorer::IndexedRestorer::getBackupHash( info ),
+                             usedChunks );
+
+  if ( backupInfo )
+    backupInfo->Swap( &info );
+}
+
+ZBackup::Session::~Session()
+{
+  if ( finished )
+    return;
+
+  try
+  {
+    zbackup.chunkStorageWriter.reset();
+  }
+  catch( std::exception & e )
+  {
+    verbosePrintf( "Can't drop the unfinished backup: %s\n", e.what() );
+  }
 }
 
 ZRestore::ZRestore( string const & storageDir, string const & password,
@@ -195,11 +497,6 @@ void ZRestore::restoreToFile( string const & inputFileName, string const & outpu
 
   BackupFile::load( inputFileName, encryptionkey, backupInfo );
 
-  string backupData;
-
-  // Perform the iterations needed to get to the actual user backup data
-  BackupRestorer::restoreIterations( chunkStorageReader, backupInfo, backupData, NULL );
-
   UnbufferedFile f( outputFileName.data(), UnbufferedFile::ReadWrite );
 
   struct FileWriter: public SeekableSink
@@ -219,7 +516,7 @@ void ZRestore::restoreToFile( string const & inputFileName, string const & outpu
   } seekWriter( &f );
 
   BackupRestorer::ChunkMap map;
-  BackupRestorer::restore( chunkStorageReader, backupData, NULL, NULL, &map, &seekWriter );
+  BackupRestorer::restore( chunkStorageReader, backupInfo, NULL, NULL, &map, &seekWriter );
   BackupRestorer::restoreMap( chunkStorageReader, &map, &seekWriter );
 
   Sha256 sha256;
@@ -233,68 +530,334 @@ void ZRestore::restoreToFile( string const & inputFileName, string const & outpu
     throw exChecksumError();
 }
 
+namespace {
+/// Restores the given backup, writing the data to the given FILE handle
+void restoreToFileHandle( ChunkStorage::Reader & chunkStorageReader,
+                          EncryptionKey const & encryptionkey,
+                          string const & inputFileName, FILE * output )
+{
+  BackupInfo backupInfo;
+
+  BackupFile::load( inputFileName, encryptionkey, backupInfo );
+
+  struct FileHandleWriter: public DataSink
+  {
+    FILE * output;
+    Sha256 sha256;
+
+    FileHandleWriter( FILE * output ): output( output )
+    {
+    }
+
+    virtual void saveData( void const * data, size_t size )
+    {
+      sha256.add( data, size );
+      if ( fwrite( data, size, 1, output ) != 1 )
+        throw ZBackupBase::exStdoutError();
+    }
+  } writer( output );
+
+  BackupRestorer::restore( chunkStorageReader, backupInfo, &writer, NULL, NULL, NULL );
+
+  if ( fflush( output ) != 0 )
+    throw ZBackupBase::exStdoutError();
+
+  if ( writer.sha256.finish() != backupInfo.sha256() )
+    throw ZBackupBase::exChecksumError();
+}
+}
+
 void ZRestore::restoreToStdin( string const & inputFileName )
 {
   if ( isatty( fileno( stdout ) ) )
     throw exWontWriteToTerminal();
 
+  restoreToFileHandle( chunkStorageReader, encryptionkey, inputFileName,
+                       stdout );
+}
+
+void ZRestore::startNBDServer( string const & inputFileName, string const & nbdDevice )
+{
   BackupInfo backupInfo;
 
   BackupFile::load( inputFileName, encryptionkey, backupInfo );
 
-  string backupData;
+  sptr< BackupRestorer::IndexedRestorer > restorer =
+    getIndexedRestorer( chunkStorageReader, backupInfo );
+
+  NbdServer server( *restorer, chunkStorageReader, config );
+
+  verbosePrintf( "Serving NBD requests with %zu thread(s)\n",
+                 config.runtime.threads );
+
+  server.serve( nbdDevice );
+}
+
+ZRepository::ZRepository( string const & storageDir, string const & password,
+                          Config & configIn ):
+  ZBackup( storageDir, password, configIn ),
+  chunkStorageReader( config, encryptionkey, chunkIndex, getBundlesPath(),
+                      config.runtime.cacheSize ),
+  users( 0 ), indexGeneration( storageLock.getGeneration() ),
+  indexStale( false )
+{
+  // Everything is loaded, so the storage is only locked again when used
+  storageLock.release();
+}
 
-  // Perform the iterations needed to get to the actual user backup data
-  BackupRestorer::restoreIterations( chunkStorageReader, backupInfo, backupData, NULL );
+void ZRepository::acquire()
+{
+  if ( !users )
+    storageLock.acquire( StorageLock::Shared );
+  ++users;
 
-  struct StdoutWriter: public DataSink
+  try
   {
-    Sha256 sha256;
+    uint64_t generation = storageLock.getGeneration();
 
-    virtual void saveData( void const * data, size_t size )
+    if ( indexStale || generation != indexGeneration )
     {
-      sha256.add( data, size );
-      if ( fwrite( data, size, 1, stdout ) != 1 )
-        throw exStdoutError();
+      // Chunks may have been removed or moved to other bundles, and the
+      // configuration may have changed
+      verbosePrintf( "Reloading the storage\n" );
+
+      // Copied over rather than assigned, since the config points into it
+      extendedStorageInfo.CopyFrom( loadExtendedStorageInfo( encryptionkey ) );
+      propagateUpdate();
+      chunkIndex.reload();
+
+      indexGeneration = generation;
+      indexStale = false;
     }
-  } stdoutWriter;
+    else
+    {
+      size_t loaded = chunkIndex.loadNewIndexFiles();
+      if ( loaded )
+        verbosePrintf( "Loaded %zu new index file(s)\n", loaded );
+    }
+  }
+  catch( ... )
+  {
+    release();
+    throw;
+  }
+}
 
-  BackupRestorer::restore( chunkStorageReader, backupData, &stdoutWriter, NULL, NULL, NULL );
+void ZRepository::release()
+{
+  if ( users && !--users )
+    storageLock.release();
+}
 
-  if ( stdoutWriter.sha256.finish() != backupInfo.sha256() )
-    throw exChecksumError();
+void ZRepository::invalidateIndex()
+{
+  indexStale = true;
 }
 
-static int buse_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+void ZRepository::restoreToFileHandle( string const & inputFileName,
+                                       FILE * output )
 {
-  dPrintf( "NBD read offset=%lu, size=%u\n", offset, len );
+  ::restoreToFileHandle( chunkStorageReader, encryptionkey, inputFileName,
+                         output );
+}
 
-  BackupRestorer::IndexedRestorer & restorer = *(BackupRestorer::IndexedRestorer *)userdata;
+sptr< BackupRestorer::IndexedRestorer > ZRepository::getIndexedRestorer(
+  string const & inputFileName, BackupInfo & backupInfo )
+{
+  BackupFile::load( inputFileName, encryptionkey, backupInfo );
 
-  restorer.saveData(offset, buf, len);
+  return ZBackupBase::getIndexedRestorer( chunkStorageReader, backupInfo );
+}
 
-  return 0;
+ZServe::ZServe( string const & storageDir, string const & password,
+                Config & configIn ):
+  ZRepository( storageDir, password, configIn )
+{
 }
 
-void ZRestore::startNBDServer( string const & inputFileName, string const & nbdDevice )
+void ZServe::serve( string const & socketPath )
 {
-  BackupInfo backupInfo;
+  // A client going away in the middle of a restore should only fail it
+  signal( SIGPIPE, SIG_IGN );
 
-  BackupFile::load( inputFileName, encryptionkey, backupInfo );
+  UnixSocket::Listener listener( socketPath );
+
+  verbosePrintf( "Serving %s on %s\n", storageDir.c_str(), socketPath.c_str() );
+
+  for ( ; ; )
+  {
+    UnixSocket::Connection connection( listener.accept() );
 
-  string backupData;
+    ServeRequest request;
+    ServeReply reply;
+    int fd = -1;
+
+    try
+    {
+      connection.receive( request, &fd );
+      if ( fd < 0 )
+        throw exNoDescriptor();
+
+      acquire();
+
+      int requestFd = fd;
+      fd = -1;
+
+      try
+      {
+        handle( request, requestFd );
+      }
+      catch( ... )
+      {
+        if ( request.command() == ServeRequest::BACKUP )
+          invalidateIndex();
+        release();
+        throw;
+      }
 
-  // Perform the iterations needed to get to the actual user backup data
-  BackupRestorer::restoreIterations( chunkStorageReader, backupInfo, backupData, NULL );
+      release();
+    }
+    catch( std::exception & e )
+    {
+      verbosePrintf( "Request failed: %s\n", e.what() );
+      reply.set_error( e.what() );
 
-  BackupRestorer::IndexedRestorer restorer( chunkStorageReader, backupData );
+      if ( fd >= 0 )
+        close( fd );
+    }
 
-  static struct buse_operations aop;
-  memset(&aop, 0, sizeof(aop));
-  aop.read = buse_read;
-  aop.size = restorer.size();
+    try
+    {
+      connection.send( reply );
+    }
+    catch( std::exception & e )
+    {
+      verbosePrintf( "Can't reply to the client: %s\n", e.what() );
+    }
+  }
+}
+
+void ZServe::handle( ServeRequest const & request, int fd )
+{
+  char const * mode = request.command() == ServeRequest::BACKUP ? "rb" : "wb";
+  FILE * file = fdopen( fd, mode );
+  if ( !file )
+  {
+    close( fd );
+    throw exNoDescriptor();
+  }
+
+  try
+  {
+    string const & backupFile = request.backup_file();
+    if ( deriveStorageDirFromBackupsFile( backupFile ) !=
+         Dir::getRealPath( storageDir ) )
+      throw exNotServed( backupFile );
+
+    if ( request.command() == ServeRequest::BACKUP )
+    {
+      verbosePrintf( "Backing up %s to %s\n", request.data_name().c_str(),
+                     backupFile.c_str() );
+      backupFromFileHandle( request.data_name(), file, backupFile );
+    }
+    else
+    {
+      verbosePrintf( "Restoring %s to %s\n", backupFile.c_str(),
+                     request.data_name().c_str() );
+      restoreToFileHandle( backupFile, file );
+    }
+  }
+  catch( ... )
+  {
+    fclose( file );
+    throw;
+  }
+
+  if ( fclose( file ) != 0 && request.command() == ServeRequest::RESTORE )
+    throw exStdoutError();
+}
+
+ZClient::ZClient( string const & socketPath ): socketPath( socketPath )
+{
+}
+
+void ZClient::backupFromStdin( string const & outputFileName )
+{
+  if ( isatty( fileno( stdin ) ) )
+    throw ZBackupBase::exWontReadFromTerminal();
 
-  buse_main(nbdDevice.c_str(), &aop, (void *)&restorer);
+  request( ServeRequest::BACKUP, outputFileName, "stdin", fileno( stdin ) );
+}
+
+void ZClient::backupFromFile( string const & inputFileName,
+                              string const & outputFileName )
+{
+  int fd = open( inputFileName.c_str(), O_RDONLY );
+  if ( fd < 0 )
+    throw exCantOpen( inputFileName );
+
+  try
+  {
+    request( ServeRequest::BACKUP, outputFileName, inputFileName, fd );
+  }
+  catch( ... )
+  {
+    close( fd );
+    throw;
+  }
+
+  close( fd );
+}
+
+void ZClient::restoreToStdin( string const & inputFileName )
+{
+  if ( isatty( fileno( stdout ) ) )
+    throw ZBackupBase::exWontWriteToTerminal();
+
+  fflush( stdout );
+  request( ServeRequest::RESTORE, inputFileName, "stdout", fileno( stdout ) );
+}
+
+void ZClient::restoreToFile( string const & inputFileName,
+                             string const & outputFileName )
+{
+  int fd = open( outputFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+  if ( fd < 0 )
+    throw exCantOpen( outputFileName );
+
+  try
+  {
+    request( ServeRequest::RESTORE, inputFileName, outputFileName, fd );
+  }
+  catch( ... )
+  {
+    close( fd );
+    throw;
+  }
+
+  close( fd );
+}
+
+void ZClient::request( ServeRequest::Command command, string const & backupFile,
+                       string const & dataName, int fd )
+{
+  // The server has a different working directory, so the path is made
+  // absolute. The backup file may not exist yet, but its directory must
+  ServeRequest request;
+  request.set_command( command );
+  request.set_backup_file( Dir::addPath(
+    Dir::getRealPath( Dir::getDirName( backupFile ) ),
+    Dir::getBaseName( backupFile ) ) );
+  request.set_data_name( dataName );
+
+  UnixSocket::Connection connection( socketPath );
+  connection.send( request, fd );
+
+  ServeReply reply;
+  connection.receive( reply );
+
+  if ( reply.has_error() )
+    throw exServeError( reply.error() );
 }
 
 ZExchange::ZExchange( string const & srcStorageDir, string const & srcPassword,
@@ -317,6 +880,10 @@ void ZExchange::exchange()
     vector< string > bundles = Utils::findOrRebuild(
         srcZBackupBase.getBundlesPath(), dstZBackupBase.getBundlesPath() );
 
+    // Read the source bundles in the order they are laid out on disk
+    IoOrder::sort( bundles, config.runtime.ioOrder,
+                   srcZBackupBase.getBundlesPath() );
+
     for ( std::vector< string >::iterator it = bundles.begin(); it != bundles.end(); ++it )
     {
       verbosePrintf( "Processing bundle file %s... ", it->c_str() );
@@ -327,7 +894,9 @@ void ZExchange::exchange()
               srcZBackupBase.getBundlesPath(), *it ), srcZBackupBase.encryptionkey, true );
         sptr< Bundle::Creator > creator = new Bundle::Creator;
         sptr< TemporaryFile > bundleTempFile = dstZBackupBase.tmpMgr.makeTemporaryFile();
-        creator->write( bundleTempFile->getFileName(), dstZBackupBase.encryptionkey, *reader );
+        creator->write( bundleTempFile->getFileName(), dstZBackupBase.encryptionkey, *reader,
+            EncryptedFile::getModeByName(
+              dstZBackupBase.config.GET_STORABLE( encryption, mode ) ) );
 
         if ( creator.get() && reader.get() )
         {
@@ -363,7 +932,9 @@ void ZExchange::exchange()
                                  Dir::addPath( srcZBackupBase.getIndexPath(), *it ) );
         sptr< TemporaryFile > indexTempFile = dstZBackupBase.tmpMgr.makeTemporaryFile();
         sptr< IndexFile::Writer > writer = new IndexFile::Writer( dstZBackupBase.encryptionkey,
-            indexTempFile->getFileName() );
+            indexTempFile->getFileName(),
+            EncryptedFile::getModeByName(
+              dstZBackupBase.config.GET_STORABLE( encryption, mode ) ) );
 
         BundleInfo bundleInfo;
         Bundle::Id bundleId;
@@ -441,12 +1012,191 @@ void ZExchange::exchange()
 
 ZCollector::ZCollector( string const & storageDir, string const & password,
                     Config & configIn ):
-  ZBackupBase( storageDir, password, configIn ),
+  // A dry run changes nothing, so it can run alongside the backups
+  ZBackupBase( storageDir, password, configIn, configIn.runtime.gcDryRun ?
+               StorageLock::Shared : StorageLock::Exclusive ),
   chunkStorageReader( config, encryptionkey, chunkIndex, getBundlesPath(),
                       config.runtime.cacheSize )
 {
 }
 
+void ZCollector::getBackupChunks( string const & backup, BackupInfo & backupInfo,
+                                  string const & backupHash,
+                                  BackupRestorer::ChunkSet & chunkSet, bool trustCache )
+{
+  verbosePrintf( "Checking backup %s...\n", backup.c_str() );
+
+  if ( trustCache && loadChunkManifest( backupHash, chunkSet ) )
+    return;
+
+  BackupRestorer::restore( chunkStorageReader, backupInfo, NULL, &chunkSet, NULL, NULL );
+
+  saveChunkManifest( backupHash, chunkSet );
+}
+
+/// State of the backup scan shared by the worker threads
+struct ZCollector::BackupScan
+{
+  vector< string > const & backups;
+  std::set< string > & backupHashes;
+  GcState * gcState;
+  ChunkUsage * chunkUsage;
+  bool trustCache;
+
+  Mutex mutex; /// Guards everything below and backupHashes
+  size_t next;
+  string error;
+
+  BackupScan( vector< string > const & backups, std::set< string > & backupHashes,
+              GcState * gcState, ChunkUsage * chunkUsage, bool trustCache ):
+    backups( backups ), backupHashes( backupHashes ), gcState( gcState ),
+    chunkUsage( chunkUsage ), trustCache( trustCache ), next( 0 )
+  {
+  }
+};
+
+class ZCollector::ScanWorker: public Thread
+{
+  ZCollector & collector;
+  BackupScan & scan;
+public:
+  ScanWorker( ZCollector & collector, BackupScan & scan ):
+    collector( collector ), scan( scan ) {}
+protected:
+  virtual void * threadFunction() throw()
+  {
+    collector.scanWorker( scan );
+    return NULL;
+  }
+};
+
+void ZCollector::scanWorker( BackupScan & scan )
+{
+  for ( ; ; )
+  {
+    string backup;
+    {
+      Lock _( scan.mutex );
+      if ( scan.next == scan.backups.size() || !scan.error.empty() )
+        return;
+      backup = Dir::addPath( getBackupsPath(), scan.backups[ scan.next++ ] );
+    }
+
+    try
+    {
+      BackupInfo backupInfo;
+
+      BackupFile::load( backup, encryptionkey, backupInfo );
+
+      string backupHash = BackupRestorer::IndexedRestorer::getBackupHash( backupInfo );
+
+      {
+        Lock _( scan.mutex );
+        // Skip the backups seen already and the ones counted before
+        if ( !scan.backupHashes.insert( backupHash ).second ||
+             ( scan.gcState && scan.gcState->hasBackup( backupHash ) ) )
+          continue;
+      }
+
+      BackupRestorer::ChunkSet chunkSet;
+      getBackupChunks( backup, backupInfo, backupHash, chunkSet, scan.trustCache );
+
+      // Both are safe to add to from several threads, so this doesn't hold
+      // the lock of the scan
+      if ( scan.gcState )
+        scan.gcState->addBackup( backupHash, chunkSet );
+      if ( scan.chunkUsage )
+        scan.chunkUsage->addUsed( chunkSet );
+    }
+    catch( std::exception & e )
+    {
+      Lock _( scan.mutex );
+      if ( scan.error.empty() )
+        scan.error = backup + ": " + e.what();
+      return;
+    }
+  }
+}
+
+void ZCollector::scanBackups( vector< string > const & backups,
+                              std::set< string > & backupHashes, GcState * gcState,
+                              ChunkUsage * chunkUsage, bool trustCache )
+{
+  BackupScan scan( backups, backupHashes, gcState, chunkUsage, trustCache );
+
+  // The workers may all save chunk manifests at once, so the directories
+  // are made beforehand rather than raced for
+  if ( !Dir::exists( getCachePath() ) )
+    Dir::create( getCachePath() );
+  if ( !Dir::exists( getChunkManifestsPath() ) )
+    Dir::create( getChunkManifestsPath() );
+
+  size_t threads = config.runtime.threads;
+  if ( threads > backups.size() )
+    threads = backups.size();
+
+  if ( threads <= 1 )
+    scanWorker( scan );
+  else
+  {
+    vector< sptr< ScanWorker > > workers;
+    for ( size_t x = 0; x < threads; ++x )
+    {
+      workers.push_back( new ScanWorker( *this, scan ) );
+      workers.back()->start();
+    }
+
+    for ( size_t x = 0; x < workers.size(); ++x )
+      workers[ x ]->join();
+  }
+
+  if ( !scan.error.empty() )
+    throw exBackupScanFailed( scan.error );
+}
+
+void ZCollector::updateGcState( GcState & gcState, vector< string > const & backups,
+                                std::set< string > & backupHashes, bool trustCache )
+{
+  for ( bool recounting = false; ; recounting = true )
+  {
+    scanBackups( backups, backupHashes, &gcState, NULL, trustCache );
+
+    // Release the chunks of the backups removed since the last collection
+    GcState::Backups removed;
+    for ( GcState::Backups::const_iterator it = gcState.getBackups().begin();
+          it != gcState.getBackups().end(); ++it )
+      if ( backupHashes.find( *it ) == backupHashes.end() )
+        removed.insert( *it );
+
+    try
+    {
+      for ( GcState::Backups::const_iterator it = removed.begin(); it != removed.end(); ++it )
+      {
+        dPrintf( "Releasing the chunks of removed backup %s\n", Utils::toHex( *it ).c_str() );
+
+        BackupRestorer::ChunkSet chunkSet;
+        if ( !loadChunkManifest( *it, chunkSet ) )
+          throw GcState::exInconsistent();
+
+        gcState.removeBackup( *it, chunkSet );
+      }
+
+      return;
+    }
+    catch( GcState::exInconsistent & )
+    {
+      // Nothing is left to remove after clearing the state, so this can only
+      // happen once
+      if ( recounting )
+        throw;
+
+      verbosePrintf( "Can't account for the removed backups, recounting all of them\n" );
+      gcState.clear();
+      backupHashes.clear();
+    }
+  }
+}
+
 void ZCollector::gc( bool gcDeep )
 {
   ChunkIndex chunkReindex( encryptionkey, tmpMgr, getIndexPath(), true );
@@ -464,21 +1214,92 @@ void ZCollector::gc( bool gcDeep )
   verbosePrintf( "Searching for backups...\n" );
   vector< string > backups = Utils::findOrRebuild( getBackupsPath() );
 
-  for ( std::vector< string >::iterator it = backups.begin(); it != backups.end(); ++it )
+  std::set< string > backupHashes;
+  sptr< ChunkUsage > chunkUsage;
+  GcState gcState;
+
+  if ( config.runtime.gcSortBuffer )
   {
-    string backup( Dir::addPath( getBackupsPath(), *it ) );
+    // Out of core: the ids of the chunks used and of the ones in the index
+    // are sorted on disk and joined. The reference counts aren't kept, as
+    // they would have to be in memory
+    chunkUsage = new ChunkUsage( tmpMgr, encryptionkey, config.runtime.gcSortBuffer );
 
-    verbosePrintf( "Checking backup %s...\n", backup.c_str() );
+    scanBackups( backups, backupHashes, NULL, chunkUsage.get(), !gcDeep );
 
-    BackupInfo backupInfo;
+    chunkIndex.loadIndex( *chunkUsage );
+    chunkUsage->join();
 
-    BackupFile::load( backup, encryptionkey, backupInfo );
+    collector.setChunkUsage( chunkUsage.get() );
+  }
+  else
+  {
+    // The reference counts saved by the previous collection. A deep collection
+    // doesn't trust them, nor the chunk manifests, and recounts everything
+    string gcStatePath = getGcStatePath();
+    if ( !gcDeep && File::exists( gcStatePath ) )
+    {
+      try
+      {
+        gcState.load( gcStatePath, encryptionkey );
+      }
+      catch( std::exception & e )
+      {
+        verbosePrintf( "Ignoring the garbage collector state: %s\n", e.what() );
+        gcState.clear();
+      }
+    }
+
+    updateGcState( gcState, backups, backupHashes, !gcDeep );
+
+    // The collector looks the chunks up in the reference counts directly,
+    // rather than in a copy of them
+    collector.setGcState( &gcState );
+
+    // The state only depends on the backups, so it can be saved right away.
+    // A dry run leaves it for the real one
+    if ( !config.runtime.gcDryRun )
+    {
+      try
+      {
+        if ( !Dir::exists( getCachePath() ) )
+          Dir::create( getCachePath() );
+
+        sptr< TemporaryFile > tmpFile = tmpMgr.makeTemporaryFile();
+        gcState.save( tmpFile->getFileName(), encryptionkey );
+        tmpFile->moveOverTo( gcStatePath, true );
+      }
+      catch( std::exception & e )
+      {
+        verbosePrintf( "Can't save the garbage collector state: %s\n", e.what() );
+      }
+    }
+  }
+
+  // Unless all the bundles with unused chunks are to be repacked, the index
+  // is first read to find out how used each of them is
+  GcPlanner planner( config.runtime.gcThreshold, config.runtime.gcBudget );
+  bool usePlanner = !config.runtime.gcRepack && ( config.runtime.gcDryRun ||
+      config.runtime.gcThreshold < 100 || config.runtime.gcBudget );
+
+  if ( usePlanner )
+  {
+    verbosePrintf( "Planning...\n" );
 
-    string backupData;
+    collector.startPass( &planner, true );
+    chunkIndex.loadIndex( collector );
+    planner.plan();
 
-    BackupRestorer::restoreIterations( chunkStorageReader, backupInfo, backupData, &collector.usedChunkSet );
+    if ( config.runtime.gcDryRun )
+    {
+      planner.print( stdout );
+      return;
+    }
+
+    if ( verboseMode )
+      planner.print( stderr );
 
-    BackupRestorer::restore( chunkStorageReader, backupData, NULL, &collector.usedChunkSet, NULL, NULL );
+    collector.startPass( &planner, false );
   }
 
   verbosePrintf( "Checking bundles...\n" );
@@ -486,6 +1307,7 @@ void ZCollector::gc( bool gcDeep )
   chunkIndex.loadIndex( collector );
 
   collector.commit();
+  storageLock.bumpGeneration();
 
   verbosePrintf( "Cleaning up...\n" );
 
@@ -501,6 +1323,29 @@ void ZCollector::gc( bool gcDeep )
     }
   }
 
+  // Instruction tables and chunk manifests of the backups still present
+  std::set< string > usedCacheFiles;
+  for ( std::set< string >::const_iterator it = backupHashes.begin();
+        it != backupHashes.end(); ++it )
+    usedCacheFiles.insert( Utils::toHex( *it ) );
+
+  string cachePaths[] = { getInstructionTablesPath(), getChunkManifestsPath() };
+  for ( size_t x = 0; x < sizeof( cachePaths ) / sizeof( *cachePaths ); ++x )
+  {
+    if ( !Dir::exists( cachePaths[ x ] ) )
+      continue;
+
+    Dir::Listing cacheLst( cachePaths[ x ] );
+    while( cacheLst.getNext( entry ) )
+    {
+      if ( !entry.isDir() && usedCacheFiles.find( entry.getFileName() ) == usedCacheFiles.end() )
+      {
+        dPrintf( "Removing stale cache file %s\n", entry.getFileName().c_str() );
+        File::erase( Dir::addPath( cachePaths[ x ], entry.getFileName() ) );
+      }
+    }
+  }
+
   verbosePrintf( "Garbage collection complete\n" );
 }
 
@@ -529,6 +1374,10 @@ void ZInspect::inspect( string const & inputFileName )
   out += "\nRestore iterations: ";
   out += Utils::numberToString( backupInfo.iterations() );
 
+  out += "\nInstruction format: ";
+  out += backupInfo.instruction_format() == LegacyInstructionFormat ?
+         "legacy" : "compact";
+
   out += "\nOriginal size: ";
   out += Utils::numberToString( backupInfo.size() );
 
@@ -544,10 +1393,8 @@ void ZInspect::inspect( string const & inputFileName )
     out += "\nBundles containing backup chunks:\n";
     ChunkStorage::Reader chunkStorageReader( config, encryptionkey, chunkIndex, getBundlesPath(),
          config.runtime.cacheSize );
-    string backupData;
-    BackupRestorer::restoreIterations( chunkStorageReader, backupInfo, backupData, NULL );
     BackupRestorer::ChunkMap map;
-    BackupRestorer::restore( chunkStorageReader, backupData, NULL, NULL, &map, NULL );
+    BackupRestorer::restore( chunkStorageReader, backupInfo, NULL, NULL, &map, NULL );
 
     for ( BackupRestorer::ChunkMap::const_iterator it = map.begin(); it != map.end(); it++ )
     {
@@ -560,3 +1407,21 @@ void ZInspect::inspect( string const & inputFileName )
 
   fprintf( stderr, "%s", out.c_str() );
 }
+
+ZVerify::ZVerify( string const & storageDir, string const & password,
+    Config & configIn ):
+  ZBackupBase( storageDir, password, configIn, true )
+{
+}
+
+bool ZVerify::verify( bool deep )
+{
+  Verifier verifier( encryptionkey, config, deep, stdout );
+
+  verifier.verifyIndexes( getIndexPath() );
+  verifier.verifyBundles( getBundlesPath() );
+  verifier.verifyBackups( getBackupsPath(), getBundlesPath(), getIndexPath(),
+                          tmpMgr );
+
+  return verifier.finish();
+}
@@ -4,24 +4,80 @@
 #ifndef ZUTILS_HH_INCLUDED
 #define ZUTILS_HH_INCLUDED
 
+#include <stdint.h>
+#include <time.h>
+
+#include "backup_creator.hh"
 #include "chunk_storage.hh"
+#include "chunk_usage.hh"
+#include "file_state_cache.hh"
+#include "gc_state.hh"
+#include "sha256.hh"
+#include "zbackup.pb.h"
 #include "zbackup_base.hh"
 
 class ZBackup: public ZBackupBase
 {
+protected:
   ChunkStorage::Writer chunkStorageWriter;
 
 public:
+  DEF_EX_STR( exParentChunkMissing, "The parent backup refers to a chunk missing from the storage:", Ex )
+
   ZBackup( string const & storageDir, string const & password,
            Config & configIn );
 
+  /// A backup being created from the data pushed into it. If it is destroyed
+  /// without being finished, the bundles not committed yet are dropped. Their
+  /// chunks stay in the index though, so it has to be reloaded before the
+  /// next backup is done
+  class Session: NoCopy
+  {
+  public:
+    Session( ZBackup &, string const & outputFileName );
+
+    /// The data can be put into the buffer returned by getInputBuffer(), up
+    /// to getInputBufferSize() bytes, followed by a call to handleMoreData()
+    /// with the number of bytes put. Or it can be copied in by add()
+    void * getInputBuffer();
+    size_t getInputBufferSize();
+    void handleMoreData( size_t size );
+    void add( void const * data, size_t size );
+
+    /// Adds the given data, which is known to be restored by the given
+    /// instruction. The instruction is output as it is, so the data is only
+    /// hashed rather than chunked
+    void addUnchanged( Instruction const &, void const * data, size_t size );
+
+    /// Finishes the backup and saves it to the output file. The BackupInfo
+    /// saved is put into the given one, if any
+    void finish( BackupInfo * = NULL );
+
+    ~Session();
+
+  private:
+    ZBackup & zbackup;
+    string outputFileName;
+    Sha256 sha256;
+    /// Chunks the backup refers to, for the garbage collector
+    ChunkManifest::Collector usedChunks;
+    BackupCreator backupCreator;
+    time_t startTime;
+    uint64_t totalDataSize;
+    bool finished;
+  };
+
+  friend class Session;
+
   /// Backs up the data from stdin
   void backupFromStdin( string const & outputFileName );
 
-  /// Backs up the data from a file
-  void backupFromFile( string const & inputFileName,
+  /// Backs up the data from a file. Returns false if it was skipped for being
+  /// smaller than backup.minimalSize, which is only checked if asked to. The
+  /// BackupInfo saved is put into the given one, if any
+  bool backupFromFile( string const & inputFileName,
       string const & outputFileName,
-      bool checkFileSize = false );
+      bool checkFileSize = false, BackupInfo * = NULL );
 
   /// Backs up the data from a directory
   void backupFromDirectory( string const & inputDirectoryName,
@@ -29,7 +85,27 @@ public:
 
   /// Backs up the data from a stdio FILE handle
   void backupFromFileHandle( string const & inputName, FILE* inputFileHandle,
-      string const & outputFileName );
+      string const & outputFileName, BackupInfo * = NULL );
+
+  /// Backs up the data from a file which is a later version of the data of
+  /// the given parent backup, e.g. a disk image. The parent's instructions
+  /// are gone through along with the file, and the ones restoring data still
+  /// the same are output as they are, so only the data changed gets chunked.
+  /// Unless backup.changed_extents lists the changes, the data is compared
+  /// with the chunks of the parent by their hashes
+  void backupFromFileWithParent( string const & inputFileName,
+      string const & outputFileName, string const & parentFileName );
+
+private:
+  /// Backs up a file of a directory, unless the file states of the previous
+  /// backup of the directory show it's unchanged, in which case its previous
+  /// backup is saved again. Returns true in the latter case
+  bool backupFromFileWithStates( string const & inputFileName,
+      string const & relativePath, string const & outputFileName,
+      FileStateCache const & previousStates, FileStateCache & states );
+
+  /// Returns true if all the chunks the backup uses are still in the storage
+  bool hasAllChunks( BackupInfo const & );
 };
 
 class ZRestore: public ZBackupBase
@@ -50,6 +126,93 @@ public:
   void startNBDServer( string const & inputFileName, string const & nbdDevice );
 };
 
+/// Keeps the storage open for any number of backups and restores, with its
+/// index and bundle cache warm. The storage is only locked while they are
+/// being done. Each time it gets locked, the index files other processes
+/// have added since are loaded, and everything is reloaded if the storage
+/// generation has changed. Not thread-safe
+class ZRepository: public ZBackup
+{
+public:
+  ZRepository( string const & storageDir, string const & password,
+               Config & configIn );
+
+  /// Locks the storage for a backup or a restore, and brings everything up
+  /// to date. Calls nest: the lock is only released once each of them is
+  /// matched by a call to release()
+  void acquire();
+  void release();
+
+  /// Makes the next acquire() reload the index, e.g. after a backup has
+  /// failed, since the index may list the chunks it never stored
+  void invalidateIndex();
+
+  /// Restores the backup, writing the data to the given FILE handle
+  void restoreToFileHandle( string const & inputFileName, FILE * );
+
+  /// Returns a restorer with random access to the backup, which info is
+  /// stored in 'backupInfo'
+  sptr< BackupRestorer::IndexedRestorer > getIndexedRestorer(
+    string const & inputFileName, BackupInfo & backupInfo );
+
+protected:
+  ChunkStorage::Reader chunkStorageReader;
+
+private:
+  /// Number of acquire() calls not matched by release() yet
+  unsigned users;
+  /// The storage generation the index was loaded at
+  uint64_t indexGeneration;
+  /// Set if the index may list chunks which haven't made it to the storage
+  bool indexStale;
+};
+
+/// Serves the backups and restores the clients request over a Unix socket,
+/// one at a time. The data is read from or written to the file descriptor
+/// the client passes along with the request
+class ZServe: public ZRepository
+{
+public:
+  DEF_EX_STR( exNotServed, "The backup isn't in the storage served:", Ex )
+  DEF_EX( exNoDescriptor, "No file descriptor was passed with the request", Ex )
+
+  ZServe( string const & storageDir, string const & password,
+          Config & configIn );
+
+  /// Serves the requests until the process is terminated
+  void serve( string const & socketPath );
+
+private:
+  /// Serves the request, taking over the file descriptor
+  void handle( ServeRequest const &, int fd );
+};
+
+/// Passes the backups and restores to a 'serve' process, along with the
+/// standard input or output or the file to use
+class ZClient
+{
+  string socketPath;
+
+public:
+  DEF_EX( Ex, "Client exception", std::exception )
+  DEF_EX_STR( exServeError, "The request has failed:", Ex )
+  DEF_EX_STR( exCantOpen, "Can't open", Ex )
+
+  ZClient( string const & socketPath );
+
+  void backupFromStdin( string const & outputFileName );
+  void backupFromFile( string const & inputFileName,
+                       string const & outputFileName );
+  void restoreToStdin( string const & inputFileName );
+  void restoreToFile( string const & inputFileName,
+                      string const & outputFileName );
+
+private:
+  /// Sends the request and waits for it to be done
+  void request( ServeRequest::Command, string const & backupFile,
+                string const & dataName, int fd );
+};
+
 class ZExchange
 {
   ZBackupBase srcZBackupBase;
@@ -70,6 +233,38 @@ class ZCollector : public ZBackupBase
 {
   ChunkStorage::Reader chunkStorageReader;
 
+public:
+  DEF_EX_STR( exBackupScanFailed, "Failed to check backup", Ex )
+
+private:
+  /// Gets the chunks the backup uses from its chunk manifest, or by restoring
+  /// it if there's none or 'trustCache' is false
+  void getBackupChunks( std::string const & backup, BackupInfo &,
+                        std::string const & backupHash,
+                        BackupRestorer::ChunkSet &, bool trustCache );
+
+  struct BackupScan;
+  class ScanWorker;
+  friend class ScanWorker;
+
+  /// Loads the given backups, adding their hashes to 'backupHashes', and gets
+  /// the chunks of the ones not in 'gcState' yet. The chunks are added either
+  /// to 'gcState' or to 'chunkUsage', whichever is set. The backups are
+  /// processed by a pool of runtime.threads threads
+  void scanBackups( std::vector< std::string > const & backups,
+                    std::set< std::string > & backupHashes, GcState *,
+                    ChunkUsage *, bool trustCache );
+
+  /// Scans the backups from the shared list until none are left
+  void scanWorker( BackupScan & );
+
+  /// Brings the reference counts up to date with the given backups, adding
+  /// their hashes to 'backupHashes'. Only the backups added or removed since
+  /// the state was saved are looked at. The chunk manifests are used instead
+  /// of restoring the backups, unless 'trustCache' is false
+  void updateGcState( GcState &, std::vector< std::string > const & backups,
+                      std::set< std::string > & backupHashes, bool trustCache );
+
 public:
   ZCollector( std::string const & storageDir, std::string const & password,
               Config & configIn );
@@ -88,4 +283,15 @@ public:
   void inspect( string const & inputFileName );
 };
 
+class ZVerify : public ZBackupBase
+{
+public:
+  ZVerify( std::string const & storageDir, std::string const & password,
+           Config & configIn );
+
+  /// Checks the whole repository, writing the report to stdout. Returns true
+  /// if no errors were found
+  bool verify( bool deep );
+};
+
 #endif